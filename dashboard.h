@@ -115,7 +115,8 @@
 "    </div-->" \
 "    <div class=\"reorg\">" \
 "        <input type=\"range\" min=\"0\" max=\"100\" value=\"50\" " \
-"class=\"slider color3\" id=\"light3_dimmer\" onchange=\"lightDim(3)\">" \
+"class=\"slider color3\" id=\"light3_dimmer\" onchange=\"lightDim(3)\" " \
+"oninput=\"lightDimLive(3)\">" \
 "        <button id=\"getinfo\" class=\"color5\" type=\"button\" " \
 "onclick=\"getInfo()\">" \
 "            Mikey Info" \
@@ -164,6 +165,16 @@
 "            xhrGlue(\"/\" + n + \"light_dim?level=\" + " \
 "document.getElementById(\"light\" + n + \"_dimmer\").value);" \
 "        }" \
+"        let dimSocket = null;" \
+"        if (window.WebSocket) {" \
+"            dimSocket = new WebSocket(\"ws://\" + location.host + \"/ws\");" \
+"            dimSocket.onclose = function() { dimSocket = null; };" \
+"        }" \
+"        function lightDimLive(n) {" \
+"            if (dimSocket && dimSocket.readyState == WebSocket.OPEN)" \
+"                dimSocket.send(" \
+"document.getElementById(\"light\" + n + \"_dimmer\").value);" \
+"        }" \
 "        function lightSwitch(n, on) {" \
 "            xhrGlue(\"/\" + n + \"light_\" + (on ? \"on\" : \"off\"));" \
 "        }" \
@@ -0,0 +1,25 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+// Host build of the clock core for ntp_sim.c. Keep the NTP settings in
+// sync with thekit4_pico_w/config.h so that the simulation means something.
+
+#include "sim_platform.h"
+
+#define ENABLE_NTP 1
+#define ENABLE_WATCHDOG 0
+
+// Time-related
+static const char NTP_SERVER[] = "time-b-g.nist.gov";
+static const uint16_t NTP_PORT = 123;
+// 2 minutes between syncs
+static const uint64_t NTP_INTERVAL_US = 120 * 1000 * 1000;
+// Time to wait in case UDP requests are lost
+static const uint32_t NTP_UDP_TIMEOUT_TIME_MS = 5 * 1000;
+// Only resolves in the scenarios that have it
+static const char *const NTP_PEERS[] = {"picoeth"};
+static const uint32_t NTP_PEER_INTERVAL_MS = 60 * 1000;
+static const uint32_t NTP_PEER_RETRY_MS = 4 * 1000;
+static const int TZ_DIFF_SEC = 0;
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+// Set SIM_VERBOSE to see what the clock core logs in virtual time
+
+#include <stdio.h>
+
+#ifdef SIM_VERBOSE
+#define LOG_DEBUG(...) printf(__VA_ARGS__)
+#define LOG_DEBUG1(str) puts((str))
+#define LOG_INFO(...) printf(__VA_ARGS__)
+#define LOG_INFO1(str) puts((str))
+#define LOG_WARN(...) printf("WARNING: " __VA_ARGS__)
+#define LOG_WARN1(str) puts(("WARNING: " str))
+#define LOG_ERR(...) printf("ERROR: " __VA_ARGS__)
+#define LOG_ERR1(str) puts(("ERROR: " str))
+#else
+#define LOG_DEBUG(...) ((void) 0)
+#define LOG_DEBUG1(str) ((void) 0)
+#define LOG_INFO(...) ((void) 0)
+#define LOG_INFO1(str) ((void) 0)
+#define LOG_WARN(...) ((void) 0)
+#define LOG_WARN1(str) ((void) 0)
+#define LOG_ERR(...) ((void) 0)
+#define LOG_ERR1(str) ((void) 0)
+#endif
+
+#endif
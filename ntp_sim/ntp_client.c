@@ -0,0 +1 @@
+../thekit4_pico_w/ntp_client.c
\ No newline at end of file
@@ -0,0 +1 @@
+../thekit4_pico_w/ntp_common.c
\ No newline at end of file
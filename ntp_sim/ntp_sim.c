@@ -0,0 +1,319 @@
+/*
+ *  ntp_sim.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Run the real clock discipline (ntp_common.c and ntp_client.c) against a
+ * simulated oscillator, PPS input and network, and check how far the
+ * clock strays from true time.
+ *
+ * Usage: ntp_sim [scenario]. Without an argument every scenario runs,
+ * each in its own process since the clock core keeps its state in statics.
+ */
+
+#include "config.h"
+#include "ntp.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Same as the main loop's poll rate of the NTP client, roughly
+#define SIM_POLL_INTERVAL_US 10000.0
+// The clock error is sampled this often, half a second off the PPS edges
+#define SIM_SAMPLE_INTERVAL_US 1000000.0
+// Samples this long after the end of an outage don't count as steady-state
+#define SIM_RECOVERY_S 600.0
+
+// PPS from the GPS module, handled like gps_update_rtc() in irq.c
+struct sim_pps {
+    bool enabled;
+    // Latency from the true second to the interrupt handler reading the timer
+    double latency_us;
+    // Standard deviation of the extra (always positive) latency
+    double jitter_us;
+    // Probability that a pulse is missed or rejected
+    double dropout;
+    // No fix during [down_from_s, down_until_s)
+    double down_from_s;
+    double down_until_s;
+};
+
+struct sim_scenario {
+    const char *name;
+    struct sim_world world;
+    struct sim_pps pps;
+    double duration_s;
+    // Only the clock is running free during [holdover_from_s, holdover_until_s)
+    double holdover_from_s;
+    double holdover_until_s;
+    // Converged once the error stays within this
+    double converge_threshold_us;
+    // Bounds the scenario must meet
+    double max_converge_s;
+    double max_steady_us;
+    // Zero to skip
+    double max_rms_us;
+    double max_holdover_us;
+};
+
+struct sim_result {
+    double converge_s;
+    double steady_rms_us;
+    double steady_max_us;
+    double holdover_max_us;
+};
+
+static const struct sim_ntp_server sim_lan_server[] = {
+    {
+        .hostname = NTP_SERVER,
+        .out_base_us = 3000, .out_mean_us = 1000,
+        .back_base_us = 3000, .back_mean_us = 1000,
+        .loss = 0.01,
+    },
+};
+
+// Uplink saturated: replies sit in a queue much longer than requests
+static const struct sim_ntp_server sim_asymmetric_server[] = {
+    {
+        .hostname = NTP_SERVER,
+        .offset_us = 200,
+        .out_base_us = 4000, .out_mean_us = 1000,
+        .back_base_us = 12000, .back_mean_us = 4000,
+        .loss = 0.05,
+    },
+};
+
+// Goes away together with the GPS in the holdover scenario
+static const struct sim_ntp_server sim_outage_server[] = {
+    {
+        .hostname = NTP_SERVER,
+        .out_base_us = 3000, .out_mean_us = 1000,
+        .back_base_us = 3000, .back_mean_us = 1000,
+        .loss = 0.01,
+        .down_from_s = 7200, .down_until_s = 10800,
+    },
+};
+
+// Another GPS-locked kit on the LAN next to the distant, asymmetric server
+static const struct sim_ntp_server sim_peer_servers[] = {
+    sim_asymmetric_server[0],
+    {
+        .hostname = "picoeth",
+        .out_base_us = 300, .out_mean_us = 200,
+        .back_base_us = 300, .back_mean_us = 200,
+        .loss = 0.01,
+    },
+};
+
+// A 12 MHz crystal near the edge of its tolerance, indoors
+static const struct sim_oscillator sim_crystal = {
+    .offset_ppm = 25,
+    .aging_ppm_per_day = 0.1,
+    .tempco_ppm_per_c = 0.2,
+    .temp_amplitude_c = 2,
+    .temp_period_s = 86400,
+};
+
+// The same at the other edge, where the timer counts a little under a
+// second between pulses
+static const struct sim_oscillator sim_slow_crystal = {
+    .offset_ppm = -25,
+    .aging_ppm_per_day = 0.1,
+    .tempco_ppm_per_c = 0.2,
+    .temp_amplitude_c = 2,
+    .temp_period_s = 86400,
+};
+
+static const struct sim_scenario sim_scenarios[] = {
+    {
+        .name = "pps",
+        .world = { .osc = sim_crystal, .servers = sim_lan_server, .n_servers = 1, .seed = 1 },
+        .pps = { .enabled = true, .latency_us = 2, .jitter_us = 3, .dropout = 0.02 },
+        .duration_s = 6 * 3600,
+        .converge_threshold_us = 100,
+        .max_converge_s = 10,
+        .max_steady_us = 50,
+    },
+    {
+        .name = "ntp_asymmetric",
+        .world = { .osc = sim_crystal, .servers = sim_asymmetric_server, .n_servers = 1, .seed = 2 },
+        .duration_s = 6 * 3600,
+        .converge_threshold_us = 20000,
+        .max_converge_s = 10,
+        .max_steady_us = 20000,
+        .max_rms_us = 8000,
+    },
+    {
+        .name = "ntp_peer",
+        .world = { .osc = sim_crystal, .servers = sim_peer_servers, .n_servers = 2, .seed = 4 },
+        .duration_s = 6 * 3600,
+        // Falls back to NTP_SERVER when the peer misses two polls in a row,
+        // so only the RMS error shows the peer at work
+        .converge_threshold_us = 10000,
+        // The first sync still comes from NTP_SERVER
+        .max_converge_s = 300,
+        .max_steady_us = 10000,
+        .max_rms_us = 1000,
+    },
+    {
+        .name = "holdover",
+        .world = { .osc = sim_crystal, .servers = sim_outage_server, .n_servers = 1, .seed = 3 },
+        .pps = { .enabled = true, .latency_us = 2, .jitter_us = 3, .dropout = 0.02,
+                 .down_from_s = 7200, .down_until_s = 10800 },
+        .duration_s = 6 * 3600,
+        .holdover_from_s = 7200,
+        .holdover_until_s = 10800,
+        .converge_threshold_us = 100,
+        .max_converge_s = 10,
+        .max_steady_us = 50,
+        .max_holdover_us = 10000,
+    },
+    {
+        .name = "holdover_slow",
+        .world = { .osc = sim_slow_crystal, .servers = sim_outage_server, .n_servers = 1, .seed = 5 },
+        .pps = { .enabled = true, .latency_us = 2, .jitter_us = 3, .dropout = 0.02,
+                 .down_from_s = 7200, .down_until_s = 10800 },
+        .duration_s = 6 * 3600,
+        .holdover_from_s = 7200,
+        .holdover_until_s = 10800,
+        .converge_threshold_us = 100,
+        .max_converge_s = 10,
+        .max_steady_us = 50,
+        .max_holdover_us = 10000,
+    },
+};
+
+#define SIM_N_SCENARIOS ((int) (sizeof(sim_scenarios) / sizeof(sim_scenarios[0])))
+
+/// Time of the next PPS interrupt after true second `s`, or INFINITY if it is missed
+static double sim_pps_time(const struct sim_pps *pps, double s) {
+    if (!pps->enabled || (s >= pps->down_from_s && s < pps->down_until_s))
+        return INFINITY;
+    if (sim_random() < pps->dropout)
+        return INFINITY;
+    return s * 1e6 + pps->latency_us + fabs(sim_gaussian()) * pps->jitter_us;
+}
+
+static void sim_run(const struct sim_scenario *sc, struct sim_result *res) {
+    struct ntp_client client;
+    double end_us = sc->duration_s * 1e6;
+    double next_poll = 0, next_sample = SIM_SAMPLE_INTERVAL_US / 2;
+    double pps_second = 1, next_pps;
+    // Time of the first sample of the current run of good samples
+    double good_since = INFINITY;
+    double sum_sq = 0;
+    long n_steady = 0;
+
+    memset(res, 0, sizeof(struct sim_result));
+    sim_reset(&sc->world);
+    ntp_client_init(&client);
+    next_pps = sim_pps_time(&sc->pps, pps_second);
+    while (1) {
+        double next = fmin(next_poll, fmin(next_sample, fmin(next_pps, pps_second * 1e6 + 5e5)));
+        if (next > end_us)
+            break;
+        sim_run_until(next);
+        if (next == next_poll) {
+            ntp_client_check_run(&client);
+            next_poll += SIM_POLL_INTERVAL_US;
+        }
+        if (next == next_pps || next == pps_second * 1e6 + 5e5) {
+            if (next == next_pps)
+                ntp_update_time(SIM_EPOCH_US + (uint64_t) pps_second * 1000000, 0, NTP_REF_GPS);
+            ++pps_second;
+            next_pps = sim_pps_time(&sc->pps, pps_second);
+        }
+        if (next == next_sample) {
+            double t_s = next / 1e6;
+            double err = (double) ntp_get_utc_us() - (SIM_EPOCH_US + next);
+            bool has_holdover = sc->holdover_until_s > 0;
+            bool in_holdover = has_holdover && t_s >= sc->holdover_from_s && t_s < sc->holdover_until_s;
+            bool in_recovery = has_holdover && t_s >= sc->holdover_until_s
+                && t_s < sc->holdover_until_s + SIM_RECOVERY_S;
+            if (in_holdover) {
+                res->holdover_max_us = fmax(res->holdover_max_us, fabs(err));
+            } else if (!has_holdover || t_s < sc->holdover_from_s) {
+                // Convergence only counts before any outage
+                if (fabs(err) > sc->converge_threshold_us)
+                    good_since = INFINITY;
+                else if (isinf(good_since))
+                    good_since = t_s;
+            }
+            if (!in_holdover && !in_recovery && !isinf(good_since) && t_s >= good_since) {
+                res->steady_max_us = fmax(res->steady_max_us, fabs(err));
+                sum_sq += err * err;
+                ++n_steady;
+            }
+            next_sample += SIM_SAMPLE_INTERVAL_US;
+        }
+    }
+    res->converge_s = good_since;
+    res->steady_rms_us = n_steady ? sqrt(sum_sq / n_steady) : INFINITY;
+}
+
+/// Run one scenario and return whether it met its bounds
+static bool sim_check(const struct sim_scenario *sc) {
+    struct sim_result res;
+    bool ok;
+
+    sim_run(sc, &res);
+    ok = res.converge_s <= sc->max_converge_s && res.steady_max_us <= sc->max_steady_us
+        && (sc->max_rms_us == 0 || res.steady_rms_us <= sc->max_rms_us)
+        && (sc->max_holdover_us == 0 || res.holdover_max_us <= sc->max_holdover_us);
+    printf("%-16s converge %6.1f s  steady rms %9.1f us  max %9.1f us",
+           sc->name, res.converge_s, res.steady_rms_us, res.steady_max_us);
+    if (sc->max_holdover_us != 0)
+        printf("  holdover max %9.1f us", res.holdover_max_us);
+    printf("  freq %+" PRId32 " ppb  %s\n", ntp_get_freq_ppb(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int failed = 0;
+
+    if (argc > 1) {
+        for (int i = 0; i < SIM_N_SCENARIOS; ++i) {
+            if (strcmp(argv[1], sim_scenarios[i].name) == 0)
+                return sim_check(&sim_scenarios[i]) ? 0 : 1;
+        }
+        fprintf(stderr, "Unknown scenario %s\n", argv[1]);
+        return 2;
+    }
+    for (int i = 0; i < SIM_N_SCENARIOS; ++i) {
+        int status;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 2;
+        }
+        if (pid == 0)
+            exit(sim_check(&sim_scenarios[i]) ? 0 : 1);
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ++failed;
+    }
+    if (failed) {
+        printf("%d scenario(s) failed\n", failed);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ *  sim_platform.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Virtual time, the oscillator model and a fake network of NTP servers */
+
+#include "config.h"
+#include "sim_platform.h"
+#include "ntp.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_MAX_PCBS 8
+#define SIM_MAX_EVENTS 32
+
+struct udp_pcb {
+    bool in_use;
+    // Bumped on removal so that packets in flight don't reach a new owner
+    uint32_t generation;
+    udp_recv_fn recv;
+    void *recv_arg;
+};
+
+struct sim_event {
+    bool in_use;
+    double at_us;
+    // Packet is on its way to the server if true, back to us otherwise
+    bool to_server;
+    int server;
+    struct udp_pcb *pcb;
+    uint32_t generation;
+    // Network byte order
+    struct ntp_message msg;
+};
+
+// Marker: static variable
+static struct {
+    struct sim_world world;
+    double true_us;
+    // Timer of the simulated Pico, in its own microseconds
+    double tick_us;
+    uint64_t rng;
+    struct udp_pcb pcbs[SIM_MAX_PCBS];
+    struct sim_event events[SIM_MAX_EVENTS];
+} sim;
+
+void sim_reset(const struct sim_world *world) {
+    memset(&sim, 0, sizeof(sim));
+    sim.world = *world;
+    sim.rng = world->seed ? world->seed : 1;
+}
+
+double sim_true_us(void) {
+    return sim.true_us;
+}
+
+// xorshift64*
+double sim_random(void) {
+    sim.rng ^= sim.rng >> 12;
+    sim.rng ^= sim.rng << 25;
+    sim.rng ^= sim.rng >> 27;
+    return (sim.rng * 0x2545f4914f6cdd1dULL >> 11) * 0x1.0p-53;
+}
+
+double sim_gaussian(void) {
+    // Box-Muller, one of the pair is thrown away
+    double u1 = sim_random(), u2 = sim_random();
+    return sqrt(-2 * log(1 - u1)) * cos(2 * M_PI * u2);
+}
+
+static double sim_exponential(double mean) {
+    return -mean * log(1 - sim_random());
+}
+
+/// Fractional frequency error of the oscillator in ppm at `t_us`
+static double sim_osc_ppm(double t_us) {
+    const struct sim_oscillator *osc = &sim.world.osc;
+    double t_s = t_us / 1e6;
+    double temp = osc->temp_period_s > 0
+        ? osc->temp_amplitude_c * sin(2 * M_PI * t_s / osc->temp_period_s)
+        : 0;
+    return osc->offset_ppm + osc->aging_ppm_per_day * t_s / 86400 + osc->tempco_ppm_per_c * temp;
+}
+
+static void sim_advance_to(double t_us) {
+    assert(t_us >= sim.true_us);
+    double mid = (sim.true_us + t_us) / 2;
+    sim.tick_us += (t_us - sim.true_us) * (1 + sim_osc_ppm(mid) * 1e-6);
+    sim.true_us = t_us;
+}
+
+absolute_time_t get_absolute_time(void) {
+    return (absolute_time_t) sim.tick_us;
+}
+
+static struct sim_event *sim_event_new(double at_us) {
+    for (int i = 0; i < SIM_MAX_EVENTS; ++i) {
+        if (!sim.events[i].in_use) {
+            memset(&sim.events[i], 0, sizeof(struct sim_event));
+            sim.events[i].in_use = true;
+            sim.events[i].at_us = at_us;
+            return &sim.events[i];
+        }
+    }
+    fprintf(stderr, "sim: too many packets in flight\n");
+    abort();
+}
+
+static bool sim_server_down(const struct sim_ntp_server *server) {
+    double t_s = sim.true_us / 1e6;
+    return t_s >= server->down_from_s && t_s < server->down_until_s;
+}
+
+static void sim_fill_ntp_ts(uint32_t *sec, uint32_t *frac, double utc_us) {
+    uint64_t us = (uint64_t) utc_us;
+    *sec = htonl((uint32_t) (us / 1000000 + NTP_DELTA));
+    *frac = htonl((uint32_t) (((us % 1000000) << 32) / 1000000));
+}
+
+/// The server got our request: answer it
+static void sim_server_process(struct sim_event *ev) {
+    const struct sim_ntp_server *server = &sim.world.servers[ev->server];
+    if (sim_server_down(server) || sim_random() < server->loss)
+        return;
+    struct sim_event *reply = sim_event_new(
+        sim.true_us + server->back_base_us + sim_exponential(server->back_mean_us));
+    reply->to_server = false;
+    reply->server = ev->server;
+    reply->pcb = ev->pcb;
+    reply->generation = ev->generation;
+    struct ntp_message *msg = &reply->msg;
+    double server_us = SIM_EPOCH_US + sim.true_us + server->offset_us;
+    // Kits answer their peers in symmetric passive mode
+    uint8_t mode = (ev->msg.flags & 0x7) == NTP_MODE_SYMMETRIC_ACTIVE
+        ? NTP_MODE_SYMMETRIC_PASSIVE : NTP_MODE_SERVER;
+    msg->flags = (NTP_VERSION << 3) | mode;
+    msg->stratum = 1;
+    msg->poll = 3;
+    msg->precision = 0xec;
+    msg->ref_id = htonl(NTP_REF_GPS);
+    msg->orig_ts_sec = ev->msg.tx_ts_sec;
+    msg->orig_ts_frac = ev->msg.tx_ts_frac;
+    sim_fill_ntp_ts(&msg->rx_ts_sec, &msg->rx_ts_frac, server_us);
+    sim_fill_ntp_ts(&msg->ref_ts_sec, &msg->ref_ts_frac, server_us);
+    // Some processing time on the server
+    sim_fill_ntp_ts(&msg->tx_ts_sec, &msg->tx_ts_frac, server_us + 20);
+}
+
+/// The reply reached us: hand it to lwIP's callback
+static void sim_client_deliver(struct sim_event *ev) {
+    struct udp_pcb *pcb = ev->pcb;
+    if (!pcb->in_use || pcb->generation != ev->generation || !pcb->recv)
+        return;
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, NTP_MSG_LEN, PBUF_RAM);
+    memcpy(p->payload, &ev->msg, NTP_MSG_LEN);
+    ip_addr_t addr = { .addr = ev->server + 1 };
+    pcb->recv(pcb->recv_arg, pcb, p, &addr, NTP_PORT);
+}
+
+void sim_run_until(double t_us) {
+    while (1) {
+        struct sim_event *next = NULL;
+        for (int i = 0; i < SIM_MAX_EVENTS; ++i) {
+            if (sim.events[i].in_use && (!next || sim.events[i].at_us < next->at_us))
+                next = &sim.events[i];
+        }
+        if (!next || next->at_us > t_us)
+            break;
+        sim_advance_to(next->at_us);
+        // Copy out so that the handler may schedule into this slot
+        struct sim_event ev = *next;
+        next->in_use = false;
+        if (ev.to_server)
+            sim_server_process(&ev);
+        else
+            sim_client_deliver(&ev);
+    }
+    sim_advance_to(t_us);
+}
+
+uint32_t lwip_htonl(uint32_t x) {
+    return htonl(x);
+}
+
+const char *ipaddr_ntoa(const ip_addr_t *addr) {
+    // Marker: static variable
+    static char buf[16];
+    snprintf(buf, sizeof(buf), "10.0.0.%u", (unsigned) addr->addr);
+    return buf;
+}
+
+const ip_addr_t *ip_current_dest_addr(void) {
+    // Marker: static variable
+    static const ip_addr_t local = { .addr = 100 };
+    return &local;
+}
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type) {
+    (void) layer;
+    (void) type;
+    struct pbuf *p = malloc(sizeof(struct pbuf) + length);
+    if (!p)
+        return NULL;
+    p->next = NULL;
+    p->payload = p + 1;
+    p->tot_len = p->len = length;
+    return p;
+}
+
+u8_t pbuf_free(struct pbuf *p) {
+    free(p);
+    return 1;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset) {
+    if (offset >= p->len)
+        return 0;
+    if (len > p->len - offset)
+        len = p->len - offset;
+    memcpy(dataptr, (const uint8_t *) p->payload + offset, len);
+    return len;
+}
+
+struct udp_pcb *udp_new_ip_type(u8_t type) {
+    (void) type;
+    for (int i = 0; i < SIM_MAX_PCBS; ++i) {
+        if (!sim.pcbs[i].in_use) {
+            sim.pcbs[i].in_use = true;
+            sim.pcbs[i].recv = NULL;
+            return &sim.pcbs[i];
+        }
+    }
+    return NULL;
+}
+
+void udp_remove(struct udp_pcb *pcb) {
+    pcb->in_use = false;
+    pcb->generation++;
+}
+
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg) {
+    pcb->recv = recv;
+    pcb->recv_arg = recv_arg;
+}
+
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port) {
+    int server = (int) dst_ip->addr - 1;
+    if (server < 0 || server >= sim.world.n_servers || dst_port != NTP_PORT || p->len != NTP_MSG_LEN)
+        return ERR_VAL;
+    const struct sim_ntp_server *s = &sim.world.servers[server];
+    if (sim_server_down(s) || sim_random() < s->loss)
+        // Lost on the way out
+        return ERR_OK;
+    struct sim_event *ev = sim_event_new(sim.true_us + s->out_base_us + sim_exponential(s->out_mean_us));
+    ev->to_server = true;
+    ev->server = server;
+    ev->pcb = pcb;
+    ev->generation = pcb->generation;
+    memcpy(&ev->msg, p->payload, NTP_MSG_LEN);
+    return ERR_OK;
+}
+
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg) {
+    (void) found;
+    (void) callback_arg;
+    for (int i = 0; i < sim.world.n_servers; ++i) {
+        if (strcmp(hostname, sim.world.servers[i].hostname) == 0) {
+            addr->addr = i + 1;
+            return ERR_OK;
+        }
+    }
+    return ERR_VAL;
+}
@@ -0,0 +1,187 @@
+/*
+ *  sim_platform.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Just enough of the Pico SDK and lwIP for ntp_common.c and ntp_client.c
+ * to run on a host against virtual time. Every SDK/lwIP header they
+ * include is a one-line file that pulls this in.
+ */
+
+#ifndef _SIM_PLATFORM_H
+#define _SIM_PLATFORM_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// pico/types.h
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+#define nil_time ((absolute_time_t) 0)
+
+// pico/util/datetime.h
+typedef struct {
+    int16_t year;
+    int8_t month;
+    int8_t day;
+    int8_t dotw;
+    int8_t hour;
+    int8_t min;
+    int8_t sec;
+} datetime_t;
+
+// pico/platform.h
+#define __uninitialized_ram(name) name
+
+// pico/time.h, backed by the simulated timer
+absolute_time_t get_absolute_time(void);
+static inline uint64_t to_us_since_boot(absolute_time_t t) {
+    return t;
+}
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return (int64_t) (to - from);
+}
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return get_absolute_time() + (uint64_t) ms * 1000;
+}
+static inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) {
+    return t + us;
+}
+static inline absolute_time_t absolute_time_min(absolute_time_t a, absolute_time_t b) {
+    return a < b ? a : b;
+}
+
+// pico/divider.h
+static inline uint64_t divmod_u64u64_rem(uint64_t a, uint64_t b, uint64_t *rem) {
+    *rem = a % b;
+    return a / b;
+}
+
+// hardware/rtc.h
+static inline bool rtc_set_datetime(datetime_t *dt) {
+    (void) dt;
+    return true;
+}
+
+// lwip/arch.h and lwip/err.h
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef int8_t err_t;
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_INPROGRESS -5
+#define ERR_VAL -6
+#define LWIP_IPV4 1
+#define LWIP_IPV6 0
+
+// lwip/def.h
+uint32_t lwip_htonl(uint32_t x);
+#define lwip_ntohl lwip_htonl
+
+// lwip/ip_addr.h, IPv4 only
+typedef struct {
+    uint32_t addr;
+} ip_addr_t;
+enum { IPADDR_TYPE_V4 = 0, IPADDR_TYPE_V6 = 6, IPADDR_TYPE_ANY = 46 };
+#define IP_IS_V4(ipaddr) ((void) (ipaddr), 1)
+#define ip_2_ip4(ipaddr) (ipaddr)
+#define ip4_addr_get_u32(ipaddr) ((ipaddr)->addr)
+#define ip_addr_cmp(a, b) ((a)->addr == (b)->addr)
+const char *ipaddr_ntoa(const ip_addr_t *addr);
+
+// lwip/ip.h
+const ip_addr_t *ip_current_dest_addr(void);
+
+// lwip/pbuf.h, single-segment RAM pbufs only
+typedef enum { PBUF_TRANSPORT } pbuf_layer;
+typedef enum { PBUF_RAM } pbuf_type;
+struct pbuf {
+    struct pbuf *next;
+    void *payload;
+    u16_t tot_len;
+    u16_t len;
+};
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+u8_t pbuf_free(struct pbuf *p);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+
+// lwip/udp.h
+struct udp_pcb;
+typedef void (*udp_recv_fn)(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                            const ip_addr_t *addr, u16_t port);
+struct udp_pcb *udp_new_ip_type(u8_t type);
+void udp_remove(struct udp_pcb *pcb);
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg);
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port);
+
+// lwip/dns.h
+typedef void (*dns_found_callback)(const char *name, const ip_addr_t *ipaddr, void *callback_arg);
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg);
+
+/* The simulated world, implemented in sim_platform.c */
+
+// Oscillator driving the Pico's timer. The fractional frequency error is
+// offset + aging * t + tempco * temperature(t), with the temperature a
+// sine wave around the calibration point.
+struct sim_oscillator {
+    double offset_ppm;
+    double aging_ppm_per_day;
+    double tempco_ppm_per_c;
+    double temp_amplitude_c;
+    double temp_period_s;
+};
+
+// An NTP server somewhere on the network
+struct sim_ntp_server {
+    const char *hostname;
+    // Error of the server's own clock
+    double offset_us;
+    // One-way delays are `base + Exp(mean)`, separately for each direction
+    double out_base_us;
+    double out_mean_us;
+    double back_base_us;
+    double back_mean_us;
+    // Probability that either packet is lost
+    double loss;
+    // Unreachable during [down_from_s, down_until_s)
+    double down_from_s;
+    double down_until_s;
+};
+
+struct sim_world {
+    struct sim_oscillator osc;
+    const struct sim_ntp_server *servers;
+    int n_servers;
+    uint64_t seed;
+};
+
+void sim_reset(const struct sim_world *world);
+// True time in microseconds since the start of the simulation
+double sim_true_us(void);
+// Advance true time to `t_us`, delivering any packets due on the way
+void sim_run_until(double t_us);
+// Uniform in [0, 1) and standard normal, from the simulation's PRNG
+double sim_random(void);
+double sim_gaussian(void);
+
+// UNIX time (in microseconds) at which the simulation starts
+#define SIM_EPOCH_US (1700000000ULL * 1000000ULL)
+
+#endif
@@ -2,10 +2,12 @@
 #define _CONFIG_H
 
 #include "pico/stdlib.h"
+#include "hardware/flash.h"
 #include "hardware/gpio.h"
 
 #define ENABLE_GPS 1
 #define ENABLE_NTP 1
+#define ENABLE_PTP 1
 
 static const char HOSTNAME[] = "picoeth";
 
@@ -23,17 +25,40 @@ static const uint16_t NTP_PORT = 123;
 static const uint64_t NTP_INTERVAL_US = 120 * 1000 * 1000;
 // Time to wait in case UDP requests are lost
 static const uint32_t NTP_UDP_TIMEOUT_TIME_MS = 5 * 1000;
+// Other kits on the LAN to peer with (symmetric mode), by their HOSTNAME.
+// A GPS-locked peer is preferred over NTP_SERVER
+static const char *const NTP_PEERS[] = {"thekit4"};
+// 1 minute between peer polls
+static const uint32_t NTP_PEER_INTERVAL_MS = 60 * 1000;
+// A poll that fails is retried after this, doubling up to NTP_PEER_INTERVAL_MS
+static const uint32_t NTP_PEER_RETRY_MS = 4 * 1000;
+
+// Must match `domainNumber` on the slaves
+static const uint8_t PTP_DOMAIN = 0;
+// log2 of the seconds between Sync messages
+static const int8_t PTP_LOG_SYNC_INTERVAL = 0;
+// log2 of the seconds between Announce messages
+static const int8_t PTP_LOG_ANNOUNCE_INTERVAL = 1;
+// log2 of the minimum seconds between Delay_Req messages from a slave
+static const int8_t PTP_LOG_MIN_DELAY_REQ_INTERVAL = 0;
+
 // Timezone for the alarms (RTC is in localtime);
 static const int TZ_DIFF_SEC = -7 * 3600;
 
 // GPS-related
 #define GPS_UART uart0
-// TX is not actually used
+// TX is only used for warm-start aiding
 static const uint GPS_TX_PIN = 12;
 static const uint GPS_RX_PIN = 13;
 static const uint GPS_EN_PIN = 11;
 static const uint GPS_PPS_PIN = 14;
 static const uint GPS_BAUD = 115200;
 #define PPS_EDGE_TYPE GPIO_IRQ_EDGE_RISE
+// Warm-start aiding lives in the last two sectors of flash
+static const uint32_t GPS_AIDING_FLASH_OFFSET = PICO_FLASH_SIZE_BYTES - 2 * FLASH_SECTOR_SIZE;
+// How often the current fix is saved
+static const uint32_t GPS_AIDING_SAVE_INTERVAL_MS = 60 * 60 * 1000;
+// Don't aid with a fix older than this, in case the kit has moved
+static const int64_t GPS_AIDING_MAX_AGE_S = 30 * 24 * 3600;
 
 #endif
@@ -30,6 +30,7 @@
 #include "pico_eth/ethpio_arch.h"
 #include "log.h"
 #include "ntp.h"
+#include "ptp.h"
 
 // Marker: static variable
 static struct ntp_client ntp_state;
@@ -56,6 +57,8 @@ static void init() {
         LOG_WARN1("Cannot init NTP client");
     ntp_server_open();
     LOG_INFO1("NTP initialized");
+    if (!ptp_server_open())
+        LOG_WARN1("Cannot open PTP server");
 }
 
 int main() {
@@ -64,6 +67,8 @@ int main() {
         eth_pio_arch_poll();
         ntp_client_check_run(&ntp_state);
         gps_parse_available();
+        gps_aiding_check_run();
+        ptp_server_check_run();
     }
     return 0;
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "pico/time.h"
+
 #include "lwip/ip_addr.h"
 
 #include "gps_util.h"
@@ -11,6 +13,10 @@ void gps_init(void);
 bool gps_get_location(float *lat, float *lon, float *alt, timestamp_t *age);
 bool gps_get_time(time_t *time, timestamp_t *age);
 uint8_t gps_get_sat_num(void);
+/// NMEA sentences parsed and rejected since boot
+void gps_get_sentence_counts(uint32_t *good, uint32_t *bad);
 void gps_parse_available(void);
+void gps_aiding_check_run(void);
+absolute_time_t gps_next_run(void);
 
 #endif
@@ -0,0 +1 @@
+../thekit4_pico_w/ptp.h
\ No newline at end of file
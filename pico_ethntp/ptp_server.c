@@ -0,0 +1 @@
+../thekit4_pico_w/ptp_server.c
\ No newline at end of file
@@ -60,6 +60,24 @@ uint8_t base64_read(struct base64decoder *decoder) {
     return ch;
 }
 
+size_t base64_encode(char *out, const uint8_t *data, size_t len) {
+    static const char ENCODE_TABLE[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *p = out;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t group = (uint32_t) data[i] << 16;
+        if (i + 1 < len)
+            group |= (uint32_t) data[i + 1] << 8;
+        if (i + 2 < len)
+            group |= data[i + 2];
+        *p++ = ENCODE_TABLE[group >> 18];
+        *p++ = ENCODE_TABLE[(group >> 12) & 0x3f];
+        *p++ = i + 1 < len ? ENCODE_TABLE[(group >> 6) & 0x3f] : '=';
+        *p++ = i + 2 < len ? ENCODE_TABLE[group & 0x3f] : '=';
+    }
+    *p = 0;
+    return p - out;
+}
+
 #ifdef BASE64_EXAMPLE
 #include <stdio.h>
 
@@ -20,6 +20,7 @@
 #ifndef BASE64_H
 #define BASE64_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -30,5 +31,8 @@ struct base64decoder {
 
 bool base64_feed(struct base64decoder *decoder, int m);
 uint8_t base64_read(struct base64decoder *decoder);
+/// Encode `len` bytes into `out`, which needs room for 4 * ((len + 2) / 3)
+/// characters and a NUL. Returns the length without the NUL
+size_t base64_encode(char *out, const uint8_t *data, size_t len);
 
 #endif
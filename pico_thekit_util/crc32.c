@@ -0,0 +1,62 @@
+/* CRC-32 for integrity checks on persisted state */
+/*
+ *  crc32.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "crc32.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef CRC32_TEST
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#endif
+
+// Half-byte table: 64 bytes of flash instead of 1 KiB, at twice the
+// lookups of the full table. Plenty for the few hundred bytes we check.
+static const uint32_t CRC32_NIBBLE_TABLE[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *bytes++;
+        crc = (crc >> 4) ^ CRC32_NIBBLE_TABLE[crc & 0xf];
+        crc = (crc >> 4) ^ CRC32_NIBBLE_TABLE[crc & 0xf];
+    }
+    return ~crc;
+}
+
+#ifdef CRC32_TEST
+int main(void) {
+    const char check[] = "123456789";
+    assert(crc32_update(CRC32_INIT, check, 9) == 0xcbf43926);
+    // Incremental use gives the same result
+    uint32_t crc = crc32_update(CRC32_INIT, check, 4);
+    assert(crc32_update(crc, check + 4, 5) == 0xcbf43926);
+    assert(crc32_update(CRC32_INIT, check, 0) == 0);
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,33 @@
+/* CRC-32 for integrity checks on persisted state */
+/*
+ *  crc32.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Initial value to pass to `crc32_update`
+#define CRC32_INIT 0
+
+/// Continue a CRC-32 (IEEE 802.3, reflected) over `len` more bytes.
+/// Start with `CRC32_INIT`; the result needs no further finalization.
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+#endif
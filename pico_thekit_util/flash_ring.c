@@ -0,0 +1,167 @@
+/* Wear-leveled ring of fixed-size records in flash */
+/*
+ *  flash_ring.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Records are appended one slot after another, so every slot is written
+ * once per trip around the ring and each sector is erased once every
+ * `FLASH_SECTOR_SIZE / slot_size` appends. A slot is a header (sequence
+ * number and CRC-32) followed by the payload, rounded up to a power of two
+ * so that slots never straddle a page. Programming only the slot's bytes
+ * of a page works because the rest of the page buffer is 0xff.
+ */
+
+#include "flash_ring.h"
+#include "crc32.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+struct flash_ring_header {
+    uint32_t seq;
+    // CRC-32 over `seq` and the payload
+    uint32_t crc;
+};
+
+static inline const uint8_t *flash_ring_xip(uint32_t offset) {
+    return (const uint8_t *) (XIP_BASE + offset);
+}
+
+static uint32_t flash_ring_crc(const struct flash_ring *ring, uint32_t seq, const void *payload) {
+    uint32_t crc = crc32_update(CRC32_INIT, &seq, sizeof(seq));
+    return crc32_update(crc, payload, ring->payload_size);
+}
+
+static bool flash_ring_slot_blank(const struct flash_ring *ring, uint32_t slot) {
+    const uint8_t *p = flash_ring_xip(slot);
+    for (uint16_t i = 0; i < ring->slot_size; ++i)
+        if (p[i] != 0xff)
+            return false;
+    return true;
+}
+
+static bool flash_ring_slot_valid(const struct flash_ring *ring, uint32_t slot) {
+    const struct flash_ring_header *header = (const struct flash_ring_header *) flash_ring_xip(slot);
+    if (header->seq == 0xffffffff)
+        return false;
+    return header->crc == flash_ring_crc(ring, header->seq, header + 1);
+}
+
+/// The slot after `slot`, wrapping around the ring
+static uint32_t flash_ring_advance(const struct flash_ring *ring, uint32_t slot) {
+    slot += ring->slot_size;
+    if (slot >= ring->offset + ring->n_sectors * FLASH_SECTOR_SIZE)
+        slot = ring->offset;
+    return slot;
+}
+
+bool flash_ring_init(struct flash_ring *ring) {
+    if (ring->n_sectors < 2 || ring->offset % FLASH_SECTOR_SIZE != 0)
+        return false;
+    uint16_t size = sizeof(struct flash_ring_header) + ring->payload_size;
+    uint16_t slot_size = sizeof(struct flash_ring_header);
+    while (slot_size < size)
+        slot_size <<= 1;
+    if (slot_size > FLASH_PAGE_SIZE)
+        return false;
+    ring->slot_size = slot_size;
+    ring->latest = 0;
+    ring->next_seq = 0;
+
+    const uint32_t end = ring->offset + ring->n_sectors * FLASH_SECTOR_SIZE;
+    for (uint32_t slot = ring->offset; slot < end; slot += slot_size) {
+        if (!flash_ring_slot_valid(ring, slot))
+            continue;
+        uint32_t seq = ((const struct flash_ring_header *) flash_ring_xip(slot))->seq;
+        // Wrapping of `seq` takes longer than the flash lives
+        if (ring->latest == 0 || seq >= ring->next_seq) {
+            ring->latest = slot;
+            ring->next_seq = seq + 1;
+        }
+    }
+    ring->next_slot = ring->latest ? flash_ring_advance(ring, ring->latest) : ring->offset;
+    return true;
+}
+
+const void *flash_ring_latest(const struct flash_ring *ring) {
+    if (!ring->latest)
+        return NULL;
+    return flash_ring_xip(ring->latest) + sizeof(struct flash_ring_header);
+}
+
+const void *flash_ring_next(const struct flash_ring *ring, uint32_t *seq) {
+    if (!ring->latest)
+        return NULL;
+    uint32_t found = 0;
+    const uint32_t end = ring->offset + ring->n_sectors * FLASH_SECTOR_SIZE;
+    for (uint32_t slot = ring->offset; slot < end; slot += ring->slot_size) {
+        uint32_t slot_seq = ((const struct flash_ring_header *) flash_ring_xip(slot))->seq;
+        // The CRC only for those that would do
+        if (slot_seq < *seq || slot_seq >= ring->next_seq)
+            continue;
+        if (found && slot_seq >= ((const struct flash_ring_header *) flash_ring_xip(found))->seq)
+            continue;
+        if (flash_ring_slot_valid(ring, slot))
+            found = slot;
+    }
+    if (!found)
+        return NULL;
+    *seq = ((const struct flash_ring_header *) flash_ring_xip(found))->seq;
+    return flash_ring_xip(found) + sizeof(struct flash_ring_header);
+}
+
+bool flash_ring_append(struct flash_ring *ring, const void *payload) {
+    if (!ring->slot_size)
+        return false;
+    uint32_t slot = ring->next_slot;
+    bool erase = slot % FLASH_SECTOR_SIZE == 0 || !flash_ring_slot_blank(ring, slot);
+    if (erase) {
+        // Either we are entering a new sector, or something (a torn write?)
+        // is in the way; both mean starting over in a fresh sector
+        slot = slot - slot % FLASH_SECTOR_SIZE;
+        if (slot == ring->latest - ring->latest % FLASH_SECTOR_SIZE)
+            // Never erase the newest record
+            slot = flash_ring_advance(ring, slot + FLASH_SECTOR_SIZE - ring->slot_size);
+    }
+
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xff, FLASH_PAGE_SIZE);
+    uint32_t page_offset = slot - slot % FLASH_PAGE_SIZE;
+    struct flash_ring_header header = {
+        .seq = ring->next_seq,
+        .crc = flash_ring_crc(ring, ring->next_seq, payload),
+    };
+    memcpy(page + slot % FLASH_PAGE_SIZE, &header, sizeof(header));
+    memcpy(page + slot % FLASH_PAGE_SIZE + sizeof(header), payload, ring->payload_size);
+
+    uint32_t ints = save_and_disable_interrupts();
+    if (erase)
+        flash_range_erase(slot - slot % FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    flash_range_program(page_offset, page, FLASH_PAGE_SIZE);
+    restore_interrupts(ints);
+
+    if (!flash_ring_slot_valid(ring, slot))
+        return false;
+    ring->latest = slot;
+    ring->next_seq++;
+    ring->next_slot = flash_ring_advance(ring, slot);
+    return true;
+}
@@ -0,0 +1,69 @@
+/* Wear-leveled ring of fixed-size records in flash */
+/*
+ *  flash_ring.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLASH_RING_H
+#define FLASH_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct flash_ring {
+    // Flash offset (not address) of the first sector, sector-aligned
+    uint32_t offset;
+    // Number of sectors, at least two so that the newest record
+    // survives erasing the next sector
+    uint8_t n_sectors;
+    // Payload size of each record
+    uint16_t payload_size;
+    // Filled in by `flash_ring_init`
+    uint16_t slot_size;
+    uint32_t next_seq;
+    // Flash offset of the slot the next record goes to
+    uint32_t next_slot;
+    // Flash offset of the newest valid record, 0 if there is none
+    uint32_t latest;
+};
+
+#define FLASH_RING_INIT(_offset, _n_sectors, _payload_size) { \
+    .offset = (_offset), \
+    .n_sectors = (_n_sectors), \
+    .payload_size = (_payload_size), \
+    .slot_size = 0, \
+    .next_seq = 0, \
+    .next_slot = 0, \
+    .latest = 0, \
+}
+
+/// Scan the sectors for the newest record. Returns false if the
+/// parameters are unusable.
+bool flash_ring_init(struct flash_ring *ring);
+
+/// Pointer (through XIP) to the payload of the newest record, or NULL
+const void *flash_ring_latest(const struct flash_ring *ring);
+
+/// Pointer (through XIP) to the payload of the oldest record numbered
+/// `*seq` or later, which is stored into `*seq`; NULL if there is none.
+/// Records are numbered from 0 in the order they were appended
+const void *flash_ring_next(const struct flash_ring *ring, uint32_t *seq);
+
+/// Append a record of `payload_size` bytes. Erases a sector only when the
+/// current one is full. Interrupts are disabled for the duration.
+bool flash_ring_append(struct flash_ring *ring, const void *payload);
+
+#endif
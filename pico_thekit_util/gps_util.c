@@ -1089,11 +1089,14 @@ bool gpsutil_feed(struct gps_status *gps_status, int c) {
         if (gps_status->buffer_pos > 0) {
             gps_status->buffer[gps_status->buffer_pos] = '\0';
             bool result = parse_sentence(gps_status);
+            if (result)
+                ++gps_status->sentences;
+            else
+                ++gps_status->bad_sentences;
 #ifndef NDEBUG
+            // Good ones are only counted, printing every one costs too much
             if (!result) {
                 printf("Bad sentence: %s\n", gps_status->buffer);
-            } else {
-                printf("GPS parsed: %s\n", gps_status->buffer);
             }
 #endif
             return result;
@@ -1105,6 +1108,7 @@ bool gpsutil_feed(struct gps_status *gps_status, int c) {
         // Buffer overflow
         printf("GPS buffer overflow\n");
         gps_status->in_sentence = false;
+        ++gps_status->bad_sentences;
     }
     return false;
 }
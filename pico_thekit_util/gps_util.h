@@ -86,6 +86,9 @@ struct gps_status {
     timestamp_t last_position_update;
     // Timestamp of the previous update to the time
     timestamp_t last_time_update;
+    // Sentences that parsed, and ones that failed (checksum, syntax, overflow)
+    uint32_t sentences;
+    uint32_t bad_sentences;
 };
 
 #define GPS_STATUS_INIT { \
@@ -106,6 +109,8 @@ struct gps_status {
     .in_sentence = false, \
     .last_position_update = 0, \
     .last_time_update = 0, \
+    .sentences = 0, \
+    .bad_sentences = 0, \
 }
 
 /// Feed a character to the parser, returns true if a sentence is parsed successfully
@@ -0,0 +1,608 @@
+/*
+ *  http_parser.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "http_parser.h"
+
+#include <string.h>
+
+#ifdef HTTP_PARSER_TEST
+#include <assert.h>
+#include <stdio.h>
+#define assert_eq(a, b) assert((a) == (b))
+#endif
+
+/// Headers we keep something from
+enum http_header {
+    HTTP_HEADER_OTHER = 0,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_UPGRADE,
+    HTTP_HEADER_WEBSOCKET_KEY,
+    HTTP_HEADER_WEBSOCKET_VERSION,
+};
+
+/// Lowercase names, indexed by `enum http_header`
+static const char *const HEADER_NAMES[] = {
+    NULL,
+    "connection",
+    "content-length",
+    "if-none-match",
+    "upgrade",
+    "sec-websocket-key",
+    "sec-websocket-version",
+};
+static const uint8_t HEADER_NAMES_LEN = sizeof(HEADER_NAMES) / sizeof(HEADER_NAMES[0]);
+
+/// Set in `token_len` once a header name is too long to be one we know
+#define TOKEN_OVERFLOW 0xff
+
+static inline char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+void http_parser_init(struct http_parser *parser, uint16_t max_len) {
+    parser->state = HTTP_PARSE_IDLE;
+    parser->len = 0;
+    parser->max_len = max_len;
+    parser->status = 0;
+    parser->method = HTTP_METHOD_OTHER;
+    parser->version_minor = 0;
+    parser->target[0] = 0;
+    parser->target_len = 0;
+    parser->query_offset = UINT8_MAX;
+    parser->path_hash = HTTP_HASH_INIT;
+    parser->token_len = 0;
+    parser->header = HTTP_HEADER_OTHER;
+    parser->value_len = 0;
+    parser->connection_close = false;
+    parser->connection_keep_alive = false;
+    parser->connection_upgrade = false;
+    parser->upgrade_websocket = false;
+    parser->websocket_version = 0;
+    parser->websocket_key[0] = 0;
+    parser->has_content_length = false;
+    parser->content_length = 0;
+    parser->if_none_match[0] = 0;
+}
+
+static bool fail(struct http_parser *parser, uint16_t status) {
+    parser->state = HTTP_PARSE_ERROR;
+    parser->status = status;
+    return false;
+}
+
+static bool finish_method(struct http_parser *parser) {
+    static const struct {
+        const char *name;
+        enum http_method method;
+    } methods[] = {
+        {"GET", HTTP_METHOD_GET},
+        {"HEAD", HTTP_METHOD_HEAD},
+        {"POST", HTTP_METHOD_POST},
+        {"PUT", HTTP_METHOD_PUT},
+        {"DELETE", HTTP_METHOD_DELETE},
+        {"OPTIONS", HTTP_METHOD_OPTIONS},
+    };
+    if (parser->token_len == 0)
+        return fail(parser, 400);
+    parser->method = HTTP_METHOD_OTHER;
+    if (parser->token_len == TOKEN_OVERFLOW)
+        return true;
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); ++i) {
+        if (strlen(methods[i].name) == parser->token_len
+                && memcmp(methods[i].name, parser->token, parser->token_len) == 0) {
+            parser->method = methods[i].method;
+            break;
+        }
+    }
+    return true;
+}
+
+static bool finish_version(struct http_parser *parser) {
+    // Only "HTTP/1.0" and "HTTP/1.1" make sense for us
+    if (parser->token_len != 8 || memcmp(parser->token, "HTTP/", 5) != 0)
+        return fail(parser, 400);
+    if (parser->token[5] != '1' || parser->token[6] != '.'
+            || parser->token[7] < '0' || parser->token[7] > '9')
+        return fail(parser, 505);
+    parser->version_minor = parser->token[7] - '0';
+    return true;
+}
+
+static void finish_header_name(struct http_parser *parser) {
+    parser->header = HTTP_HEADER_OTHER;
+    parser->value_len = 0;
+    if (parser->token_len == TOKEN_OVERFLOW)
+        return;
+    for (uint8_t i = 1; i < HEADER_NAMES_LEN; ++i) {
+        if (strlen(HEADER_NAMES[i]) == parser->token_len
+                && memcmp(HEADER_NAMES[i], parser->token, parser->token_len) == 0) {
+            parser->header = i;
+            return;
+        }
+    }
+}
+
+/// Whether the comma-separated list in `value` contains `token`
+static bool list_has_token(const char *value, uint8_t value_len, const char *token) {
+    size_t token_len = strlen(token);
+    uint8_t i = 0;
+    while (i < value_len) {
+        while (i < value_len && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+            ++i;
+        uint8_t start = i;
+        while (i < value_len && value[i] != ',' && value[i] != ' ' && value[i] != '\t')
+            ++i;
+        if ((size_t) (i - start) == token_len) {
+            uint8_t j = 0;
+            while (j < token_len && lower(value[start + j]) == token[j])
+                ++j;
+            if (j == token_len)
+                return true;
+        }
+    }
+    return false;
+}
+
+static bool finish_header_value(struct http_parser *parser) {
+    // Trailing whitespace is not part of the value
+    while (parser->value_len && (parser->value[parser->value_len - 1] == ' '
+                                 || parser->value[parser->value_len - 1] == '\t'))
+        --parser->value_len;
+    switch (parser->header) {
+    case HTTP_HEADER_CONNECTION:
+        parser->connection_close |= list_has_token(parser->value, parser->value_len, "close");
+        parser->connection_keep_alive |= list_has_token(parser->value, parser->value_len, "keep-alive");
+        parser->connection_upgrade |= list_has_token(parser->value, parser->value_len, "upgrade");
+        break;
+    case HTTP_HEADER_UPGRADE:
+        parser->upgrade_websocket |= list_has_token(parser->value, parser->value_len, "websocket");
+        break;
+    case HTTP_HEADER_WEBSOCKET_KEY:
+        if (parser->value_len >= sizeof(parser->websocket_key))
+            return fail(parser, 400);
+        memcpy(parser->websocket_key, parser->value, parser->value_len);
+        parser->websocket_key[parser->value_len] = 0;
+        break;
+    case HTTP_HEADER_WEBSOCKET_VERSION: {
+        struct http_slice version = {parser->value, parser->value_len};
+        uint32_t number;
+        // Anything unknown is answered as "not 13" later
+        if (http_parse_uint(version, 0, 255, &number))
+            parser->websocket_version = number;
+        break;
+    }
+    case HTTP_HEADER_CONTENT_LENGTH: {
+        uint32_t length = 0;
+        if (parser->value_len == 0 || parser->has_content_length)
+            return fail(parser, 400);
+        for (uint8_t i = 0; i < parser->value_len; ++i) {
+            char c = parser->value[i];
+            if (c < '0' || c > '9' || length > (UINT32_MAX - (c - '0')) / 10)
+                return fail(parser, 400);
+            length = length * 10 + (c - '0');
+        }
+        parser->has_content_length = true;
+        parser->content_length = length;
+        break;
+    }
+    case HTTP_HEADER_IF_NONE_MATCH:
+        memcpy(parser->if_none_match, parser->value, parser->value_len);
+        parser->if_none_match[parser->value_len] = 0;
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+/// Advance by one byte. `false` once the head is complete or broken
+static inline bool http_parser_step(struct http_parser *parser, char c) {
+    // Leading empty lines count too, or they could be sent forever
+    if (++parser->len > parser->max_len)
+        return fail(parser, 431);
+    switch (parser->state) {
+    case HTTP_PARSE_IDLE:
+        // Stray empty lines before a request are allowed (RFC 9112 2.2)
+        if (c == '\r' || c == '\n')
+            return true;
+        parser->state = HTTP_PARSE_METHOD;
+        parser->token_len = 0;
+        // Fall through
+    case HTTP_PARSE_METHOD:
+        if (c == ' ') {
+            parser->state = HTTP_PARSE_TARGET;
+            return finish_method(parser);
+        }
+        if (c < 'A' || c > 'Z')
+            return fail(parser, 400);
+        if (parser->token_len == TOKEN_OVERFLOW)
+            return true;
+        if (parser->token_len == HTTP_PARSER_NAME_LEN)
+            parser->token_len = TOKEN_OVERFLOW;
+        else
+            parser->token[parser->token_len++] = c;
+        return true;
+    case HTTP_PARSE_TARGET:
+        if (c == ' ') {
+            if (parser->target_len == 0)
+                return fail(parser, 400);
+            parser->target[parser->target_len] = 0;
+            if (parser->query_offset == UINT8_MAX)
+                parser->query_offset = parser->target_len;
+            parser->state = HTTP_PARSE_VERSION;
+            parser->token_len = 0;
+            return true;
+        }
+        if ((unsigned char) c <= ' ' || c == 0x7f)
+            return fail(parser, 400);
+        if (parser->target_len == HTTP_PARSER_TARGET_LEN - 1)
+            return fail(parser, 414);
+        if (c == '?' && parser->query_offset == UINT8_MAX)
+            parser->query_offset = parser->target_len;
+        else if (parser->query_offset == UINT8_MAX)
+            parser->path_hash = http_hash_update(parser->path_hash, c);
+        parser->target[parser->target_len++] = c;
+        return true;
+    case HTTP_PARSE_VERSION:
+        if (c == '\r')
+            return true;
+        if (c == '\n') {
+            parser->state = HTTP_PARSE_HEADER_START;
+            return finish_version(parser);
+        }
+        if (parser->token_len == HTTP_PARSER_NAME_LEN)
+            return fail(parser, 400);
+        parser->token[parser->token_len++] = c;
+        return true;
+    case HTTP_PARSE_HEADER_START:
+        if (c == '\r')
+            return true;
+        if (c == '\n') {
+            parser->state = HTTP_PARSE_DONE;
+            return false;
+        }
+        // Obsolete line folding is not worth supporting
+        if (c == ' ' || c == '\t' || c == ':')
+            return fail(parser, 400);
+        parser->state = HTTP_PARSE_HEADER_NAME;
+        parser->token_len = 0;
+        // Fall through
+    case HTTP_PARSE_HEADER_NAME:
+        if (c == ':') {
+            finish_header_name(parser);
+            parser->state = HTTP_PARSE_HEADER_SPACE;
+            return true;
+        }
+        if ((unsigned char) c <= ' ' || c == 0x7f)
+            return fail(parser, 400);
+        if (parser->token_len == TOKEN_OVERFLOW)
+            return true;
+        if (parser->token_len == HTTP_PARSER_NAME_LEN)
+            parser->token_len = TOKEN_OVERFLOW;
+        else
+            parser->token[parser->token_len++] = lower(c);
+        return true;
+    case HTTP_PARSE_HEADER_SPACE:
+        if (c == ' ' || c == '\t')
+            return true;
+        parser->state = HTTP_PARSE_HEADER_VALUE;
+        // Fall through
+    case HTTP_PARSE_HEADER_VALUE:
+        if (c == '\r')
+            return true;
+        if (c == '\n') {
+            parser->state = HTTP_PARSE_HEADER_START;
+            return finish_header_value(parser);
+        }
+        // Values of headers we don't care about are not kept at all
+        if (parser->header != HTTP_HEADER_OTHER && parser->value_len < HTTP_PARSER_VALUE_LEN - 1)
+            parser->value[parser->value_len++] = c;
+        return true;
+    case HTTP_PARSE_DONE:
+    case HTTP_PARSE_ERROR:
+    default:
+        return false;
+    }
+}
+
+size_t http_parser_feed(struct http_parser *parser, const char *data, size_t len) {
+    size_t i = 0;
+    if (parser->state == HTTP_PARSE_DONE || parser->state == HTTP_PARSE_ERROR)
+        return 0;
+    while (i < len) {
+        if (!http_parser_step(parser, data[i++]))
+            break;
+    }
+    return i;
+}
+
+bool http_query_next(const char *query, size_t len, size_t *cursor,
+                     struct http_slice *key, struct http_slice *value) {
+    size_t i = *cursor;
+    // Skip empty pairs as in "a=1&&b=2"
+    while (i < len && query[i] == '&')
+        ++i;
+    if (i >= len)
+        return false;
+    key->data = query + i;
+    while (i < len && query[i] != '=' && query[i] != '&')
+        ++i;
+    key->len = query + i - key->data;
+    if (i < len && query[i] == '=')
+        ++i;
+    value->data = query + i;
+    while (i < len && query[i] != '&')
+        ++i;
+    value->len = query + i - value->data;
+    *cursor = i;
+    return true;
+}
+
+bool http_query_get(const char *query, size_t len, const char *key, struct http_slice *value) {
+    size_t key_len = strlen(key);
+    size_t cursor = 0;
+    struct http_slice k;
+    while (http_query_next(query, len, &cursor, &k, value)) {
+        if (k.len == key_len && memcmp(k.data, key, key_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool http_parse_uint(struct http_slice str, uint32_t min, uint32_t max, uint32_t *result) {
+    uint32_t value = 0;
+    if (str.len == 0)
+        return false;
+    for (size_t i = 0; i < str.len; ++i) {
+        char c = str.data[i];
+        if (c < '0' || c > '9' || value > (UINT32_MAX - (c - '0')) / 10)
+            return false;
+        value = value * 10 + (c - '0');
+    }
+    if (value < min || value > max)
+        return false;
+    *result = value;
+    return true;
+}
+
+bool http_parse_fixed(struct http_slice str, uint8_t decimals, int32_t min, int32_t max, int32_t *result) {
+    size_t i = 0;
+    bool negative = false;
+    bool digits = false;
+    int64_t value = 0;
+    uint8_t fraction = 0;
+    if (i < str.len && (str.data[i] == '-' || str.data[i] == '+'))
+        negative = str.data[i++] == '-';
+    for (; i < str.len && str.data[i] >= '0' && str.data[i] <= '9'; ++i) {
+        value = value * 10 + (str.data[i] - '0');
+        digits = true;
+        // Already out of any int32_t range
+        if (value > (int64_t) INT32_MAX + 1)
+            return false;
+    }
+    if (i < str.len && str.data[i] == '.') {
+        for (++i; i < str.len && str.data[i] >= '0' && str.data[i] <= '9'; ++i) {
+            digits = true;
+            if (fraction < decimals) {
+                value = value * 10 + (str.data[i] - '0');
+                ++fraction;
+            }
+        }
+    }
+    if (!digits || i != str.len)
+        return false;
+    for (; fraction < decimals; ++fraction) {
+        value *= 10;
+        if (value > (int64_t) INT32_MAX + 1)
+            return false;
+    }
+    if (negative)
+        value = -value;
+    if (value < min || value > max)
+        return false;
+    *result = (int32_t) value;
+    return true;
+}
+
+#ifdef HTTP_PARSER_TEST
+static const char REQUEST[] = "GET /3light_dim?level=42.5 HTTP/1.1\r\n"
+                              "Host: thekit4\r\n"
+                              "CONNECTION: Upgrade, Close\r\n"
+                              "If-None-Match: \"abc\", \"def\"  \r\n"
+                              "\r\n"
+                              "GET / HTTP/1.0\r\n\r\n";
+// Where the first request ends
+static const size_t REQUEST_LEN = sizeof(REQUEST) - 1 - 18;
+
+static void check_request(const struct http_parser *parser) {
+    size_t path_len;
+    const char *path = http_parser_path(parser, &path_len);
+    assert_eq(parser->state, HTTP_PARSE_DONE);
+    assert_eq(parser->method, HTTP_METHOD_GET);
+    assert_eq(parser->version_minor, 1);
+    assert_eq(path_len, 11);
+    assert(memcmp(path, "/3light_dim", 11) == 0);
+    assert(strcmp(http_parser_query(parser), "level=42.5") == 0);
+    assert(parser->connection_close);
+    assert(!http_parser_keep_alive(parser));
+    assert(strcmp(parser->if_none_match, "\"abc\", \"def\"") == 0);
+    uint32_t hash = HTTP_HASH_INIT;
+    for (size_t i = 0; i < path_len; ++i)
+        hash = http_hash_update(hash, path[i]);
+    assert_eq(parser->path_hash, hash);
+}
+
+static void test_whole(void) {
+    struct http_parser parser;
+    http_parser_init(&parser, 1024);
+    assert(!http_parser_started(&parser));
+    size_t used = http_parser_feed(&parser, REQUEST, sizeof(REQUEST) - 1);
+    assert_eq(used, REQUEST_LEN);
+    check_request(&parser);
+    // Nothing more is taken until re-initialized
+    assert_eq(http_parser_feed(&parser, REQUEST + used, 1), 0);
+    // The pipelined request
+    http_parser_init(&parser, 1024);
+    used = http_parser_feed(&parser, REQUEST + REQUEST_LEN, 18);
+    assert_eq(used, 18);
+    assert_eq(parser.state, HTTP_PARSE_DONE);
+    assert_eq(parser.version_minor, 0);
+    assert(!http_parser_keep_alive(&parser));
+    assert_eq(http_parser_query(&parser)[0], 0);
+}
+
+static void test_bytewise(void) {
+    struct http_parser parser;
+    http_parser_init(&parser, 1024);
+    size_t total = 0;
+    while (parser.state != HTTP_PARSE_DONE) {
+        assert(total < REQUEST_LEN);
+        total += http_parser_feed(&parser, REQUEST + total, 1);
+    }
+    assert_eq(total, REQUEST_LEN);
+    check_request(&parser);
+}
+
+static void test_errors(void) {
+    struct http_parser parser;
+    char target[HTTP_PARSER_TARGET_LEN + 32] = "GET /";
+    memset(target + 5, 'a', sizeof(target) - 6);
+    target[sizeof(target) - 1] = 0;
+    http_parser_init(&parser, 1024);
+    http_parser_feed(&parser, target, strlen(target));
+    assert_eq(parser.state, HTTP_PARSE_ERROR);
+    assert_eq(parser.status, 414);
+
+    static const char long_header[] = "GET / HTTP/1.1\r\nX-Padding: 0123456789\r\n\r\n";
+    http_parser_init(&parser, 30);
+    http_parser_feed(&parser, long_header, sizeof(long_header) - 1);
+    assert_eq(parser.status, 431);
+
+    static const char bad_version[] = "GET / HTTP/2.0\r\n\r\n";
+    http_parser_init(&parser, 1024);
+    http_parser_feed(&parser, bad_version, sizeof(bad_version) - 1);
+    assert_eq(parser.status, 505);
+
+    static const char no_colon[] = "GET / HTTP/1.1\r\nHost\r\n\r\n";
+    http_parser_init(&parser, 1024);
+    http_parser_feed(&parser, no_colon, sizeof(no_colon) - 1);
+    assert_eq(parser.status, 400);
+
+    static const char bad_length[] = "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n";
+    http_parser_init(&parser, 1024);
+    http_parser_feed(&parser, bad_length, sizeof(bad_length) - 1);
+    assert_eq(parser.status, 400);
+}
+
+static void test_other(void) {
+    struct http_parser parser;
+    static const char post[] = "\r\nPOST /x HTTP/1.0\nContent-Length: 12\nConnection: keep-alive\n\n";
+    http_parser_init(&parser, 1024);
+    assert_eq(http_parser_feed(&parser, post, 2), 2);
+    // Leading empty lines don't start a request
+    assert(!http_parser_started(&parser));
+    http_parser_feed(&parser, post + 2, sizeof(post) - 3);
+    assert_eq(parser.state, HTTP_PARSE_DONE);
+    assert_eq(parser.method, HTTP_METHOD_POST);
+    assert(parser.has_content_length);
+    assert_eq(parser.content_length, 12);
+    assert(http_parser_keep_alive(&parser));
+
+    static const char unknown[] = "BREW /pot HTTP/1.1\r\n\r\n";
+    http_parser_init(&parser, 1024);
+    http_parser_feed(&parser, unknown, sizeof(unknown) - 1);
+    assert_eq(parser.state, HTTP_PARSE_DONE);
+    assert_eq(parser.method, HTTP_METHOD_OTHER);
+}
+
+static void test_websocket(void) {
+    static const char upgrade[] = "GET /ws HTTP/1.1\r\n"
+                                  "Connection: keep-alive, Upgrade\r\n"
+                                  "Upgrade: WebSocket\r\n"
+                                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n\r\n";
+    struct http_parser parser;
+    http_parser_init(&parser, 1024);
+    http_parser_feed(&parser, upgrade, sizeof(upgrade) - 1);
+    assert_eq(parser.state, HTTP_PARSE_DONE);
+    assert(parser.connection_upgrade);
+    assert(parser.upgrade_websocket);
+    assert_eq(parser.websocket_version, 13);
+    assert(strcmp(parser.websocket_key, "dGhlIHNhbXBsZSBub25jZQ==") == 0);
+}
+
+static void test_query(void) {
+    static const char query[] = "level=42.5&&flag&x=&level=7";
+    size_t cursor = 0;
+    struct http_slice key, value;
+    assert(http_query_next(query, sizeof(query) - 1, &cursor, &key, &value));
+    assert(key.len == 5 && memcmp(key.data, "level", 5) == 0);
+    assert(value.len == 4 && memcmp(value.data, "42.5", 4) == 0);
+    assert(http_query_next(query, sizeof(query) - 1, &cursor, &key, &value));
+    assert(key.len == 4 && memcmp(key.data, "flag", 4) == 0);
+    assert_eq(value.len, 0);
+    assert(http_query_next(query, sizeof(query) - 1, &cursor, &key, &value));
+    assert(key.len == 1 && value.len == 0);
+    assert(http_query_next(query, sizeof(query) - 1, &cursor, &key, &value));
+    assert(value.len == 1 && value.data[0] == '7');
+    assert(!http_query_next(query, sizeof(query) - 1, &cursor, &key, &value));
+    // The first one wins
+    assert(http_query_get(query, sizeof(query) - 1, "level", &value));
+    assert_eq(value.data, query + 6);
+    assert(!http_query_get(query, sizeof(query) - 1, "lev", &value));
+    assert(!http_query_get("", 0, "level", &value));
+}
+
+static void test_numbers(void) {
+    int32_t fixed;
+    uint32_t uint;
+    assert(http_parse_fixed((struct http_slice){"42.5", 4}, 2, 0, 10000, &fixed));
+    assert_eq(fixed, 4250);
+    assert(http_parse_fixed((struct http_slice){"100", 3}, 2, 0, 10000, &fixed));
+    assert_eq(fixed, 10000);
+    assert(http_parse_fixed((struct http_slice){"33.3333", 7}, 2, 0, 10000, &fixed));
+    assert_eq(fixed, 3333);
+    assert(http_parse_fixed((struct http_slice){"-.5", 3}, 1, -10, 10, &fixed));
+    assert_eq(fixed, -5);
+    assert(!http_parse_fixed((struct http_slice){"100.01", 6}, 2, 0, 10000, &fixed));
+    assert(!http_parse_fixed((struct http_slice){"-1", 2}, 2, 0, 10000, &fixed));
+    assert(!http_parse_fixed((struct http_slice){"4x", 2}, 2, 0, 10000, &fixed));
+    assert(!http_parse_fixed((struct http_slice){".", 1}, 2, 0, 10000, &fixed));
+    assert(!http_parse_fixed((struct http_slice){"", 0}, 2, 0, 10000, &fixed));
+    assert(!http_parse_fixed((struct http_slice){"99999999999", 11}, 0, 0, INT32_MAX, &fixed));
+    assert(http_parse_uint((struct http_slice){"4294967295", 10}, 0, UINT32_MAX, &uint));
+    assert_eq(uint, UINT32_MAX);
+    assert(!http_parse_uint((struct http_slice){"4294967296", 10}, 0, UINT32_MAX, &uint));
+    assert(!http_parse_uint((struct http_slice){"5", 1}, 6, 9, &uint));
+    assert(!http_parse_uint((struct http_slice){"+5", 2}, 0, 9, &uint));
+}
+
+int main(void) {
+    test_whole();
+    test_bytewise();
+    test_errors();
+    test_other();
+    test_websocket();
+    test_query();
+    test_numbers();
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,170 @@
+/*
+ *  http_parser.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Resumable HTTP/1.x request head parser.
+//! Bytes are fed as they arrive, in pieces of any size, and each one is
+//! looked at exactly once. Only the parts the server acts on are kept, so
+//! the caller can free its buffers right after feeding them.
+//! Also has the query-string helpers that work on the parsed target.
+
+#ifndef _HTTP_PARSER_H
+#define _HTTP_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest request target (path and query) kept, including the NUL
+#define HTTP_PARSER_TARGET_LEN 128
+// Longest header name that can be recognized
+#define HTTP_PARSER_NAME_LEN 24
+// Longest header value kept, including the NUL. Longer ones are truncated
+#define HTTP_PARSER_VALUE_LEN 64
+
+enum http_method {
+    HTTP_METHOD_OTHER = 0,
+    HTTP_METHOD_GET,
+    HTTP_METHOD_HEAD,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_PUT,
+    HTTP_METHOD_DELETE,
+    HTTP_METHOD_OPTIONS,
+};
+
+/// For `struct http_route`-style method masks
+#define HTTP_METHOD_MASK(method) (1u << (method))
+
+/// FNV-1a, used to look up paths without comparing against each one
+#define HTTP_HASH_INIT 0x811c9dc5u
+static inline uint32_t http_hash_update(uint32_t hash, char c) {
+    return (hash ^ (uint8_t) c) * 0x01000193u;
+}
+
+/// A piece of a buffer owned by someone else. Not NUL-terminated
+struct http_slice {
+    const char *data;
+    size_t len;
+};
+
+enum http_parser_state {
+    // Nothing of the next request seen yet
+    HTTP_PARSE_IDLE = 0,
+    HTTP_PARSE_METHOD,
+    HTTP_PARSE_TARGET,
+    HTTP_PARSE_VERSION,
+    HTTP_PARSE_HEADER_START,
+    HTTP_PARSE_HEADER_NAME,
+    HTTP_PARSE_HEADER_SPACE,
+    HTTP_PARSE_HEADER_VALUE,
+    // A blank line has been seen; the request head is complete
+    HTTP_PARSE_DONE,
+    // `status` says what was wrong
+    HTTP_PARSE_ERROR,
+};
+
+struct http_parser {
+    enum http_parser_state state;
+    // Request head bytes so far, against `max_len`
+    uint16_t len;
+    uint16_t max_len;
+    // Status code to answer with in HTTP_PARSE_ERROR
+    uint16_t status;
+    enum http_method method;
+    // HTTP/1.x
+    uint8_t version_minor;
+    // Path and query, NUL-terminated
+    char target[HTTP_PARSER_TARGET_LEN];
+    uint8_t target_len;
+    // Offset of '?' in `target`, or `target_len` if there is no query
+    uint8_t query_offset;
+    // `http_hash_update` over the path, computed as it arrives
+    uint32_t path_hash;
+    // Scratch for the method, "HTTP/1.x" and the current header
+    char token[HTTP_PARSER_NAME_LEN];
+    uint8_t token_len;
+    // Which header the current value belongs to
+    uint8_t header;
+    char value[HTTP_PARSER_VALUE_LEN];
+    uint8_t value_len;
+    // Recognized headers
+    bool connection_close;
+    bool connection_keep_alive;
+    bool connection_upgrade;
+    // "Upgrade: websocket"
+    bool upgrade_websocket;
+    uint8_t websocket_version;
+    // Sec-WebSocket-Key, NUL-terminated
+    char websocket_key[32];
+    bool has_content_length;
+    uint32_t content_length;
+    // ETag list from If-None-Match, NUL-terminated
+    char if_none_match[HTTP_PARSER_VALUE_LEN];
+};
+
+/// Get ready for a new request whose head is at most `max_len` bytes
+void http_parser_init(struct http_parser *parser, uint16_t max_len);
+
+/// Feed `len` bytes. Stops after the blank line ending the request head or
+/// on error, so the return value (bytes consumed) can be less than `len`
+/// when there are pipelined requests behind this one
+size_t http_parser_feed(struct http_parser *parser, const char *data, size_t len);
+
+/// Whether any byte of a request has been seen
+static inline bool http_parser_started(const struct http_parser *parser) {
+    return parser->state != HTTP_PARSE_IDLE;
+}
+
+/// The path part of the target, `path_len` bytes long
+static inline const char *http_parser_path(const struct http_parser *parser, size_t *path_len) {
+    *path_len = parser->query_offset;
+    return parser->target;
+}
+
+/// The query string after '?', NUL-terminated and empty if there is none
+static inline const char *http_parser_query(const struct http_parser *parser) {
+    if (parser->query_offset == parser->target_len)
+        return parser->target + parser->target_len;
+    return parser->target + parser->query_offset + 1;
+}
+
+/// Whether the connection stays open after this request.
+/// HTTP/1.1 defaults to keep-alive and HTTP/1.0 to close
+static inline bool http_parser_keep_alive(const struct http_parser *parser) {
+    if (parser->version_minor == 0)
+        return parser->connection_keep_alive;
+    return !parser->connection_close;
+}
+
+/// Get the next `key=value` pair of a query string or urlencoded form,
+/// starting at `*cursor` (0 for the first one). Nothing is copied or
+/// percent-decoded. A pair without '=' has an empty value
+bool http_query_next(const char *query, size_t len, size_t *cursor,
+                     struct http_slice *key, struct http_slice *value);
+
+/// Find the first value for `key`
+bool http_query_get(const char *query, size_t len, const char *key, struct http_slice *value);
+
+/// Parse an unsigned decimal integer in [min, max]
+bool http_parse_uint(struct http_slice str, uint32_t min, uint32_t max, uint32_t *result);
+
+/// Parse a decimal number into an integer scaled by 10^`decimals`, e.g.
+/// "42.5" with 2 decimals is 4250, and check it against [min, max] (scaled).
+/// Digits past `decimals` are truncated
+bool http_parse_fixed(struct http_slice str, uint8_t decimals, int32_t min, int32_t max, int32_t *result);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ *  json_writer.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "json_writer.h"
+
+#include <string.h>
+
+#ifdef JSON_WRITER_TEST
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#define assert_str_eq(writer, str) assert(!(writer).overflow && (writer).len == strlen(str) && memcmp((writer).buf, (str), (writer).len) == 0)
+#endif
+
+/// Lookup table for scaling floats
+static const float POW_10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6};
+static const uint8_t POW_10_LEN = sizeof(POW_10) / sizeof(POW_10[0]);
+
+void json_init(struct json_writer *writer, char *buf, size_t cap) {
+    writer->buf = buf;
+    writer->cap = cap;
+    writer->len = 0;
+    writer->overflow = false;
+    writer->depth = 0;
+    writer->nonempty = 0;
+}
+
+static void put(struct json_writer *writer, const char *data, size_t len) {
+    if (writer->overflow || len > writer->cap - writer->len) {
+        writer->overflow = true;
+        return;
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+}
+
+static void put_char(struct json_writer *writer, char c) {
+    if (writer->overflow || writer->len == writer->cap) {
+        writer->overflow = true;
+        return;
+    }
+    writer->buf[writer->len++] = c;
+}
+
+/// Separator and key before a value
+static void put_key(struct json_writer *writer, const char *key) {
+    uint8_t bit = 1u << writer->depth;
+    if (writer->nonempty & bit)
+        put(writer, ", ", 2);
+    writer->nonempty |= bit;
+    if (key) {
+        put_char(writer, '"');
+        put(writer, key, strlen(key));
+        put(writer, "\": ", 3);
+    }
+}
+
+static void begin(struct json_writer *writer, const char *key, char open) {
+    put_key(writer, key);
+    put_char(writer, open);
+    if (writer->depth == JSON_MAX_DEPTH - 1) {
+        writer->overflow = true;
+        return;
+    }
+    ++writer->depth;
+    writer->nonempty &= ~(1u << writer->depth);
+}
+
+static void end(struct json_writer *writer, char close) {
+    if (writer->depth == 0) {
+        writer->overflow = true;
+        return;
+    }
+    --writer->depth;
+    put_char(writer, close);
+}
+
+void json_begin_object(struct json_writer *writer, const char *key) {
+    begin(writer, key, '{');
+}
+
+void json_end_object(struct json_writer *writer) {
+    end(writer, '}');
+}
+
+void json_begin_array(struct json_writer *writer, const char *key) {
+    begin(writer, key, '[');
+}
+
+void json_end_array(struct json_writer *writer) {
+    end(writer, ']');
+}
+
+size_t json_format_uint(char *out, uint64_t value) {
+    char digits[20];
+    size_t n = 0;
+    // 64-bit division is done in software on Cortex-M0+, so only use it
+    // until the rest fits in 32 bits
+    while (value > UINT32_MAX) {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    }
+    uint32_t small = value;
+    do {
+        digits[n++] = '0' + small % 10;
+        small /= 10;
+    } while (small);
+    for (size_t i = 0; i < n; ++i)
+        out[i] = digits[n - 1 - i];
+    return n;
+}
+
+static void put_uint(struct json_writer *writer, uint64_t value) {
+    char out[20];
+    put(writer, out, json_format_uint(out, value));
+}
+
+void json_uint(struct json_writer *writer, const char *key, uint64_t value) {
+    put_key(writer, key);
+    put_uint(writer, value);
+}
+
+void json_int(struct json_writer *writer, const char *key, int64_t value) {
+    put_key(writer, key);
+    if (value < 0) {
+        put_char(writer, '-');
+        // Also right for INT64_MIN
+        put_uint(writer, -(uint64_t) value);
+    } else
+        put_uint(writer, value);
+}
+
+void json_fixed(struct json_writer *writer, const char *key, int32_t value, uint8_t decimals) {
+    char out[20];
+    put_key(writer, key);
+    uint32_t magnitude = value < 0 ? -(uint32_t) value : (uint32_t) value;
+    if (value < 0)
+        put_char(writer, '-');
+    size_t len = json_format_uint(out, magnitude);
+    if (decimals == 0) {
+        put(writer, out, len);
+        return;
+    }
+    if (len <= decimals) {
+        // 0.0ddd
+        put(writer, "0.", 2);
+        for (size_t i = len; i < decimals; ++i)
+            put_char(writer, '0');
+        put(writer, out, len);
+        return;
+    }
+    put(writer, out, len - decimals);
+    put_char(writer, '.');
+    put(writer, out + len - decimals, decimals);
+}
+
+void json_float(struct json_writer *writer, const char *key, float value, uint8_t decimals) {
+    if (decimals >= POW_10_LEN)
+        decimals = POW_10_LEN - 1;
+    float scaled = value * POW_10[decimals];
+    // Also catches NaN
+    if (!(scaled > -2147483520.f && scaled < 2147483520.f)) {
+        json_null(writer, key);
+        return;
+    }
+    int32_t rounded = (int32_t) (scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+    json_fixed(writer, key, rounded, decimals);
+}
+
+void json_bool(struct json_writer *writer, const char *key, bool value) {
+    put_key(writer, key);
+    if (value)
+        put(writer, "true", 4);
+    else
+        put(writer, "false", 5);
+}
+
+void json_null(struct json_writer *writer, const char *key) {
+    put_key(writer, key);
+    put(writer, "null", 4);
+}
+
+void json_string(struct json_writer *writer, const char *key, const char *value) {
+    static const char HEX[] = "0123456789abcdef";
+    put_key(writer, key);
+    put_char(writer, '"');
+    for (const char *c = value; *c; ++c) {
+        // Copy runs that need no escaping in one go
+        const char *run = c;
+        while (*c && *c != '"' && *c != '\\' && (unsigned char) *c >= 0x20)
+            ++c;
+        put(writer, run, c - run);
+        if (!*c)
+            break;
+        char escape[6] = {'\\', *c};
+        size_t escape_len = 2;
+        if (*c == '\n')
+            escape[1] = 'n';
+        else if (*c == '\r')
+            escape[1] = 'r';
+        else if (*c == '\t')
+            escape[1] = 't';
+        else if ((unsigned char) *c < 0x20) {
+            memcpy(escape + 1, "u00", 3);
+            escape[4] = HEX[*c >> 4];
+            escape[5] = HEX[*c & 0xf];
+            escape_len = 6;
+        }
+        put(writer, escape, escape_len);
+    }
+    put_char(writer, '"');
+}
+
+#ifdef JSON_WRITER_TEST
+static void test_numbers(void) {
+    char buf[128];
+    struct json_writer writer;
+    json_init(&writer, buf, sizeof(buf));
+    json_begin_array(&writer, NULL);
+    json_uint(&writer, NULL, 0);
+    json_uint(&writer, NULL, UINT64_MAX);
+    json_int(&writer, NULL, INT64_MIN);
+    json_fixed(&writer, NULL, 4250, 2);
+    json_fixed(&writer, NULL, -5, 3);
+    json_fixed(&writer, NULL, 7, 0);
+    json_float(&writer, NULL, -3.14159f, 3);
+    json_float(&writer, NULL, 0.0005f, 3);
+    json_float(&writer, NULL, NAN, 2);
+    json_float(&writer, NULL, 1e12f, 2);
+    json_end_array(&writer);
+    assert_str_eq(writer, "[0, 18446744073709551615, -9223372036854775808, 42.50, -0.005, 7, "
+                          "-3.142, 0.001, null, null]");
+}
+
+static void test_structure(void) {
+    char buf[128];
+    struct json_writer writer;
+    json_init(&writer, buf, sizeof(buf));
+    json_begin_object(&writer, NULL);
+    json_bool(&writer, "dim", true);
+    json_begin_object(&writer, "empty");
+    json_end_object(&writer);
+    json_begin_array(&writer, "list");
+    json_null(&writer, NULL);
+    json_bool(&writer, NULL, false);
+    json_end_array(&writer);
+    json_string(&writer, "s", "a\"b\\c\n\x01");
+    json_end_object(&writer);
+    assert_str_eq(writer, "{\"dim\": true, \"empty\": {}, \"list\": [null, false], "
+                          "\"s\": \"a\\\"b\\\\c\\n\\u0001\"}");
+}
+
+static void test_overflow(void) {
+    char buf[8];
+    struct json_writer writer;
+    json_init(&writer, buf, sizeof(buf));
+    json_begin_object(&writer, NULL);
+    json_uint(&writer, "key", 1);
+    assert(writer.overflow);
+    assert(writer.len <= sizeof(buf));
+    json_init(&writer, buf, sizeof(buf));
+    json_end_object(&writer);
+    assert(writer.overflow);
+}
+
+int main(void) {
+    test_numbers();
+    test_structure();
+    test_overflow();
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
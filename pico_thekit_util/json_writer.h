@@ -0,0 +1,68 @@
+/*
+ *  json_writer.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Streaming JSON writer into a caller-provided buffer.
+//! Numbers are formatted with integer arithmetic only; floats are scaled
+//! to fixed point first, which avoids the printf float path entirely.
+
+#ifndef _JSON_WRITER_H
+#define _JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Deepest nesting of objects and arrays
+#define JSON_MAX_DEPTH 8
+
+struct json_writer {
+    char *buf;
+    size_t cap;
+    size_t len;
+    // Something did not fit; the output is truncated and must not be used
+    bool overflow;
+    uint8_t depth;
+    // Bit n: the container at depth n already has a member
+    uint8_t nonempty;
+};
+
+void json_init(struct json_writer *writer, char *buf, size_t cap);
+
+/// `key` is NULL for array elements and the top level.
+/// Keys are written as-is, so they must not need escaping
+void json_begin_object(struct json_writer *writer, const char *key);
+void json_end_object(struct json_writer *writer);
+void json_begin_array(struct json_writer *writer, const char *key);
+void json_end_array(struct json_writer *writer);
+
+void json_uint(struct json_writer *writer, const char *key, uint64_t value);
+void json_int(struct json_writer *writer, const char *key, int64_t value);
+/// `value` / 10^`decimals`, e.g. (4250, 2) is 42.50
+void json_fixed(struct json_writer *writer, const char *key, int32_t value, uint8_t decimals);
+/// Rounded to `decimals` (at most 6) places. Non-finite or huge values are null
+void json_float(struct json_writer *writer, const char *key, float value, uint8_t decimals);
+void json_bool(struct json_writer *writer, const char *key, bool value);
+void json_null(struct json_writer *writer, const char *key);
+/// Escaped as needed
+void json_string(struct json_writer *writer, const char *key, const char *value);
+
+/// Write the decimal representation of `value` to `out`, which must have
+/// room for 20 characters. Returns the length. Not NUL-terminated
+size_t json_format_uint(char *out, uint64_t value);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ *  log_ring.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "log_ring.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef RPI_PICO
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#else
+// Single-threaded host build
+#define save_and_disable_interrupts() 0
+#define restore_interrupts(status) ((void) (status))
+#define time_us_64() 0
+#endif
+
+#ifdef LOG_RING_TEST
+#include <assert.h>
+#endif
+
+// Length, level, format string, timestamp
+#define HEADER_LEN (2 + sizeof(const char *) + sizeof(uint64_t))
+
+_Static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+
+// Marker: static variable
+static uint8_t log_ring[LOG_RING_SIZE];
+// Marker: static variable
+// Free-running, so that head - tail is the fill level
+static volatile uint32_t log_head;
+// Marker: static variable
+static volatile uint32_t log_tail;
+// Marker: static variable
+static volatile uint32_t log_dropped;
+
+void log_begin(struct log_builder *builder, uint8_t level, const char *fmt) {
+    uint64_t now = time_us_64();
+    builder->buf[1] = level;
+    memcpy(builder->buf + 2, &fmt, sizeof(fmt));
+    memcpy(builder->buf + 2 + sizeof(fmt), &now, sizeof(now));
+    builder->len = HEADER_LEN;
+}
+
+/// Append a tagged argument, or mark the record as truncated
+static void put(struct log_builder *builder, uint8_t tag, const void *data, size_t len) {
+    // Once one is left out, so are the rest, or they would shift
+    if ((builder->buf[1] & LOG_LEVEL_TRUNCATED) || builder->len + 1 + len > LOG_MAX_RECORD) {
+        builder->buf[1] |= LOG_LEVEL_TRUNCATED;
+        return;
+    }
+    builder->buf[builder->len] = tag;
+    memcpy(builder->buf + builder->len + 1, data, len);
+    builder->len += 1 + len;
+}
+
+void log_put_i32(struct log_builder *builder, int32_t value) {
+    put(builder, LOG_ARG_I32, &value, sizeof(value));
+}
+
+void log_put_i64(struct log_builder *builder, int64_t value) {
+    put(builder, LOG_ARG_I64, &value, sizeof(value));
+}
+
+void log_put_double(struct log_builder *builder, double value) {
+    put(builder, LOG_ARG_DOUBLE, &value, sizeof(value));
+}
+
+void log_put_ptr(struct log_builder *builder, const void *value) {
+    uint64_t address = (uintptr_t) value;
+    put(builder, LOG_ARG_PTR, &address, sizeof(address));
+}
+
+void log_put_str(struct log_builder *builder, const char *value) {
+    uint8_t str[1 + LOG_MAX_STR];
+    size_t len = value ? strnlen(value, LOG_MAX_STR) : 0;
+    str[0] = len;
+    memcpy(str + 1, value, len);
+    put(builder, LOG_ARG_STR, str, 1 + len);
+}
+
+void log_commit(struct log_builder *builder) {
+    uint32_t len = builder->len;
+    builder->buf[0] = len;
+    // Short enough that masking interrupts beats anything lock-free
+    uint32_t status = save_and_disable_interrupts();
+    uint32_t head = log_head;
+    if (LOG_RING_SIZE - (head - log_tail) < len) {
+        log_dropped = log_dropped + 1;
+        restore_interrupts(status);
+        return;
+    }
+    uint32_t offset = head & (LOG_RING_SIZE - 1);
+    uint32_t first = LOG_RING_SIZE - offset;
+    if (first >= len)
+        memcpy(log_ring + offset, builder->buf, len);
+    else {
+        memcpy(log_ring + offset, builder->buf, first);
+        memcpy(log_ring, builder->buf + first, len - first);
+    }
+    log_head = head + len;
+    restore_interrupts(status);
+}
+
+bool log_ring_empty(void) {
+    return log_head == log_tail;
+}
+
+uint32_t log_ring_dropped(void) {
+    return log_dropped;
+}
+
+/// Take the oldest record out of the ring. Returns its length or 0
+static uint32_t log_ring_take(uint8_t record[LOG_MAX_RECORD]) {
+    uint32_t status = save_and_disable_interrupts();
+    uint32_t tail = log_tail;
+    if (tail == log_head) {
+        restore_interrupts(status);
+        return 0;
+    }
+    uint32_t len = log_ring[tail & (LOG_RING_SIZE - 1)];
+    for (uint32_t i = 0; i < len; ++i)
+        record[i] = log_ring[(tail + i) & (LOG_RING_SIZE - 1)];
+    log_tail = tail + len;
+    restore_interrupts(status);
+    return len;
+}
+
+/// Append `str` to `out`, keeping the NUL
+static size_t append(char *out, size_t size, size_t pos, const char *str) {
+    while (*str && pos + 1 < size)
+        out[pos++] = *str++;
+    out[pos] = '\0';
+    return pos;
+}
+
+/// Format one conversion from `spec` (flags and width, without the length
+/// modifier or conversion) with an argument, converting it to whatever
+/// `conv` takes so that a mismatch can't read garbage
+static size_t format_arg(char *out, size_t size, size_t pos, char *spec, size_t spec_len,
+                         char conv, const uint8_t **arg, const uint8_t *end) {
+    if (*arg >= end)
+        return append(out, size, pos, "?");
+    uint8_t tag = **arg;
+    int64_t ival = 0;
+    double dval = 0;
+    char sval[LOG_MAX_STR + 1] = "?";
+    size_t len = tag == LOG_ARG_STR ? 1 + (*arg)[1] : tag == LOG_ARG_I32 ? 4 : 8;
+    if (*arg + 1 + len > end)
+        return append(out, size, pos, "?");
+    const uint8_t *data = *arg + 1;
+    *arg += 1 + len;
+    switch (tag) {
+    case LOG_ARG_I32: {
+        int32_t v;
+        memcpy(&v, data, sizeof(v));
+        ival = v;
+        dval = v;
+        break;
+    }
+    case LOG_ARG_I64:
+    case LOG_ARG_PTR:
+        memcpy(&ival, data, sizeof(ival));
+        dval = (double) ival;
+        break;
+    case LOG_ARG_DOUBLE:
+        memcpy(&dval, data, sizeof(dval));
+        ival = (int64_t) dval;
+        break;
+    case LOG_ARG_STR:
+        memcpy(sval, data + 1, data[0]);
+        sval[data[0]] = '\0';
+        break;
+    default:
+        return append(out, size, pos, "?");
+    }
+    int written;
+    if (conv == 'c') {
+        spec[spec_len++] = 'c';
+        spec[spec_len] = '\0';
+        written = snprintf(out + pos, size - pos, spec, (int) ival);
+    } else if (strchr("diouxX", conv)) {
+        // 32-bit arguments were sign-extended, which is wrong for %u of a
+        // uint32_t above INT32_MAX
+        if (tag == LOG_ARG_I32 && strchr("ouxX", conv))
+            ival = (uint32_t) ival;
+        spec[spec_len++] = 'l';
+        spec[spec_len++] = 'l';
+        spec[spec_len++] = conv;
+        spec[spec_len] = '\0';
+        written = snprintf(out + pos, size - pos, spec, (long long) ival);
+    } else if (strchr("fFeEgGaA", conv)) {
+        spec[spec_len++] = conv;
+        spec[spec_len] = '\0';
+        written = snprintf(out + pos, size - pos, spec, dval);
+    } else if (conv == 's') {
+        spec[spec_len++] = 's';
+        spec[spec_len] = '\0';
+        written = snprintf(out + pos, size - pos, spec, tag == LOG_ARG_STR ? sval : "?");
+    } else if (conv == 'p') {
+        written = snprintf(out + pos, size - pos, "0x%llx", (unsigned long long) ival);
+    } else
+        return append(out, size, pos, "?");
+    if (written < 0)
+        return pos;
+    pos += written;
+    return pos < size ? pos : size - 1;
+}
+
+/// Turn a record back into text
+static void log_format(const uint8_t *record, uint32_t len, char *out, size_t size) {
+    static const char *const PREFIX[] = {"", "", "WARNING: ", "ERROR: "};
+    uint8_t level = record[1];
+    const char *fmt;
+    uint64_t timestamp;
+    memcpy(&fmt, record + 2, sizeof(fmt));
+    memcpy(&timestamp, record + 2 + sizeof(fmt), sizeof(timestamp));
+    int written = snprintf(out, size, "[%5lu.%06lu] %s", (unsigned long) (timestamp / 1000000),
+                           (unsigned long) (timestamp % 1000000), PREFIX[level & 3]);
+    size_t pos = written < 0 ? 0 : (size_t) written < size ? (size_t) written : size - 1;
+    if (level & LOG_LEVEL_LITERAL)
+        pos = append(out, size, pos, fmt);
+    else {
+        const uint8_t *arg = record + HEADER_LEN;
+        const uint8_t *end = record + len;
+        const char *c = fmt;
+        while (*c && pos + 1 < size) {
+            if (*c != '%') {
+                out[pos++] = *c++;
+                continue;
+            }
+            if (c[1] == '%') {
+                out[pos++] = '%';
+                c += 2;
+                continue;
+            }
+            // Room for the flags and width, "ll", the conversion and a NUL
+            char spec[16];
+            size_t spec_len = 0;
+            spec[spec_len++] = *c++;
+            while (*c && strchr("-+ #0123456789.", *c)) {
+                if (spec_len < sizeof(spec) - 4)
+                    spec[spec_len++] = *c;
+                ++c;
+            }
+            while (*c && strchr("hlLqjzt", *c))
+                ++c;
+            if (!*c)
+                break;
+            pos = format_arg(out, size, pos, spec, spec_len, *c++, &arg, end);
+        }
+        out[pos] = '\0';
+    }
+    if (level & LOG_LEVEL_TRUNCATED)
+        pos = append(out, size, pos, " [truncated]");
+    // Sinks add their own line endings
+    while (pos > 0 && (out[pos - 1] == '\n' || out[pos - 1] == '\r'))
+        out[--pos] = '\0';
+}
+
+bool log_ring_pop(char *out, size_t size, uint8_t *level) {
+    uint8_t record[LOG_MAX_RECORD];
+    uint32_t len = log_ring_take(record);
+    if (!len)
+        return false;
+    if (level)
+        *level = record[1] & 3;
+    log_format(record, len, out, size);
+    return true;
+}
+
+#ifdef LOG_RING_TEST
+static void assert_pop(const char *want) {
+    char line[192];
+    assert(log_ring_pop(line, sizeof(line), NULL));
+    if (strcmp(line, want) != 0) {
+        fprintf(stderr, "Got \"%s\", want \"%s\"\n", line, want);
+        assert(0);
+    }
+}
+
+static void test_format(void) {
+    char buf[16];
+    strcpy(buf, "reused");
+    LOG_RECORD(LOG_LEVEL_INFO, "a %d b %5.2f c %s d %lld %%\n", -3, 2.5, buf, (long long) 1 << 40);
+    // The copy is taken at log time
+    strcpy(buf, "changed");
+    LOG_RECORD(LOG_LEVEL_WARN, "%02x:%u:%c", 10, UINT32_MAX, 'x');
+    LOG_RECORD_LITERAL(LOG_LEVEL_ERR, "100% literal");
+    LOG_RECORD(LOG_LEVEL_DEBUG, "no args\n");
+    assert_pop("[    0.000000] a -3 b  2.50 c reused d 1099511627776 %");
+    assert_pop("[    0.000000] WARNING: 0a:4294967295:x");
+    assert_pop("[    0.000000] ERROR: 100% literal");
+    assert_pop("[    0.000000] no args");
+    char line[16];
+    assert(!log_ring_pop(line, sizeof(line), NULL));
+}
+
+static void test_truncation(void) {
+    static const char long_str[] = "01234567890123456789012345678901234567890123456789";
+    LOG_RECORD(LOG_LEVEL_INFO, "%s %s %s %d", long_str, long_str, long_str, 1);
+    assert_pop("[    0.000000] 0123456789012345678901234567890123456789012345 "
+               "0123456789012345678901234567890123456789012345 ? ? [truncated]");
+    // A short line buffer cuts the text, not the ring
+    LOG_RECORD(LOG_LEVEL_INFO, "%s", long_str);
+    char line[20];
+    assert(log_ring_pop(line, sizeof(line), NULL));
+    assert(strcmp(line, "[    0.000000] 0123") == 0);
+}
+
+static void test_full(void) {
+    uint32_t dropped = log_ring_dropped();
+    size_t logged = 0;
+    while (log_ring_dropped() == dropped) {
+        LOG_RECORD(LOG_LEVEL_INFO, "%d", (int) logged);
+        ++logged;
+    }
+    char line[32];
+    for (size_t i = 0; i < logged - 1; ++i) {
+        char want[32];
+        snprintf(want, sizeof(want), "[    0.000000] %d", (int) i);
+        assert(log_ring_pop(line, sizeof(line), NULL));
+        assert(strcmp(line, want) == 0);
+    }
+    assert(!log_ring_pop(line, sizeof(line), NULL));
+}
+
+int main(void) {
+    test_format();
+    test_truncation();
+    test_full();
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
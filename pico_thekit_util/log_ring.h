@@ -0,0 +1,148 @@
+/*
+ *  log_ring.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Deferred binary logging.
+//! A log call stores the address of its format string (which is in flash,
+//! so it doubles as an ID a host tool can look up in the ELF), a timestamp
+//! and the raw arguments in a ring buffer. Text is only produced when the
+//! record is popped, normally in idle time. Strings are copied (truncated
+//! to LOG_MAX_STR) since they tend to live in reused buffers.
+//! Records are committed with interrupts masked for a short memcpy, so any
+//! IRQ handler can log; a full ring drops the new record and counts it.
+
+#ifndef _LOG_RING_H
+#define _LOG_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Must be a power of two
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 4096
+#endif
+// Largest record, header included
+#define LOG_MAX_RECORD 128
+// Longest string argument kept (an IPv6 address with a zone fits)
+#define LOG_MAX_STR 46
+
+enum log_level {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERR,
+};
+// Or-ed into the level: print the format string as-is (the *1 macros)
+#define LOG_LEVEL_LITERAL 0x80
+// Or-ed into the level: some arguments did not fit
+#define LOG_LEVEL_TRUNCATED 0x40
+
+enum log_arg_tag {
+    LOG_ARG_I32 = 0,
+    LOG_ARG_I64,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STR,
+};
+
+/// A record being put together on the stack before `log_commit`
+struct log_builder {
+    uint8_t len;
+    uint8_t buf[LOG_MAX_RECORD];
+};
+
+void log_begin(struct log_builder *builder, uint8_t level, const char *fmt);
+void log_put_i32(struct log_builder *builder, int32_t value);
+void log_put_i64(struct log_builder *builder, int64_t value);
+void log_put_double(struct log_builder *builder, double value);
+void log_put_ptr(struct log_builder *builder, const void *value);
+void log_put_str(struct log_builder *builder, const char *value);
+/// Copy the record into the ring, or count it as dropped
+void log_commit(struct log_builder *builder);
+
+static inline void log_put_long(struct log_builder *builder, long value) {
+    if (sizeof(long) == sizeof(int64_t))
+        log_put_i64(builder, value);
+    else
+        log_put_i32(builder, (int32_t) value);
+}
+
+/// Pick the encoder by the static type of `x`
+#define LOG_PUT(builder, x) _Generic((x), \
+    char *: log_put_str, \
+    const char *: log_put_str, \
+    float: log_put_double, \
+    double: log_put_double, \
+    long long: log_put_i64, \
+    unsigned long long: log_put_i64, \
+    long: log_put_long, \
+    unsigned long: log_put_long, \
+    void *: log_put_ptr, \
+    const void *: log_put_ptr, \
+    default: log_put_i32)((builder), (x))
+
+// Up to eight arguments
+#define LOG_NARG(...) LOG_NARG_(_, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARG_(_, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+#define LOG_PUT_ALL(b, ...) LOG_CAT(LOG_PUT_, LOG_NARG(__VA_ARGS__))(b, ##__VA_ARGS__)
+#define LOG_PUT_0(b)
+#define LOG_PUT_1(b, x) LOG_PUT(b, x);
+#define LOG_PUT_2(b, x, ...) LOG_PUT(b, x); LOG_PUT_1(b, __VA_ARGS__)
+#define LOG_PUT_3(b, x, ...) LOG_PUT(b, x); LOG_PUT_2(b, __VA_ARGS__)
+#define LOG_PUT_4(b, x, ...) LOG_PUT(b, x); LOG_PUT_3(b, __VA_ARGS__)
+#define LOG_PUT_5(b, x, ...) LOG_PUT(b, x); LOG_PUT_4(b, __VA_ARGS__)
+#define LOG_PUT_6(b, x, ...) LOG_PUT(b, x); LOG_PUT_5(b, __VA_ARGS__)
+#define LOG_PUT_7(b, x, ...) LOG_PUT(b, x); LOG_PUT_6(b, __VA_ARGS__)
+#define LOG_PUT_8(b, x, ...) LOG_PUT(b, x); LOG_PUT_7(b, __VA_ARGS__)
+
+/// Never called, only here so that the compiler still checks formats
+static inline __attribute__((format(printf, 1, 2))) void log_check_format(const char *fmt, ...) {
+    (void) fmt;
+}
+
+/// Record `fmt` and its arguments
+#define LOG_RECORD(level, fmt, ...) do { \
+    if (0) \
+        log_check_format(fmt, ##__VA_ARGS__); \
+    struct log_builder log_builder_; \
+    log_begin(&log_builder_, (level), (fmt)); \
+    LOG_PUT_ALL(&log_builder_, ##__VA_ARGS__) \
+    log_commit(&log_builder_); \
+} while (0)
+
+/// Record `str`, which is printed as-is
+#define LOG_RECORD_LITERAL(level, str) do { \
+    struct log_builder log_builder_; \
+    log_begin(&log_builder_, (level) | LOG_LEVEL_LITERAL, (str)); \
+    log_commit(&log_builder_); \
+} while (0)
+
+/// Whether there is nothing to pop
+bool log_ring_empty(void);
+
+/// Records dropped because the ring was full
+uint32_t log_ring_dropped(void);
+
+/// Format the oldest record into `out` (NUL-terminated, no newline) and
+/// remove it. `level` (optional) gets its `enum log_level`. `false` if the
+/// ring is empty
+bool log_ring_pop(char *out, size_t size, uint8_t *level);
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ *  metrics.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+#include "json_writer.h"
+
+#include <string.h>
+
+#ifdef METRICS_TEST
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#define assert_str_eq(writer, str) assert(!(writer).overflow && (writer).len == strlen(str) && memcmp((writer).buf, (str), (writer).len) == 0)
+#endif
+
+/// Lookup table for scaling floats
+static const float POW_10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6};
+static const uint8_t POW_10_LEN = sizeof(POW_10) / sizeof(POW_10[0]);
+
+void metric_observe(struct metric_histogram *histogram, uint32_t value) {
+    uint8_t i = 0;
+    // Only a handful of buckets, so a linear scan beats anything smarter
+    while (i < histogram->n_bounds && value > histogram->bounds[i])
+        ++i;
+    histogram->buckets[i] = histogram->buckets[i] + 1;
+    histogram->count = histogram->count + 1;
+    histogram->sum += value;
+}
+
+void metrics_init(struct metrics_writer *writer, char *buf, size_t cap) {
+    writer->buf = buf;
+    writer->cap = cap;
+    writer->len = 0;
+    writer->overflow = false;
+}
+
+static void put(struct metrics_writer *writer, const char *data, size_t len) {
+    if (writer->overflow || len > writer->cap - writer->len) {
+        writer->overflow = true;
+        return;
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+}
+
+static void put_str(struct metrics_writer *writer, const char *str) {
+    put(writer, str, strlen(str));
+}
+
+/// value / 10^decimals
+static void put_fixed(struct metrics_writer *writer, int64_t value, uint8_t decimals) {
+    char out[20];
+    uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+    if (value < 0)
+        put(writer, "-", 1);
+    size_t len = json_format_uint(out, magnitude);
+    if (decimals == 0) {
+        put(writer, out, len);
+        return;
+    }
+    if (len <= decimals) {
+        put(writer, "0.", 2);
+        for (size_t i = len; i < decimals; ++i)
+            put(writer, "0", 1);
+        put(writer, out, len);
+        return;
+    }
+    put(writer, out, len - decimals);
+    put(writer, ".", 1);
+    put(writer, out + len - decimals, decimals);
+}
+
+void metrics_family(struct metrics_writer *writer, const char *name, const char *type,
+                    const char *help) {
+    put(writer, "# HELP ", 7);
+    put_str(writer, name);
+    put(writer, " ", 1);
+    put_str(writer, help);
+    put(writer, "\n# TYPE ", 8);
+    put_str(writer, name);
+    put(writer, " ", 1);
+    put_str(writer, type);
+    put(writer, "\n", 1);
+}
+
+/// Name and labels of a sample line, up to the space before the value
+static void put_series(struct metrics_writer *writer, const char *name, const char *suffix,
+                       const char *labels) {
+    put_str(writer, name);
+    if (suffix)
+        put_str(writer, suffix);
+    if (labels) {
+        put(writer, "{", 1);
+        put_str(writer, labels);
+        put(writer, "}", 1);
+    }
+    put(writer, " ", 1);
+}
+
+void metrics_sample(struct metrics_writer *writer, const char *name, const char *labels,
+                    int64_t value, uint8_t decimals) {
+    put_series(writer, name, NULL, labels);
+    put_fixed(writer, value, decimals);
+    put(writer, "\n", 1);
+}
+
+void metrics_counter(struct metrics_writer *writer, const char *name, const char *help,
+                     uint64_t value) {
+    metrics_family(writer, name, "counter", help);
+    metrics_sample(writer, name, NULL, (int64_t) value, 0);
+}
+
+void metrics_gauge(struct metrics_writer *writer, const char *name, const char *help,
+                   int64_t value, uint8_t decimals) {
+    metrics_family(writer, name, "gauge", help);
+    metrics_sample(writer, name, NULL, value, decimals);
+}
+
+void metrics_gauge_float(struct metrics_writer *writer, const char *name, const char *help,
+                         float value, uint8_t decimals) {
+    if (decimals >= POW_10_LEN)
+        decimals = POW_10_LEN - 1;
+    float scaled = value * POW_10[decimals];
+    metrics_family(writer, name, "gauge", help);
+    // Also catches NaN
+    if (!(scaled > -9.2e18f && scaled < 9.2e18f)) {
+        put_series(writer, name, NULL, NULL);
+        put(writer, "NaN\n", 4);
+        return;
+    }
+    int64_t rounded = (int64_t) (scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+    metrics_sample(writer, name, NULL, rounded, decimals);
+}
+
+void metrics_histogram_samples(struct metrics_writer *writer, const char *name, const char *labels,
+                               const struct metric_histogram *histogram) {
+    // An observation in between might make the buckets disagree with
+    // `count` by one, which Prometheus tolerates
+    uint64_t cumulative = 0;
+    for (uint8_t i = 0; i <= histogram->n_bounds; ++i) {
+        cumulative += histogram->buckets[i];
+        put_str(writer, name);
+        put(writer, "_bucket{", 8);
+        if (labels) {
+            put_str(writer, labels);
+            put(writer, ",", 1);
+        }
+        if (i < histogram->n_bounds) {
+            put(writer, "le=\"", 4);
+            put_fixed(writer, histogram->bounds[i], histogram->decimals);
+            put(writer, "\"} ", 3);
+        } else
+            put(writer, "le=\"+Inf\"} ", 11);
+        put_fixed(writer, cumulative, 0);
+        put(writer, "\n", 1);
+    }
+    put_series(writer, name, "_sum", labels);
+    put_fixed(writer, histogram->sum, histogram->decimals);
+    put(writer, "\n", 1);
+    put_series(writer, name, "_count", labels);
+    put_fixed(writer, cumulative, 0);
+    put(writer, "\n", 1);
+}
+
+void metrics_histogram(struct metrics_writer *writer, const char *name, const char *help,
+                       const struct metric_histogram *histogram) {
+    metrics_family(writer, name, "histogram", help);
+    metrics_histogram_samples(writer, name, NULL, histogram);
+}
+
+bool metrics_write_parts(struct metrics_writer *writer, const metrics_part_fn *parts, uint8_t n_parts,
+                         uint32_t *pos) {
+    size_t first = writer->len;
+    bool dropped = false;
+    while ((*pos >> 24) < n_parts) {
+        size_t start = writer->len;
+        writer->overflow = false;
+        if (!parts[*pos >> 24](writer, *pos & 0xffffff)) {
+            writer->len = start;
+            *pos = METRICS_POS((*pos >> 24) + 1, 0);
+            continue;
+        }
+        if (writer->overflow) {
+            writer->len = start;
+            // Goes first in the next buffer
+            if (start != first)
+                break;
+            dropped = true;
+        }
+        ++*pos;
+    }
+    writer->overflow = dropped;
+    return writer->len != first;
+}
+
+uint32_t metric_histogram_quantile(const struct metric_histogram *histogram, uint16_t permille) {
+    uint32_t count = histogram->count;
+    if (count == 0)
+        return 0;
+    // The rank of the observation wanted, counting from 1
+    uint32_t rank = ((uint64_t) count * permille + 999) / 1000;
+    if (rank == 0)
+        rank = 1;
+    uint32_t cumulative = 0;
+    for (uint8_t i = 0; i < histogram->n_bounds; ++i) {
+        cumulative += histogram->buckets[i];
+        if (cumulative >= rank)
+            return histogram->bounds[i];
+    }
+    return UINT32_MAX;
+}
+
+#ifdef METRICS_TEST
+METRIC_HISTOGRAM(test_latency, 3, 10, 100);
+
+static void test_histogram(void) {
+    char buf[512];
+    struct metrics_writer writer;
+    metric_observe(&test_latency, 5);
+    metric_observe(&test_latency, 10);
+    metric_observe(&test_latency, 50);
+    metric_observe(&test_latency, 5000);
+    assert(test_latency.count == 4);
+    assert(metric_histogram_quantile(&test_latency, 500) == 10);
+    assert(metric_histogram_quantile(&test_latency, 750) == 100);
+    assert(metric_histogram_quantile(&test_latency, 990) == UINT32_MAX);
+    metrics_init(&writer, buf, sizeof(buf));
+    metrics_histogram(&writer, "latency_seconds", "Latency", &test_latency);
+    assert_str_eq(writer, "# HELP latency_seconds Latency\n"
+                          "# TYPE latency_seconds histogram\n"
+                          "latency_seconds_bucket{le=\"0.010\"} 2\n"
+                          "latency_seconds_bucket{le=\"0.100\"} 3\n"
+                          "latency_seconds_bucket{le=\"+Inf\"} 4\n"
+                          "latency_seconds_sum 5.065\n"
+                          "latency_seconds_count 4\n");
+    metrics_init(&writer, buf, sizeof(buf));
+    metrics_histogram_samples(&writer, "latency_seconds", "stage=\"a\"", &test_latency);
+    assert_str_eq(writer, "latency_seconds_bucket{stage=\"a\",le=\"0.010\"} 2\n"
+                          "latency_seconds_bucket{stage=\"a\",le=\"0.100\"} 3\n"
+                          "latency_seconds_bucket{stage=\"a\",le=\"+Inf\"} 4\n"
+                          "latency_seconds_sum{stage=\"a\"} 5.065\n"
+                          "latency_seconds_count{stage=\"a\"} 4\n");
+}
+
+static void test_values(void) {
+    char buf[512];
+    struct metrics_writer writer;
+    struct metric_counter requests = {0};
+    metric_inc(&requests);
+    metric_add(&requests, 2);
+    metrics_init(&writer, buf, sizeof(buf));
+    metrics_counter(&writer, "requests_total", "Requests", requests.value);
+    metrics_gauge(&writer, "offset", "Offset", -5, 2);
+    metrics_gauge_float(&writer, "temp", "Temperature", 21.456f, 1);
+    metrics_gauge_float(&writer, "bad", "Bad", NAN, 1);
+    metrics_sample(&writer, "pool_used", "pool=\"PBUF\"", 7, 0);
+    assert_str_eq(writer, "# HELP requests_total Requests\n"
+                          "# TYPE requests_total counter\n"
+                          "requests_total 3\n"
+                          "# HELP offset Offset\n"
+                          "# TYPE offset gauge\n"
+                          "offset -0.05\n"
+                          "# HELP temp Temperature\n"
+                          "# TYPE temp gauge\n"
+                          "temp 21.5\n"
+                          "# HELP bad Bad\n"
+                          "# TYPE bad gauge\n"
+                          "bad NaN\n"
+                          "pool_used{pool=\"PBUF\"} 7\n");
+}
+
+static void test_overflow(void) {
+    char buf[16];
+    struct metrics_writer writer;
+    metrics_init(&writer, buf, sizeof(buf));
+    metrics_counter(&writer, "requests_total", "Requests", 1);
+    assert(writer.overflow);
+    assert(writer.len <= sizeof(buf));
+}
+
+static struct metric_histogram test_stages[10];
+static uint32_t test_stage_buckets[10][7];
+static const uint32_t test_stage_bounds[] = {100, 1000, 10000, 100000, 1000000, 10000000};
+
+/// As many stages as the main loop has, as full as they get
+static bool test_part_stages(struct metrics_writer *writer, uint32_t i) {
+    if (i >= 10)
+        return false;
+    if (i == 0)
+        metrics_family(writer, "loop_stage_duration_seconds", "histogram", "Main loop stage run time");
+    metrics_histogram_samples(writer, "loop_stage_duration_seconds", "stage=\"http_server_check_run\"",
+                              &test_stages[i]);
+    return true;
+}
+
+static bool test_part_pools(struct metrics_writer *writer, uint32_t i) {
+    if (i >= 4)
+        return false;
+    metrics_family(writer, "lwip_mem_used", "gauge", "lwIP heap bytes or pool entries in use");
+    for (int pool = 0; pool < 20; ++pool)
+        metrics_sample(writer, "lwip_mem_used", "pool=\"TCP_PCB_LISTEN\"", UINT32_MAX, 0);
+    return true;
+}
+
+static bool test_part_huge(struct metrics_writer *writer, uint32_t i) {
+    if (i >= 2)
+        return false;
+    if (i == 0)
+        for (int n = 0; n < 100; ++n)
+            metrics_counter(writer, "requests_total", "Requests", n);
+    else
+        metrics_counter(writer, "after_total", "After", 1);
+    return true;
+}
+
+static void test_parts(void) {
+    static char whole[32768];
+    static char chunk[2048];
+    static const metrics_part_fn parts[] = {test_part_stages, test_part_pools};
+    struct metrics_writer writer;
+    uint32_t pos = 0;
+    size_t len = 0;
+    for (int stage = 0; stage < 10; ++stage) {
+        test_stages[stage] = (struct metric_histogram) {test_stage_bounds, 6, test_stage_buckets[stage], 0, 0, 6};
+        for (int i = 0; i < 7; ++i)
+            test_stage_buckets[stage][i] = UINT32_MAX / 7;
+        test_stages[stage].sum = UINT64_MAX / 2;
+    }
+    // The whole set at once, for comparison
+    metrics_init(&writer, whole, sizeof(whole));
+    assert(metrics_write_parts(&writer, parts, 2, &pos));
+    assert(!writer.overflow);
+    assert(!metrics_write_parts(&writer, parts, 2, &pos));
+    len = writer.len;
+    assert(len > 3 * sizeof(chunk));
+    // A buffer at a time, with only whole items in each
+    pos = 0;
+    size_t offset = 0;
+    while (true) {
+        metrics_init(&writer, chunk, sizeof(chunk));
+        if (!metrics_write_parts(&writer, parts, 2, &pos))
+            break;
+        assert(!writer.overflow);
+        assert(offset + writer.len <= len && memcmp(whole + offset, chunk, writer.len) == 0);
+        offset += writer.len;
+    }
+    assert(offset == len);
+    // Left out, but the rest still goes
+    static const metrics_part_fn huge[] = {test_part_huge};
+    pos = 0;
+    metrics_init(&writer, chunk, sizeof(chunk));
+    assert(metrics_write_parts(&writer, huge, 1, &pos));
+    assert(writer.overflow);
+    writer.overflow = false;
+    assert_str_eq(writer, "# HELP after_total After\n"
+                          "# TYPE after_total counter\n"
+                          "after_total 1\n");
+    metrics_init(&writer, chunk, sizeof(chunk));
+    assert(!metrics_write_parts(&writer, huge, 1, &pos));
+}
+
+int main(void) {
+    test_histogram();
+    test_values();
+    test_overflow();
+    test_parts();
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,124 @@
+/*
+ *  metrics.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Static counters, gauges and fixed-bucket histograms, and a writer for
+//! the Prometheus text format.
+//! Updates are a few instructions and take no lock. The M0+ has no atomic
+//! add, so each metric must only be updated from one context (the main
+//! loop or the lwIP IRQ); reading from anywhere is fine.
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct metric_counter {
+    volatile uint32_t value;
+};
+
+struct metric_gauge {
+    volatile int32_t value;
+};
+
+struct metric_histogram {
+    // Upper bounds, ascending. +Inf is implied
+    const uint32_t *bounds;
+    uint8_t n_bounds;
+    // `n_bounds` + 1 per-bucket counts, not cumulative
+    volatile uint32_t *buckets;
+    volatile uint32_t count;
+    uint64_t sum;
+    // Exported as value / 10^decimals, e.g. 6 for microseconds as seconds
+    uint8_t decimals;
+};
+
+/// Define a histogram `name` with the given upper bounds
+#define METRIC_HISTOGRAM(name, decimals, ...) \
+    static const uint32_t name##_bounds[] = {__VA_ARGS__}; \
+    static uint32_t name##_buckets[sizeof(name##_bounds) / sizeof(uint32_t) + 1]; \
+    struct metric_histogram name = { \
+        name##_bounds, sizeof(name##_bounds) / sizeof(uint32_t), name##_buckets, 0, 0, (decimals) \
+    }
+
+static inline void metric_inc(struct metric_counter *counter) {
+    counter->value = counter->value + 1;
+}
+
+static inline void metric_add(struct metric_counter *counter, uint32_t n) {
+    counter->value = counter->value + n;
+}
+
+static inline void metric_set(struct metric_gauge *gauge, int32_t value) {
+    gauge->value = value;
+}
+
+void metric_observe(struct metric_histogram *histogram, uint32_t value);
+/// Upper bound of the bucket holding quantile `permille` / 1000: UINT32_MAX
+/// if that is the +Inf bucket, 0 if there is nothing yet
+uint32_t metric_histogram_quantile(const struct metric_histogram *histogram, uint16_t permille);
+
+struct metrics_writer {
+    char *buf;
+    size_t cap;
+    size_t len;
+    // Something did not fit; the output is truncated and must not be used
+    bool overflow;
+};
+
+void metrics_init(struct metrics_writer *writer, char *buf, size_t cap);
+
+/// "# HELP" and "# TYPE" lines. `type` is "counter", "gauge" or "histogram"
+void metrics_family(struct metrics_writer *writer, const char *name, const char *type,
+                    const char *help);
+/// A sample line of value / 10^decimals. `labels` is NULL or like `pool="PBUF"`
+void metrics_sample(struct metrics_writer *writer, const char *name, const char *labels,
+                    int64_t value, uint8_t decimals);
+
+/// A family with one unlabelled sample
+void metrics_counter(struct metrics_writer *writer, const char *name, const char *help,
+                     uint64_t value);
+void metrics_gauge(struct metrics_writer *writer, const char *name, const char *help,
+                   int64_t value, uint8_t decimals);
+/// Rounded to `decimals` (at most 6) places. Non-finite values are NaN
+void metrics_gauge_float(struct metrics_writer *writer, const char *name, const char *help,
+                         float value, uint8_t decimals);
+void metrics_histogram(struct metrics_writer *writer, const char *name, const char *help,
+                       const struct metric_histogram *histogram);
+/// The samples of one labelled histogram, for a family with several
+void metrics_histogram_samples(struct metrics_writer *writer, const char *name, const char *labels,
+                               const struct metric_histogram *histogram);
+
+/// One part of a body too big to build at once, such as all the samples
+/// of a labelled family. Writes item `i` of the part and returns true, or
+/// returns false if there is no such item
+typedef bool (*metrics_part_fn)(struct metrics_writer *writer, uint32_t i);
+
+/// Where `metrics_write_parts` is up to: the part in the top byte, then
+/// the item in it
+#define METRICS_POS(part, item) ((uint32_t) (part) << 24 | (uint32_t) (item))
+
+/// Write as many whole items of `parts` as fit, starting at `*pos`, and move
+/// `*pos` past them, so that a body can go out a buffer at a time. An item
+/// too big for an empty buffer is left out and sets `overflow`, but what
+/// is written is still whole items. Returns false if there was nothing left
+bool metrics_write_parts(struct metrics_writer *writer, const metrics_part_fn *parts, uint8_t n_parts,
+                         uint32_t *pos);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ *  pool.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pool.h"
+
+#include <assert.h>
+
+#ifdef RPI_PICO
+#include "hardware/sync.h"
+#else
+#define save_and_disable_interrupts() 0
+#define restore_interrupts(status) ((void) (status))
+#endif
+
+#ifdef POOL_TEST
+#include <stdio.h>
+#endif
+
+void *pool_alloc(struct pool *pool) {
+    void *block = NULL;
+    uint32_t status = save_and_disable_interrupts();
+    for (uint16_t word = 0; word * 32 < pool->n_blocks; ++word) {
+        uint32_t free_bits = ~pool->used[word];
+        if (free_bits == 0)
+            continue;
+        uint16_t i = word * 32 + __builtin_ctz(free_bits);
+        // Bits past the end are never set
+        if (i >= pool->n_blocks)
+            break;
+        pool->used[word] |= (uint32_t) 1 << (i % 32);
+        if (++pool->in_use > pool->high_water)
+            pool->high_water = pool->in_use;
+        block = (uint8_t *) pool->blocks + (size_t) i * pool->block_size;
+        break;
+    }
+    if (block == NULL)
+        ++pool->exhausted;
+    restore_interrupts(status);
+    return block;
+}
+
+void *pool_alloc_sized(struct pool *pool, size_t size) {
+    assert(size == pool->block_size);
+    return pool_alloc(pool);
+}
+
+void pool_free(struct pool *pool, void *block) {
+    if (block == NULL)
+        return;
+    size_t offset = (uint8_t *) block - (uint8_t *) pool->blocks;
+    assert(offset % pool->block_size == 0 && offset / pool->block_size < pool->n_blocks);
+    uint16_t i = offset / pool->block_size;
+    uint32_t bit = (uint32_t) 1 << (i % 32);
+    uint32_t status = save_and_disable_interrupts();
+    if (pool->used[i / 32] & bit) {
+        pool->used[i / 32] &= ~bit;
+        --pool->in_use;
+    }
+    restore_interrupts(status);
+}
+
+bool pool_is_used(const struct pool *pool, uint16_t i) {
+    return i < pool->n_blocks && (pool->used[i / 32] & ((uint32_t) 1 << (i % 32)));
+}
+
+void *pool_get(const struct pool *pool, uint16_t i) {
+    return (uint8_t *) pool->blocks + (size_t) i * pool->block_size;
+}
+
+#ifdef POOL_TEST
+struct thing {
+    int a;
+    char b[3];
+};
+
+static struct thing things[40];
+POOL_DEFINE(thing_pool, things);
+
+int main(void) {
+    struct thing *taken[40];
+    assert(thing_pool.n_blocks == 40);
+    for (int i = 0; i < 40; ++i) {
+        taken[i] = POOL_ALLOC(&thing_pool, struct thing);
+        assert(taken[i] == &things[i]);
+        assert(pool_is_used(&thing_pool, i));
+    }
+    assert(pool_alloc(&thing_pool) == NULL);
+    assert(thing_pool.exhausted == 1);
+    assert(thing_pool.in_use == 40 && thing_pool.high_water == 40);
+
+    pool_free(&thing_pool, taken[35]);
+    pool_free(&thing_pool, taken[3]);
+    // Twice does nothing
+    pool_free(&thing_pool, taken[3]);
+    pool_free(&thing_pool, NULL);
+    assert(thing_pool.in_use == 38 && thing_pool.high_water == 40);
+    assert(!pool_is_used(&thing_pool, 3) && !pool_is_used(&thing_pool, 35));
+    // Lowest free first
+    assert(pool_alloc(&thing_pool) == &things[3]);
+    assert(pool_alloc(&thing_pool) == &things[35]);
+    assert(pool_alloc(&thing_pool) == NULL);
+    assert(thing_pool.exhausted == 2);
+
+    for (int i = 0; i < 40; ++i)
+        pool_free(&thing_pool, pool_get(&thing_pool, i));
+    assert(thing_pool.in_use == 0 && thing_pool.high_water == 40);
+    assert(!pool_is_used(&thing_pool, 40));
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
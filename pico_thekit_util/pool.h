@@ -0,0 +1,72 @@
+/*
+ *  pool.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Fixed-size object pools.
+//! A pool hands out the elements of a static array, so that long-running
+//! code never touches the heap and cannot fragment it. Which elements are
+//! taken is kept in a bitmap; allocation and release mask interrupts, so
+//! lwIP callbacks can use a pool too. Each pool counts how many are in use,
+//! the most that ever were, and how often it ran dry.
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct pool {
+    const char *name;
+    void *blocks;
+    size_t block_size;
+    uint16_t n_blocks;
+    // Bit i is set while block i is handed out
+    uint32_t *used;
+    uint16_t in_use;
+    uint16_t high_water;
+    uint32_t exhausted;
+};
+
+/// Define pool `var` over the static array `array`
+#define POOL_DEFINE(var, array) \
+    static uint32_t var##_used[(sizeof(array) / sizeof((array)[0]) + 31) / 32]; \
+    struct pool var = { \
+        .name = #var, \
+        .blocks = (array), \
+        .block_size = sizeof((array)[0]), \
+        .n_blocks = sizeof(array) / sizeof((array)[0]), \
+        .used = var##_used, \
+    }
+
+/// Take a block, not cleared, or NULL if none is free
+void *pool_alloc(struct pool *pool);
+
+/// `pool_alloc` as a `type *`, checking that `pool` holds that type
+#define POOL_ALLOC(p, type) ((type *) pool_alloc_sized((p), sizeof(type)))
+void *pool_alloc_sized(struct pool *pool, size_t size);
+
+/// Give `block` back. Freeing one that is not taken does nothing
+void pool_free(struct pool *pool, void *block);
+
+/// Whether block `i` is taken
+bool pool_is_used(const struct pool *pool, uint16_t i);
+
+/// Block `i`, taken or not
+void *pool_get(const struct pool *pool, uint16_t i);
+
+#endif
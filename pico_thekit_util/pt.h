@@ -0,0 +1,77 @@
+/*
+ *  pt.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Protothreads (after Adam Dunkels).
+//! A protothread is a function written as straight-line code that can wait,
+//! but has no stack of its own: `PT_BEGIN` is a `switch` on the line it
+//! last stopped at, so the function returns while waiting and resumes
+//! there when it is called again. Call it from the main loop until it is no
+//! longer `PT_WAITING`.
+//! Locals do not survive a wait (keep state in the struct the thread runs
+//! on), and the body cannot have a `switch` of its own around a wait.
+
+#ifndef _PT_H
+#define _PT_H
+
+#include <stdint.h>
+
+struct pt {
+    // Where to resume, 0 to start over
+    uint16_t line;
+};
+
+enum pt_status {
+    PT_WAITING = 0,
+    // Left through `PT_EXIT`
+    PT_EXITED,
+    // Ran to `PT_END`
+    PT_ENDED,
+};
+
+#define PT_INIT(pt) ((pt)->line = 0)
+
+#define PT_BEGIN(pt) switch ((pt)->line) { case 0:
+
+#define PT_WAIT_UNTIL(pt, cond) do { \
+    (pt)->line = __LINE__; \
+    __attribute__((fallthrough)); \
+    case __LINE__: \
+    if (!(cond)) \
+        return PT_WAITING; \
+} while (0)
+
+#define PT_WAIT_WHILE(pt, cond) PT_WAIT_UNTIL((pt), !(cond))
+
+/// Give the rest of the main loop a turn
+#define PT_YIELD(pt) do { \
+    (pt)->line = __LINE__; \
+    return PT_WAITING; \
+    case __LINE__:; \
+} while (0)
+
+/// Stop here; the next call starts over
+#define PT_EXIT(pt) do { \
+    PT_INIT(pt); \
+    return PT_EXITED; \
+} while (0)
+
+#define PT_END(pt) } \
+    PT_INIT(pt); \
+    return PT_ENDED
+
+#endif
@@ -0,0 +1,316 @@
+/*
+ *  sched.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sched.h"
+
+#include <stddef.h>
+
+#ifdef SCHED_TEST
+#include <assert.h>
+#include <stdio.h>
+#endif
+
+// Marker: static variable
+static struct sched_task *sched_heap[SCHED_MAX_TASKS];
+// Marker: static variable
+static uint8_t sched_len;
+// Marker: static variable
+// xorshift32 state, never 0
+static uint32_t sched_rand = 2463534242;
+
+void sched_seed(uint32_t seed) {
+    if (seed != 0)
+        sched_rand = seed;
+}
+
+static uint32_t sched_next_rand(void) {
+    uint32_t x = sched_rand;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sched_rand = x;
+    return x;
+}
+
+/// `delay_ms` plus `task`'s jitter, in us
+static uint64_t sched_delay_us(const struct sched_task *task, uint32_t delay_ms) {
+    uint64_t delay_us = (uint64_t) delay_ms * 1000;
+    if (task->jitter_ms != 0)
+        delay_us += sched_next_rand() % ((uint64_t) task->jitter_ms * 1000);
+    return delay_us;
+}
+
+static void sched_swap(uint8_t a, uint8_t b) {
+    struct sched_task *task = sched_heap[a];
+    sched_heap[a] = sched_heap[b];
+    sched_heap[b] = task;
+}
+
+static void sched_sift_up(uint8_t i) {
+    while (i > 0) {
+        uint8_t parent = (i - 1) / 2;
+        if (sched_heap[parent]->due_us <= sched_heap[i]->due_us)
+            break;
+        sched_swap(parent, i);
+        i = parent;
+    }
+}
+
+static void sched_sift_down(uint8_t i) {
+    while (1) {
+        uint8_t smallest = i;
+        uint8_t left = 2 * i + 1;
+        uint8_t right = left + 1;
+        if (left < sched_len && sched_heap[left]->due_us < sched_heap[smallest]->due_us)
+            smallest = left;
+        if (right < sched_len && sched_heap[right]->due_us < sched_heap[smallest]->due_us)
+            smallest = right;
+        if (smallest == i)
+            break;
+        sched_swap(smallest, i);
+        i = smallest;
+    }
+}
+
+bool sched_add(struct sched_task *task, uint64_t now_us, uint32_t delay_ms) {
+    if (sched_len == SCHED_MAX_TASKS)
+        return false;
+    task->due_us = now_us + sched_delay_us(task, delay_ms);
+    task->backoff_ms = 0;
+    sched_heap[sched_len] = task;
+    sched_sift_up(sched_len++);
+    return true;
+}
+
+uint64_t sched_next_due(void) {
+    return sched_len == 0 ? UINT64_MAX : sched_heap[0]->due_us;
+}
+
+/// How long to wait after a run of `task` that did or did not succeed
+static uint32_t sched_next_delay_ms(struct sched_task *task, bool ok) {
+    if (ok || task->retry_ms == 0) {
+        task->backoff_ms = 0;
+        return task->period_ms;
+    }
+    uint32_t limit = task->period_ms;
+    if (task->max_backoff_ms != 0 && task->max_backoff_ms < limit)
+        limit = task->max_backoff_ms;
+    if (task->backoff_ms == 0)
+        task->backoff_ms = task->retry_ms;
+    else if (task->backoff_ms <= limit / 2)
+        task->backoff_ms *= 2;
+    else
+        task->backoff_ms = limit;
+    if (task->backoff_ms > limit)
+        task->backoff_ms = limit;
+    return task->backoff_ms;
+}
+
+struct sched_task *sched_run_due(uint64_t now_us) {
+    if (sched_len == 0 || sched_heap[0]->due_us > now_us)
+        return NULL;
+    struct sched_task *task = sched_heap[0];
+    uint64_t due_us = task->due_us;
+    bool ok = task->run(task);
+    ++task->runs;
+    // It finished and rescheduled itself already
+    if (task->due_us != due_us)
+        return task;
+    if (!ok)
+        ++task->failures;
+    // From when it ran, not when it was due, so that a late run does not
+    // make the next one early. `run` may have moved other tasks around
+    sched_set_due(task, now_us + sched_delay_us(task, sched_next_delay_ms(task, ok)));
+    return task;
+}
+
+void sched_set_due(struct sched_task *task, uint64_t due_us) {
+    for (uint8_t i = 0; i < sched_len; ++i) {
+        if (sched_heap[i] != task)
+            continue;
+        task->due_us = due_us;
+        // Only one of these moves it
+        sched_sift_up(i);
+        sched_sift_down(i);
+        return;
+    }
+}
+
+void sched_finish(struct sched_task *task, uint64_t now_us, bool ok) {
+    if (!ok)
+        ++task->failures;
+    sched_set_due(task, now_us + sched_delay_us(task, sched_next_delay_ms(task, ok)));
+}
+
+uint8_t sched_count(void) {
+    return sched_len;
+}
+
+const struct sched_task *sched_get(uint8_t i) {
+    return i < sched_len ? sched_heap[i] : NULL;
+}
+
+#ifdef SCHED_TEST
+static int test_a_runs, test_b_runs;
+static bool test_a_ok = true;
+
+static bool test_a(struct sched_task *task) {
+    ++test_a_runs;
+    return test_a_ok;
+}
+
+static bool test_b(struct sched_task *task) {
+    ++test_b_runs;
+    return true;
+}
+
+static void test_order(void) {
+    static struct sched_task a = {.name = "a", .run = test_a, .period_ms = 1000};
+    static struct sched_task b = {.name = "b", .run = test_b, .period_ms = 300};
+    assert(sched_next_due() == UINT64_MAX);
+    assert(sched_run_due(0) == NULL);
+    assert(sched_add(&a, 0, 500));
+    assert(sched_add(&b, 0, 0));
+    assert(sched_count() == 2);
+    assert(sched_next_due() == 0);
+    // Only one per call
+    assert(sched_run_due(0) == &b);
+    assert(sched_run_due(0) == NULL);
+    assert(sched_next_due() == 300000);
+    assert(sched_run_due(300000) == &b);
+    assert(sched_run_due(500000) == &a);
+    assert(sched_next_due() == 600000);
+    assert(sched_run_due(600000) == &b);
+    // Late: rescheduled from when it ran
+    assert(sched_run_due(1000000) == &b);
+    assert(sched_next_due() == 1300000);
+    assert(sched_run_due(1300000) == &b);
+    assert(sched_run_due(1500000) == &a);
+    assert(test_a_runs == 2 && test_b_runs == 5);
+    assert(a.runs == 2 && a.failures == 0);
+}
+
+static void test_backoff(void) {
+    static struct sched_task c = {
+        .name = "c", .run = test_a, .period_ms = 10000, .retry_ms = 1000, .max_backoff_ms = 5000
+    };
+    // Reset everything from `test_order`
+    sched_len = 0;
+    assert(sched_add(&c, 0, 0));
+    test_a_ok = false;
+    uint64_t now = 0;
+    static const uint32_t delays[] = {1000, 2000, 4000, 5000, 5000};
+    for (size_t i = 0; i < sizeof(delays) / sizeof(delays[0]); ++i) {
+        assert(sched_run_due(now) == &c);
+        assert(sched_next_due() == now + delays[i] * 1000);
+        now = sched_next_due();
+    }
+    assert(c.failures == 5);
+    // Success goes back to the period
+    test_a_ok = true;
+    assert(sched_run_due(now) == &c);
+    assert(sched_next_due() == now + 10000000);
+    assert(c.backoff_ms == 0);
+    // No retry policy: just the period
+    c.retry_ms = 0;
+    test_a_ok = false;
+    now = sched_next_due();
+    assert(sched_run_due(now) == &c);
+    assert(sched_next_due() == now + 10000000);
+    test_a_ok = true;
+}
+
+static void test_finish(void) {
+    static struct sched_task d = {.name = "d", .run = test_b, .period_ms = 10000, .retry_ms = 1000};
+    static struct sched_task e = {.name = "e", .run = test_b, .period_ms = 3000};
+    sched_len = 0;
+    assert(sched_add(&d, 0, 0));
+    assert(sched_add(&e, 0, 2000));
+    assert(sched_run_due(0) == &d);
+    assert(sched_next_due() == 2000000);
+    // The upload `d` started failed after all
+    sched_finish(&d, 500000, false);
+    assert(d.failures == 1 && d.backoff_ms == 1000);
+    assert(sched_next_due() == 1500000);
+    assert(sched_run_due(1500000) == &d);
+    sched_finish(&d, 1600000, true);
+    assert(d.backoff_ms == 0);
+    assert(sched_run_due(2000000) == &e);
+    assert(sched_next_due() == 5000000);
+    // Brought forward past `e`
+    sched_set_due(&d, 4000000);
+    assert(sched_run_due(4000000) == &d);
+}
+
+static bool test_fail_at_once(struct sched_task *task) {
+    // What finished from within `run` reports
+    sched_finish(task, 7000000, false);
+    return true;
+}
+
+static void test_finish_in_run(void) {
+    static struct sched_task f = {.name = "f", .run = test_fail_at_once, .period_ms = 10000, .retry_ms = 1000};
+    static struct sched_task g = {.name = "g", .run = test_b, .period_ms = 3000};
+    sched_len = 0;
+    assert(sched_add(&f, 0, 7000));
+    assert(sched_add(&g, 0, 7500));
+    assert(sched_run_due(7000000) == &f);
+    assert(f.runs == 1 && f.failures == 1 && f.backoff_ms == 1000);
+    // Left where `sched_finish` put it, after `g`
+    assert(sched_run_due(7500000) == &g);
+    assert(sched_next_due() == 8000000);
+    assert(sched_run_due(8000000) == &f);
+}
+
+static void test_jitter(void) {
+    static struct sched_task tasks[SCHED_MAX_TASKS];
+    sched_len = 0;
+    sched_seed(12345);
+    for (uint8_t i = 0; i < SCHED_MAX_TASKS; ++i) {
+        tasks[i] = (struct sched_task) {.name = "j", .run = test_b, .period_ms = 1000, .jitter_ms = 100};
+        assert(sched_add(&tasks[i], 0, 1000));
+    }
+    struct sched_task extra = {.name = "extra", .run = test_b, .period_ms = 1000};
+    assert(!sched_add(&extra, 0, 0));
+    // Within the jitter, not all the same, and popped in order
+    bool spread = false;
+    for (uint8_t i = 0; i < SCHED_MAX_TASKS; ++i) {
+        assert(tasks[i].due_us >= 1000000 && tasks[i].due_us < 1100000);
+        spread = spread || tasks[i].due_us != tasks[0].due_us;
+    }
+    assert(spread);
+    uint64_t last = 0;
+    for (uint8_t i = 0; i < SCHED_MAX_TASKS; ++i) {
+        uint64_t due = sched_next_due();
+        assert(due >= last);
+        struct sched_task *task = sched_run_due(due);
+        assert(task != NULL && task->due_us >= due + 1000000);
+        last = due;
+    }
+}
+
+int main(void) {
+    test_order();
+    test_backoff();
+    test_finish();
+    test_finish_in_run();
+    test_jitter();
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,87 @@
+/*
+ *  sched.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Periodic task scheduler.
+//! Tasks are kept in a binary min-heap ordered by when they are next due,
+//! so the earliest deadline is always at hand for the main loop's sleep.
+//! Each task has its own period plus a random jitter, so that tasks with
+//! the same period drift apart instead of firing together. A failed run is
+//! retried sooner than the period, backing off exponentially.
+//! Times are microseconds on any monotonic clock; the caller passes `now`.
+//! Not reentrant: call everything from the same context.
+
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef SCHED_MAX_TASKS
+#define SCHED_MAX_TASKS 8
+#endif
+
+struct sched_task {
+    // Static string, for logs and metrics
+    const char *name;
+    // Returns whether the task succeeded. A task that only starts
+    // something returns true and reports back with `sched_finish`
+    bool (*run)(struct sched_task *task);
+    uint32_t period_ms;
+    // Up to this much is added to every delay
+    uint32_t jitter_ms;
+    // First delay after a failure, 0 to just wait for the next period
+    uint32_t retry_ms;
+    // Retries double their delay up to this (or the period, if smaller)
+    uint32_t max_backoff_ms;
+
+    // Filled in by the scheduler
+    uint64_t due_us;
+    // Delay of the next retry, 0 if the last run succeeded
+    uint32_t backoff_ms;
+    uint32_t runs;
+    uint32_t failures;
+};
+
+/// Seed the jitter generator. Anything but 0 is fine
+void sched_seed(uint32_t seed);
+
+/// Schedule `task` `delay_ms` (plus jitter) from `now_us`.
+/// Returns false if there are already SCHED_MAX_TASKS
+bool sched_add(struct sched_task *task, uint64_t now_us, uint32_t delay_ms);
+
+/// When the earliest task is due, or UINT64_MAX with no tasks
+uint64_t sched_next_due(void);
+
+/// Run the earliest task if it is due and reschedule it. Only one runs per
+/// call, so that a backlog is spread over several main loop iterations.
+/// A task that calls `sched_finish` from `run` keeps what that set.
+/// Returns the task that ran, or NULL
+struct sched_task *sched_run_due(uint64_t now_us);
+
+/// Reschedule `task` from `now_us` as if its last run had returned `ok`,
+/// for when the outcome is only known later
+void sched_finish(struct sched_task *task, uint64_t now_us, bool ok);
+
+/// Make `task` due at `due_us` instead
+void sched_set_due(struct sched_task *task, uint64_t due_us);
+
+/// Registered tasks, in no particular order
+uint8_t sched_count(void);
+const struct sched_task *sched_get(uint8_t i);
+
+#endif
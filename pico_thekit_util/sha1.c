@@ -0,0 +1,137 @@
+/*
+ *  sha1.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sha1.h"
+
+#include <string.h>
+
+#ifdef SHA1_TEST
+#include <assert.h>
+#include <stdio.h>
+#endif
+
+static inline uint32_t rol(uint32_t x, uint8_t n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+/// FIPS 180-4 6.1.2, with the message schedule kept in 16 words
+static void sha1_block(uint32_t state[5], const uint8_t block[64]) {
+    uint32_t w[16];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (uint8_t i = 0; i < 16; ++i)
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16
+            | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (uint8_t i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i >= 16) {
+            w[i & 15] = rol(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+        }
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = rol(a, 5) + f + e + k + w[i & 15];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void sha1_init(struct sha1_ctx *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->len = 0;
+}
+
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    size_t used = ctx->len % 64;
+    ctx->len += len;
+    while (len) {
+        size_t take = 64 - used < len ? 64 - used : len;
+        memcpy(ctx->block + used, bytes, take);
+        used += take;
+        bytes += take;
+        len -= take;
+        if (used == 64) {
+            sha1_block(ctx->state, ctx->block);
+            used = 0;
+        }
+    }
+}
+
+void sha1_final(struct sha1_ctx *ctx, uint8_t digest[SHA1_DIGEST_LEN]) {
+    uint64_t bits = ctx->len * 8;
+    size_t used = ctx->len % 64;
+    ctx->block[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->block + used, 0, 64 - used);
+        sha1_block(ctx->state, ctx->block);
+        used = 0;
+    }
+    memset(ctx->block + used, 0, 56 - used);
+    for (uint8_t i = 0; i < 8; ++i)
+        ctx->block[56 + i] = bits >> (56 - 8 * i);
+    sha1_block(ctx->state, ctx->block);
+    for (uint8_t i = 0; i < 20; ++i)
+        digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+#ifdef SHA1_TEST
+static void check(const char *input, size_t repeat, const char *hex) {
+    struct sha1_ctx ctx;
+    uint8_t digest[SHA1_DIGEST_LEN];
+    char out[41];
+    sha1_init(&ctx);
+    for (size_t i = 0; i < repeat; ++i)
+        sha1_update(&ctx, input, strlen(input));
+    sha1_final(&ctx, digest);
+    for (uint8_t i = 0; i < SHA1_DIGEST_LEN; ++i)
+        sprintf(out + 2 * i, "%02x", digest[i]);
+    assert(strcmp(out, hex) == 0);
+}
+
+int main(void) {
+    check("", 1, "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+    check("abc", 1, "a9993e364706816aba3e25717850c26c9cd0d89d");
+    check("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+          "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+    check("a", 1000000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
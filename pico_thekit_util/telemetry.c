@@ -0,0 +1,578 @@
+/*
+ *  telemetry.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "telemetry.h"
+#include "json_writer.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifdef TELEMETRY_TEST
+#include <assert.h>
+#include <stdio.h>
+#endif
+
+// Marker: static variable
+static struct telemetry_sample telemetry_ring[TELEMETRY_RING_LEN];
+// Marker: static variable
+// Free-running count of samples recorded
+static uint32_t telemetry_head;
+
+void telemetry_record(uint32_t time, const float *values, uint8_t n_fields) {
+    telemetry_record_for(time, values, n_fields, TELEMETRY_ALL_READERS);
+}
+
+void telemetry_record_for(uint32_t time, const float *values, uint8_t n_fields, uint8_t readers) {
+    bool first = true;
+    for (uint8_t field = 0; field < n_fields; ++field) {
+        if (isnan(values[field]))
+            continue;
+        struct telemetry_sample *sample = &telemetry_ring[telemetry_head % TELEMETRY_RING_LEN];
+        sample->time = time;
+        sample->value = values[field];
+        sample->field = field;
+        sample->first = first;
+        sample->readers = readers;
+        first = false;
+        ++telemetry_head;
+    }
+}
+
+uint32_t telemetry_recorded(void) {
+    return telemetry_head;
+}
+
+uint32_t telemetry_pending(struct telemetry_reader *reader) {
+    uint32_t pending = telemetry_head - reader->next;
+    if (pending > TELEMETRY_RING_LEN) {
+        reader->lost += pending - TELEMETRY_RING_LEN;
+        reader->next = telemetry_head - TELEMETRY_RING_LEN;
+        pending = TELEMETRY_RING_LEN;
+    }
+    return pending;
+}
+
+const struct telemetry_sample *telemetry_peek(const struct telemetry_reader *reader, uint32_t i) {
+    return &telemetry_ring[(reader->next + i) % TELEMETRY_RING_LEN];
+}
+
+void telemetry_ack(struct telemetry_reader *reader, uint32_t n) {
+    uint32_t pending = telemetry_pending(reader);
+    reader->next += n < pending ? n : pending;
+}
+
+/// Samples in the record that starts at `start` in the backlog
+static uint32_t telemetry_record_len(const struct telemetry_reader *reader, uint32_t start, uint32_t pending) {
+    uint32_t n = 1;
+    while (start + n < pending && !telemetry_peek(reader, start + n)->first)
+        ++n;
+    return n;
+}
+
+uint32_t telemetry_read(struct telemetry_reader *reader, uint32_t *time, float *values, uint8_t n_fields,
+                        uint8_t *readers) {
+    uint32_t pending = telemetry_pending(reader);
+    if (pending == 0)
+        return 0;
+    uint32_t n = telemetry_record_len(reader, 0, pending);
+    for (uint8_t field = 0; field < n_fields; ++field)
+        values[field] = NAN;
+    for (uint32_t i = 0; i < n; ++i) {
+        const struct telemetry_sample *sample = telemetry_peek(reader, i);
+        if (sample->field < n_fields)
+            values[sample->field] = sample->value;
+    }
+    *time = telemetry_peek(reader, 0)->time;
+    *readers = telemetry_peek(reader, 0)->readers;
+    return n;
+}
+
+static bool telemetry_uploaded(const struct telemetry_format *format, const struct telemetry_sample *sample) {
+    return sample->field < 32 && (format->mask & ((uint32_t) 1 << sample->field));
+}
+
+/// Whether any sample of the record at `start` is uploaded
+static bool telemetry_record_uploaded(const struct telemetry_reader *reader, const struct telemetry_format *format,
+                                      uint32_t start, uint32_t n) {
+    if (reader->bit != 0 && !(telemetry_peek(reader, start)->readers & reader->bit))
+        return false;
+    for (uint32_t i = 0; i < n; ++i)
+        if (telemetry_uploaded(format, telemetry_peek(reader, start + i)))
+            return true;
+    return false;
+}
+
+/// Append `n` bytes of `str` to `buf`. Returns false if they do not fit
+static bool telemetry_put(char *buf, size_t size, size_t *len, const char *str, size_t n) {
+    if (size - *len < n)
+        return false;
+    memcpy(buf + *len, str, n);
+    *len += n;
+    return true;
+}
+
+static bool telemetry_put_str(char *buf, size_t size, size_t *len, const char *str) {
+    return telemetry_put(buf, size, len, str, strlen(str));
+}
+
+/// Append `sample`'s value rounded as its field says, without the printf
+/// float path
+static bool telemetry_put_value(char *buf, size_t size, size_t *len, const struct telemetry_format *format,
+                                const struct telemetry_sample *sample) {
+    char out[24];
+    struct json_writer json;
+    json_init(&json, out, sizeof(out));
+    // Too large for fixed point comes out as null, which is the best we
+    // can do short of dropping the batch
+    json_float(&json, NULL, sample->value, format->fields[sample->field].decimals);
+    return telemetry_put(buf, size, len, out, json.len);
+}
+
+static bool telemetry_put_uint(char *buf, size_t size, size_t *len, uint32_t value) {
+    char out[20];
+    return telemetry_put(buf, size, len, out, json_format_uint(out, value));
+}
+
+uint32_t telemetry_format_influx(struct telemetry_reader *reader, const struct telemetry_format *format,
+                                 char *buf, size_t size, size_t *len) {
+    uint32_t pending = telemetry_pending(reader);
+    uint32_t used = 0;
+    *len = 0;
+    while (used < pending) {
+        uint32_t n = telemetry_record_len(reader, used, pending);
+        if (!telemetry_record_uploaded(reader, format, used, n)) {
+            used += n;
+            continue;
+        }
+        size_t line_start = *len;
+        bool fits = telemetry_put_str(buf, size, len, format->measurement);
+        char separator = ' ';
+        for (uint32_t i = 0; i < n && fits; ++i) {
+            const struct telemetry_sample *sample = telemetry_peek(reader, used + i);
+            if (!telemetry_uploaded(format, sample))
+                continue;
+            fits = telemetry_put(buf, size, len, &separator, 1)
+                   && telemetry_put_str(buf, size, len, format->fields[sample->field].name)
+                   && telemetry_put(buf, size, len, "=", 1)
+                   && telemetry_put_value(buf, size, len, format, sample);
+            separator = ',';
+        }
+        uint32_t time = telemetry_peek(reader, used)->time;
+        if (fits && time != 0) {
+            fits = telemetry_put(buf, size, len, " ", 1) && telemetry_put_uint(buf, size, len, time);
+            if (format->nanoseconds)
+                fits = fits && telemetry_put(buf, size, len, "000000000", 9);
+        }
+        fits = fits && telemetry_put(buf, size, len, "\n", 1);
+        if (!fits) {
+            *len = line_start;
+            break;
+        }
+        used += n;
+    }
+    return used;
+}
+
+uint32_t telemetry_format_json(struct telemetry_reader *reader, const struct telemetry_format *format,
+                               char *buf, size_t size, size_t *len) {
+    uint32_t pending = telemetry_pending(reader);
+    uint32_t used = 0;
+    bool any = false;
+    struct json_writer json;
+    *len = 0;
+    if (size < 2)
+        return 0;
+    // Room for the closing bracket
+    json_init(&json, buf, size - 1);
+    json_begin_array(&json, NULL);
+    while (used < pending) {
+        uint32_t n = telemetry_record_len(reader, used, pending);
+        if (!telemetry_record_uploaded(reader, format, used, n)) {
+            used += n;
+            continue;
+        }
+        struct json_writer before = json;
+        uint32_t time = telemetry_peek(reader, used)->time;
+        json_begin_object(&json, NULL);
+        if (time != 0)
+            json_uint(&json, "time", time);
+        for (uint32_t i = 0; i < n; ++i) {
+            const struct telemetry_sample *sample = telemetry_peek(reader, used + i);
+            if (telemetry_uploaded(format, sample))
+                json_float(&json, format->fields[sample->field].name, sample->value,
+                           format->fields[sample->field].decimals);
+        }
+        json_end_object(&json);
+        if (json.overflow) {
+            json = before;
+            break;
+        }
+        any = true;
+        used += n;
+    }
+    json.cap = size;
+    json_end_array(&json);
+    if (any)
+        *len = json.len;
+    return used;
+}
+
+uint32_t telemetry_format_query(struct telemetry_reader *reader, const struct telemetry_format *format,
+                                char *buf, size_t size, size_t *len) {
+    uint32_t pending = telemetry_pending(reader);
+    uint32_t used = 0;
+    *len = 0;
+    while (used < pending) {
+        uint32_t n = telemetry_record_len(reader, used, pending);
+        if (!telemetry_record_uploaded(reader, format, used, n)) {
+            used += n;
+            continue;
+        }
+        bool fits = true;
+        const char *separator = "";
+        for (uint32_t i = 0; i < n && fits; ++i) {
+            const struct telemetry_sample *sample = telemetry_peek(reader, used + i);
+            if (!telemetry_uploaded(format, sample))
+                continue;
+            fits = telemetry_put_str(buf, size, len, separator)
+                   && telemetry_put_str(buf, size, len, format->fields[sample->field].name)
+                   && telemetry_put(buf, size, len, "=", 1)
+                   && telemetry_put_value(buf, size, len, format, sample);
+            separator = "&";
+        }
+        uint32_t time = telemetry_peek(reader, used)->time;
+        if (fits && time != 0)
+            fits = telemetry_put(buf, size, len, "&time=", 6) && telemetry_put_uint(buf, size, len, time);
+        if (!fits) {
+            *len = 0;
+            break;
+        }
+        used += n;
+        // One record per request
+        break;
+    }
+    return used;
+}
+
+static const int32_t TELEMETRY_POW_10[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+static size_t telemetry_put_varint(uint8_t *buf, size_t size, size_t len, int64_t value) {
+    // Zigzag, so that small negative differences stay short
+    uint64_t zigzag = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    do {
+        if (len >= size)
+            return 0;
+        buf[len++] = (zigzag & 0x7f) | (zigzag > 0x7f ? 0x80 : 0);
+        zigzag >>= 7;
+    } while (zigzag != 0);
+    return len;
+}
+
+static size_t telemetry_get_varint(const uint8_t *buf, size_t len, size_t pos, int64_t *value) {
+    uint64_t zigzag = 0;
+    for (uint8_t shift = 0; shift < 64; shift += 7) {
+        if (pos >= len)
+            return 0;
+        uint8_t byte = buf[pos++];
+        zigzag |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+            return pos;
+        }
+    }
+    return 0;
+}
+
+void telemetry_codec_init(struct telemetry_codec *codec, const struct telemetry_field *fields, uint8_t n_fields) {
+    codec->fields = fields;
+    codec->n_fields = n_fields < TELEMETRY_MAX_FIELDS ? n_fields : TELEMETRY_MAX_FIELDS;
+    codec->time = 0;
+    memset(codec->last, 0, sizeof(codec->last));
+}
+
+size_t telemetry_pack(struct telemetry_codec *codec, uint32_t time, const float *values, uint8_t readers,
+                      uint8_t *buf, size_t size) {
+    int32_t fixed[TELEMETRY_MAX_FIELDS];
+    uint8_t present = 0;
+    for (uint8_t field = 0; field < codec->n_fields; ++field) {
+        uint8_t decimals = codec->fields[field].decimals;
+        float scaled = values[field] * TELEMETRY_POW_10[decimals < 6 ? decimals : 6];
+        // NaN fails both
+        if (!(scaled > -2e9f && scaled < 2e9f))
+            continue;
+        fixed[field] = lroundf(scaled);
+        present |= 1 << field;
+    }
+    if (size < 2)
+        return 0;
+    buf[0] = readers;
+    buf[1] = present;
+    size_t len = telemetry_put_varint(buf, size, 2, (int32_t) (time - codec->time));
+    for (uint8_t field = 0; field < codec->n_fields && len != 0; ++field)
+        if (present & (1 << field))
+            len = telemetry_put_varint(buf, size, len, (int64_t) fixed[field] - codec->last[field]);
+    if (len == 0)
+        return 0;
+    codec->time = time;
+    for (uint8_t field = 0; field < codec->n_fields; ++field)
+        if (present & (1 << field))
+            codec->last[field] = fixed[field];
+    return len;
+}
+
+size_t telemetry_unpack(struct telemetry_codec *codec, const uint8_t *buf, size_t len, uint32_t *time,
+                        float *values, uint8_t *readers) {
+    if (len < 2 || (codec->n_fields < 8 && buf[1] >> codec->n_fields))
+        return 0;
+    uint8_t present = buf[1];
+    int64_t time_delta;
+    size_t pos = telemetry_get_varint(buf, len, 2, &time_delta);
+    int32_t fixed[TELEMETRY_MAX_FIELDS];
+    for (uint8_t field = 0; field < codec->n_fields && pos != 0; ++field) {
+        int64_t delta;
+        if (!(present & (1 << field)))
+            continue;
+        pos = telemetry_get_varint(buf, len, pos, &delta);
+        fixed[field] = (int32_t) (codec->last[field] + delta);
+    }
+    if (pos == 0)
+        return 0;
+    codec->time += (uint32_t) time_delta;
+    *time = codec->time;
+    *readers = buf[0];
+    for (uint8_t field = 0; field < codec->n_fields; ++field) {
+        if (!(present & (1 << field))) {
+            values[field] = NAN;
+            continue;
+        }
+        uint8_t decimals = codec->fields[field].decimals;
+        codec->last[field] = fixed[field];
+        values[field] = (float) fixed[field] / TELEMETRY_POW_10[decimals < 6 ? decimals : 6];
+    }
+    return pos;
+}
+
+#ifdef TELEMETRY_TEST
+static const struct telemetry_field test_fields[] = {
+    {"temperature", 2},
+    {"pressure", 0},
+    {"core", 1},
+};
+
+static void assert_out(const char *buf, size_t len, const char *want) {
+    if (len != strlen(want) || memcmp(buf, want, len) != 0) {
+        printf("got  %.*s\nwant %s\n", (int) len, buf, want);
+        assert(0);
+    }
+}
+
+static void test_ring(void) {
+    struct telemetry_reader a = {0}, b = {0};
+    const float values[] = {21.5f, NAN, 40.f};
+    assert(telemetry_pending(&a) == 0);
+    telemetry_record(1000, values, 3);
+    // NaN left out
+    assert(telemetry_pending(&a) == 2);
+    assert(telemetry_peek(&a, 0)->first && !telemetry_peek(&a, 1)->first);
+    assert(telemetry_peek(&a, 1)->field == 2);
+    telemetry_ack(&a, 2);
+    assert(telemetry_pending(&a) == 0);
+    // `b` is independent
+    assert(telemetry_pending(&b) == 2);
+    // Acking more than there is stops at the end
+    telemetry_ack(&a, 5);
+    assert(telemetry_pending(&a) == 0);
+
+    // Overrun `b`
+    for (uint32_t i = 0; i < TELEMETRY_RING_LEN; ++i)
+        telemetry_record(2000 + i, values, 1);
+    assert(telemetry_pending(&b) == TELEMETRY_RING_LEN);
+    assert(b.lost == 2);
+    assert(telemetry_peek(&b, 0)->time == 2000);
+    telemetry_ack(&b, TELEMETRY_RING_LEN);
+    telemetry_ack(&a, TELEMETRY_RING_LEN);
+}
+
+static void test_influx(void) {
+    struct telemetry_reader reader = {0};
+    telemetry_pending(&reader);
+    reader.next = telemetry_head;
+    const struct telemetry_format format = {
+        .fields = test_fields, .mask = 0x3, .measurement = "thekit", .nanoseconds = false
+    };
+    const float first[] = {21.456f, 101325.f, 40.f};
+    const float second[] = {-3.f, 99000.4f};
+    const float skipped[] = {NAN, NAN, 41.f};
+    telemetry_record(1700000000, first, 3);
+    telemetry_record(1700000060, skipped, 3);
+    telemetry_record(0, second, 2);
+    char buf[128];
+    size_t len;
+    assert(telemetry_format_influx(&reader, &format, buf, sizeof(buf), &len) == 6);
+    assert_out(buf, len, "thekit temperature=21.46,pressure=101325 1700000000\n"
+                         "thekit temperature=-3.00,pressure=99000\n");
+    // Only the first line fits
+    assert(telemetry_format_influx(&reader, &format, buf, 60, &len) == 4);
+    assert_out(buf, len, "thekit temperature=21.46,pressure=101325 1700000000\n");
+    // Not even that
+    assert(telemetry_format_influx(&reader, &format, buf, 20, &len) == 0);
+    assert(len == 0);
+    const struct telemetry_format ns = {
+        .fields = test_fields, .mask = 0x1, .measurement = "m", .nanoseconds = true
+    };
+    assert(telemetry_format_influx(&reader, &ns, buf, 40, &len) == 4);
+    assert_out(buf, len, "m temperature=21.46 1700000000000000000\n");
+    telemetry_ack(&reader, 6);
+}
+
+static void test_json(void) {
+    struct telemetry_reader reader = {.next = telemetry_head};
+    const struct telemetry_format format = {.fields = test_fields, .mask = 0x5};
+    const float first[] = {21.456f, 101325.f, 40.f};
+    const float second[] = {NAN, 99000.f};
+    telemetry_record(1700000000, first, 3);
+    // Nothing uploaded in this one
+    telemetry_record(1700000060, second, 2);
+    telemetry_record(0, first, 3);
+    char buf[128];
+    size_t len;
+    assert(telemetry_format_json(&reader, &format, buf, sizeof(buf), &len) == 7);
+    assert_out(buf, len, "[{\"time\": 1700000000, \"temperature\": 21.46, \"core\": 40.0}, "
+                         "{\"temperature\": 21.46, \"core\": 40.0}]");
+    assert(telemetry_format_json(&reader, &format, buf, 70, &len) == 4);
+    assert_out(buf, len, "[{\"time\": 1700000000, \"temperature\": 21.46, \"core\": 40.0}]");
+    assert(telemetry_format_json(&reader, &format, buf, 20, &len) == 0);
+    telemetry_ack(&reader, 3);
+    // Only the record without uploaded fields is left before the last
+    telemetry_ack(&reader, 1);
+    assert(telemetry_format_json(&reader, &format, buf, sizeof(buf), &len) == 3);
+    telemetry_ack(&reader, 3);
+    assert(telemetry_format_json(&reader, &format, buf, sizeof(buf), &len) == 0);
+    assert(len == 0);
+}
+
+static void test_query(void) {
+    struct telemetry_reader reader = {.next = telemetry_head};
+    const struct telemetry_format format = {.fields = test_fields, .mask = 0x1};
+    const float only_pressure[] = {NAN, 99000.f};
+    const float first[] = {21.456f, 101325.f};
+    telemetry_record(1700000000, only_pressure, 2);
+    telemetry_record(1700000060, first, 2);
+    telemetry_record(1700000120, first, 2);
+    char buf[64];
+    size_t len;
+    // The skipped record and then one more
+    assert(telemetry_format_query(&reader, &format, buf, sizeof(buf), &len) == 3);
+    assert_out(buf, len, "temperature=21.46&time=1700000060");
+    assert(telemetry_format_query(&reader, &format, buf, 20, &len) == 1);
+    assert(len == 0);
+    telemetry_ack(&reader, 3);
+    assert(telemetry_format_query(&reader, &format, buf, sizeof(buf), &len) == 2);
+    assert_out(buf, len, "temperature=21.46&time=1700000120");
+}
+
+static void test_readers(void) {
+    struct telemetry_reader a = {.next = telemetry_head, .bit = 1};
+    struct telemetry_reader b = {.next = telemetry_head, .bit = 2};
+    const struct telemetry_format format = {.fields = test_fields, .mask = 0x1, .measurement = "m"};
+    const float values[] = {20.f, 100000.f};
+    telemetry_record_for(1700000000, values, 2, 2);
+    telemetry_record(1700000060, values, 2);
+    char buf[128];
+    size_t len;
+    // `a` passes over the record for `b` only
+    assert(telemetry_format_influx(&a, &format, buf, sizeof(buf), &len) == 4);
+    assert_out(buf, len, "m temperature=20.00 1700000060\n");
+    assert(telemetry_format_influx(&b, &format, buf, sizeof(buf), &len) == 4);
+    assert_out(buf, len, "m temperature=20.00 1700000000\n"
+                         "m temperature=20.00 1700000060\n");
+
+    uint32_t time;
+    float got[3];
+    uint8_t readers;
+    assert(telemetry_read(&a, &time, got, 3, &readers) == 2);
+    assert(time == 1700000000 && readers == 2);
+    assert(got[0] == 20.f && got[1] == 100000.f && isnan(got[2]));
+    telemetry_ack(&a, 2);
+    assert(telemetry_read(&a, &time, got, 3, &readers) == 2);
+    assert(readers == TELEMETRY_ALL_READERS);
+    telemetry_ack(&a, 2);
+    assert(telemetry_read(&a, &time, got, 3, &readers) == 0);
+    assert(telemetry_recorded() == a.next);
+}
+
+static void test_pack(void) {
+    struct telemetry_codec packer, unpacker;
+    uint8_t buf[64];
+    size_t len = 0, n;
+    telemetry_codec_init(&packer, test_fields, 3);
+    const float first[] = {21.456f, 101325.f, 40.04f};
+    const float second[] = {21.5f, NAN, 39.5f};
+    const float huge[] = {3e9f, 1.f, 0.f};
+    n = telemetry_pack(&packer, 1700000000, first, 1, buf + len, sizeof(buf) - len);
+    assert(n != 0);
+    len += n;
+    n = telemetry_pack(&packer, 1700000060, second, 3, buf + len, sizeof(buf) - len);
+    // Small differences take a byte each
+    assert(n == 5);
+    len += n;
+    // Does not fit, and changes nothing
+    assert(telemetry_pack(&packer, 1700000120, first, 1, buf + len, 3) == 0);
+    n = telemetry_pack(&packer, 1700000120, huge, 1, buf + len, sizeof(buf) - len);
+    assert(n != 0);
+    len += n;
+
+    uint32_t time;
+    float values[3];
+    uint8_t readers;
+    size_t pos = 0;
+    telemetry_codec_init(&unpacker, test_fields, 3);
+    n = telemetry_unpack(&unpacker, buf, len, &time, values, &readers);
+    assert(n != 0);
+    pos += n;
+    assert(time == 1700000000 && readers == 1);
+    // Rounded to the decimals uploaded
+    assert(fabsf(values[0] - 21.46f) < 1e-4f && values[1] == 101325.f && fabsf(values[2] - 40.f) < 1e-4f);
+    n = telemetry_unpack(&unpacker, buf + pos, len - pos, &time, values, &readers);
+    pos += n;
+    assert(time == 1700000060 && readers == 3);
+    assert(fabsf(values[0] - 21.5f) < 1e-4f && isnan(values[1]) && fabsf(values[2] - 39.5f) < 1e-4f);
+    n = telemetry_unpack(&unpacker, buf + pos, len - pos, &time, values, &readers);
+    pos += n;
+    // Out of fixed-point range is left out
+    assert(time == 1700000120 && isnan(values[0]) && values[1] == 1.f && values[2] == 0.f);
+    assert(pos == len);
+    // Cut short
+    telemetry_codec_init(&unpacker, test_fields, 3);
+    assert(telemetry_unpack(&unpacker, buf, 4, &time, values, &readers) == 0);
+    // Flash left blank
+    memset(buf, 0xff, sizeof(buf));
+    assert(telemetry_unpack(&unpacker, buf, sizeof(buf), &time, values, &readers) == 0);
+}
+
+int main(void) {
+    test_ring();
+    test_influx();
+    test_json();
+    test_query();
+    test_readers();
+    test_pack();
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,152 @@
+/*
+ *  telemetry.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Telemetry spool.
+//! A record (a timestamp and a few field values) is stored as one sample
+//! per field in a ring that every uplink reads at its own pace through a
+//! `telemetry_reader`. An uplink formats a batch from the start of its
+//! backlog and only acknowledges it once the upload went through, so a
+//! failed upload is retried with the same samples. When the ring is full
+//! the oldest samples are overwritten, and a reader still behind them
+//! skips ahead and counts what it lost.
+//! Records can also be packed into a compact, delta-encoded binary form,
+//! for keeping them in flash until they can be uploaded.
+//! Not reentrant: record and read from the main loop only.
+
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TELEMETRY_RING_LEN
+#define TELEMETRY_RING_LEN 512
+#endif
+
+// Most fields in a record that can be packed
+#define TELEMETRY_MAX_FIELDS 8
+// `telemetry_record_for` readers: all of them
+#define TELEMETRY_ALL_READERS 0xff
+
+struct telemetry_sample {
+    // Unix time in seconds, 0 if the clock was not set
+    uint32_t time;
+    float value;
+    uint8_t field;
+    // The first sample of its record
+    bool first;
+    // Readers (by `telemetry_reader.bit`) the record is for
+    uint8_t readers;
+};
+
+/// What a field is called and how precisely it is uploaded
+struct telemetry_field {
+    const char *name;
+    uint8_t decimals;
+};
+
+struct telemetry_reader {
+    // Free-running index of the next sample to upload
+    uint32_t next;
+    // Samples overwritten before they were uploaded
+    uint32_t lost;
+    // Formatters skip records not for this reader. 0 takes all
+    uint8_t bit;
+};
+
+/// How a batch is put together
+struct telemetry_format {
+    // Indexed by `telemetry_sample.field`
+    const struct telemetry_field *fields;
+    // Bit n set: field n is uploaded, the others are skipped
+    uint32_t mask;
+    // Influx measurement
+    const char *measurement;
+    // Influx timestamps in nanoseconds rather than seconds
+    bool nanoseconds;
+};
+
+/// Store a record of `n_fields` values, fields 0 to `n_fields` - 1. NaN
+/// values are left out
+void telemetry_record(uint32_t time, const float *values, uint8_t n_fields);
+
+/// Likewise, for only some of the readers
+void telemetry_record_for(uint32_t time, const float *values, uint8_t n_fields, uint8_t readers);
+
+/// Free-running count of samples recorded, which is where the next one goes
+uint32_t telemetry_recorded(void);
+
+/// Samples `reader` has yet to upload, after skipping any it lost
+uint32_t telemetry_pending(struct telemetry_reader *reader);
+
+/// Sample `i` of `reader`'s backlog. `i` must be below `telemetry_pending`
+const struct telemetry_sample *telemetry_peek(const struct telemetry_reader *reader, uint32_t i);
+
+/// `n` samples were uploaded
+void telemetry_ack(struct telemetry_reader *reader, uint32_t n);
+
+/// The first record of `reader`'s backlog, with NaN for missing fields.
+/// Returns how many samples it takes up, 0 if there is none
+uint32_t telemetry_read(struct telemetry_reader *reader, uint32_t *time, float *values, uint8_t n_fields,
+                        uint8_t *readers);
+
+/// The formatters below put as many whole records from the start of
+/// `reader`'s backlog as fit into `buf` and return how many samples they
+/// used up, skipped fields included. `len` is the length of the output,
+/// which is 0 if none of those samples had an uploaded field; a return
+/// value of 0 means the first record alone does not fit.
+/// None of them NUL-terminate.
+
+/// InfluxDB line protocol, a line per record
+uint32_t telemetry_format_influx(struct telemetry_reader *reader, const struct telemetry_format *format,
+                                 char *buf, size_t size, size_t *len);
+
+/// A JSON array with an object per record, with "time" (unless unknown)
+/// and a member per field
+uint32_t telemetry_format_json(struct telemetry_reader *reader, const struct telemetry_format *format,
+                               char *buf, size_t size, size_t *len);
+
+/// A single record as `field=value&...` with `&time=` last (unless unknown)
+uint32_t telemetry_format_query(struct telemetry_reader *reader, const struct telemetry_format *format,
+                                char *buf, size_t size, size_t *len);
+
+/// Packing state. Every field is rounded to its `decimals` and stored as
+/// the difference from the same field of the previous record, and the time
+/// as the difference from the previous time, all as zigzag varints
+struct telemetry_codec {
+    const struct telemetry_field *fields;
+    uint8_t n_fields;
+    uint32_t time;
+    int32_t last[TELEMETRY_MAX_FIELDS];
+};
+
+/// Start a run of packed records, which can only be unpacked from its start
+void telemetry_codec_init(struct telemetry_codec *codec, const struct telemetry_field *fields, uint8_t n_fields);
+
+/// Pack a record into `buf`. Returns its length, or 0 (and leaves `codec`
+/// as it was) if it does not fit in `size`
+size_t telemetry_pack(struct telemetry_codec *codec, uint32_t time, const float *values, uint8_t readers,
+                      uint8_t *buf, size_t size);
+
+/// Unpack a record from `buf`, NaN for missing fields. Returns the length
+/// it took up, or 0 if it is cut short or garbage
+size_t telemetry_unpack(struct telemetry_codec *codec, const uint8_t *buf, size_t len, uint32_t *time,
+                        float *values, uint8_t *readers);
+
+#endif
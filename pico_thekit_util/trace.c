@@ -0,0 +1,193 @@
+/*
+ *  trace.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef RPI_PICO
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "pico/platform.h"
+#else
+// Single-threaded host build, where every record is a microsecond after
+// the previous one
+static uint32_t trace_host_clock;
+#define save_and_disable_interrupts() 0
+#define restore_interrupts(status) ((void) (status))
+#define time_us_32() (trace_host_clock++)
+#define __get_current_exception() 0
+#endif
+
+#ifdef TRACE_TEST
+#include <assert.h>
+#endif
+
+// Marker: static variable
+static struct trace_event trace_ring[TRACE_RING_LEN];
+// Marker: static variable
+// Free-running count of records written
+static volatile uint32_t trace_next;
+// Marker: static variable
+static volatile bool trace_frozen;
+
+void trace_record(const char *name, char phase) {
+    // Time taken inside, so that records are in time order
+    uint32_t status = save_and_disable_interrupts();
+    if (!trace_frozen) {
+        struct trace_event *event = &trace_ring[trace_next % TRACE_RING_LEN];
+        event->time = time_us_32();
+        event->name = name;
+        event->phase = phase;
+        // Fits in `trace_contexts`: the RP2040 has 16 + 32 exceptions
+        event->context = __get_current_exception() & 63;
+        ++trace_next;
+    }
+    restore_interrupts(status);
+}
+
+void trace_freeze(bool frozen) {
+    trace_frozen = frozen;
+}
+
+bool trace_is_frozen(void) {
+    return trace_frozen;
+}
+
+uint32_t trace_count(void) {
+    uint32_t next = trace_next;
+    return next < TRACE_RING_LEN ? next : TRACE_RING_LEN;
+}
+
+const struct trace_event *trace_get(uint32_t i) {
+    return &trace_ring[(trace_next - trace_count() + i) % TRACE_RING_LEN];
+}
+
+uint64_t trace_contexts(void) {
+    uint64_t contexts = 0;
+    uint32_t count = trace_count();
+    for (uint32_t i = 0; i < count; ++i)
+        contexts |= (uint64_t) 1 << trace_get(i)->context;
+    return contexts;
+}
+
+void trace_json_event(struct json_writer *json, const struct trace_event *event, uint32_t t0) {
+    const char phase[2] = {event->phase, 0};
+    json_begin_object(json, NULL);
+    json_string(json, "name", event->name);
+    json_string(json, "ph", phase);
+    // Wraps correctly as long as the ring spans less than 2^32 us
+    json_uint(json, "ts", event->time - t0);
+    json_uint(json, "pid", 1);
+    json_uint(json, "tid", event->context);
+    if (event->phase == 'i')
+        // Only as tall as its own track
+        json_string(json, "s", "t");
+    json_end_object(json);
+}
+
+void trace_json_context(struct json_writer *json, uint8_t context) {
+    char name[16];
+    if (context == 0)
+        strcpy(name, "main");
+    else if (context >= 16)
+        snprintf(name, sizeof(name), "irq %u", (unsigned) (context - 16));
+    else
+        snprintf(name, sizeof(name), "exception %u", (unsigned) context);
+    json_begin_object(json, NULL);
+    json_string(json, "name", "thread_name");
+    json_string(json, "ph", "M");
+    json_uint(json, "pid", 1);
+    json_uint(json, "tid", context);
+    json_begin_object(json, "args");
+    json_string(json, "name", name);
+    json_end_object(json);
+    json_end_object(json);
+}
+
+#ifdef TRACE_TEST
+static void assert_json(void (*write)(struct json_writer *json), const char *want) {
+    char buf[256];
+    struct json_writer json;
+    json_init(&json, buf, sizeof(buf));
+    write(&json);
+    assert(!json.overflow);
+    buf[json.len] = 0;
+    if (strcmp(buf, want) != 0) {
+        printf("got  %s\nwant %s\n", buf, want);
+        assert(0);
+    }
+}
+
+static void write_first(struct json_writer *json) {
+    trace_json_event(json, trace_get(0), trace_get(0)->time);
+}
+
+static void write_second(struct json_writer *json) {
+    trace_json_event(json, trace_get(1), trace_get(0)->time);
+}
+
+static void write_irq(struct json_writer *json) {
+    trace_json_context(json, 16 + 13);
+}
+
+static void test_record(void) {
+    assert(trace_count() == 0);
+    TRACE_BEGIN("stage");
+    TRACE_END("stage");
+    TRACE_INSTANT("tick");
+    assert(trace_count() == 3);
+    assert(trace_get(0)->phase == 'B');
+    assert(trace_get(2)->phase == 'i');
+    assert(trace_contexts() == 1);
+    assert_json(write_first, "{\"name\": \"stage\", \"ph\": \"B\", \"ts\": 0, \"pid\": 1, \"tid\": 0}");
+    assert_json(write_second, "{\"name\": \"stage\", \"ph\": \"E\", \"ts\": 1, \"pid\": 1, \"tid\": 0}");
+    assert_json(write_irq, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 29, "
+                           "\"args\": {\"name\": \"irq 13\"}}");
+}
+
+static void test_freeze(void) {
+    uint32_t count = trace_count();
+    trace_freeze(true);
+    TRACE_INSTANT("ignored");
+    assert(trace_count() == count);
+    trace_freeze(false);
+    TRACE_INSTANT("kept");
+    assert(trace_count() == count + 1);
+}
+
+static void test_wrap(void) {
+    static const char *const names[] = {"a", "b", "c"};
+    for (uint32_t i = 0; i < TRACE_RING_LEN + 5; ++i)
+        TRACE_INSTANT(names[i % 3]);
+    assert(trace_count() == TRACE_RING_LEN);
+    // Oldest first, and consecutive
+    for (uint32_t i = 1; i < TRACE_RING_LEN; ++i)
+        assert(trace_get(i)->time == trace_get(i - 1)->time + 1);
+    assert(strcmp(trace_get(TRACE_RING_LEN - 1)->name, names[(TRACE_RING_LEN + 4) % 3]) == 0);
+}
+
+int main(void) {
+    test_record();
+    test_freeze();
+    test_wrap();
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,81 @@
+/*
+ *  trace.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Event tracing.
+//! A trace point stores a timestamp, a static name and a phase in a ring
+//! of fixed-size records, overwriting the oldest. Each record also notes
+//! whether it came from thread mode or which exception, so that IRQ work
+//! (lwIP callbacks included) shows up as its own track. The ring can be
+//! exported as Chrome trace JSON, which Perfetto and chrome://tracing open.
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "json_writer.h"
+
+#ifndef TRACE_RING_LEN
+#define TRACE_RING_LEN 512
+#endif
+
+struct trace_event {
+    // time_us_32(), so the ring must span less than 71 minutes
+    uint32_t time;
+    // Static string, only the pointer is kept
+    const char *name;
+    // 'B'egin, 'E'nd or 'i'nstant, as in the Chrome format
+    char phase;
+    // 0 in thread mode, the exception number in a handler
+    uint8_t context;
+};
+
+void trace_record(const char *name, char phase);
+
+#define TRACE_BEGIN(name) trace_record((name), 'B')
+#define TRACE_END(name) trace_record((name), 'E')
+#define TRACE_INSTANT(name) trace_record((name), 'i')
+
+/// `stmt` between a begin and an end named `name`
+#define TRACE_BLOCK(name, stmt) do { \
+    TRACE_BEGIN(name); \
+    stmt; \
+    TRACE_END(name); \
+} while (0)
+
+/// Stop or resume recording, so that the ring can be read undisturbed
+void trace_freeze(bool frozen);
+bool trace_is_frozen(void);
+
+/// Events in the ring, at most TRACE_RING_LEN
+uint32_t trace_count(void);
+
+/// Event `i`, oldest first. Only stable while frozen
+const struct trace_event *trace_get(uint32_t i);
+
+/// Bit n is set if context n has events in the ring
+uint64_t trace_contexts(void);
+
+/// `event` as a trace event object, timed relative to `t0`
+void trace_json_event(struct json_writer *json, const struct trace_event *event, uint32_t t0);
+
+/// Metadata object naming the track of `context`
+void trace_json_context(struct json_writer *json, uint8_t context);
+
+#endif
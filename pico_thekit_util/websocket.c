@@ -0,0 +1,213 @@
+/*
+ *  websocket.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "websocket.h"
+#include "base64.h"
+#include "sha1.h"
+
+#include <string.h>
+
+#ifdef WEBSOCKET_TEST
+#include <assert.h>
+#include <stdio.h>
+#define assert_eq(a, b) assert((a) == (b))
+#endif
+
+static const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+void ws_parser_init(struct ws_parser *parser) {
+    parser->state = WS_PARSE_HEADER;
+    parser->remaining = 2;
+    parser->len = 0;
+    parser->pos = 0;
+    parser->status = 0;
+}
+
+static bool fail(struct ws_parser *parser, uint16_t status) {
+    parser->state = WS_PARSE_ERROR;
+    parser->status = status;
+    return false;
+}
+
+/// The length is known, so the mask is next
+static bool start_mask(struct ws_parser *parser) {
+    if (parser->len > WS_MAX_PAYLOAD)
+        return fail(parser, WS_CLOSE_TOO_BIG);
+    parser->state = WS_PARSE_MASK;
+    parser->remaining = 4;
+    return true;
+}
+
+/// Advance by one byte. `false` once a frame is complete or broken
+static inline bool ws_parser_step(struct ws_parser *parser, uint8_t c) {
+    switch (parser->state) {
+    case WS_PARSE_HEADER:
+        if (parser->remaining == 2) {
+            // No extensions were negotiated, so RSV1-3 must be clear
+            if (c & 0x70)
+                return fail(parser, WS_CLOSE_PROTOCOL_ERROR);
+            parser->opcode = c & 0x0f;
+            // Fragmented messages are not worth supporting here
+            if (!(c & 0x80) || parser->opcode == WS_OP_CONTINUATION)
+                return fail(parser, WS_CLOSE_UNSUPPORTED);
+            if (parser->opcode != WS_OP_TEXT && parser->opcode != WS_OP_BINARY
+                    && parser->opcode != WS_OP_CLOSE && parser->opcode != WS_OP_PING
+                    && parser->opcode != WS_OP_PONG)
+                return fail(parser, WS_CLOSE_PROTOCOL_ERROR);
+            parser->remaining = 1;
+            return true;
+        }
+        // Clients must mask everything
+        if (!(c & 0x80))
+            return fail(parser, WS_CLOSE_PROTOCOL_ERROR);
+        c &= 0x7f;
+        if (c == 127)
+            return fail(parser, WS_CLOSE_TOO_BIG);
+        if (c == 126) {
+            parser->state = WS_PARSE_LENGTH;
+            parser->remaining = 2;
+            return true;
+        }
+        parser->len = c;
+        return start_mask(parser);
+    case WS_PARSE_LENGTH:
+        parser->len = parser->len << 8 | c;
+        if (--parser->remaining)
+            return true;
+        return start_mask(parser);
+    case WS_PARSE_MASK:
+        parser->mask[4 - parser->remaining] = c;
+        if (--parser->remaining)
+            return true;
+        if (parser->len == 0) {
+            parser->state = WS_PARSE_DONE;
+            return false;
+        }
+        parser->state = WS_PARSE_PAYLOAD;
+        return true;
+    case WS_PARSE_PAYLOAD:
+        parser->payload[parser->pos] = c ^ parser->mask[parser->pos % 4];
+        if (++parser->pos < parser->len)
+            return true;
+        parser->state = WS_PARSE_DONE;
+        return false;
+    case WS_PARSE_DONE:
+    case WS_PARSE_ERROR:
+    default:
+        return false;
+    }
+}
+
+size_t ws_parser_feed(struct ws_parser *parser, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    if (parser->state == WS_PARSE_DONE || parser->state == WS_PARSE_ERROR)
+        return 0;
+    while (i < len) {
+        if (!ws_parser_step(parser, data[i++]))
+            break;
+    }
+    return i;
+}
+
+size_t ws_frame_header(uint8_t out[WS_MAX_HEADER], enum ws_opcode opcode, uint16_t len) {
+    out[0] = 0x80 | opcode;
+    if (len < 126) {
+        out[1] = len;
+        return 2;
+    }
+    out[1] = 126;
+    out[2] = len >> 8;
+    out[3] = len & 0xff;
+    return 4;
+}
+
+void ws_accept_key(const char *key, size_t key_len, char out[WS_ACCEPT_LEN + 1]) {
+    struct sha1_ctx ctx;
+    uint8_t digest[SHA1_DIGEST_LEN];
+    sha1_init(&ctx);
+    sha1_update(&ctx, key, key_len);
+    sha1_update(&ctx, WS_GUID, sizeof(WS_GUID) - 1);
+    sha1_final(&ctx, digest);
+    base64_encode(out, digest, sizeof(digest));
+}
+
+#ifdef WEBSOCKET_TEST
+static void test_accept(void) {
+    // RFC 6455 1.3
+    char accept[WS_ACCEPT_LEN + 1];
+    ws_accept_key("dGhlIHNhbXBsZSBub25jZQ==", WS_KEY_LEN, accept);
+    assert(strcmp(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") == 0);
+}
+
+static void test_frames(void) {
+    // RFC 6455 5.7: a masked "Hello", then a masked empty ping
+    static const uint8_t frames[] = {0x81, 0x85, 0x37, 0xfa, 0x21, 0x3d, 0x7f, 0x9f, 0x4d, 0x51, 0x58,
+                                     0x89, 0x80, 0x01, 0x02, 0x03, 0x04};
+    struct ws_parser parser;
+    ws_parser_init(&parser);
+    // Byte by byte
+    size_t total = 0;
+    while (parser.state != WS_PARSE_DONE)
+        total += ws_parser_feed(&parser, frames + total, 1);
+    assert_eq(total, 11);
+    assert_eq(parser.opcode, WS_OP_TEXT);
+    assert_eq(parser.len, 5);
+    assert(memcmp(parser.payload, "Hello", 5) == 0);
+    ws_parser_init(&parser);
+    assert_eq(ws_parser_feed(&parser, frames + total, sizeof(frames) - total), 6);
+    assert_eq(parser.state, WS_PARSE_DONE);
+    assert_eq(parser.opcode, WS_OP_PING);
+    assert_eq(parser.len, 0);
+}
+
+static void test_errors(void) {
+    struct ws_parser parser;
+    // Unmasked
+    static const uint8_t unmasked[] = {0x81, 0x05};
+    ws_parser_init(&parser);
+    ws_parser_feed(&parser, unmasked, sizeof(unmasked));
+    assert_eq(parser.status, WS_CLOSE_PROTOCOL_ERROR);
+    // Fragmented
+    static const uint8_t fragment[] = {0x01, 0x81};
+    ws_parser_init(&parser);
+    ws_parser_feed(&parser, fragment, sizeof(fragment));
+    assert_eq(parser.status, WS_CLOSE_UNSUPPORTED);
+    // 256 bytes
+    static const uint8_t big[] = {0x82, 0xfe, 0x01, 0x00};
+    ws_parser_init(&parser);
+    ws_parser_feed(&parser, big, sizeof(big));
+    assert_eq(parser.status, WS_CLOSE_TOO_BIG);
+}
+
+static void test_header(void) {
+    uint8_t header[WS_MAX_HEADER];
+    assert_eq(ws_frame_header(header, WS_OP_TEXT, 5), 2);
+    assert(header[0] == 0x81 && header[1] == 5);
+    assert_eq(ws_frame_header(header, WS_OP_BINARY, 300), 4);
+    assert(header[0] == 0x82 && header[1] == 126 && header[2] == 1 && header[3] == 44);
+}
+
+int main(void) {
+    test_accept();
+    test_frames();
+    test_errors();
+    test_header();
+    printf("All tests passed\n");
+    return 0;
+}
+#endif
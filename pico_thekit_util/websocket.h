@@ -0,0 +1,90 @@
+/*
+ *  websocket.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Server side of RFC 6455 for small messages.
+//! Client frames are parsed incrementally like `http_parser`; only
+//! unfragmented frames up to WS_MAX_PAYLOAD bytes are accepted.
+
+#ifndef _WEBSOCKET_H
+#define _WEBSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest payload taken, which is also the limit for control frames
+#define WS_MAX_PAYLOAD 125
+// Length of a Sec-WebSocket-Key (16 bytes in base64)
+#define WS_KEY_LEN 24
+// Length of a Sec-WebSocket-Accept (20 bytes in base64)
+#define WS_ACCEPT_LEN 28
+// Longest header of a frame we send (payload < 64 KiB)
+#define WS_MAX_HEADER 4
+
+enum ws_opcode {
+    WS_OP_CONTINUATION = 0x0,
+    WS_OP_TEXT = 0x1,
+    WS_OP_BINARY = 0x2,
+    WS_OP_CLOSE = 0x8,
+    WS_OP_PING = 0x9,
+    WS_OP_PONG = 0xa,
+};
+
+// Close codes
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_UNSUPPORTED 1003
+#define WS_CLOSE_TOO_BIG 1009
+
+enum ws_parser_state {
+    WS_PARSE_HEADER = 0,
+    WS_PARSE_LENGTH,
+    WS_PARSE_MASK,
+    WS_PARSE_PAYLOAD,
+    // `opcode` and `payload` hold a complete frame
+    WS_PARSE_DONE,
+    // `status` is the close code to send
+    WS_PARSE_ERROR,
+};
+
+struct ws_parser {
+    enum ws_parser_state state;
+    // Bytes left in the current field
+    uint8_t remaining;
+    enum ws_opcode opcode;
+    uint8_t mask[4];
+    uint16_t len;
+    uint16_t pos;
+    uint16_t status;
+    uint8_t payload[WS_MAX_PAYLOAD];
+};
+
+void ws_parser_init(struct ws_parser *parser);
+
+/// Feed `len` bytes. Stops after a complete frame or on error, so the
+/// return value (bytes consumed) can be less than `len`
+size_t ws_parser_feed(struct ws_parser *parser, const uint8_t *data, size_t len);
+
+/// Write the header of an unmasked, final frame. Returns its length
+size_t ws_frame_header(uint8_t out[WS_MAX_HEADER], enum ws_opcode opcode, uint16_t len);
+
+/// Compute Sec-WebSocket-Accept for a Sec-WebSocket-Key. `out` gets
+/// WS_ACCEPT_LEN characters and a NUL
+void ws_accept_key(const char *key, size_t key_len, char out[WS_ACCEPT_LEN + 1]);
+
+#endif
@@ -19,7 +19,6 @@
 
 #include "hardware/pwm.h"
 #include "hardware/uart.h"
-#include "malloc.h"
 #include "pico/stdlib.h"
 
 #include "base64.h"
@@ -48,9 +47,10 @@ bool switch_status = 1;
 struct repeating_timer switch_timer;
 // Speaker stuff
 struct pcmaudio_player player;
-// Buffer for received data
-uint8_t *received_buf = NULL;
-uint32_t received_size;
+// Buffer for received data, as large as `uart_get_int5` can ask for. It is
+// static so that a big blob cannot fail to fit in a fragmented heap
+uint8_t received_buf[99999];
+uint32_t received_size = 0;
 
 /// Initialize all interfaces
 static inline void init() {
@@ -118,25 +118,28 @@ static inline uint32_t uart_get_int5(uart_inst_t *uart) {
     return result;
 }
 
+/// Stop the player if it is playing `received_buf`, but not embedded audio
+static inline void stop_received_playback() {
+    if (player.started && player.audio_buf == received_buf)
+        pcmaudio_stop(&player);
+}
+
 /// Fill `received_buf` and `received_size` from UART
-/// Returns `false` on failure and `received_buf` is reset to NULL
+/// Returns `false` on failure, keeping what was received
 static inline bool fill_receiving_buf() {
     uint32_t size = uart_get_int5(UART_ID);
     struct base64decoder decoder = BASE64_INITIALIZER;
-    uint8_t *buf;
-
-    // Make sure the previous stuff is free()d before overwriting
-    if (received_buf)
-        free(received_buf);
-    // Allocate after free() to make OOM less likely
-    buf = malloc(size);
-    received_buf = buf;
-    received_size = size;
-    if (buf == NULL) {
+    uint8_t *buf = received_buf;
+
+    // `uart_get_int5` does not check for digits
+    if (size > sizeof(received_buf)) {
         // Send a "cancel" signal
         uart_putc(UART_ID, '-');
         return false;
     }
+    // Overwritten below
+    stop_received_playback();
+    received_size = size;
 
     while (size) {
         uint8_t nextchar = uart_getc_blocking(UART_ID);
@@ -181,13 +184,12 @@ static inline void dispatch_commands(uint8_t cmd) {
             fill_receiving_buf();
             break;
         case 'c':
-            if (received_buf) {
-                free(received_buf);
-                received_buf = NULL;
-            }
+            stop_received_playback();
+            received_size = 0;
             break;
         case 'P':
-            // free() handled by 'c' command
+            if (received_size == 0)
+                break;
             pcmaudio_fill(&player, received_buf, received_size, false);
             pcmaudio_play(&player);
             break;
@@ -6,6 +6,7 @@
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 
+#include "hardware/flash.h"
 #include "hardware/gpio.h"
 #include "hardware/i2c.h"
 
@@ -32,6 +33,9 @@
 #ifndef ENABLE_GPS
 #define ENABLE_GPS 1
 #endif
+#ifndef ENABLE_PTP
+#define ENABLE_PTP 1
+#endif
 
 // Zeroing pin for all ADC measurements
 static const uint ADC_ZERO_PIN = 28;
@@ -59,6 +63,8 @@ static const struct light_sched_entry light_sched[] = {
     {20, 0, true},
     {22, 0, false},
 };
+// The next alarm is set again this often in case one was missed
+static const uint32_t LIGHT_RENEW_INTERVAL_MS = 5 * 60 * 1000;
 #endif
 
 // Light sensor
@@ -73,14 +79,39 @@ static const uint BMP280_SDA_PIN = 20;
 static const uint BMP280_SCL_PIN = 21;
 static const uint BMP280_ADDR = 0x76;
 #endif
+// All sensors are read this often, and requests get the latest readings
+static const uint32_t SENSORS_INTERVAL_MS = 2 * 1000;
 
 // Tasks-related
-// 5 minutes
-static const int32_t TASKS_INTERVAL_MS = (5 * 60 * 1000);
+// Network tasks wait up to this much longer than their periods so that
+// they do not all go out at once
+static const uint32_t TASKS_JITTER_MS = 30 * 1000;
+// A failed task is retried this soon, then twice as long each time up to
+// its period
+static const uint32_t TASKS_RETRY_MS = 15 * 1000;
+#if ENABLE_DDNS
+static const uint32_t DDNS_INTERVAL_MS = 5 * 60 * 1000;
+static const char DDNS_HOST[] = "dyn.dns.he.net";
+static const char DDNS_URI[] = "/nic/update?hostname=%s&password=%s&myip=%s";
+static const size_t DDNS_URI_BUFSIZE = sizeof(DDNS_URI) + sizeof(DDNS_HOST) + sizeof(DDNS_KEY) + IPADDR_STRLEN_MAX - 6 + 8;
+#endif
+
+// Telemetry-related
+// Readings are spooled this often, and each sink below uploads what it has
+// not yet sent in batches
+static const uint32_t TELEMETRY_SAMPLE_INTERVAL_MS = 60 * 1000;
+// How often the batching sinks upload
+static const uint32_t TELEMETRY_UPLOAD_INTERVAL_MS = 5 * 60 * 1000;
+// A sink that had more than a batch to send goes again this soon
+static const uint32_t TELEMETRY_BACKLOG_DELAY_MS = 2 * 1000;
+// Largest batch. Must fit in the TCP send buffer and a UDP datagram
+#define TELEMETRY_BATCH_SIZE 1024
 #if ENABLE_TEMPERATURE_SENSOR
+// Wolfram Databin, which takes a single entry per request
+static const uint32_t WOLFRAM_INTERVAL_MS = 5 * 60 * 1000;
 static const char WOLFRAM_HOST[] = "datadrop.wolframcloud.com";
-static const char WOLFRAM_URI[] = "/api/v1.0/Add?bin=%s&temperature=%.4f";
-static const size_t WOLFRAM_URI_BUFSIZE = sizeof(WOLFRAM_URI) + sizeof(WOLFRAM_HOST) + sizeof(WOLFRAM_DATABIN_ID) - 6 + 8;
+static const uint16_t WOLFRAM_PORT = 80;
+static const char WOLFRAM_URI[] = "/api/v1.0/Add?bin=%s&%.*s";
 /* Access data as:
  * ```mma
  * data := TimeSeries[
@@ -91,11 +122,32 @@ static const size_t WOLFRAM_URI_BUFSIZE = sizeof(WOLFRAM_URI) + sizeof(WOLFRAM_H
  * because we are uploading the data as strings
  */
 #endif
-#if ENABLE_DDNS
-static const char DDNS_HOST[] = "dyn.dns.he.net";
-static const char DDNS_URI[] = "/nic/update?hostname=%s&password=%s&myip=%s";
-static const size_t DDNS_URI_BUFSIZE = sizeof(DDNS_URI) + sizeof(DDNS_HOST) + sizeof(DDNS_KEY) + IPADDR_STRLEN_MAX - 6 + 8;
-#endif
+// InfluxDB line protocol over UDP to this IP address, or "" for none
+static const char INFLUX_UDP_SERVER[] = "";
+static const uint16_t INFLUX_UDP_PORT = 8089;
+// InfluxDB line protocol over HTTP, or "" for none. Any of these hosts can
+// be an IP address, such as that of a stand-in server on the LAN
+static const char INFLUX_HTTP_HOST[] = "";
+static const uint16_t INFLUX_HTTP_PORT = 8086;
+static const char INFLUX_HTTP_PATH[] = "/write?db=thekit&precision=s";
+// A JSON array of records POSTed to this host, or "" for none
+static const char TELEMETRY_POST_HOST[] = "";
+static const uint16_t TELEMETRY_POST_PORT = 80;
+static const char TELEMETRY_POST_PATH[] = "/telemetry";
+// Influx measurement
+static const char TELEMETRY_MEASUREMENT[] = "thekit";
+// A sink this many samples behind has its oldest records moved to flash
+// (of the 512 the spool in RAM holds)
+static const uint32_t TELEMETRY_SPOOL_AFTER = 256;
+// Records come back from flash, a block per sample, only while every sink
+// is up and has no more than this waiting
+static const uint32_t TELEMETRY_REPLAY_MAX_PENDING = 64;
+// Flash for spooled records, below where replay got to and the GPS aiding.
+// A sector holds 16 blocks of some 30 records
+#define TELEMETRY_SPOOL_SECTORS 16
+static const uint32_t TELEMETRY_SPOOL_CURSOR_FLASH_OFFSET = PICO_FLASH_SIZE_BYTES - 4 * FLASH_SECTOR_SIZE;
+static const uint32_t TELEMETRY_SPOOL_FLASH_OFFSET =
+    PICO_FLASH_SIZE_BYTES - (4 + TELEMETRY_SPOOL_SECTORS) * FLASH_SECTOR_SIZE;
 
 // Time-related
 #if ENABLE_NTP
@@ -105,6 +157,23 @@ static const uint16_t NTP_PORT = 123;
 static const uint64_t NTP_INTERVAL_US = 120 * 1000 * 1000;
 // Time to wait in case UDP requests are lost
 static const uint32_t NTP_UDP_TIMEOUT_TIME_MS = 5 * 1000;
+// Other kits on the LAN to peer with (symmetric mode), by their HOSTNAME.
+// A GPS-locked peer is preferred over NTP_SERVER
+static const char *const NTP_PEERS[] = {"picoeth"};
+// 1 minute between peer polls
+static const uint32_t NTP_PEER_INTERVAL_MS = 60 * 1000;
+// A poll that fails is retried after this, doubling up to NTP_PEER_INTERVAL_MS
+static const uint32_t NTP_PEER_RETRY_MS = 4 * 1000;
+#endif
+#if ENABLE_PTP
+// Must match `domainNumber` on the slaves
+static const uint8_t PTP_DOMAIN = 0;
+// log2 of the seconds between Sync messages
+static const int8_t PTP_LOG_SYNC_INTERVAL = 0;
+// log2 of the seconds between Announce messages
+static const int8_t PTP_LOG_ANNOUNCE_INTERVAL = 1;
+// log2 of the minimum seconds between Delay_Req messages from a slave
+static const int8_t PTP_LOG_MIN_DELAY_REQ_INTERVAL = 0;
 #endif
 // Timezone for the alarms (RTC is in localtime);
 static const int TZ_DIFF_SEC = -7 * 3600;
@@ -112,17 +181,70 @@ static const int TZ_DIFF_SEC = -7 * 3600;
 // GPS-related
 #if ENABLE_GPS
 #define GPS_UART uart0
-// TX is not actually used
+// TX is only used for warm-start aiding
 static const uint GPS_TX_PIN = 12;
 static const uint GPS_RX_PIN = 13;
 static const uint GPS_EN_PIN = 11;
 static const uint GPS_PPS_PIN = 14;
 static const uint GPS_BAUD = 115200;
 #define PPS_EDGE_TYPE GPIO_IRQ_EDGE_RISE
+// Warm-start aiding lives in the last two sectors of flash
+static const uint32_t GPS_AIDING_FLASH_OFFSET = PICO_FLASH_SIZE_BYTES - 2 * FLASH_SECTOR_SIZE;
+// How often the current fix is saved
+static const uint32_t GPS_AIDING_SAVE_INTERVAL_MS = 60 * 60 * 1000;
+// Don't aid with a fix older than this, in case the kit has moved
+static const int64_t GPS_AIDING_MAX_AGE_S = 30 * 24 * 3600;
 #endif
 
+// HTTP-related
+// Clients served at the same time, the rest get 503
+#define HTTP_MAX_CONNS 4
+// A request must arrive completely within this time after its first byte
+static const uint32_t HTTP_REQUEST_TIMEOUT_MS = 10 * 1000;
+// Keep-alive connections with nothing received for this long are closed
+static const uint32_t HTTP_IDLE_TIMEOUT_MS = 30 * 1000;
+// Longest request line and headers accepted, the rest get 431
+static const uint16_t HTTP_MAX_REQUEST_LEN = 2048;
+// Pieces of a response queued per connection
+#define HTTP_MAX_SEGMENTS 8
+// Room per connection for dynamic responses
+#define HTTP_SCRATCH_SIZE 512
+// Room for a piece of the /metrics body, shared by all connections. The
+// biggest, a loop stage histogram or an lwIP pool family, is about 1.3 KB
+// with every value at its widest
+#define HTTP_METRICS_SIZE 2048
+// Of HTTP_MAX_CONNS, how many can be /events streams or WebSockets
+static const uint8_t HTTP_MAX_STREAMS = 2;
+// Events and state frames go out at most this often per stream, changes
+// in between are merged
+static const uint32_t HTTP_EVENT_MIN_INTERVAL_MS = 250;
+// An idle stream gets a comment (or a ping) this often so that it is not
+// timed out
+static const uint32_t HTTP_EVENT_KEEPALIVE_MS = 15 * 1000;
+// Outgoing requests (DDNS and uploads) in flight at the same time
+#define HTTP_MAX_CLIENTS 2
+// Longest outgoing request, request line and headers
+#define HTTP_CLIENT_REQUEST_SIZE 256
+// Outgoing requests are given up after this long
+static const uint32_t HTTP_CLIENT_TIMEOUT_MS = 20 * 1000;
+
 // Networking-related
 static const char DEFAULT_DNS[] = "1.1.1.1";
 static const bool FORCE_DEFAULT_DNS = false;
 
+// Logging-related
+// Syslog server (an IP address) that also gets the log, or "" for USB only
+static const char LOG_SYSLOG_SERVER[] = "";
+// Log lines printed per main loop iteration, the rest wait in the ring
+static const uint8_t LOG_DRAIN_MAX = 16;
+// Longest log line printed
+#define LOG_LINE_MAX 160
+
+// Main loop-related
+// A main loop stage over its budget is warned about at most this often
+static const int64_t LOOP_WARN_INTERVAL_MS = 10 * 1000;
+// Longest sleep between iterations when nothing is due, which is also how
+// often the Wi-Fi link is checked
+static const uint32_t LOOP_MAX_SLEEP_MS = 1000;
+
 #endif
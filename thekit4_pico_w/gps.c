@@ -17,25 +17,75 @@
  */
 
 #include "config.h"
+#include "log.h"
+#include "ntp.h"
+
+#include "flash_ring.h"
 #include "gps_util.h"
 
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include "pico/stdlib.h"
 
 #include "hardware/gpio.h"
+#include "hardware/irq.h"
 #include "hardware/rtc.h"
 #include "hardware/uart.h"
 
 #if ENABLE_GPS
+// Last good fix, kept in flash to aid the receiver after a power cut
+struct gps_aiding_data {
+    // UNIX time of the fix
+    int64_t time;
+    float lat;
+    float lon;
+    float alt;
+};
+
 // Marker: static variable
 static struct gps_status gps_status = GPS_STATUS_INIT;
+// Marker: static variable
+static struct flash_ring gps_aiding_ring = FLASH_RING_INIT(
+    GPS_AIDING_FLASH_OFFSET, 2, sizeof(struct gps_aiding_data));
+// Whether the saved fix still needs to be sent to the receiver
+// Marker: static variable
+static bool gps_aiding_pending = false;
+// Marker: static variable
+static absolute_time_t gps_aiding_next_save;
+
+// Received bytes, from the UART interrupt to `gps_parse_available`.
+// Must be a power of two
+#define GPS_RX_SIZE 1024
+// Marker: static variable
+static char gps_rx[GPS_RX_SIZE];
+// Marker: static variable
+// Free-running; only the interrupt writes `gps_rx_head`, only the main
+// loop writes `gps_rx_tail`
+static volatile uint32_t gps_rx_head;
+// Marker: static variable
+static volatile uint32_t gps_rx_tail;
+
+/// Empty the hardware FIFO, which only holds 32 bytes, as soon as it fills
+/// up a bit. This also wakes the main loop when a burst comes in
+static void gps_uart_irq(void) {
+    while (uart_is_readable(GPS_UART)) {
+        char c = uart_getc(GPS_UART);
+        uint32_t head = gps_rx_head;
+        // When full, drop the byte and let the checksum catch it
+        if (head - gps_rx_tail < GPS_RX_SIZE) {
+            gps_rx[head % GPS_RX_SIZE] = c;
+            gps_rx_head = head + 1;
+        }
+    }
+}
 
 void gps_init(void) {
     uart_init(GPS_UART, GPS_BAUD);
     gpio_set_function(GPS_TX_PIN, GPIO_FUNC_UART);
     gpio_set_function(GPS_RX_PIN, GPIO_FUNC_UART);
-    // We don't need TX
+    // TX is only used for aiding
     // Turn off flow control CTS/RTS
     uart_set_hw_flow(GPS_UART, false, false);
     // Set up EN
@@ -44,6 +94,17 @@ void gps_init(void) {
     // Enable GPS
     gpio_put(GPS_EN_PIN, 1);
     // PPS is set up in irq.c
+    uint uart_irq = uart_get_index(GPS_UART) ? UART1_IRQ : UART0_IRQ;
+    irq_set_exclusive_handler(uart_irq, gps_uart_irq);
+    irq_set_enabled(uart_irq, true);
+    uart_set_irq_enables(GPS_UART, true, false);
+
+    if (!flash_ring_init(&gps_aiding_ring))
+        LOG_ERR1("Bad GPS aiding flash region");
+    // Nothing can be sent before the time is known, so that happens
+    // in `gps_aiding_check_run`
+    gps_aiding_pending = flash_ring_latest(&gps_aiding_ring) != NULL;
+    gps_aiding_next_save = get_absolute_time();
 }
 
 bool gps_get_location(float *lat, float *lon, float *alt, timestamp_t *age) {
@@ -70,12 +131,89 @@ uint8_t gps_get_sat_num(void) {
     return gps_status.gps_sat_num;
 }
 
-/// Read whatever is in the UART, and parse it if it's a sentence
+void gps_get_sentence_counts(uint32_t *good, uint32_t *bad) {
+    *good = gps_status.sentences;
+    *bad = gps_status.bad_sentences;
+}
+
+/// Parse whatever the UART has received
 void gps_parse_available(void) {
-    while (uart_is_readable(GPS_UART)) {
-        char c = uart_getc(GPS_UART);
-        gpsutil_feed(&gps_status, c);
+    uint32_t head = gps_rx_head;
+    uint32_t tail = gps_rx_tail;
+    while (tail != head)
+        gpsutil_feed(&gps_status, gps_rx[tail++ % GPS_RX_SIZE]);
+    gps_rx_tail = tail;
+}
+
+/// Send a PMTK command, adding the checksum. `body` starts after '$'.
+static void gps_send_pmtk(const char *body) {
+    uint8_t checksum = 0;
+    for (const char *c = body; *c; ++c)
+        checksum ^= (uint8_t) *c;
+    char trailer[6];
+    snprintf(trailer, sizeof(trailer), "*%02X\r\n", checksum);
+    uart_putc_raw(GPS_UART, '$');
+    uart_write_blocking(GPS_UART, (const uint8_t *) body, strlen(body));
+    uart_write_blocking(GPS_UART, (const uint8_t *) trailer, strlen(trailer));
+}
+
+/// Push the saved position and the current time to the receiver
+static void gps_send_aiding(const struct gps_aiding_data *saved) {
+    time_t now = ntp_get_utc_us() / 1000000;
+    int64_t age = now - saved->time;
+    if (age < 0 || age > GPS_AIDING_MAX_AGE_S) {
+        LOG_INFO("Saved GPS fix is %lld s old, not aiding\n", (long long) age);
+        return;
     }
+    struct tm *utc = gmtime(&now);
+    char body[96];
+    // PMTK741: reference location and UTC time, speeds up the first fix
+    // as long as the receiver still has a recent almanac
+    snprintf(body, sizeof(body), "PMTK741,%.6f,%.6f,%d,%04d,%02d,%02d,%02d,%02d,%02d",
+             saved->lat, saved->lon, (int) saved->alt,
+             utc->tm_year + 1900, utc->tm_mon + 1, utc->tm_mday,
+             utc->tm_hour, utc->tm_min, utc->tm_sec);
+    gps_send_pmtk(body);
+    LOG_INFO("Sent GPS aiding from a fix %lld s old\n", (long long) age);
+}
+
+/// Aid the receiver once the time is known, and save good fixes
+void gps_aiding_check_run(void) {
+    if (gps_aiding_pending && !gps_status.gps_valid && ntp_get_stratum() < 16) {
+        const struct gps_aiding_data *saved = flash_ring_latest(&gps_aiding_ring);
+        if (saved)
+            gps_send_aiding(saved);
+        gps_aiding_pending = false;
+    }
+    if (absolute_time_diff_us(get_absolute_time(), gps_aiding_next_save) > 0)
+        return;
+    struct gps_aiding_data fix;
+    time_t t;
+    timestamp_t timestamp;
+    if (!gpsutil_get_location(&gps_status, &fix.lat, &fix.lon, &fix.alt, &timestamp)
+            || !gpsutil_get_time(&gps_status, &t, &timestamp))
+        return;
+    // Got a fix, don't bother the receiver with an old one
+    gps_aiding_pending = false;
+    fix.time = t;
+    // A fix means PPS is on, and an edge during the write comes in late
+    ntp_hold_updates(true);
+    bool ok = flash_ring_append(&gps_aiding_ring, &fix);
+    ntp_hold_updates(false);
+    if (!ok)
+        LOG_ERR1("Failed to save GPS fix");
+    gps_aiding_next_save = make_timeout_time_ms(GPS_AIDING_SAVE_INTERVAL_MS);
+}
+
+/// When `gps_parse_available` or `gps_aiding_check_run` next has work
+absolute_time_t gps_next_run(void) {
+    if (gps_rx_head != gps_rx_tail)
+        return get_absolute_time();
+    // Past the save time, a fix (or the clock, for aiding) is awaited,
+    // and those come in by interrupt
+    if (absolute_time_diff_us(get_absolute_time(), gps_aiding_next_save) <= 0)
+        return at_the_end_of_time;
+    return gps_aiding_next_save;
 }
 
 
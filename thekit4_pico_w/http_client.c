@@ -0,0 +1,374 @@
+/*
+ *  http_client.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Outgoing HTTP/1.0 requests, each in a `struct http_client` taken from
+ * a pool of HTTP_MAX_CLIENTS for as long as it runs. A POST body belongs
+ * to the caller and is sent from where it is, so it must stay put until
+ * the completion callback.
+ * The exchange is a protothread (pt.h) run from the main loop by
+ * `http_client_check_run`. The lwIP callbacks, which may be in IRQ
+ * context, only record what happened in `events` (and copy the start of
+ * the response); the thread waits on those with HTTP_CLIENT_AWAIT and does
+ * all the lwIP calls itself.
+ */
+
+#include "config.h"
+#include "thekit4_pico_w.h"
+#include "log.h"
+#include "pt.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/cyw43_arch.h"
+
+#include "lwip/dns.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcp.h"
+
+#define HTTP_CLIENT_EV_DNS        0x01
+#define HTTP_CLIENT_EV_CONNECTED  0x02
+#define HTTP_CLIENT_EV_SENT       0x04
+#define HTTP_CLIENT_EV_RECV       0x08
+#define HTTP_CLIENT_EV_CLOSED     0x10
+#define HTTP_CLIENT_EV_ERR        0x20
+
+/// An HTTP request in progress
+struct http_client {
+    struct pt pt;
+    // Bumped for every request, so that a late DNS answer meant for an
+    // earlier one that used this slot can be told apart
+    uint8_t generation;
+    const char *host;
+    uint16_t port;
+    uint16_t request_len;
+    // POST body, not copied
+    const char *body;
+    uint16_t body_len;
+    // Bytes of `request` and `body` ACKed so far
+    uint32_t acked;
+    char request[HTTP_CLIENT_REQUEST_SIZE];
+    ip_addr_t addr;
+    struct tcp_pcb *pcb;
+    // HTTP_CLIENT_EV_* set by the lwIP callbacks
+    volatile uint8_t events;
+    // `events` when the thread last ran
+    uint8_t seen_events;
+    absolute_time_t deadline;
+    // The start of the response
+    char head[32];
+    volatile uint8_t head_len;
+    // Outcome: status 0 if it failed at `failed_at`
+    uint16_t status;
+    const char *failed_at;
+    err_t err;
+    http_client_done_fn done;
+    void *done_arg;
+};
+
+// Marker: static variable
+static struct http_client http_clients[HTTP_MAX_CLIENTS];
+// Marker: static variable
+POOL_DEFINE(http_client_pool, http_clients);
+
+static const char *REQUEST_FMT = "GET %s HTTP/1.0\r\n"
+    "Host: %s\r\n\r\n";
+static const char *POST_FMT = "POST %s HTTP/1.0\r\n"
+    "Host: %s\r\n"
+    "Content-Type: %s\r\n"
+    "Content-Length: %u\r\n\r\n";
+
+/// Wait for any of `ev`, an error or the deadline. `pt` is the thread
+#define HTTP_CLIENT_AWAIT(pt, client, ev) PT_WAIT_UNTIL((pt), \
+    ((client)->events & ((ev) | HTTP_CLIENT_EV_ERR)) || time_reached((client)->deadline))
+
+/// Jump to `fail` with `what` unless `ev` (rather than an error or the
+/// deadline) ended the wait
+#define HTTP_CLIENT_CHECK(client, ev, what) do { \
+    if (!((client)->events & (ev))) { \
+        (client)->failed_at = (what); \
+        goto fail; \
+    } \
+} while (0)
+
+/// DNS callback argument for `client`: the slot and the generation
+static void *http_client_dns_arg(const struct http_client *client) {
+    return (void *) (uintptr_t) ((client - http_clients) | (uint32_t) client->generation << 8);
+}
+
+static void http_client_dns_cb(const char *name, const ip_addr_t *ipaddr, void *arg) {
+    uintptr_t slot = (uintptr_t) arg & 0xff;
+    struct http_client *client = &http_clients[slot];
+    // lwIP cannot cancel a query, so it may be from a request that has
+    // timed out, or even from one to another host
+    if (!pool_is_used(&http_client_pool, slot) || client->generation != (uintptr_t) arg >> 8)
+        return;
+    if (ipaddr != NULL) {
+        client->addr = *ipaddr;
+        client->events |= HTTP_CLIENT_EV_DNS;
+    }
+    else
+        client->events |= HTTP_CLIENT_EV_ERR;
+}
+
+static err_t http_client_connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err) {
+    struct http_client *client = arg;
+    // lwIP only calls this with ERR_OK; failures go to the error callback
+    client->events |= HTTP_CLIENT_EV_CONNECTED;
+    return ERR_OK;
+}
+
+static err_t http_client_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+    struct http_client *client = arg;
+    client->acked += len;
+    if (client->acked >= (uint32_t) client->request_len + client->body_len)
+        client->events |= HTTP_CLIENT_EV_SENT;
+    return ERR_OK;
+}
+
+static err_t http_client_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
+    struct http_client *client = arg;
+    if (p == NULL) {
+        client->events |= HTTP_CLIENT_EV_CLOSED;
+        return ERR_OK;
+    }
+    // Only the status line is of interest
+    uint16_t room = sizeof(client->head) - 1 - client->head_len;
+    client->head_len += pbuf_copy_partial(p, client->head + client->head_len, room, 0);
+    client->head[client->head_len] = 0;
+    client->events |= HTTP_CLIENT_EV_RECV;
+    tcp_recved(tpcb, p->tot_len);
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+static void http_client_err_cb(void *arg, err_t err) {
+    struct http_client *client = arg;
+    // Already freed by lwIP
+    client->pcb = NULL;
+    client->err = err;
+    client->events |= HTTP_CLIENT_EV_ERR;
+}
+
+/// Let go of the connection. Unless everything sent has been ACKed, `abort`
+/// it: lwIP would otherwise go on retransmitting `request` and `body`
+/// from buffers that are no longer ours
+static void http_client_close(struct http_client *client, bool abort) {
+    cyw43_arch_lwip_begin();
+    struct tcp_pcb *pcb = client->pcb;
+    if (pcb != NULL) {
+        tcp_arg(pcb, NULL);
+        tcp_recv(pcb, NULL);
+        tcp_sent(pcb, NULL);
+        tcp_err(pcb, NULL);
+        if (abort || tcp_close(pcb) != ERR_OK)
+            tcp_abort(pcb);
+        client->pcb = NULL;
+    }
+    cyw43_arch_lwip_end();
+}
+
+/// Whether `head` has all it needs to
+static bool http_client_head_done(struct http_client *client) {
+    // `head` is written to by the receive callback
+    cyw43_arch_lwip_begin();
+    bool done = strchr(client->head, '\n') != NULL || client->head_len == sizeof(client->head) - 1;
+    cyw43_arch_lwip_end();
+    return done;
+}
+
+/// Status code in the first line of `head`, or 0
+static uint16_t http_client_status(const char *head) {
+    unsigned status;
+    if (sscanf(head, "HTTP/%*u.%*u %3u", &status) != 1)
+        return 0;
+    return status;
+}
+
+/// The exchange itself
+static enum pt_status http_client_thread(struct http_client *client) {
+    struct pt *pt = &client->pt;
+    err_t err;
+    PT_BEGIN(pt);
+    client->deadline = make_timeout_time_ms(HTTP_CLIENT_TIMEOUT_MS);
+
+    cyw43_arch_lwip_begin();
+    err = dns_gethostbyname(client->host, &client->addr, http_client_dns_cb, http_client_dns_arg(client));
+    cyw43_arch_lwip_end();
+    if (err == ERR_INPROGRESS) {
+        HTTP_CLIENT_AWAIT(pt, client, HTTP_CLIENT_EV_DNS);
+        HTTP_CLIENT_CHECK(client, HTTP_CLIENT_EV_DNS, "DNS");
+    }
+    else if (err != ERR_OK) {
+        client->err = err;
+        client->failed_at = "DNS";
+        goto fail;
+    }
+
+    cyw43_arch_lwip_begin();
+    client->pcb = tcp_new_ip_type(IP_GET_TYPE(&client->addr));
+    if (client->pcb != NULL) {
+        tcp_arg(client->pcb, client);
+        tcp_recv(client->pcb, http_client_recv_cb);
+        tcp_sent(client->pcb, http_client_sent_cb);
+        tcp_err(client->pcb, http_client_err_cb);
+        err = tcp_connect(client->pcb, &client->addr, client->port, http_client_connected_cb);
+    }
+    cyw43_arch_lwip_end();
+    if (client->pcb == NULL) {
+        client->failed_at = "PCB";
+        goto fail;
+    }
+    if (err != ERR_OK) {
+        client->err = err;
+        client->failed_at = "connect";
+        goto fail;
+    }
+    HTTP_CLIENT_AWAIT(pt, client, HTTP_CLIENT_EV_CONNECTED);
+    HTTP_CLIENT_CHECK(client, HTTP_CLIENT_EV_CONNECTED, "connect");
+
+    cyw43_arch_lwip_begin();
+    // Unless the connection was reset in between
+    err = ERR_CLSD;
+    if (client->pcb != NULL)
+        // `request` stays put until it is ACKed, so no copy
+        err = tcp_write(client->pcb, client->request, client->request_len,
+                        client->body_len != 0 ? TCP_WRITE_FLAG_MORE : 0);
+    if (err == ERR_OK && client->body_len != 0)
+        err = tcp_write(client->pcb, client->body, client->body_len, 0);
+    if (err == ERR_OK)
+        err = tcp_output(client->pcb);
+    cyw43_arch_lwip_end();
+    if (err != ERR_OK) {
+        client->err = err;
+        client->failed_at = "send";
+        goto fail;
+    }
+    HTTP_CLIENT_AWAIT(pt, client, HTTP_CLIENT_EV_SENT);
+    HTTP_CLIENT_CHECK(client, HTTP_CLIENT_EV_SENT, "send");
+
+    // Until the status line is in or the server is done
+    HTTP_CLIENT_AWAIT(pt, client, HTTP_CLIENT_EV_CLOSED
+                      | ((client->events & HTTP_CLIENT_EV_RECV) && http_client_head_done(client)
+                         ? HTTP_CLIENT_EV_RECV : 0));
+    // Everything is ACKed by now
+    http_client_close(client, false);
+    client->status = http_client_status(client->head);
+    if (client->status == 0) {
+        client->failed_at = "receive";
+        goto fail;
+    }
+    if (client->status >= 400)
+        LOG_WARN("%s answered %u\n", client->host, (unsigned) client->status);
+    else
+        LOG_DEBUG("%s answered %u\n", client->host, (unsigned) client->status);
+    PT_EXIT(pt);
+
+fail:
+    http_client_close(client, true);
+    LOG_WARN("Request to %s failed at %s (%d)\n", client->host, client->failed_at, (int) client->err);
+    client->status = 0;
+    PT_EXIT(pt);
+    PT_END(pt);
+}
+
+/// Run `client` until it waits, and give it back once it is done
+static void http_client_step(struct http_client *client) {
+    client->seen_events = client->events;
+    if (http_client_thread(client) == PT_WAITING)
+        return;
+    // Free first so that the callback can start another request
+    http_client_done_fn done = client->done;
+    void *done_arg = client->done_arg;
+    uint16_t status = client->status;
+    pool_free(&http_client_pool, client);
+    if (done != NULL)
+        done(done_arg, status);
+}
+
+/// Take a client and put the request in it. `len` is what snprintf
+/// returned for `request`
+static bool http_client_start(struct http_client *client, const char *host, uint16_t port, int len,
+                              const char *body, uint16_t body_len, http_client_done_fn done, void *arg) {
+    if (len < 0 || (size_t) len >= sizeof(client->request)) {
+        LOG_ERR("Request to %s does not fit\n", host);
+        pool_free(&http_client_pool, client);
+        return false;
+    }
+    ++client->generation;
+    client->host = host;
+    client->port = port;
+    client->request_len = len;
+    client->body = body;
+    client->body_len = body_len;
+    client->done = done;
+    client->done_arg = arg;
+    client->pcb = NULL;
+    client->acked = 0;
+    client->head_len = 0;
+    client->head[0] = 0;
+    client->events = 0;
+    client->err = ERR_OK;
+    client->failed_at = NULL;
+    client->status = 0;
+    PT_INIT(&client->pt);
+    // Get the DNS query out right away
+    http_client_step(client);
+    return true;
+}
+
+bool http_client_get(const char *host, uint16_t port, const char *path, http_client_done_fn done, void *arg) {
+    struct http_client *client = POOL_ALLOC(&http_client_pool, struct http_client);
+    if (client == NULL) {
+        LOG_WARN("No free HTTP client for %s\n", host);
+        return false;
+    }
+    int len = snprintf(client->request, sizeof(client->request), REQUEST_FMT, path, host);
+    return http_client_start(client, host, port, len, NULL, 0, done, arg);
+}
+
+bool http_client_post(const char *host, uint16_t port, const char *path, const char *content_type,
+                      const char *body, uint16_t body_len, http_client_done_fn done, void *arg) {
+    struct http_client *client = POOL_ALLOC(&http_client_pool, struct http_client);
+    if (client == NULL) {
+        LOG_WARN("No free HTTP client for %s\n", host);
+        return false;
+    }
+    int len = snprintf(client->request, sizeof(client->request), POST_FMT, path, host, content_type,
+                       (unsigned) body_len);
+    return http_client_start(client, host, port, len, body, body_len, done, arg);
+}
+
+void http_clients_check_run(void) {
+    for (uint16_t i = 0; i < HTTP_MAX_CLIENTS; ++i)
+        if (pool_is_used(&http_client_pool, i))
+            http_client_step(&http_clients[i]);
+}
+
+absolute_time_t http_clients_next_run(void) {
+    absolute_time_t next = at_the_end_of_time;
+    for (uint16_t i = 0; i < HTTP_MAX_CLIENTS; ++i) {
+        if (!pool_is_used(&http_client_pool, i))
+            continue;
+        const struct http_client *client = &http_clients[i];
+        if (client->events != client->seen_events)
+            return get_absolute_time();
+        next = absolute_time_min(next, client->deadline);
+    }
+    return next;
+}
@@ -21,9 +21,33 @@
 /* Lifecycle:
    http_server_open(state)
 | -> http_server_accept_cb(state)
-   | For each client connect:
+   | For each client connect, take a slot from `http_conn_pool` (or send 503):
    | -> http_conn_recv_cb(conn)
-      | -> http_req_check_parse(conn)
+      | -> http_conn_process(conn)
+         | For each complete request received, once the last response is out:
+         | -> http_req_check_parse(conn) looks up `http_routes`
+            | -> handler(conn)
+               | -> http_conn_write(conn) queues the response
+         | -> http_conn_flush(conn)
+   | As the client ACKs:
+   | -> http_conn_sent_cb(conn)
+      | -> http_conn_flush(conn)
+         | Once the queue is empty:
+         | -> http_conn_process(conn) for pipelined requests
+         | Unless keep-alive:
+           -> http_conn_close(conn)
+   | Once a request has turned the connection into an /events stream:
+   | -> http_server_check_run() from the main loop
+      | -> http_events_push(conn) whatever changed
+   | Or into a WebSocket, where http_conn_process(conn) reads frames:
+   | -> http_ws_frame(conn) records the level asked for
+   | -> http_server_check_run() applies the latest one
+      | -> http_ws_push(conn) the resulting state
+   | A body too big for `scratch` (/trace) is produced as it goes:
+   | -> http_conn_flush(conn) calls conn->stream(conn) when the queue is empty
+   | Every HTTP_POLL_INTERVAL:
+   | -> http_conn_poll_cb(conn)
+      | On idle or slowloris timeout:
         -> http_conn_close(conn)
    | On error:
    | -> http_conn_err_cb(conn)
@@ -37,6 +61,10 @@
 #include "thekit4_pico_w.h"
 #include "log.h"
 #include "ntp.h"
+#include "http_parser.h"
+#include "json_writer.h"
+#include "trace.h"
+#include "websocket.h"
 
 #include <inttypes.h>
 #include <math.h>
@@ -51,45 +79,148 @@
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
 
-/// HTTP server. The entire structure exists throughout the program
-/// but `conn` is re-initialized each time a request is received.
+/// HTTP server, one for each IP version. The entire structure exists
+/// throughout the program.
 struct http_server {
     struct tcp_pcb *server_pcb;
-    struct http_server_conn {
-        struct tcp_pcb *client_pcb;
-        enum {
-            HTTP_OTHER = 0,
-            HTTP_ACCEPTED,
-            HTTP_RECEIVING
-        } state;
-        struct pbuf *received;
-    } conn;
+};
+
+/// A client connection. Both servers share a fixed pool of these and
+/// each one is re-initialized when a client is accepted into it.
+struct http_server_conn {
+    struct tcp_pcb *client_pcb;
+    enum {
+        // Free slot
+        HTTP_OTHER = 0,
+        // Waiting for a request
+        HTTP_ACCEPTED,
+        // In the middle of a request
+        HTTP_RECEIVING,
+        // Streaming /events, nothing more is read
+        HTTP_EVENTS,
+        // Upgraded to a WebSocket
+        HTTP_WEBSOCKET
+    } state;
+    // Keep the connection open after the current response
+    bool keep_alive;
+    // Close once the output queue is empty
+    bool closing;
+    // Received data not yet seen by `parser`
+    struct pbuf *received;
+    // Picks up where the previous pbuf ended
+    union {
+        struct http_parser parser;
+        // Once upgraded
+        struct ws_parser ws;
+    };
+    // Bytes received but not yet passed to `tcp_recved` because too much
+    // is waiting to be parsed. This closes the window on the client
+    uint16_t recved_pending;
+    // Output queue, fed to `tcp_write` as `tcp_sndbuf` allows
+    struct http_segment {
+        const uint8_t *data;
+        size_t len;
+        // Data in `scratch`, which lwIP has to copy
+        bool copy;
+    } out[HTTP_MAX_SEGMENTS];
+    uint8_t out_head;
+    uint8_t out_count;
+    // How much of `out[out_head]` has been written
+    size_t out_offset;
+    // Dynamic responses are built here, freed when the queue is empty
+    uint8_t scratch[HTTP_SCRATCH_SIZE];
+    size_t scratch_used;
+    // Queues more of a body that is too big for `scratch` whenever the
+    // queue runs dry. Returns `false` when there is no more, and is called
+    // with `cancel` if the connection goes away first
+    bool (*stream)(struct http_server_conn *conn, bool cancel);
+    // Where `stream` is up to
+    uint32_t stream_pos;
+    // First byte of the current request
+    absolute_time_t request_start;
+    // The rest of the current request must arrive before this (slowloris)
+    absolute_time_t request_deadline;
+    // Closed if nothing is received before this
+    absolute_time_t idle_deadline;
+    // What an /events stream or a WebSocket has last been sent
+    struct {
+        absolute_time_t snapshot_taken;
+        absolute_time_t next_event;
+        absolute_time_t next_keepalive;
+        uint16_t pwm;
+        uint8_t stratum;
+    } events;
 };
 
 #define HTTP_PORT 80
+// In units of the TCP coarse timer (500 ms)
+#define HTTP_POLL_INTERVAL 2
 
+// Marker: static variable
+static struct http_server_conn http_conns[HTTP_MAX_CONNS];
+// Marker: static variable
+POOL_DEFINE(http_conn_pool, http_conns);
+// Marker: static variable
+// Connection streaming /metrics, until its queue is empty or it closes
+static struct http_server_conn *http_metrics_owner;
+
+static const char resp_keep_alive[] = "\r\nConnection: keep-alive";
+static const char resp_close[] = "\r\nConnection: close";
 static const char resp_common[] = "\r\nContent-Type: application/json\r\n"
                                   "Content-Length: ";
 
-static const char resp_200_pre[] = "HTTP/1.0 200 OK";
-static const char resp_400_pre[] = "HTTP/1.0 400 BAD REQUEST";
+static const char resp_200_pre[] = "HTTP/1.1 200 OK";
+static const char resp_400_pre[] = "HTTP/1.1 400 BAD REQUEST";
 static const char resp_400_post[] = "24\r\n\r\n"
                                     "{\"error\": \"bad request\"}";
-static const char resp_404_pre[] = "HTTP/1.0 404 NOT FOUND";
+static const char resp_404_pre[] = "HTTP/1.1 404 NOT FOUND";
 static const char resp_404_post[] = "22\r\n\r\n"
                                     "{\"error\": \"not found\"}";
-static const char resp_405_pre[] = "HTTP/1.0 405 METHOD NOT ALLOWED";
+static const char resp_405_pre[] = "HTTP/1.1 405 METHOD NOT ALLOWED";
 static const char resp_405_post[] = "31\r\n\r\n"
                                     "{\"error\": \"method not allowed\"}";
-static const char resp_500_pre[] = "HTTP/1.0 500 INTERNAL SERVER ERROR";
-static const char resp_500_post[] = "24\r\n\r\n"
+static const char resp_500_pre[] = "HTTP/1.1 500 INTERNAL SERVER ERROR";
+static const char resp_500_post[] = "34\r\n\r\n"
                                     "{\"error\": \"internal server error\"}";
-static const char resp_dashboard[] =
-    "HTTP/1.0 200 OK\r\n"
-    "Content-Type: text/html\r\n"
-    "Content-Length: 4157\r\n\r\n"
-#include "dashboard.h"
-    ;
+static const char resp_414_pre[] = "HTTP/1.1 414 URI TOO LONG";
+static const char resp_414_post[] = "25\r\n\r\n"
+                                    "{\"error\": \"uri too long\"}";
+static const char resp_431_pre[] = "HTTP/1.1 431 REQUEST HEADER FIELDS TOO LARGE";
+static const char resp_431_post[] = "44\r\n\r\n"
+                                    "{\"error\": \"request header fields too large\"}";
+static const char resp_505_pre[] = "HTTP/1.1 505 HTTP VERSION NOT SUPPORTED";
+static const char resp_505_post[] = "39\r\n\r\n"
+                                    "{\"error\": \"http version not supported\"}";
+static const char resp_408_pre[] = "HTTP/1.1 408 REQUEST TIMEOUT";
+static const char resp_408_post[] = "28\r\n\r\n"
+                                    "{\"error\": \"request timeout\"}";
+static const char resp_503_pre[] = "HTTP/1.1 503 SERVICE UNAVAILABLE";
+static const char resp_503_post[] = "32\r\n\r\n"
+                                    "{\"error\": \"service unavailable\"}";
+static const char resp_304_pre[] = "HTTP/1.1 304 NOT MODIFIED";
+static const char resp_101_pre[] = "HTTP/1.1 101 SWITCHING PROTOCOLS\r\n"
+                                   "Upgrade: websocket\r\n"
+                                   "Connection: Upgrade\r\n"
+                                   "Sec-WebSocket-Accept: ";
+static const char resp_metrics[] = "\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+static const char resp_trace[] = "\r\nContent-Type: application/json\r\n"
+                                 "Content-Disposition: attachment; filename=\"trace.json\"\r\n\r\n";
+static const char resp_events[] = "\r\nContent-Type: text/event-stream\r\n"
+                                  "Cache-Control: no-cache\r\n\r\n";
+
+/// Static file, gzipped at build time by mkassets.py
+struct http_asset {
+    const char *path;
+    // Strong ETag, quotes included
+    const char *etag;
+    // Headers after the status line and Connection, including the blank line
+    const char *head_200;
+    const char *head_304;
+    const uint8_t *body;
+    size_t body_len;
+};
+
+#include "http_assets.h"
 
 static err_t http_conn_close(void *arg) {
     struct http_server_conn *conn = (struct http_server_conn *)arg;
@@ -101,6 +232,7 @@ static err_t http_conn_close(void *arg) {
         tcp_sent(conn->client_pcb, NULL);
         tcp_recv(conn->client_pcb, NULL);
         tcp_err(conn->client_pcb, NULL);
+        tcp_poll(conn->client_pcb, NULL, 0);
         err = tcp_close(conn->client_pcb);
         if (err != ERR_OK) {
             LOG_ERR("Close failed (%d), calling abort\n", err);
@@ -111,10 +243,20 @@ static err_t http_conn_close(void *arg) {
         conn->client_pcb = NULL;
     }
     conn->state = HTTP_OTHER;
+    conn->out_count = 0;
+    conn->scratch_used = 0;
+    if (conn->stream) {
+        conn->stream(conn, true);
+        conn->stream = NULL;
+    }
     if (conn->received) {
-        free(conn->received);
+        pbuf_free(conn->received);
         conn->received = NULL;
     }
+    // The slot may go to a client that never asked for /metrics
+    if (http_metrics_owner == conn)
+        http_metrics_owner = NULL;
+    pool_free(&http_conn_pool, conn);
     return err;
 }
 
@@ -124,214 +266,777 @@ static err_t http_conn_fail(void *arg, int status, const char *function) {
 }
 
 static void http_conn_err_cb(void *arg, err_t err) {
+    struct http_server_conn *conn = (struct http_server_conn *)arg;
+    // lwIP has already freed the pcb
+    conn->client_pcb = NULL;
     if (err != ERR_ABRT)
         http_conn_fail(arg, err, "TCP error callback invoked");
+    else
+        http_conn_close(arg);
+}
+
+/// Add a segment to the output queue
+static err_t http_conn_queue(struct http_server_conn *conn, const uint8_t *data,
+                               size_t size, uint8_t copy) {
+    if (conn->out_count == HTTP_MAX_SEGMENTS)
+        return http_conn_fail((void *)conn, ERR_MEM, "write");
+    struct http_segment *seg = &conn->out[(conn->out_head + conn->out_count) % HTTP_MAX_SEGMENTS];
+    seg->data = data;
+    seg->len = size;
+    seg->copy = copy;
+    ++conn->out_count;
+    return ERR_OK;
 }
 
+/// Queue data to be sent. Unless `copy`, `buf` must stay valid until the
+/// client ACKs it, so it should be in flash or another static array.
+/// Nothing is sent until `http_conn_flush`
 static err_t http_conn_write(struct http_server_conn *conn, const char *buf,
                                size_t size, uint8_t copy) {
+    cyw43_arch_lwip_check();
+    if (!conn->client_pcb)
+        // An earlier write failed and closed the connection
+        return ERR_CLSD;
+    if (size == 0)
+        return ERR_OK;
+    if (!copy)
+        return http_conn_queue(conn, (const uint8_t *) buf, size, 0);
+    if (size > HTTP_SCRATCH_SIZE - conn->scratch_used)
+        return http_conn_fail((void *)conn, ERR_MEM, "write");
+    uint8_t *data = conn->scratch + conn->scratch_used;
+    memcpy(data, buf, size);
+    conn->scratch_used += size;
+    return http_conn_queue(conn, data, size, 1);
+}
+
+static err_t http_conn_process(struct http_server_conn *conn);
+
+/// Hand as much of the output queue to lwIP as it takes. Called again
+/// from `http_conn_sent_cb` as the client ACKs, which is the backpressure
+static err_t http_conn_flush(struct http_server_conn *conn) {
     struct tcp_pcb *tpcb = conn->client_pcb;
     cyw43_arch_lwip_check();
-    assert(size < tcp_sndbuf(tpcb));
-    err_t err = tcp_write(tpcb, buf, size, copy);
-    if (err != ERR_OK) {
-        return http_conn_fail((void *)conn, err, "write");
+    if (!tpcb)
+        return ERR_OK;
+    while (conn->out_count) {
+        struct http_segment *seg = &conn->out[conn->out_head];
+        size_t size = seg->len - conn->out_offset;
+        size_t space = tcp_sndbuf(tpcb);
+        if (space == 0 || tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN)
+            break;
+        if (size > space)
+            size = space;
+        uint8_t flags = seg->copy ? TCP_WRITE_FLAG_COPY : 0;
+        if (conn->out_count > 1 || size < seg->len - conn->out_offset)
+            flags |= TCP_WRITE_FLAG_MORE;
+        err_t err = tcp_write(tpcb, seg->data + conn->out_offset, size, flags);
+        if (err == ERR_MEM)
+            // Out of segments, wait for some to be ACKed
+            break;
+        if (err != ERR_OK)
+            return http_conn_fail((void *)conn, err, "write");
+        conn->out_offset += size;
+        if (conn->out_offset == seg->len) {
+            conn->out_head = (conn->out_head + 1) % HTTP_MAX_SEGMENTS;
+            --conn->out_count;
+            conn->out_offset = 0;
+        }
+        if (!conn->out_count && conn->stream) {
+            // `scratch` is free again, so the body can go on
+            conn->scratch_used = 0;
+            if (!conn->stream(conn, false))
+                conn->stream = NULL;
+            if (!conn->client_pcb)
+                return ERR_OK;
+        }
     }
+    tcp_output(tpcb);
+    if (conn->out_count)
+        return ERR_OK;
+    // Everything is with lwIP now
+    conn->scratch_used = 0;
+    if (http_metrics_owner == conn)
+        http_metrics_owner = NULL;
+    if (conn->closing)
+        return http_conn_close(conn);
     return ERR_OK;
 }
 
-// `true` means that we can stop reading
-static bool http_req_check_parse(struct http_server_conn *conn) {
+static err_t http_conn_sent(struct http_server_conn *conn) {
+    // A slow reader is not idle
+    conn->idle_deadline = make_timeout_time_ms(HTTP_IDLE_TIMEOUT_MS);
+    if (conn->out_count || conn->closing)
+        return http_conn_flush(conn);
+    // The previous response is out, so go on with pipelined requests
+    if (conn->received)
+        return http_conn_process(conn);
+    return ERR_OK;
+}
+
+static err_t http_conn_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+    err_t err;
     cyw43_arch_lwip_check();
-    uint16_t offset_newline = pbuf_memfind(conn->received, "\r\n", 2, 0);
-    if (offset_newline == 0xffff)
-        // Have not received a complete request line yet
-        return false;
-    uint16_t offset_first_space = pbuf_memfind(conn->received, " ", 1, 0);
-    if (offset_first_space == 0xffff || offset_first_space > offset_newline)
-        // Invalid request
-        goto finish;
-    uint16_t offset_path = offset_first_space + 1;
-    // Extract method (GET, POST, etc.)
-    // Only process GET because I discard the entire body.
-    // Note the extra space after GET
-    if (pbuf_memcmp(conn->received, 0, "GET ", 4) != 0) {
-        http_conn_write(conn, resp_405_pre, sizeof(resp_405_pre) - 1, 0);
+    TRACE_BLOCK("http_conn_sent_cb", err = http_conn_sent(arg));
+    return err;
+}
+
+/// Write a status line followed by the Connection header
+static void http_conn_write_status(struct http_server_conn *conn, const char *status, size_t size) {
+    http_conn_write(conn, status, size, 0);
+    if (conn->keep_alive)
+        http_conn_write(conn, resp_keep_alive, sizeof(resp_keep_alive) - 1, 0);
+    else
+        http_conn_write(conn, resp_close, sizeof(resp_close) - 1, 0);
+}
+
+/// Whether the request path is exactly `want`
+static bool http_req_path_is(const struct http_parser *parser, const char *want) {
+    size_t len;
+    const char *path = http_parser_path(parser, &len);
+    return strlen(want) == len && memcmp(path, want, len) == 0;
+}
+
+/// Whether the client already has this version of the asset (If-None-Match)
+static bool http_req_asset_cached(const struct http_parser *parser, const struct http_asset *asset) {
+    // The value can be a list of ETags
+    return strstr(parser->if_none_match, asset->etag) != NULL;
+}
+
+/// Answer a request the parser gave up on. The connection is closed
+/// afterwards since there is no telling where the next request starts
+static void http_req_error(struct http_server_conn *conn) {
+    LOG_WARN("Bad HTTP request (%u)\n", (unsigned)conn->parser.status);
+    conn->keep_alive = false;
+    switch (conn->parser.status) {
+    case 414:
+        http_conn_write_status(conn, resp_414_pre, sizeof(resp_414_pre) - 1);
         http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
-        http_conn_write(conn, resp_405_post, sizeof(resp_405_post) - 1, 0);
-        goto finish;
-    }
-    // We don't use or care about HTTP version anymore
-    // Note the space at the end of this path
-    if (pbuf_memcmp(conn->received, offset_path, "/ ", 2) == 0
-        // unlikely
-        || pbuf_memcmp(conn->received, offset_path, "/\r", 2) == 0) {
-        http_conn_write(conn, resp_dashboard, 512, 0);
-        http_conn_write(conn, resp_dashboard + 512, 512, 0);
-        http_conn_write(conn, resp_dashboard + 1024, 512, 0);
-        http_conn_write(conn, resp_dashboard + 1536, 512, 0);
-        http_conn_write(conn, resp_dashboard + 2048, 512, 0);
-        http_conn_write(conn, resp_dashboard + 2560, 512, 0);
-        http_conn_write(conn, resp_dashboard + 3072, 512, 0);
-        http_conn_write(conn, resp_dashboard + 3584, 512, 0);
-        http_conn_write(conn, resp_dashboard + 4096, sizeof(resp_dashboard) - 4096 - 1, 0);
-        goto finish;
-    }
-    // Note the space at the end of this path
-    if (pbuf_memcmp(conn->received, offset_path, "/get_info ", 10) == 0
-        // unlikely
-        || pbuf_memcmp(conn->received, offset_path, "/get_info\r", 2) == 0) {
-        // Max length + NNN\r\n\r\n + \0
-        char response[279] = {0};
-        size_t length;
-#if ENABLE_TEMPERATURE_SENSOR
-        float temperature;
-        bmp280_measure(&temperature, NULL);
-#else
-        // JSON doesn't support NaN
-        float temperature = -512;
-#endif
-        float core_temperature = temperature_core();
+        http_conn_write(conn, resp_414_post, sizeof(resp_414_post) - 1, 0);
+        break;
+    case 431:
+        http_conn_write_status(conn, resp_431_pre, sizeof(resp_431_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_431_post, sizeof(resp_431_post) - 1, 0);
+        break;
+    case 505:
+        http_conn_write_status(conn, resp_505_pre, sizeof(resp_505_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_505_post, sizeof(resp_505_post) - 1, 0);
+        break;
+    default:
+        http_conn_write_status(conn, resp_400_pre, sizeof(resp_400_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_400_post, sizeof(resp_400_post) - 1, 0);
+        break;
+    }
+}
+
+// "Content-Length: " is followed by at most this (scratch is < 64 KiB)
+#define HTTP_JSON_HEAD_ROOM (sizeof("65535\r\n\r\n") - 1)
+
+/// Start a JSON body in the free part of `conn->scratch`, leaving room in
+/// front of it for the Content-Length
+static void http_json_begin(struct http_server_conn *conn, struct json_writer *writer) {
+    size_t space = HTTP_SCRATCH_SIZE - conn->scratch_used;
+    if (space < HTTP_JSON_HEAD_ROOM)
+        space = HTTP_JSON_HEAD_ROOM;
+    json_init(writer, (char *) conn->scratch + conn->scratch_used + HTTP_JSON_HEAD_ROOM,
+              space - HTTP_JSON_HEAD_ROOM);
+}
+
+/// Answer 200 with the body in `writer`. The length is known by now, so it
+/// is put right in front of the body and both go out as one segment
+static void http_json_send(struct http_server_conn *conn, struct json_writer *writer) {
+    if (writer->overflow) {
+        LOG_ERR1("JSON response does not fit");
+        http_conn_write_status(conn, resp_500_pre, sizeof(resp_500_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_500_post, sizeof(resp_500_post) - 1, 0);
+        return;
+    }
+    char digits[20];
+    size_t n = json_format_uint(digits, writer->len);
+    uint8_t *start = (uint8_t *) writer->buf - 4 - n;
+    memcpy(start, digits, n);
+    memcpy(start + n, "\r\n\r\n", 4);
+    http_conn_write_status(conn, resp_200_pre, sizeof(resp_200_pre) - 1);
+    http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+    if (!conn->client_pcb)
+        return;
+    // Already in `scratch`, so lwIP copies it but we don't
+    conn->scratch_used = (uint8_t *) writer->buf + writer->len - conn->scratch;
+    http_conn_queue(conn, start, writer->len + 4 + n, 1);
+}
+
+/// "YYYY-MM-DD hh:mm:ss" and a NUL
+static void http_format_datetime(char out[20], const datetime_t *dt) {
+    const uint16_t fields[] = {dt->year, dt->month, dt->day, dt->hour, dt->min, dt->sec};
+    const char separators[] = "-- ::";
+    char *p = out;
+    for (size_t i = 0; i < 6; ++i) {
+        uint16_t value = fields[i];
+        if (i == 0) {
+            *p++ = '0' + value / 1000 % 10;
+            *p++ = '0' + value / 100 % 10;
+        }
+        *p++ = '0' + value / 10 % 10;
+        *p++ = '0' + value % 10;
+        if (i < 5)
+            *p++ = separators[i];
+    }
+    *p = 0;
+}
+
+/// Telemetry object, for /get_info and the "telemetry" event
+static void http_json_info(struct json_writer *json) {
+    // Sensors are read in the main loop, never from here
+    const struct sensors_snapshot *snap = sensors_get();
+    char datetime[20];
+    datetime_t dt;
+    if (!rtc_get_datetime(&dt)) {
+        dt.year = 0;
+        dt.month = 0;
+        dt.day = 0;
+        dt.hour = 0;
+        dt.min = 0;
+        dt.sec = 0;
+        dt.dotw = 0;
+    }
+    http_format_datetime(datetime, &dt);
+    // The fix has aged since the snapshot
+    timestamp_t gps_age = snap->gps_valid
+        ? snap->gps_age + absolute_time_diff_us(snap->taken, get_absolute_time())
+        : 0;
+
+    json_begin_object(json, NULL);
+    json_float(json, "temperature", snap->temperature, 3);
 #if ENABLE_LIGHT
-        uint16_t current_pwm_level = light_get_pwm_level();
-        float light_voltage = light_smps_measure();
+    json_uint(json, "pwm", light_get_pwm_level());
 #else
-        uint16_t current_pwm_level = 0;
-        float light_voltage = 0;
+    json_uint(json, "pwm", 0);
 #endif
-#if ENABLE_GPS
-        float lat, lon, alt;
-        timestamp_t gps_age;
-        bool gps_location_valid = gps_get_location(&lat, &lon, &alt, &gps_age);
-        if (!gps_get_location(&lat, &lon, &alt, &gps_age)) {
-            lat = -512;
-            lon = -512;
-            alt = -512;
-        }
+    json_float(json, "core_temp", snap->core_temperature, 3);
+    json_float(json, "light_voltage", snap->light_voltage, 2);
+    json_float(json, "latitude", snap->lat, 6);
+    json_float(json, "longitude", snap->lon, 6);
+    json_float(json, "altitude", snap->alt, 3);
+    json_string(json, "time", datetime);
+    json_int(json, "tz_sec", TZ_DIFF_SEC);
+    json_uint(json, "stratum", ntp_get_stratum());
+    json_uint(json, "gps_age", gps_age);
+    json_uint(json, "gps_valid", snap->gps_valid);
+    json_end_object(json);
+}
+
+/// GET /get_info
+static void http_req_get_info(struct http_server_conn *conn) {
+    struct json_writer json;
+    http_json_begin(conn, &json);
+    http_json_info(&json);
+    http_json_send(conn, &json);
+}
+
+/// "light" event
+static void http_json_light(struct json_writer *json) {
+    json_begin_object(json, NULL);
+#if ENABLE_LIGHT
+    json_uint(json, "pwm", light_get_pwm_level());
 #else
-        float lat = -512, lon = -512, alt = -512;
-        timestamp_t gps_age = 0;
-        bool gps_location_valid = false;
+    json_uint(json, "pwm", 0);
 #endif
-        uint8_t ntp_stratum = ntp_get_stratum();
-        datetime_t dt;
-        if (!rtc_get_datetime(&dt)) {
-            dt.year = 0;
-            dt.month = 0;
-            dt.day = 0;
-            dt.hour = 0;
-            dt.min = 0;
-            dt.sec = 0;
-            dt.dotw = 0;
+    json_end_object(json);
+}
+
+/// "time" event, when the stratum changes
+static void http_json_time(struct json_writer *json) {
+    json_begin_object(json, NULL);
+    json_uint(json, "stratum", ntp_get_stratum());
+    json_end_object(json);
+}
+
+/// Take one of the HTTP_MAX_STREAMS slots for /events or /ws, or answer
+/// 503 and return `false`
+static bool http_stream_start(struct http_server_conn *conn) {
+    uint8_t streams = 0;
+    for (size_t i = 0; i < HTTP_MAX_CONNS; ++i)
+        streams += http_conns[i].state == HTTP_EVENTS || http_conns[i].state == HTTP_WEBSOCKET;
+    if (streams >= HTTP_MAX_STREAMS) {
+        // Keep slots for ordinary requests
+        LOG_WARN1("Too many streams");
+        http_conn_write_status(conn, resp_503_pre, sizeof(resp_503_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_503_post, sizeof(resp_503_post) - 1, 0);
+        return false;
+    }
+    // So that everything is sent on the first run
+    conn->events.snapshot_taken = nil_time;
+    conn->events.pwm = UINT16_MAX;
+    conn->events.stratum = UINT8_MAX;
+    conn->events.next_event = get_absolute_time();
+    conn->events.next_keepalive = make_timeout_time_ms(HTTP_EVENT_KEEPALIVE_MS);
+    return true;
+}
+
+/// GET /events: Server-Sent Events. The connection becomes a stream that
+/// `http_server_check_run` feeds
+static void http_req_events(struct http_server_conn *conn) {
+    if (!http_stream_start(conn))
+        return;
+    conn->keep_alive = true;
+    http_conn_write_status(conn, resp_200_pre, sizeof(resp_200_pre) - 1);
+    http_conn_write(conn, resp_events, sizeof(resp_events) - 1, 0);
+    conn->state = HTTP_EVENTS;
+}
+
+/// GET /ws: WebSocket for the dimmer. Text frames carry a percent ("42.5"),
+/// binary frames a big-endian uint16 in hundredths of a percent. The
+/// resulting level is pushed back as {"pwm": N}
+static void http_req_websocket(struct http_server_conn *conn) {
+    const struct http_parser *parser = &conn->parser;
+    char accept[WS_ACCEPT_LEN + 1];
+    if (!parser->upgrade_websocket || !parser->connection_upgrade || parser->version_minor == 0
+            || strlen(parser->websocket_key) != WS_KEY_LEN || parser->websocket_version != 13) {
+        http_conn_write_status(conn, resp_400_pre, sizeof(resp_400_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_400_post, sizeof(resp_400_post) - 1, 0);
+        return;
+    }
+    if (!http_stream_start(conn))
+        return;
+    // Before `http_conn_process` reuses the parser for frames
+    ws_accept_key(parser->websocket_key, WS_KEY_LEN, accept);
+    conn->keep_alive = true;
+    http_conn_write(conn, resp_101_pre, sizeof(resp_101_pre) - 1, 0);
+    http_conn_write(conn, accept, WS_ACCEPT_LEN, 1);
+    http_conn_write(conn, "\r\n\r\n", 4, 0);
+    conn->state = HTTP_WEBSOCKET;
+}
+
+// Marker: static variable
+// /metrics is rendered here a piece at a time, as it is much bigger than
+// `scratch`
+static char http_metrics_buf[HTTP_METRICS_SIZE];
+
+/// Queue the next piece of /metrics
+static bool http_metrics_fill(struct http_server_conn *conn, bool cancel) {
+    struct metrics_writer writer;
+    if (cancel)
+        return false;
+    metrics_init(&writer, http_metrics_buf, sizeof(http_metrics_buf));
+    if (!metrics_write_next(&writer, &conn->stream_pos))
+        return false;
+    if (writer.overflow)
+        LOG_ERR1("Metrics left out, they do not fit");
+    // lwIP copies it as it goes, so it is free once the queue is empty
+    http_conn_queue(conn, (const uint8_t *) http_metrics_buf, writer.len, 1);
+    return true;
+}
+
+/// GET /metrics: Prometheus text format. One at a time, because each piece
+/// stays in `http_metrics_buf` until lwIP has copied all of it
+static void http_req_metrics(struct http_server_conn *conn) {
+    if (http_metrics_owner) {
+        http_conn_write_status(conn, resp_503_pre, sizeof(resp_503_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_503_post, sizeof(resp_503_post) - 1, 0);
+        return;
+    }
+    // Too big to know the length up front, so the body ends with the connection
+    conn->keep_alive = false;
+    http_conn_write_status(conn, resp_200_pre, sizeof(resp_200_pre) - 1);
+    http_conn_write(conn, resp_metrics, sizeof(resp_metrics) - 1, 0);
+    if (!conn->client_pcb)
+        return;
+    conn->stream = http_metrics_fill;
+    conn->stream_pos = 0;
+    http_metrics_owner = conn;
+}
+
+// Marker: static variable
+// Bit n set if /trace has a track for context n
+static uint64_t http_trace_contexts;
+// Marker: static variable
+// Time of the first event, which /trace counts from
+static uint32_t http_trace_t0;
+// Marker: static variable
+// Whether /trace has written a list item yet
+static bool http_trace_comma;
+
+// `stream_pos` of /trace: 0 is the head, then one per context, the events
+// and the tail
+#define HTTP_TRACE_FIRST_EVENT 65
+
+/// Queue as much of /trace as fits in `scratch`
+static bool http_trace_fill(struct http_server_conn *conn, bool cancel) {
+    uint32_t count = trace_count();
+    uint32_t end = HTTP_TRACE_FIRST_EVENT + count;
+    char *out = (char *) conn->scratch;
+    size_t len = 0;
+    if (cancel || conn->stream_pos > end) {
+        trace_freeze(false);
+        return false;
+    }
+    for (; conn->stream_pos <= end; ++conn->stream_pos) {
+        uint32_t pos = conn->stream_pos;
+        size_t space = HTTP_SCRATCH_SIZE - len;
+        if (pos == 0 || pos == end) {
+            const char *piece = pos == 0 ? "{\"traceEvents\": [" : "]}\n";
+            size_t n = strlen(piece);
+            if (n > space)
+                break;
+            memcpy(out + len, piece, n);
+            len += n;
+            continue;
         }
-        /* Generate response. Might need refactoring if/when exceeds MTU */
-        /* This number is the sum + 1 (for the \0). NNN is this sum - content-length */
-        length = snprintf(response, 279,
-                     /* content-length = 7 */
-                     "NNN\r\n\r\n"
-                     /* JSON = 2 */
-                     "{"
-                     /* temperature = 6 + 11 + 8 (-3.3 float) */
-                     "\"temperature\": %.3f, "
-                     /* pwm = 6 + 3 + 4 (4 int) */
-                     "\"pwm\": %u, "
-                     /* core_temp = 6 + 9 + 7 (-2.3 float) */
-                     "\"core_temp\": %.3f, "
-                     /* light_voltage = 6 + 13 + 5 (2.2 float) */
-                     "\"light_voltage\": %.2f, "
-                     /* latitude = 6 + 8 + 11 (-3.6 float) */
-                     "\"latitude\": %.6f, "
-                     /* longitude = 6 + 9 + 11 (-3.6 float) */
-                     "\"longitude\": %.6f, "
-                     /* altitude = 6 + 8 + 9 (-4.3 float) */
-                     "\"altitude\": %.3f, "
-                     /* time = 6 + 4 + 19 + 2 (str) */
-                     "\"time\": \"%04u-%02u-%02u %02u:%02u:%02u\", "
-                     /* tz_sec = 6 + 6 + 6 (-5 int) */
-                     "\"tz_sec\": %d, "
-                     /* stratum = 6 + 7 + 2 (b4 int) */
-                     "\"stratum\": %u, "
-                     /* gps_age = 6 + 7 + 20 (b64 int) */
-                     "\"gps_age\": %llu, "
-                     /* gps_valid = 6 - 2 + 9 + 1 (b1 int) */
-                     "\"gps_valid\": %u}",
-                     temperature, (unsigned)current_pwm_level,
-                     core_temperature, light_voltage,
-                     lat, lon, alt,
-                     dt.year, dt.month, dt.day, dt.hour, dt.min, dt.sec, TZ_DIFF_SEC,
-                     (unsigned)ntp_stratum, (unsigned long long)gps_age, (unsigned)gps_location_valid);
-        snprintf(response, 279, "%u\r\n\r\n{\"temperature\": %.3f, \"pwm\": %u, "
-                "\"core_temp\": %.3f, \"light_voltage\": %.2f, "
-                "\"latitude\": %.6f, \"longitude\": %.6f, \"altitude\": %.3f, "
-                "\"time\": \"%04u-%02u-%02u %02u:%02u:%02u\", \"tz_sec\": %d, "
-                "\"stratum\": %u, \"gps_age\": %llu, \"gps_valid\": %u}",
-                 (unsigned)length - 7,
-                 temperature, (unsigned)current_pwm_level,
-                 core_temperature, light_voltage,
-                 lat, lon, alt,
-                 dt.year, dt.month, dt.day, dt.hour, dt.min, dt.sec, TZ_DIFF_SEC,
-                 (unsigned)ntp_stratum, (unsigned long long)gps_age, (unsigned)gps_location_valid);
-        http_conn_write(conn, resp_200_pre, sizeof(resp_200_pre) - 1, 0);
+        if (pos < HTTP_TRACE_FIRST_EVENT && !(http_trace_contexts >> (pos - 1) & 1))
+            continue;
+        // Room for ", " in front
+        struct json_writer json;
+        if (space < 2)
+            break;
+        json_init(&json, out + len + 2, space - 2);
+        if (pos < HTTP_TRACE_FIRST_EVENT)
+            trace_json_context(&json, pos - 1);
+        else
+            trace_json_event(&json, trace_get(pos - HTTP_TRACE_FIRST_EVENT), http_trace_t0);
+        if (json.overflow)
+            break;
+        if (http_trace_comma) {
+            memcpy(out + len, ", ", 2);
+            len += 2;
+        } else
+            memmove(out + len, out + len + 2, json.len);
+        len += json.len;
+        http_trace_comma = true;
+    }
+    conn->scratch_used = len;
+    http_conn_queue(conn, conn->scratch, len, 1);
+    return true;
+}
+
+/// GET /trace: the trace ring as Chrome trace JSON. Tracing stops until it
+/// has all been sent, so there is one download at a time
+static void http_req_trace(struct http_server_conn *conn) {
+    if (trace_is_frozen()) {
+        http_conn_write_status(conn, resp_503_pre, sizeof(resp_503_pre) - 1);
         http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
-        // This one needs to be copied
-        http_conn_write(conn, response, length, 1);
-        goto finish;
+        http_conn_write(conn, resp_503_post, sizeof(resp_503_post) - 1, 0);
+        return;
+    }
+    trace_freeze(true);
+    http_trace_contexts = trace_contexts();
+    http_trace_t0 = trace_count() ? trace_get(0)->time : 0;
+    http_trace_comma = false;
+    // Too big to know the length up front, so the body ends with the connection
+    conn->keep_alive = false;
+    http_conn_write_status(conn, resp_200_pre, sizeof(resp_200_pre) - 1);
+    http_conn_write(conn, resp_trace, sizeof(resp_trace) - 1, 0);
+    if (!conn->client_pcb) {
+        trace_freeze(false);
+        return;
     }
+    conn->stream = http_trace_fill;
+    conn->stream_pos = 0;
+}
+
 #if ENABLE_LIGHT
-    if (pbuf_memcmp(conn->received, offset_path, "/3light_dim", 11) == 0) {
-        uint16_t offset_level = pbuf_memfind(conn->received, "level=", 6, offset_path);
-        if (offset_level == 0xffff) {
-            http_conn_write(conn, resp_400_pre, sizeof(resp_400_pre) - 1, 0);
-            http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
-            http_conn_write(conn, resp_400_post, sizeof(resp_400_post) - 1, 0);
-            goto finish;
-        }
-        // Max should be 100.000000 and NUL
-        char number[12];
-        if (pbuf_copy_partial(conn->received, number, 11, offset_level + 6) == 0) {
-            LOG_ERR1("Cannot copy pbuf to string");
-            http_conn_write(conn, resp_500_pre, sizeof(resp_500_pre) - 1, 0);
-            http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
-            http_conn_write(conn, resp_500_post, sizeof(resp_500_post) - 1, 0);
-            goto finish;
-        }
-        number[11] = 0;
-        float intensity = atof(number);
-        // Max length + nn\r\n\r\n + \0
-        char response[37] = {0};
-        size_t length;
-        light_dim(intensity);
-        /* Generate response */
-        length = snprintf(response, 37,
-                     "30\r\n\r\n{\"dim\": true, \"value\": %.2f}", intensity);
-        snprintf(response, 37, "%u\r\n\r\n{\"dim\": true, \"value\": %.2f}",
-                 (unsigned)length - 6, intensity);
-        http_conn_write(conn, resp_200_pre, sizeof(resp_200_pre) - 1, 0);
+/// GET /3light_dim?level=<percent>
+static void http_req_light_dim(struct http_server_conn *conn) {
+    const char *query = http_parser_query(&conn->parser);
+    struct http_slice value;
+    struct json_writer json;
+    int32_t level;
+    // Percent with two decimals, which is finer than the PWM resolution
+    if (!http_query_get(query, strlen(query), "level", &value)
+            || !http_parse_fixed(value, 2, 0, 10000, &level)) {
+        http_conn_write_status(conn, resp_400_pre, sizeof(resp_400_pre) - 1);
         http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
-        // This one needs to be copied
-        http_conn_write(conn, response, length, 1);
-        goto finish;
+        http_conn_write(conn, resp_400_post, sizeof(resp_400_post) - 1, 0);
+        return;
     }
+    light_dim(level / 100.f);
+    http_json_begin(conn, &json);
+    json_begin_object(&json, NULL);
+    json_bool(&json, "dim", true);
+    json_fixed(&json, "value", level, 2);
+    json_end_object(&json);
+    http_json_send(conn, &json);
+}
 #endif
-    http_conn_write(conn, resp_404_pre, sizeof(resp_404_pre) - 1, 0);
-    http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
-    http_conn_write(conn, resp_404_post, sizeof(resp_404_post) - 1, 0);
 
-finish:
-    // We only need one recv/send cycle, so we simply
-    // close the connection here.
-    tcp_output(conn->client_pcb);
-    pbuf_free(conn->received);
-    conn->received = NULL;
-    http_conn_close(conn);
-    return true;
+/// Answer with the static file `asset`
+static void http_req_asset(struct http_server_conn *conn, const struct http_asset *asset) {
+    if (http_req_asset_cached(&conn->parser, asset)) {
+        http_conn_write_status(conn, resp_304_pre, sizeof(resp_304_pre) - 1);
+        http_conn_write(conn, asset->head_304, strlen(asset->head_304), 0);
+        return;
+    }
+    // Every browser accepts gzip, so there is no uncompressed copy
+    http_conn_write_status(conn, resp_200_pre, sizeof(resp_200_pre) - 1);
+    http_conn_write(conn, asset->head_200, strlen(asset->head_200), 0);
+    http_conn_write(conn, (const char *) asset->body, asset->body_len, 0);
 }
 
-static err_t http_conn_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p,
+/// An API endpoint. Handlers queue the whole response and may clear
+/// `conn->keep_alive`
+struct http_route {
+    const char *path;
+    // `HTTP_METHOD_MASK`s of the methods it answers
+    uint8_t methods;
+    void (*handler)(struct http_server_conn *conn);
+};
+
+#define HTTP_GET HTTP_METHOD_MASK(HTTP_METHOD_GET)
+
+static const struct http_route http_routes[] = {
+    {"/get_info", HTTP_GET, http_req_get_info},
+    {"/events", HTTP_GET, http_req_events},
+    {"/ws", HTTP_GET, http_req_websocket},
+    {"/metrics", HTTP_GET, http_req_metrics},
+    {"/trace", HTTP_GET, http_req_trace},
+#if ENABLE_LIGHT
+    {"/3light_dim", HTTP_GET, http_req_light_dim},
+#endif
+};
+
+#define HTTP_N_ROUTES (sizeof(http_routes) / sizeof(http_routes[0]))
+#define HTTP_N_ASSETS (sizeof(http_assets) / sizeof(http_assets[0]))
+// Open-addressed index over both tables, at most half full so that
+// lookups are a probe or two
+#define HTTP_ROUTE_BUCKETS 16
+_Static_assert(HTTP_N_ROUTES + HTTP_N_ASSETS <= HTTP_ROUTE_BUCKETS / 2,
+               "HTTP_ROUTE_BUCKETS is too small");
+
+// Marker: static variable
+// Route number + 1 (assets after `http_routes`), or 0 if empty
+static uint8_t http_route_index[HTTP_ROUTE_BUCKETS];
+
+static uint32_t http_route_hash(const char *path) {
+    uint32_t hash = HTTP_HASH_INIT;
+    while (*path)
+        hash = http_hash_update(hash, *path++);
+    return hash;
+}
+
+static const char *http_route_path(uint8_t route) {
+    if (route < HTTP_N_ROUTES)
+        return http_routes[route].path;
+    return http_assets[route - HTTP_N_ROUTES].path;
+}
+
+/// Fill `http_route_index` from the route and asset tables
+static void http_route_index_build(void) {
+    memset(http_route_index, 0, sizeof(http_route_index));
+    for (uint8_t route = 0; route < HTTP_N_ROUTES + HTTP_N_ASSETS; ++route) {
+        uint32_t bucket = http_route_hash(http_route_path(route));
+        while (http_route_index[bucket % HTTP_ROUTE_BUCKETS])
+            ++bucket;
+        http_route_index[bucket % HTTP_ROUTE_BUCKETS] = route + 1;
+    }
+}
+
+/// Find the route for the request path. Returns 0xff if there is none
+static uint8_t http_route_find(const struct http_parser *parser) {
+    // The parser has hashed the path on the way in
+    uint32_t bucket = parser->path_hash;
+    uint8_t entry;
+    while ((entry = http_route_index[bucket % HTTP_ROUTE_BUCKETS])) {
+        if (http_req_path_is(parser, http_route_path(entry - 1)))
+            return entry - 1;
+        ++bucket;
+    }
+    return 0xff;
+}
+
+/// Respond to the request `conn->parser` has just finished.
+/// `false` means that the connection must be closed
+static bool http_req_check_parse(struct http_server_conn *conn) {
+    const struct http_parser *parser = &conn->parser;
+    cyw43_arch_lwip_check();
+    conn->keep_alive = http_parser_keep_alive(parser);
+    // Only GET is answered because the body is never read, so there
+    // might be one we don't know how to skip
+    if (parser->method != HTTP_METHOD_GET)
+        conn->keep_alive = false;
+    uint8_t route = http_route_find(parser);
+    if (route == 0xff) {
+        http_conn_write_status(conn, resp_404_pre, sizeof(resp_404_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_404_post, sizeof(resp_404_post) - 1, 0);
+        return conn->keep_alive;
+    }
+    uint8_t methods = route < HTTP_N_ROUTES ? http_routes[route].methods : HTTP_GET;
+    if (!(methods & HTTP_METHOD_MASK(parser->method))) {
+        http_conn_write_status(conn, resp_405_pre, sizeof(resp_405_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_405_post, sizeof(resp_405_post) - 1, 0);
+        return conn->keep_alive;
+    }
+    if (route < HTTP_N_ROUTES)
+        http_routes[route].handler(conn);
+    else
+        http_req_asset(conn, &http_assets[route - HTTP_N_ROUTES]);
+    return conn->keep_alive;
+}
+
+// Marker: static variable
+// Latest level asked for over any WebSocket, in hundredths of a percent,
+// or -1. Applied by `http_server_check_run`
+static int32_t http_ws_pending_level = -1;
+
+/// Queue a frame with a copy of `payload`
+static void http_ws_send(struct http_server_conn *conn, enum ws_opcode opcode,
+                         const uint8_t *payload, uint16_t len) {
+    uint8_t header[WS_MAX_HEADER];
+    size_t header_len = ws_frame_header(header, opcode, len);
+    http_conn_write(conn, (const char *) header, header_len, 1);
+    http_conn_write(conn, (const char *) payload, len, 1);
+}
+
+/// Send a Close frame and hang up once it is out
+static void http_ws_close(struct http_server_conn *conn, uint16_t status) {
+    uint8_t code[2] = {status >> 8, status & 0xff};
+    http_ws_send(conn, WS_OP_CLOSE, code, sizeof(code));
+    conn->closing = true;
+}
+
+/// Act on the frame `conn->ws` has just finished
+static void http_ws_frame(struct http_server_conn *conn) {
+    const struct ws_parser *ws = &conn->ws;
+    struct http_slice text;
+    int32_t level;
+    switch (ws->opcode) {
+    case WS_OP_TEXT:
+        text.data = (const char *) ws->payload;
+        text.len = ws->len;
+        if (!http_parse_fixed(text, 2, 0, 10000, &level)) {
+            http_ws_close(conn, WS_CLOSE_UNSUPPORTED);
+            break;
+        }
+        // Only the latest one matters
+        http_ws_pending_level = level;
+        break;
+    case WS_OP_BINARY:
+        level = ws->len == 2 ? ws->payload[0] << 8 | ws->payload[1] : -1;
+        if (level < 0 || level > 10000) {
+            http_ws_close(conn, WS_CLOSE_UNSUPPORTED);
+            break;
+        }
+        http_ws_pending_level = level;
+        break;
+    case WS_OP_PING:
+        http_ws_send(conn, WS_OP_PONG, ws->payload, ws->len);
+        break;
+    case WS_OP_CLOSE:
+        // Echo the status code, if any
+        http_ws_send(conn, WS_OP_CLOSE, ws->payload, ws->len < 2 ? ws->len : 2);
+        conn->closing = true;
+        break;
+    default:
+        // Pongs to our pings
+        break;
+    }
+}
+
+/// Read every complete frame received so far
+static err_t http_ws_process(struct http_server_conn *conn) {
+    // Same rule as for requests: replies (pongs) go out in order
+    while (conn->received && !conn->out_count && !conn->closing) {
+        struct pbuf *p = conn->received;
+        size_t used = ws_parser_feed(&conn->ws, p->payload, p->len);
+        conn->received = pbuf_free_header(p, used);
+        if (conn->ws.state == WS_PARSE_ERROR) {
+            LOG_WARN1("Bad WebSocket frame");
+            http_ws_close(conn, conn->ws.status);
+            break;
+        }
+        if (conn->ws.state != WS_PARSE_DONE)
+            continue;
+        http_ws_frame(conn);
+        if (!conn->client_pcb)
+            return ERR_OK;
+        ws_parser_init(&conn->ws);
+    }
+    if (conn->received && conn->closing) {
+        pbuf_free(conn->received);
+        conn->received = NULL;
+    }
+    if (conn->recved_pending && conn->client_pcb) {
+        tcp_recved(conn->client_pcb, conn->recved_pending);
+        conn->recved_pending = 0;
+    }
+    return http_conn_flush(conn);
+}
+
+/// Answer every complete request received so far, in order
+static err_t http_conn_process(struct http_server_conn *conn) {
+    if (conn->state == HTTP_WEBSOCKET)
+        return http_ws_process(conn);
+    // Responses don't overtake each other, and pipelined requests wait
+    // until the previous response has been handed to lwIP
+    while (conn->received && !conn->out_count && !conn->closing
+            && (conn->state == HTTP_ACCEPTED || conn->state == HTTP_RECEIVING)) {
+        // Every byte goes through the parser once, and each pbuf is
+        // freed as soon as the parser is done with it
+        struct pbuf *p = conn->received;
+        size_t used = http_parser_feed(&conn->parser, p->payload, p->len);
+        conn->received = pbuf_free_header(p, used);
+        if (conn->state != HTTP_RECEIVING && http_parser_started(&conn->parser)) {
+            conn->state = HTTP_RECEIVING;
+            conn->request_start = get_absolute_time();
+            conn->request_deadline = delayed_by_ms(conn->request_start, HTTP_REQUEST_TIMEOUT_MS);
+        }
+        if (conn->parser.state == HTTP_PARSE_ERROR) {
+            metric_inc(&metrics_http_bad_requests);
+            http_req_error(conn);
+            conn->closing = true;
+            break;
+        }
+        if (conn->parser.state != HTTP_PARSE_DONE)
+            // Need the next pbuf
+            continue;
+        if (!http_req_check_parse(conn))
+            conn->closing = true;
+        metric_inc(&metrics_http_requests);
+        metric_observe(&metrics_http_duration,
+                       absolute_time_diff_us(conn->request_start, get_absolute_time()));
+        if (!conn->client_pcb)
+            // Closed by a failed write
+            return ERR_OK;
+        if (conn->state == HTTP_WEBSOCKET) {
+            // Frames follow right after the blank line
+            ws_parser_init(&conn->ws);
+            break;
+        }
+        // Pipelined requests follow right after the blank line
+        http_parser_init(&conn->parser, HTTP_MAX_REQUEST_LEN);
+        if (conn->state == HTTP_EVENTS) {
+            // Nothing after the request that started a stream is answered
+            if (conn->received) {
+                pbuf_free(conn->received);
+                conn->received = NULL;
+            }
+        } else
+            conn->state = HTTP_ACCEPTED;
+        // Reopen the window if it was held back
+        if (conn->recved_pending) {
+            tcp_recved(conn->client_pcb, conn->recved_pending);
+            conn->recved_pending = 0;
+        }
+        err_t err = http_conn_flush(conn);
+        if (err != ERR_OK || !conn->client_pcb)
+            return err;
+    }
+    return http_conn_flush(conn);
+}
+
+static err_t http_conn_recv(struct http_server_conn *conn, struct tcp_pcb *tpcb, struct pbuf *p,
                            err_t err) {
-    struct http_server_conn *conn = (struct http_server_conn *)arg;
-    if (!p)
-        return http_conn_fail(arg, ERR_OK, "remote disconnected");
+    if (!p) {
+        // Normal for keep-alive connections
+        LOG_INFO1("Client disconnected");
+        return http_conn_close(conn);
+    }
     else if (err != ERR_OK) {
         /* cleanup, for unknown reason */
         pbuf_free(p);
@@ -341,50 +1046,269 @@ static err_t http_conn_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p,
     // required, however you can use this method to cause an assertion in debug
     // mode, if this method is called when cyw43_arch_lwip_begin IS needed
     cyw43_arch_lwip_check();
-    tcp_recved(tpcb, p->tot_len);
-    if (conn->state == HTTP_ACCEPTED) {
-        // First chunk
-        assert(!conn->received);
-        conn->received = p;
+    conn->idle_deadline = make_timeout_time_ms(HTTP_IDLE_TIMEOUT_MS);
+    if (conn->closing || conn->state == HTTP_EVENTS) {
+        // Not going to answer anything more
+        tcp_recved(tpcb, p->tot_len);
+        pbuf_free(p);
+        return ERR_OK;
     }
-    else if (conn->state == HTTP_RECEIVING) {
-        // Not first chunk
+    if (!conn->received)
+        conn->received = p;
+    else
         pbuf_cat(conn->received, p);
+    // Hold back the window while requests pile up behind a slow response
+    if (conn->received->tot_len > HTTP_MAX_REQUEST_LEN && conn->out_count)
+        conn->recved_pending += p->tot_len;
+    else
+        tcp_recved(tpcb, p->tot_len);
+    return http_conn_process(conn);
+}
+
+static err_t http_conn_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p,
+                           err_t err) {
+    TRACE_BLOCK("http_conn_recv_cb", err = http_conn_recv(arg, tpcb, p, err));
+    return err;
+}
+
+static err_t http_conn_poll_cb(void *arg, struct tcp_pcb *tpcb) {
+    struct http_server_conn *conn = (struct http_server_conn *)arg;
+    cyw43_arch_lwip_check();
+    absolute_time_t now = get_absolute_time();
+    if (conn->state == HTTP_RECEIVING && absolute_time_diff_us(now, conn->request_deadline) < 0) {
+        LOG_WARN1("HTTP request took too long");
+        conn->keep_alive = false;
+        http_conn_write_status(conn, resp_408_pre, sizeof(resp_408_pre) - 1);
+        http_conn_write(conn, resp_common, sizeof(resp_common) - 1, 0);
+        http_conn_write(conn, resp_408_post, sizeof(resp_408_post) - 1, 0);
+        conn->closing = true;
+        return http_conn_flush(conn);
     }
-    else {
-        // Might be DONE or something else
+    if (absolute_time_diff_us(now, conn->idle_deadline) < 0) {
+        LOG_INFO1("HTTP connection idle");
+        return http_conn_close(conn);
+    }
+    // In case `tcp_write` ran out of memory with nothing in flight
+    if (conn->out_count)
+        return http_conn_flush(conn);
+    return ERR_OK;
+}
+
+/// Get a free connection slot or NULL if all are busy. If there is no
+/// free one, the idle keep-alive connection closest to timing out makes room
+static struct http_server_conn *http_conn_alloc(void) {
+    struct http_server_conn *conn = POOL_ALLOC(&http_conn_pool, struct http_server_conn);
+    if (conn)
+        return conn;
+    struct http_server_conn *idle = NULL;
+    for (size_t i = 0; i < HTTP_MAX_CONNS; ++i) {
+        conn = &http_conns[i];
+        // Back to HTTP_ACCEPTED once the response is queued, which is not
+        // the same as sent: cutting it off would truncate the body
+        if (conn->state == HTTP_ACCEPTED && !conn->received
+                && !conn->out_count && !conn->closing && !conn->stream
+                && (!idle || absolute_time_diff_us(conn->idle_deadline, idle->idle_deadline) > 0))
+            idle = conn;
+    }
+    if (!idle)
+        return NULL;
+    LOG_INFO1("Closing idle HTTP connection to make room");
+    // If this aborts, the pcb is gone all the same
+    http_conn_close(idle);
+    return POOL_ALLOC(&http_conn_pool, struct http_server_conn);
+}
+
+/// Tell a client that we are full and hang up
+static err_t http_server_reject(struct tcp_pcb *client_pcb) {
+    LOG_WARN1("No free HTTP connection, sending 503");
+    metric_inc(&metrics_http_rejected);
+    // The connection isn't ours to track, so ignore write errors
+    tcp_write(client_pcb, resp_503_pre, sizeof(resp_503_pre) - 1, 0);
+    tcp_write(client_pcb, resp_close, sizeof(resp_close) - 1, 0);
+    tcp_write(client_pcb, resp_common, sizeof(resp_common) - 1, 0);
+    tcp_write(client_pcb, resp_503_post, sizeof(resp_503_post) - 1, 0);
+    tcp_output(client_pcb);
+    if (tcp_close(client_pcb) != ERR_OK) {
+        tcp_abort(client_pcb);
+        return ERR_ABRT;
     }
-    if (http_req_check_parse(conn))
-        conn->state = HTTP_OTHER;
     return ERR_OK;
 }
 
 static err_t http_server_accept_cb(void *arg, struct tcp_pcb *client_pcb,
                                 err_t err) {
-    struct http_server_conn *conn = (struct http_server_conn *)arg;
-
     cyw43_arch_lwip_check();
     if (err != ERR_OK || client_pcb == NULL) {
-        http_conn_fail(arg, err, "accept");
+        LOG_ERR("HTTP server accept failed with status %d\n", err);
         return ERR_VAL;
     }
+    struct http_server_conn *conn = http_conn_alloc();
+    if (!conn)
+        return http_server_reject(client_pcb);
     LOG_INFO1("Client connected");
     conn->state = HTTP_ACCEPTED;
+    conn->keep_alive = false;
+    conn->closing = false;
+    conn->received = NULL;
+    http_parser_init(&conn->parser, HTTP_MAX_REQUEST_LEN);
+    conn->recved_pending = 0;
+    conn->out_head = 0;
+    conn->out_count = 0;
+    conn->out_offset = 0;
+    conn->scratch_used = 0;
+    conn->stream = NULL;
+    conn->idle_deadline = make_timeout_time_ms(HTTP_IDLE_TIMEOUT_MS);
 
     conn->client_pcb = client_pcb;
     tcp_arg(client_pcb, conn);
     tcp_recv(client_pcb, http_conn_recv_cb);
+    tcp_sent(client_pcb, http_conn_sent_cb);
     tcp_err(client_pcb, http_conn_err_cb);
+    tcp_poll(client_pcb, http_conn_poll_cb, HTTP_POLL_INTERVAL);
 
     return ERR_OK;
 }
 
-static bool http_server_open_one(struct http_server *server, uint8_t lwip_type, const ip_addr_t *ipaddr) {
-    // NULL-init `conn`
-    server->conn.client_pcb = NULL;
-    server->conn.state = HTTP_OTHER;
-    server->conn.received = NULL;
+/// Append an event to `conn->scratch`. `false` if it does not fit
+static bool http_events_append(struct http_server_conn *conn, const char *event,
+                               void (*fill)(struct json_writer *json)) {
+    struct json_writer json;
+    size_t name_len = strlen(event);
+    // "event: NAME\ndata: JSON\n\n"
+    size_t head_len = 7 + name_len + 7;
+    size_t space = HTTP_SCRATCH_SIZE - conn->scratch_used;
+    if (space < head_len + 2)
+        return false;
+    char *head = (char *) conn->scratch + conn->scratch_used;
+    memcpy(head, "event: ", 7);
+    memcpy(head + 7, event, name_len);
+    memcpy(head + 7 + name_len, "\ndata: ", 7);
+    json_init(&json, head + head_len, space - head_len - 2);
+    fill(&json);
+    if (json.overflow)
+        return false;
+    memcpy(head + head_len + json.len, "\n\n", 2);
+    conn->scratch_used += head_len + json.len + 2;
+    return true;
+}
+
+/// Send whatever changed since the last event, coalesced into one segment
+static void http_events_push(struct http_server_conn *conn, absolute_time_t now) {
+    const struct sensors_snapshot *snap = sensors_get();
+#if ENABLE_LIGHT
+    uint16_t pwm = light_get_pwm_level();
+#else
+    uint16_t pwm = 0;
+#endif
+    uint8_t stratum = ntp_get_stratum();
+    // The queue is empty, so is the scratch space
+    assert(conn->scratch_used == 0);
+    if (pwm != conn->events.pwm && http_events_append(conn, "light", http_json_light))
+        conn->events.pwm = pwm;
+    if (stratum != conn->events.stratum && http_events_append(conn, "time", http_json_time))
+        conn->events.stratum = stratum;
+    if (to_us_since_boot(snap->taken) != to_us_since_boot(conn->events.snapshot_taken)
+            && http_events_append(conn, "telemetry", http_json_info))
+        conn->events.snapshot_taken = snap->taken;
+    if (conn->scratch_used == 0) {
+        if (absolute_time_diff_us(now, conn->events.next_keepalive) > 0)
+            return;
+        // A comment, ignored by EventSource
+        http_conn_write(conn, ":\n\n", 3, 0);
+    } else
+        http_conn_queue(conn, conn->scratch, conn->scratch_used, 1);
+    conn->events.next_event = delayed_by_us(now, HTTP_EVENT_MIN_INTERVAL_MS * 1000ull);
+    conn->events.next_keepalive = delayed_by_us(now, HTTP_EVENT_KEEPALIVE_MS * 1000ull);
+    http_conn_flush(conn);
+}
 
+/// Send the light state if it changed, otherwise a ping now and then
+static void http_ws_push(struct http_server_conn *conn, absolute_time_t now) {
+#if ENABLE_LIGHT
+    uint16_t pwm = light_get_pwm_level();
+#else
+    uint16_t pwm = 0;
+#endif
+    struct json_writer json;
+    assert(conn->scratch_used == 0);
+    if (pwm != conn->events.pwm) {
+        // Text frame with the header in front, like `http_json_send`
+        json_init(&json, (char *) conn->scratch + WS_MAX_HEADER, HTTP_SCRATCH_SIZE - WS_MAX_HEADER);
+        http_json_light(&json);
+        if (json.overflow)
+            return;
+        uint8_t header[WS_MAX_HEADER];
+        size_t header_len = ws_frame_header(header, WS_OP_TEXT, json.len);
+        uint8_t *start = (uint8_t *) json.buf - header_len;
+        memcpy(start, header, header_len);
+        conn->scratch_used = (uint8_t *) json.buf + json.len - conn->scratch;
+        http_conn_queue(conn, start, header_len + json.len, 1);
+        conn->events.pwm = pwm;
+    } else if (absolute_time_diff_us(now, conn->events.next_keepalive) <= 0)
+        http_ws_send(conn, WS_OP_PING, NULL, 0);
+    else
+        return;
+    conn->events.next_event = delayed_by_us(now, HTTP_EVENT_MIN_INTERVAL_MS * 1000ull);
+    conn->events.next_keepalive = delayed_by_us(now, HTTP_EVENT_KEEPALIVE_MS * 1000ull);
+    http_conn_flush(conn);
+}
+
+/// When `http_server_check_run` next has something to push
+absolute_time_t http_server_next_run(void) {
+    absolute_time_t now = get_absolute_time();
+    absolute_time_t next = at_the_end_of_time;
+    if (http_ws_pending_level >= 0)
+        return now;
+    for (size_t i = 0; i < HTTP_MAX_CONNS; ++i) {
+        const struct http_server_conn *conn = &http_conns[i];
+        // One that is still sending wakes us through the IRQ once it is done
+        if (!conn->client_pcb || conn->out_count || conn->closing)
+            continue;
+        if (conn->state != HTTP_EVENTS && conn->state != HTTP_WEBSOCKET)
+            continue;
+        // Changes before `next_event` wait for it; after it, they come from
+        // an interrupt (the button, lwIP, PPS) or from earlier in the loop,
+        // so only the keepalive needs a timer
+        if (absolute_time_diff_us(now, conn->events.next_event) > 0)
+            next = absolute_time_min(next, conn->events.next_event);
+        else
+            next = absolute_time_min(next, conn->events.next_keepalive);
+    }
+    return next;
+}
+
+void http_server_check_run(void) {
+    absolute_time_t now = get_absolute_time();
+    cyw43_arch_lwip_begin();
+    // However many levels arrived since the last pass, only the latest is
+    // applied. Taken under the lock so that none arrives in between
+    int32_t level = http_ws_pending_level;
+    http_ws_pending_level = -1;
+#if ENABLE_LIGHT
+    if (level >= 0)
+        light_dim(level / 100.f);
+#else
+    (void) level;
+#endif
+    for (size_t i = 0; i < HTTP_MAX_CONNS; ++i) {
+        struct http_server_conn *conn = &http_conns[i];
+        // A stream still sending the last batch gets the changes coalesced
+        // into the next one
+        if (!conn->client_pcb || conn->out_count || conn->closing)
+            continue;
+        if (conn->state != HTTP_EVENTS && conn->state != HTTP_WEBSOCKET)
+            continue;
+        if (absolute_time_diff_us(now, conn->events.next_event) > 0)
+            continue;
+        if (conn->state == HTTP_EVENTS)
+            http_events_push(conn, now);
+        else
+            http_ws_push(conn, now);
+    }
+    cyw43_arch_lwip_end();
+}
+
+static bool http_server_open_one(struct http_server *server, uint8_t lwip_type, const ip_addr_t *ipaddr) {
     LOG_INFO("Starting HTTP server on [%s]:%u\n", ipaddr_ntoa(ipaddr), HTTP_PORT);
 
     cyw43_arch_lwip_begin();
@@ -403,7 +1327,8 @@ static bool http_server_open_one(struct http_server *server, uint8_t lwip_type,
         return false;
     }
 
-    server->server_pcb = tcp_listen_with_backlog(pcb, 1);
+    // Let clients queue up a bit while all slots are busy
+    server->server_pcb = tcp_listen_with_backlog(pcb, HTTP_MAX_CONNS);
     if (!server->server_pcb) {
         tcp_close(pcb);
         cyw43_arch_lwip_end();
@@ -412,7 +1337,7 @@ static bool http_server_open_one(struct http_server *server, uint8_t lwip_type,
     }
 
     // Specify the payload for the callbacks
-    tcp_arg(server->server_pcb, &server->conn);
+    tcp_arg(server->server_pcb, server);
     tcp_accept(server->server_pcb, http_server_accept_cb);
     cyw43_arch_lwip_end();
 
@@ -420,7 +1345,6 @@ static bool http_server_open_one(struct http_server *server, uint8_t lwip_type,
 }
 
 static void http_server_close_one(struct http_server *server) {
-    http_conn_close(&server->conn);
     if (server->server_pcb) {
         cyw43_arch_lwip_begin();
         tcp_arg(server->server_pcb, NULL);
@@ -441,6 +1365,7 @@ static struct http_server state6;
 
 bool http_server_open(void) {
     bool success = true;
+    http_route_index_build();
 #if LWIP_IPV4
     success &= http_server_open_one(&state4, IPADDR_TYPE_V4, IP4_ADDR_ANY);
 #endif
@@ -451,6 +1376,9 @@ bool http_server_open(void) {
 }
 
 void http_server_close(void) {
+    for (uint16_t i = 0; i < HTTP_MAX_CONNS; ++i)
+        if (pool_is_used(&http_conn_pool, i))
+            http_conn_close(&http_conns[i]);
 #if LWIP_IPV4
     http_server_close_one(&state4);
 #endif
@@ -45,6 +45,7 @@
 #include "config.h"
 #include "thekit4_pico_w.h"
 #include "log.h"
+#include "ntp.h"
 
 #include <math.h>
 
@@ -138,6 +139,33 @@ void light_toggle(void) {
     LOG_INFO1("Toggling");
 }
 
+// Sometimes for some reason the RTC alarm is not triggered
+// so we constantly renew the alarm
+static bool renew_light_alarm(struct sched_task *task) {
+    datetime_t dt;
+    if (ntp_get_stratum() == 16) {
+        LOG_WARN1("No NTP sync yet, skipping light alarm");
+        return false;
+    }
+    if (!ntp_update_rtc(&dt)) {
+        LOG_WARN1("RTC not running, skipping light alarm");
+        return false;
+    }
+    LOG_INFO1("Renewing light alarm");
+    // Note that this function alters `dt`
+    light_register_next_alarm(&dt);
+    return true;
+}
+
+// Marker: static variable
+static struct sched_task light_alarm_task = {
+    .name = "light_alarm",
+    .run = renew_light_alarm,
+    .period_ms = LIGHT_RENEW_INTERVAL_MS,
+    // Retried until NTP syncs
+    .retry_ms = TASKS_RETRY_MS,
+};
+
 void light_init(void) {
     // IO
     gpio_set_function(LIGHT_PIN, GPIO_FUNC_PWM);
@@ -161,6 +189,8 @@ void light_init(void) {
 
     // SMPS feedback ADC
     adc_gpio_init(ADC_SMPS_FB_PIN);
+
+    tasks_add(&light_alarm_task, 0);
 }
 
 /// Takes a percentage perceived intensity and dim the light
@@ -3,6 +3,27 @@
 
 #include <stdio.h>
 
+#ifdef LOG_DEFERRED
+// Records go to a ring buffer and are printed from the main loop
+#include "log_ring.h"
+
+#if !defined(NDEBUG) || defined(THEKIT_DEBUG)
+#define LOG_DEBUG(...) LOG_RECORD(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_DEBUG1(str) LOG_RECORD_LITERAL(LOG_LEVEL_DEBUG, str)
+#else
+#define LOG_DEBUG(...)
+#define LOG_DEBUG1(str)
+#endif
+
+#define LOG_INFO(...) LOG_RECORD(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_INFO1(str) LOG_RECORD_LITERAL(LOG_LEVEL_INFO, str)
+
+#define LOG_WARN(...) LOG_RECORD(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_WARN1(str) LOG_RECORD_LITERAL(LOG_LEVEL_WARN, str)
+
+#define LOG_ERR(...) LOG_RECORD(LOG_LEVEL_ERR, __VA_ARGS__)
+#define LOG_ERR1(str) LOG_RECORD_LITERAL(LOG_LEVEL_ERR, str)
+#else
 #if !defined(NDEBUG) || defined(THEKIT_DEBUG)
 #define LOG_DEBUG(...) (printf)(__VA_ARGS__)
 #define LOG_DEBUG1(str) (puts)((str))
@@ -19,6 +40,7 @@
 
 #define LOG_ERR(...) (printf)("ERROR: " __VA_ARGS__)
 #define LOG_ERR1(str) (puts)(("ERROR: " str))
+#endif
 
 #define puts(_) error("puts is not allowed")
 #define printf(...) error("printf is not allowed")
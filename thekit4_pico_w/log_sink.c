@@ -0,0 +1,110 @@
+/*
+ *  log_sink.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The LOG_* macros only append to `log_ring`. This is where the records
+ * are turned into text, from the main loop: to USB stdio, and to a syslog
+ * server over UDP if LOG_SYSLOG_SERVER is set.
+ * It is the one place allowed to use stdio, so it does not include log.h.
+ */
+
+#include "config.h"
+#include "thekit4_pico_w.h"
+#include "log_ring.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/cyw43_arch.h"
+
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+#define SYSLOG_PORT 514
+// local0
+#define SYSLOG_FACILITY 16
+
+// Marker: static variable
+static uint32_t log_sink_dropped;
+// Marker: static variable
+static struct udp_pcb *log_sink_pcb;
+// Marker: static variable
+static ip_addr_t log_sink_server;
+
+void log_sink_init(void) {
+    if (!LOG_SYSLOG_SERVER[0])
+        return;
+    if (!ipaddr_aton(LOG_SYSLOG_SERVER, &log_sink_server)) {
+        LOG_RECORD_LITERAL(LOG_LEVEL_ERR, "Bad LOG_SYSLOG_SERVER");
+        return;
+    }
+    cyw43_arch_lwip_begin();
+    log_sink_pcb = udp_new_ip_type(IP_GET_TYPE(&log_sink_server));
+    cyw43_arch_lwip_end();
+    if (!log_sink_pcb)
+        LOG_RECORD_LITERAL(LOG_LEVEL_ERR, "Failed to create syslog pcb");
+}
+
+/// RFC 3164 without the timestamp, which the line already has
+static void log_sink_syslog(const char *line, uint8_t level) {
+    static const uint8_t SEVERITY[] = {7, 6, 4, 3};
+    char head[48];
+    int head_len = snprintf(head, sizeof(head), "<%u>%s: ",
+                            SYSLOG_FACILITY * 8 + SEVERITY[level & 3], HOSTNAME);
+    if (head_len < 0)
+        return;
+    if ((size_t) head_len >= sizeof(head))
+        head_len = sizeof(head) - 1;
+    size_t line_len = strlen(line);
+    cyw43_arch_lwip_begin();
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, head_len + line_len, PBUF_RAM);
+    if (p) {
+        memcpy(p->payload, head, head_len);
+        memcpy((char *) p->payload + head_len, line, line_len);
+        // Best effort, like any syslog over UDP
+        udp_sendto(log_sink_pcb, p, &log_sink_server, SYSLOG_PORT);
+        pbuf_free(p);
+    }
+    cyw43_arch_lwip_end();
+}
+
+static void log_sink_emit(const char *line, uint8_t level) {
+    fputs(line, stdout);
+    putchar('\n');
+    if (log_sink_pcb)
+        log_sink_syslog(line, level);
+}
+
+/// Now if the last run left lines behind
+absolute_time_t log_sink_next_run(void) {
+    return log_ring_empty() ? at_the_end_of_time : get_absolute_time();
+}
+
+void log_sink_check_run(void) {
+    char line[LOG_LINE_MAX];
+    uint8_t level;
+    uint32_t dropped = log_ring_dropped();
+    if (dropped != log_sink_dropped) {
+        snprintf(line, sizeof(line), "WARNING: %lu log records dropped",
+                 (unsigned long) (dropped - log_sink_dropped));
+        log_sink_dropped = dropped;
+        log_sink_emit(line, LOG_LEVEL_WARN);
+    }
+    // A bounded batch, so that a burst does not hold up the main loop
+    for (uint8_t i = 0; i < LOG_DRAIN_MAX && log_ring_pop(line, sizeof(line), &level); ++i)
+        log_sink_emit(line, level);
+}
@@ -16,8 +16,10 @@
 #define MEM_ALIGNMENT               4
 #define MEM_SIZE                    4000
 #define MEMP_NUM_TCP_SEG            32
-#define MEMP_NUM_TCP_PCB            (2 * LWIP_IPV6 + 2 * LWIP_IPV4 + 4)
-#define MEMP_NUM_UDP_PCB            (LWIP_IPV6 + LWIP_IPV4 + 2 + 2)
+// HTTP_MAX_CONNS clients, the outgoing tasks and a few in TIME_WAIT
+#define MEMP_NUM_TCP_PCB            (2 * LWIP_IPV6 + 2 * LWIP_IPV4 + 4 + 4)
+#define TCP_LISTEN_BACKLOG          1
+#define MEMP_NUM_UDP_PCB            (LWIP_IPV6 + LWIP_IPV4 + 2 + 2 + 2 + 1)
 #define MEMP_NUM_ARP_QUEUE          10
 #define MEMP_NUM_SYS_TIMEOUT        14
 #define PBUF_POOL_SIZE              12
@@ -33,10 +35,10 @@
 #define LWIP_NETIF_LINK_CALLBACK    1
 #define LWIP_NETIF_HOSTNAME         1
 #define LWIP_NETCONN                0
-#define MEM_STATS                   0
+#define MEM_STATS                   1
 #define SYS_STATS                   0
-#define MEMP_STATS                  0
-#define LINK_STATS                  0
+#define MEMP_STATS                  1
+#define LINK_STATS                  1
 // #define ETH_PAD_SIZE                2
 #define LWIP_AUTOIP                 0
 #define LWIP_CHKSUM_ALGORITHM       3
@@ -54,11 +56,12 @@
 #define DHCP_DOES_ARP_CHECK         0
 #define LWIP_DHCP_DOES_ACD_CHECK    0
 #define LWIP_NUM_NETIF_CLIENT_DATA  (LWIP_MDNS_RESPONDER)
+// Exported on /metrics
+#define LWIP_STATS                  1
 
 #ifndef NDEBUG
 #define LWIP_NOASSERT               0
 #define LWIP_DEBUG                  1
-#define LWIP_STATS                  1
 #define LWIP_STATS_DISPLAY          1
 #else
 #define LWIP_NOASSERT               1
@@ -0,0 +1,343 @@
+/*
+ *  metrics.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Everything /metrics exports. Subsystems only bump the counters defined
+ * here (or next to them, for code shared with pico_ethntp); the list of
+ * what gets exported and under which name lives in `metrics_parts`.
+ */
+
+#include "config.h"
+#include "thekit4_pico_w.h"
+#include "ntp.h"
+
+#include <stdio.h>
+
+#include "pico/time.h"
+
+#include "lwip/memp.h"
+#include "lwip/stats.h"
+
+// Marker: static variable
+struct metric_counter metrics_http_requests;
+// Marker: static variable
+struct metric_counter metrics_http_bad_requests;
+// Marker: static variable
+struct metric_counter metrics_http_rejected;
+// Marker: static variable
+struct metric_counter metrics_watchdog_feeds;
+// Marker: static variable
+// From the first byte of a request until its response is queued, in us
+METRIC_HISTOGRAM(metrics_http_duration, 6, 1000, 5000, 10000, 50000, 100000, 500000, 1000000);
+
+/// `key="value"` for `metrics_sample`
+static const char *metrics_label(char *buf, size_t size, const char *key, const char *value) {
+    snprintf(buf, size, "%s=\"%s\"", key, value);
+    return buf;
+}
+
+#if LWIP_STATS
+#if MEMP_STATS
+static const char *const memp_names[] = {
+#define LWIP_MEMPOOL(name, num, size, desc) #name,
+#include "lwip/priv/memp_std.h"
+};
+#endif
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} metrics_mem_families[] = {
+    {"lwip_mem_used", "gauge", "lwIP heap bytes or pool entries in use"},
+    {"lwip_mem_max", "gauge", "lwIP heap or pool high-water mark"},
+    {"lwip_mem_avail", "gauge", "lwIP heap or pool size"},
+    {"lwip_mem_errors_total", "counter", "lwIP failed allocations"},
+}, metrics_proto_families[] = {
+    {"lwip_xmit_total", "counter", "lwIP packets sent"},
+    {"lwip_recv_total", "counter", "lwIP packets received"},
+    {"lwip_drop_total", "counter", "lwIP packets dropped"},
+    {"lwip_errors_total", "counter", "lwIP checksum, length, memory, routing and protocol errors"},
+};
+
+/// Field `family` (an index into `metrics_mem_families`) of `mem`
+static uint32_t metrics_mem_field(const struct stats_mem *mem, size_t family) {
+    switch (family) {
+    case 0:
+        return mem->used;
+    case 1:
+        return mem->max;
+    case 2:
+        return mem->avail;
+    default:
+        return mem->err;
+    }
+}
+
+/// Field `family` (an index into `metrics_proto_families`) of `stats`
+static uint32_t metrics_proto_field(const struct stats_proto *stats, size_t family) {
+    switch (family) {
+    case 0:
+        return stats->xmit;
+    case 1:
+        return stats->recv;
+    case 2:
+        return stats->drop;
+    default:
+        return stats->chkerr + stats->lenerr + stats->memerr + stats->rterr
+               + stats->proterr + stats->opterr + stats->err;
+    }
+}
+
+/// Heap and pools (the pbuf pool is PBUF_POOL), one family per item
+static bool metrics_write_lwip_mem(struct metrics_writer *writer, uint32_t family) {
+    char label[32];
+    if (family >= sizeof(metrics_mem_families) / sizeof(metrics_mem_families[0]))
+        return false;
+    const char *name = metrics_mem_families[family].name;
+    metrics_family(writer, name, metrics_mem_families[family].type, metrics_mem_families[family].help);
+#if MEM_STATS
+    metrics_sample(writer, name, metrics_label(label, sizeof(label), "pool", "HEAP"),
+                   metrics_mem_field(&lwip_stats.mem, family), 0);
+#endif
+#if MEMP_STATS
+    for (size_t i = 0; i < MEMP_MAX; ++i)
+        metrics_sample(writer, name, metrics_label(label, sizeof(label), "pool", memp_names[i]),
+                       metrics_mem_field(lwip_stats.memp[i], family), 0);
+#endif
+    return true;
+}
+
+/// Per-protocol packets, one family per item
+static bool metrics_write_lwip_proto(struct metrics_writer *writer, uint32_t family) {
+    static const struct {
+        const char *name;
+        const struct stats_proto *stats;
+    } protos[] = {
+#if LINK_STATS
+        {"link", &lwip_stats.link},
+#endif
+#if ETHARP_STATS
+        {"etharp", &lwip_stats.etharp},
+#endif
+#if IP_STATS
+        {"ip", &lwip_stats.ip},
+#endif
+#if ICMP_STATS
+        {"icmp", &lwip_stats.icmp},
+#endif
+#if UDP_STATS
+        {"udp", &lwip_stats.udp},
+#endif
+#if TCP_STATS
+        {"tcp", &lwip_stats.tcp},
+#endif
+    };
+    char label[32];
+    if (family >= sizeof(metrics_proto_families) / sizeof(metrics_proto_families[0]))
+        return false;
+    const char *name = metrics_proto_families[family].name;
+    metrics_family(writer, name, metrics_proto_families[family].type, metrics_proto_families[family].help);
+    for (size_t i = 0; i < sizeof(protos) / sizeof(protos[0]); ++i)
+        metrics_sample(writer, name, metrics_label(label, sizeof(label), "proto", protos[i].name),
+                       metrics_proto_field(protos[i].stats, family), 0);
+    return true;
+}
+#endif
+
+/// Main loop stage timings from profiler.c: a histogram per stage, then
+/// the maxima and the overruns
+static bool metrics_write_loop(struct metrics_writer *writer, uint32_t i) {
+    char label[48];
+    if (i < LOOP_N_STAGES) {
+        if (i == 0)
+            metrics_family(writer, "loop_stage_duration_seconds", "histogram", "Main loop stage run time");
+        metrics_histogram_samples(writer, "loop_stage_duration_seconds",
+                                  metrics_label(label, sizeof(label), "stage", profiler_get(i)->name),
+                                  &profiler_get(i)->duration);
+    } else if (i == LOOP_N_STAGES) {
+        metrics_family(writer, "loop_stage_max_seconds", "gauge", "Longest main loop stage run");
+        for (uint8_t stage = 0; stage < LOOP_N_STAGES; ++stage)
+            metrics_sample(writer, "loop_stage_max_seconds",
+                           metrics_label(label, sizeof(label), "stage", profiler_get(stage)->name),
+                           profiler_get(stage)->max_us, 6);
+    } else if (i == LOOP_N_STAGES + 1) {
+        metrics_family(writer, "loop_stage_overruns_total", "counter", "Main loop stage runs over budget");
+        for (uint8_t stage = 0; stage < LOOP_N_STAGES; ++stage)
+            metrics_sample(writer, "loop_stage_overruns_total",
+                           metrics_label(label, sizeof(label), "stage", profiler_get(stage)->name),
+                           profiler_get(stage)->overruns.value, 0);
+    } else
+        return false;
+    return true;
+}
+
+/// Object pools: use, high-water mark and how often they ran out, one
+/// family per item
+static bool metrics_write_pools(struct metrics_writer *writer, uint32_t family) {
+    static const struct pool *const pools[] = {&http_conn_pool, &http_client_pool};
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+    } families[] = {
+        {"pool_in_use", "gauge", "Pool objects handed out"},
+        {"pool_high_water", "gauge", "Most pool objects ever handed out at once"},
+        {"pool_size", "gauge", "Pool objects in total"},
+        {"pool_exhausted_total", "counter", "Allocations from an empty pool"},
+    };
+    char label[48];
+    if (family >= sizeof(families) / sizeof(families[0]))
+        return false;
+    metrics_family(writer, families[family].name, families[family].type, families[family].help);
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); ++i) {
+        const struct pool *pool = pools[i];
+        uint32_t values[] = {pool->in_use, pool->high_water, pool->n_blocks, pool->exhausted};
+        metrics_sample(writer, families[family].name, metrics_label(label, sizeof(label), "pool", pool->name),
+                       values[family], 0);
+    }
+    return true;
+}
+
+/// Runs and failures of each scheduled task
+static bool metrics_write_tasks(struct metrics_writer *writer, uint32_t i) {
+    char label[48];
+    if (i == 0) {
+        metrics_family(writer, "task_runs_total", "counter", "Scheduled task runs");
+        for (uint8_t task = 0; task < sched_count(); ++task)
+            metrics_sample(writer, "task_runs_total",
+                           metrics_label(label, sizeof(label), "task", sched_get(task)->name),
+                           sched_get(task)->runs, 0);
+    } else if (i == 1) {
+        metrics_family(writer, "task_failures_total", "counter", "Scheduled task runs that failed");
+        for (uint8_t task = 0; task < sched_count(); ++task)
+            metrics_sample(writer, "task_failures_total",
+                           metrics_label(label, sizeof(label), "task", sched_get(task)->name),
+                           sched_get(task)->failures, 0);
+    } else
+        return false;
+    return true;
+}
+
+/// Uploads and backlog of each configured telemetry sink, one family per
+/// item
+static bool metrics_write_uplinks(struct metrics_writer *writer, uint32_t family) {
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+    } families[] = {
+        {"uplink_uploads_total", "counter", "Telemetry batches the sink got through"},
+        {"uplink_pending_samples", "gauge", "Telemetry samples waiting for the sink"},
+        {"uplink_lost_samples_total", "counter", "Telemetry samples overwritten before the sink sent them"},
+    };
+    char label[48];
+    struct uplink_stats stats;
+    if (family >= sizeof(families) / sizeof(families[0]))
+        return false;
+    metrics_family(writer, families[family].name, families[family].type, families[family].help);
+    for (uint8_t i = 0; uplink_get_stats(i, &stats); ++i) {
+        if (!stats.enabled)
+            continue;
+        uint32_t values[] = {stats.uploads, stats.pending, stats.lost};
+        metrics_sample(writer, families[family].name, metrics_label(label, sizeof(label), "sink", stats.name),
+                       values[family], 0);
+    }
+    return true;
+}
+
+/// What the flash spool has done
+static bool metrics_write_spool(struct metrics_writer *writer, uint32_t i) {
+    struct spool_stats stats;
+    if (i != 0)
+        return false;
+    spool_get_stats(&stats);
+    metrics_counter(writer, "spool_records_total", "Telemetry records moved to flash", stats.spooled);
+    metrics_counter(writer, "spool_replayed_records_total", "Telemetry records put back for upload",
+                    stats.replayed);
+    metrics_counter(writer, "spool_blocks_written_total", "Telemetry blocks written to flash",
+                    stats.blocks_written);
+    metrics_counter(writer, "spool_blocks_lost_total", "Telemetry blocks overwritten before upload",
+                    stats.blocks_lost);
+    metrics_gauge(writer, "spool_blocks_waiting", "Telemetry blocks in flash yet to be uploaded",
+                  stats.blocks_waiting, 0);
+    return true;
+}
+
+/// Families without labels: the system and HTTP, then time, then sensors
+static bool metrics_write_basic(struct metrics_writer *writer, uint32_t i) {
+    const struct sensors_snapshot *snap = sensors_get();
+    switch (i) {
+    case 0:
+        metrics_gauge(writer, "uptime_seconds", "Time since boot",
+                      to_us_since_boot(get_absolute_time()), 6);
+        metrics_counter(writer, "watchdog_feeds_total", "Watchdog updates", metrics_watchdog_feeds.value);
+        metrics_counter(writer, "http_requests_total", "HTTP requests answered", metrics_http_requests.value);
+        metrics_counter(writer, "http_bad_requests_total", "HTTP requests that failed to parse",
+                        metrics_http_bad_requests.value);
+        metrics_counter(writer, "http_rejected_total", "HTTP connections turned away for want of a slot",
+                        metrics_http_rejected.value);
+        metrics_histogram(writer, "http_request_duration_seconds", "HTTP request first byte to response queued",
+                          &metrics_http_duration);
+        return true;
+    case 1:
+        metrics_counter(writer, "ntp_server_requests_total", "NTP requests answered", ntp_server_requests.value);
+        metrics_counter(writer, "ntp_server_bad_requests_total", "NTP requests not answered",
+                        ntp_server_bad_requests.value);
+        metrics_gauge(writer, "ntp_stratum", "Current NTP stratum", ntp_get_stratum(), 0);
+        metrics_gauge(writer, "ntp_frequency_ppb", "Clock frequency correction", ntp_get_freq_ppb(), 0);
+#if ENABLE_GPS
+        uint32_t sentences, bad_sentences;
+        gps_get_sentence_counts(&sentences, &bad_sentences);
+        metrics_counter(writer, "gps_sentences_total", "NMEA sentences parsed", sentences);
+        metrics_counter(writer, "gps_bad_sentences_total", "NMEA sentences that failed to parse", bad_sentences);
+        metrics_gauge(writer, "gps_satellites", "Satellites used in the fix", gps_get_sat_num(), 0);
+#endif
+        return true;
+    case 2:
+        metrics_gauge_float(writer, "core_temperature_celsius", "RP2040 temperature", snap->core_temperature, 2);
+#if ENABLE_TEMPERATURE_SENSOR
+        metrics_gauge_float(writer, "temperature_celsius", "BMP280 temperature", snap->temperature, 2);
+        metrics_gauge(writer, "pressure_pascals", "BMP280 pressure", snap->pressure, 0);
+#endif
+#if ENABLE_LIGHT
+        metrics_gauge(writer, "light_pwm_level", "Light PWM level", light_get_pwm_level(), 0);
+        metrics_gauge_float(writer, "light_smps_volts", "Light SMPS output", snap->light_voltage, 3);
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Each item must fit in an empty HTTP_METRICS_SIZE on its own
+static const metrics_part_fn metrics_parts[] = {
+    metrics_write_basic,
+    metrics_write_loop,
+    metrics_write_tasks,
+    metrics_write_pools,
+    metrics_write_uplinks,
+    metrics_write_spool,
+#if LWIP_STATS
+    metrics_write_lwip_mem,
+    metrics_write_lwip_proto,
+#endif
+};
+
+bool metrics_write_next(struct metrics_writer *writer, uint32_t *pos) {
+    return metrics_write_parts(writer, metrics_parts, sizeof(metrics_parts) / sizeof(metrics_parts[0]), pos);
+}
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+#
+#  mkassets.py
+#
+#  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#
+
+"""Bundle the static files served by http_server.c into a C header.
+
+Usage: mkassets.py OUTPUT [PATH CONTENT-TYPE CACHE-CONTROL FILE]...
+
+Each file is minified (whitespace only), gzipped and emitted together with
+its response headers and a strong ETag, so the server only has to pick an
+entry and write it out. A FILE ending in .h is read as a sequence of C string
+literals, like dashboard.h, which thekitd3.c includes directly.
+"""
+
+import gzip
+import hashlib
+import re
+import sys
+
+C_STRING = re.compile(r'"((?:[^"\\\n]|\\.)*)"')
+C_ESCAPES = {"n": "\n", "t": "\t", "r": "\r", '"': '"', "\\": "\\", "'": "'"}
+
+
+def read_c_strings(text):
+    """Concatenate all C string literals in `text`."""
+    out = []
+    for literal in C_STRING.findall(text):
+        out.append(re.sub(r"\\(.)", lambda m: C_ESCAPES[m.group(1)], literal))
+    return "".join(out)
+
+
+def minify(text):
+    """Collapse whitespace runs, which is safe for the dashboard's HTML, CSS
+    and JS (no <pre> and no string literals with repeated spaces)."""
+    return re.sub(r"\s+", " ", text).strip()
+
+
+def c_bytes(data):
+    lines = []
+    for i in range(0, len(data), 16):
+        lines.append("    " + " ".join(f"0x{b:02x}," for b in data[i:i + 16]))
+    return "\n".join(lines)
+
+
+def c_string(text):
+    return '"' + text.replace("\\", "\\\\").replace('"', '\\"').replace("\r", "\\r").replace("\n", "\\n") + '"'
+
+
+def main(argv):
+    if len(argv) < 2 or (len(argv) - 2) % 4 != 0:
+        sys.exit(__doc__)
+    output = argv[1]
+    out = [
+        "// Generated by mkassets.py, do not edit",
+        "// Included by http_server.c after `struct http_asset` is defined",
+        "",
+    ]
+    entries = []
+    for n, i in enumerate(range(2, len(argv), 4)):
+        path, content_type, cache_control, filename = argv[i:i + 4]
+        with open(filename, encoding="utf-8") as f:
+            text = f.read()
+        if filename.endswith(".h"):
+            text = read_c_strings(text)
+        raw = minify(text).encode("utf-8")
+        # mtime=0 so that the output (and the ETag) only depends on the content
+        body = gzip.compress(raw, compresslevel=9, mtime=0)
+        etag = '"' + hashlib.sha256(body).hexdigest()[:16] + '"'
+        # Everything after the status line and the Connection header
+        head_200 = (f"\r\nContent-Type: {content_type}\r\n"
+                    "Content-Encoding: gzip\r\n"
+                    f"Content-Length: {len(body)}\r\n"
+                    f"ETag: {etag}\r\n"
+                    f"Cache-Control: {cache_control}\r\n\r\n")
+        head_304 = (f"\r\nETag: {etag}\r\n"
+                    f"Cache-Control: {cache_control}\r\n\r\n")
+        out.append(f"// {path}: {filename}, {len(text)} -> {len(raw)} -> {len(body)} bytes")
+        out.append(f"static const uint8_t http_asset{n}_body[] = {{")
+        out.append(c_bytes(body))
+        out.append("};")
+        out.append("")
+        entries.append(
+            f"    {{{c_string(path)}, {c_string(etag)},\n"
+            f"     {c_string(head_200)},\n"
+            f"     {c_string(head_304)},\n"
+            f"     http_asset{n}_body, sizeof(http_asset{n}_body)}},")
+    out.append("static const struct http_asset http_assets[] = {")
+    out.extend(entries)
+    out.append("};")
+    out.append("")
+    with open(output, "w", encoding="utf-8") as f:
+        f.write("\n".join(out))
+
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -31,6 +31,8 @@
 #include "lwip/ip_addr.h"
 #include "lwip/pbuf.h"
 
+#include "metrics.h"
+
 // The endianess of this structure is flexible
 struct ntp_message {
     /// Leap indicator, version number, mode
@@ -58,6 +60,34 @@ struct ntp_client {
     // If `in_progress` is true, this is the time when the request will be
     // considered lost.
     absolute_time_t deadline;
+    // What the upstream server looked like last time, to compare peers against
+    uint8_t upstream_stratum;
+    int64_t upstream_delay_us;
+};
+
+// Another kit we are in symmetric active mode with
+struct ntp_peer {
+    const char *hostname;
+    ip_addr_t address;
+    struct udp_pcb *pcb;
+    bool in_progress;
+    // Sync the clock to the reply of this poll
+    bool apply;
+    absolute_time_t deadline;
+    absolute_time_t next_poll;
+    // Transmit timestamp of our last poll in host byte order, to match the reply
+    uint32_t xmt_sec;
+    uint32_t xmt_frac;
+    // The last 8 polls, LSB is the latest, set if it was answered
+    uint8_t reach;
+    // The rest comes from the last reply
+    uint8_t stratum;
+    // The peer is synchronized to us
+    bool loop;
+    // Time since the peer itself was last synchronized
+    int64_t sync_age_us;
+    int64_t offset_us;
+    int64_t delay_us;
 };
 
 static const uint16_t NTP_MSG_LEN = sizeof(struct ntp_message);
@@ -69,16 +99,32 @@ static const uint8_t NTP_VERSION = 4;
 static const uint8_t NTP_VERSION_OK = 3;
 // "GPS\0" in host byte order
 static const uint32_t NTP_REF_GPS = 0x00535047;
+// Modes in the lower 3 bits of `flags`
+static const uint8_t NTP_MODE_SYMMETRIC_ACTIVE = 1;
+static const uint8_t NTP_MODE_SYMMETRIC_PASSIVE = 2;
+static const uint8_t NTP_MODE_CLIENT = 3;
+static const uint8_t NTP_MODE_SERVER = 4;
+// Don't sync to a peer that hasn't been synchronized itself for this long
+static const int64_t NTP_PEER_MAX_SYNC_AGE_US = 10LL * 60 * 1000 * 1000;
+// How often the clock is saved for `ntp_persist_init`
+static const int32_t NTP_SAVE_INTERVAL_MS = 100;
+// Don't restore a clock that has been free-running for longer than this
+static const uint64_t NTP_RESTORE_MAX_AGE_US = 24ULL * 3600 * 1000 * 1000;
 
 // ntp_common.c
 uint8_t ntp_get_stratum(void);
 uint32_t ntp_get_ref(void);
 absolute_time_t ntp_get_last_sync(void);
+int32_t ntp_get_freq_ppb(void);
 
 void ntp_update_time(uint64_t now, uint8_t stratum, uint32_t ref);
 void ntp_update_time_by_offset(int64_t offset, uint8_t stratum, uint32_t ref);
+/// Drop syncs while `hold`, around something that masks interrupts for
+/// long (flash writes), as the timestamps would be late by that much
+void ntp_hold_updates(bool hold);
 uint64_t ntp_get_utc_us(void);
 bool ntp_update_rtc(datetime_t *dt);
+bool ntp_persist_init(void);
 
 void unix_to_local_datetime(time_t result, datetime_t *dt);
 uint32_t ntp_make_ref(const ip_addr_t *addr);
@@ -88,8 +134,11 @@ void ntp_dump_debug(const struct ntp_message *msg);
 // ntp_client.c
 bool ntp_client_init(struct ntp_client *state);
 void ntp_client_check_run(struct ntp_client *state);
+absolute_time_t ntp_client_next_run(const struct ntp_client *state);
 
 // ntp_server.c
+extern struct metric_counter ntp_server_requests;
+extern struct metric_counter ntp_server_bad_requests;
 bool ntp_server_open(void);
 
 #endif
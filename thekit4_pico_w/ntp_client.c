@@ -32,10 +32,16 @@
 #include "pico/stdlib.h"
 
 #include "lwip/dns.h"
+#include "lwip/ip.h"
 #include "lwip/pbuf.h"
 #include "lwip/udp.h"
 
 #if ENABLE_NTP
+#define NTP_N_PEERS (sizeof(NTP_PEERS) / sizeof(NTP_PEERS[0]))
+
+// Marker: static variable
+static struct ntp_peer ntp_peers[NTP_N_PEERS];
+
 /// Fill the current time into `tx_ts_*`, in network byte order.
 /// Call this as close to sending the request as possible.
 static void ntp_fill_tx(struct ntp_message *outgoing) {
@@ -56,11 +62,23 @@ static void ntp_fill_rx_as_ref(struct ntp_message *incoming) {
     incoming->ref_ts_frac = (uint32_t) ((now_uspart << 26) / 15625);
 }
 
+/// NTP timestamp in host byte order to microseconds since the NTP epoch
+static int64_t ntp_ts_to_us(uint32_t sec, uint32_t frac) {
+    return (int64_t) sec * 1000000 + (((uint64_t) frac * 15625) >> 26);
+}
+
+/// Whether it is time to synchronize the clock again
+static bool ntp_sync_due(void) {
+    // if unlikely(just booted), sync
+    return absolute_time_diff_us(ntp_get_last_sync(), get_absolute_time()) >= (int64_t) NTP_INTERVAL_US
+        || !absolute_time_diff_us(nil_time, ntp_get_last_sync());
+}
+
 /// Process an incoming NTP response and update the clock
 /// `incoming` should have been modified before calling this function such that:
 /// - Fields are in host byte order
 /// - `ref_ts` should be replaced with the time the server received the request (from `ntp_fill_rx_as_ref`)
-static void ntp_process_response(const struct ntp_message *incoming, uint32_t ref) {
+static void ntp_process_response(struct ntp_client *state, const struct ntp_message *incoming, uint32_t ref) {
     uint32_t t1s = incoming->orig_ts_sec;
     uint32_t t2s = incoming->rx_ts_sec;
     uint32_t t3s = incoming->tx_ts_sec;
@@ -69,6 +87,10 @@ static void ntp_process_response(const struct ntp_message *incoming, uint32_t re
     uint32_t t2f = incoming->rx_ts_frac;
     uint32_t t3f = incoming->tx_ts_frac;
     uint32_t t4f = incoming->ref_ts_frac;
+    // Remembered for peer selection
+    state->upstream_stratum = incoming->stratum;
+    state->upstream_delay_us = (ntp_ts_to_us(t4s, t4f) - ntp_ts_to_us(t1s, t1f))
+        - (ntp_ts_to_us(t3s, t3f) - ntp_ts_to_us(t2s, t2f));
     // RFC 5905 calculation
     // Since we use a `uint64_t` to keep the microseconds, we can completely eliminate floating
     // point operations
@@ -130,11 +152,11 @@ static void ntp_recv_cb(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip
     ntp_dump_debug(&incoming);
     uint8_t mode = incoming.flags & 0x7;
     uint8_t version = (incoming.flags >> 3) & 0x7;
-    if (incoming.stratum == 0 || mode != 0x4 || version < NTP_VERSION_OK) {
+    if (incoming.stratum == 0 || mode != NTP_MODE_SERVER || version < NTP_VERSION_OK) {
         LOG_ERR1("Invalid or unsupported NTP response");
         goto bad;
     }
-    ntp_process_response(&incoming, ntp_make_ref(addr));
+    ntp_process_response(state, &incoming, ntp_make_ref(addr));
 bad:
     ntp_req_close(state);
     pbuf_free(p);
@@ -171,7 +193,7 @@ static void do_send_ntp_request(const char *_hostname, const ip_addr_t *ipaddr,
     // This struct should use network byte order
     struct ntp_message *outgoing = (struct ntp_message *) p->payload;
     memset(outgoing, 0, NTP_MSG_LEN);
-    outgoing->flags = (NTP_VERSION << 3) | 0x3; // client mode
+    outgoing->flags = (NTP_VERSION << 3) | NTP_MODE_CLIENT;
     ntp_fill_tx(outgoing);
     udp_sendto(state->pcb, p, &state->server_address, NTP_PORT);
     pbuf_free(p);
@@ -180,6 +202,200 @@ static void do_send_ntp_request(const char *_hostname, const ip_addr_t *ipaddr,
 #endif
 }
 
+/// Close this poll. `answered` goes into the reachability register
+static void ntp_peer_close(struct ntp_peer *peer, bool answered) {
+    if (peer->pcb) {
+#ifdef PICO_CYW43_SUPPORTED
+        cyw43_arch_lwip_begin();
+#endif
+        udp_remove(peer->pcb);
+#ifdef PICO_CYW43_SUPPORTED
+        cyw43_arch_lwip_end();
+#endif
+        peer->pcb = NULL;
+    }
+    peer->reach = (peer->reach << 1) | answered;
+    peer->in_progress = false;
+    peer->apply = false;
+    if (!answered) {
+        // Back off from a quick retry to the usual interval as polls keep
+        // failing in a row
+        uint8_t missed = 1;
+        while (missed < 8 && !(peer->reach >> missed & 1))
+            ++missed;
+        uint32_t delay_ms = NTP_PEER_RETRY_MS << (missed - 1);
+        peer->next_poll = make_timeout_time_ms(delay_ms < NTP_PEER_INTERVAL_MS ? delay_ms : NTP_PEER_INTERVAL_MS);
+    }
+}
+
+/// Whether the last reply from this peer is good enough to sync to
+static bool ntp_peer_sample_ok(const struct ntp_peer *peer) {
+    return peer->stratum < 16 && !peer->loop && peer->sync_age_us <= NTP_PEER_MAX_SYNC_AGE_US;
+}
+
+/// Pick a peer to sync to instead of the upstream server, if any is better.
+/// Lower stratum wins, then lower delay
+static struct ntp_peer *ntp_select_peer(const struct ntp_client *state) {
+    struct ntp_peer *best = NULL;
+    for (size_t i = 0; i < NTP_N_PEERS; ++i) {
+        struct ntp_peer *peer = &ntp_peers[i];
+        // Ride out a single lost packet
+        if (!(peer->reach & 0x3) || !ntp_peer_sample_ok(peer))
+            continue;
+        if (!best || peer->stratum < best->stratum
+                || (peer->stratum == best->stratum && peer->delay_us < best->delay_us))
+            best = peer;
+    }
+    if (best && (best->stratum < state->upstream_stratum
+            || (best->stratum == state->upstream_stratum && best->delay_us < state->upstream_delay_us)))
+        return best;
+    return NULL;
+}
+
+// NTP peer data received callback
+static void ntp_peer_recv_cb(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+    struct ntp_peer *peer = (struct ntp_peer *)arg;
+    // This struct should use host byte order
+    struct ntp_message incoming;
+    bool answered = false;
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_check();
+#endif
+    if (!ip_addr_cmp(addr, &peer->address) || port != NTP_PORT) {
+        LOG_ERR1("Invalid NTP peer response");
+        goto bad;
+    }
+    if (!ntp_from_pbuf(p, &incoming)) {
+        LOG_ERR1("Failed to copy NTP peer response");
+        goto bad;
+    }
+    // When the peer itself was last synchronized, before it's replaced with T4
+    uint32_t peer_ref_sec = incoming.ref_ts_sec;
+    uint32_t peer_ref_frac = incoming.ref_ts_frac;
+    ntp_fill_rx_as_ref(&incoming);
+    ntp_dump_debug(&incoming);
+    uint8_t mode = incoming.flags & 0x7;
+    uint8_t version = (incoming.flags >> 3) & 0x7;
+    if (incoming.stratum == 0 || mode != NTP_MODE_SYMMETRIC_PASSIVE || version < NTP_VERSION_OK) {
+        LOG_ERR1("Invalid or unsupported NTP peer response");
+        goto bad;
+    }
+    if (incoming.orig_ts_sec != peer->xmt_sec || incoming.orig_ts_frac != peer->xmt_frac) {
+        LOG_ERR1("NTP peer response does not match our poll");
+        goto bad;
+    }
+    int64_t t1 = ntp_ts_to_us(incoming.orig_ts_sec, incoming.orig_ts_frac);
+    int64_t t2 = ntp_ts_to_us(incoming.rx_ts_sec, incoming.rx_ts_frac);
+    int64_t t3 = ntp_ts_to_us(incoming.tx_ts_sec, incoming.tx_ts_frac);
+    int64_t t4 = ntp_ts_to_us(incoming.ref_ts_sec, incoming.ref_ts_frac);
+    peer->stratum = incoming.stratum;
+    peer->offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+    peer->delay_us = (t4 - t1) - (t3 - t2);
+    peer->sync_age_us = peer_ref_sec
+        ? t3 - ntp_ts_to_us(peer_ref_sec, peer_ref_frac)
+        : INT64_MAX;
+    // Reference ID is kept in network byte order like `ntp_make_ref`
+    peer->loop = lwip_htonl(incoming.ref_id) == ntp_make_ref(ip_current_dest_addr());
+    answered = true;
+    LOG_INFO("NTP peer %s: stratum %u, offset = %" PRId64 ", delay = %" PRId64 "\n",
+             peer->hostname, peer->stratum, peer->offset_us, peer->delay_us);
+    // GPS might have come back while we were waiting
+    if (peer->apply && ntp_sync_due() && ntp_peer_sample_ok(peer))
+        ntp_update_time_by_offset(peer->offset_us, peer->stratum, ntp_make_ref(addr));
+bad:
+    ntp_peer_close(peer, answered);
+    pbuf_free(p);
+}
+
+// Make an NTP poll to a peer
+static void do_send_peer_request(const char *_hostname, const ip_addr_t *ipaddr, void *arg) {
+    struct ntp_peer *peer = (struct ntp_peer *)arg;
+    // The answer came after the poll timed out, or it is already sent
+    if (!peer->in_progress || peer->pcb)
+        return;
+    if (ipaddr) {
+        peer->address = *ipaddr;
+        LOG_DEBUG("NTP peer address %s\n", ipaddr_ntoa(ipaddr));
+    } else {
+        LOG_ERR1("NTP peer DNS request failed");
+        ntp_peer_close(peer, false);
+        return;
+    }
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_begin();
+#endif
+    peer->pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (!peer->pcb) {
+#ifdef PICO_CYW43_SUPPORTED
+        cyw43_arch_lwip_end();
+#endif
+        LOG_ERR1("Failed to create pcb");
+        ntp_peer_close(peer, false);
+        return;
+    }
+    udp_recv(peer->pcb, ntp_peer_recv_cb, peer);
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, NTP_MSG_LEN, PBUF_RAM);
+    if (!p) {
+#ifdef PICO_CYW43_SUPPORTED
+        cyw43_arch_lwip_end();
+#endif
+        LOG_ERR1("Failed to allocate pbuf");
+        ntp_peer_close(peer, false);
+        return;
+    }
+    // This struct should use network byte order
+    struct ntp_message *outgoing = (struct ntp_message *) p->payload;
+    memset(outgoing, 0, NTP_MSG_LEN);
+    outgoing->flags = (NTP_VERSION << 3) | NTP_MODE_SYMMETRIC_ACTIVE;
+    // Let the peer see where we are so that it doesn't sync to us in a loop
+    outgoing->stratum = ntp_get_stratum();
+    outgoing->ref_id = ntp_get_ref();
+    ntp_fill_tx(outgoing);
+    peer->xmt_sec = lwip_ntohl(outgoing->tx_ts_sec);
+    peer->xmt_frac = lwip_ntohl(outgoing->tx_ts_frac);
+    udp_sendto(peer->pcb, p, &peer->address, NTP_PORT);
+    pbuf_free(p);
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_end();
+#endif
+}
+
+/// Poll a peer. If `apply`, sync to it if the reply is good
+static void ntp_peer_poll(struct ntp_peer *peer, bool apply) {
+    peer->deadline = make_timeout_time_ms(NTP_UDP_TIMEOUT_TIME_MS);
+    peer->next_poll = make_timeout_time_ms(NTP_PEER_INTERVAL_MS);
+    peer->apply = apply;
+    peer->in_progress = true;
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_begin();
+#endif
+    int err = dns_gethostbyname(peer->hostname, &peer->address, do_send_peer_request, peer);
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_end();
+#endif
+
+    if (err == ERR_OK) {
+        // Cached result
+        do_send_peer_request(peer->hostname, &peer->address, peer);
+    } else if (err != ERR_INPROGRESS) { // ERR_INPROGRESS means expect a callback
+        LOG_ERR1("DNS request for NTP peer failed");
+        ntp_peer_close(peer, false);
+    }
+}
+
+/// Keep polling the peers, whether or not we are going to sync to them
+static void ntp_peers_check_run(void) {
+    for (size_t i = 0; i < NTP_N_PEERS; ++i) {
+        struct ntp_peer *peer = &ntp_peers[i];
+        if (peer->in_progress && absolute_time_diff_us(get_absolute_time(), peer->deadline) < 0) {
+            LOG_ERR1("NTP peer request timed out");
+            ntp_peer_close(peer, false);
+        }
+        if (!peer->in_progress && absolute_time_diff_us(get_absolute_time(), peer->next_poll) < 0)
+            ntp_peer_poll(peer, false);
+    }
+}
+
 /// Perform initialisation
 bool ntp_client_init(struct ntp_client *state) {
     if (!state)
@@ -187,9 +403,35 @@ bool ntp_client_init(struct ntp_client *state) {
     // Meaningful init values
     state->in_progress = false;
     state->pcb = NULL;
+    // Until we hear from it, any usable peer is better
+    state->upstream_stratum = 16;
+    state->upstream_delay_us = INT64_MAX;
+    for (size_t i = 0; i < NTP_N_PEERS; ++i) {
+        memset(&ntp_peers[i], 0, sizeof(struct ntp_peer));
+        ntp_peers[i].hostname = NTP_PEERS[i];
+        ntp_peers[i].next_poll = get_absolute_time();
+    }
     return true;
 }
 
+/// When `ntp_client_check_run` next has something to do: a timeout, a peer
+/// poll or the next sync
+absolute_time_t ntp_client_next_run(const struct ntp_client *state) {
+    absolute_time_t next;
+    if (state->in_progress)
+        next = state->deadline;
+    else if (!absolute_time_diff_us(nil_time, ntp_get_last_sync()))
+        // Never synchronized
+        next = get_absolute_time();
+    else
+        next = delayed_by_us(ntp_get_last_sync(), NTP_INTERVAL_US);
+    for (size_t i = 0; i < NTP_N_PEERS; ++i) {
+        const struct ntp_peer *peer = &ntp_peers[i];
+        next = absolute_time_min(next, peer->in_progress ? peer->deadline : peer->next_poll);
+    }
+    return next;
+}
+
 /// Check and see if the time should be synchronized
 void ntp_client_check_run(struct ntp_client *state) {
     if (!state)
@@ -200,15 +442,26 @@ void ntp_client_check_run(struct ntp_client *state) {
         LOG_ERR1("NTP request timed out");
         ntp_req_close(state);
     }
-    if (absolute_time_diff_us(ntp_get_last_sync(), get_absolute_time()) < NTP_INTERVAL_US
-        // if unlikely(just booted), sync
-        && absolute_time_diff_us(nil_time, ntp_get_last_sync()))
+    ntp_peers_check_run();
+    if (!ntp_sync_due())
         // Not time to sync yet
         // Successful GPS syncs renew `sync_expiry` so we also get here
         return;
 
     if (state->in_progress)
         return;
+    // A GPS-locked kit nearby beats a server across the internet
+    struct ntp_peer *peer = ntp_select_peer(state);
+    if (peer) {
+        if (peer->in_progress)
+            // Take whatever is on its way
+            peer->apply = true;
+        else if (peer->reach & 1)
+            ntp_peer_poll(peer, true);
+        // Otherwise its last poll failed, and `ntp_peers_check_run` retries
+        // at `next_poll`. It stays selected until a second one fails
+        return;
+    }
     // Time to close the connection in case UDP requests are lost
     state->deadline = make_timeout_time_ms(NTP_UDP_TIMEOUT_TIME_MS);
 
@@ -20,10 +20,18 @@
 #include "ntp.h"
 #include "log.h"
 
+#include "crc32.h"
+
+#include <stddef.h>
+#include <string.h>
 #include <time.h>
 
+#include "pico/platform.h"
 #include "pico/time.h"
 #include "hardware/rtc.h"
+#if ENABLE_WATCHDOG
+#include "hardware/watchdog.h"
+#endif
 
 #include "lwip/ip_addr.h"
 #include "lwip/pbuf.h"
@@ -42,6 +50,49 @@ static volatile absolute_time_t last_sync;
 // This is likely a large number, so 0 means the system has not been synchronized
 // Marker: static variable
 static volatile uint64_t ntp_boot_us = 0;
+// Estimated frequency error of the timer in parts per billion. Positive if
+// the timer runs slow, so that many more microseconds are added per second
+// since `last_sync`.
+// Marker: static variable
+static volatile int32_t ntp_freq_ppb = 0;
+// Interrupts may be masked for long, so that a sync is as late as they
+// were (see `ntp_hold_updates`)
+// Marker: static variable
+static volatile bool ntp_updates_held = false;
+
+// Frequency discipline: residuals larger than this are steps, not drift
+static const int64_t NTP_FREQ_MAX_RESIDUAL_US = 128000;
+// Each new measurement is weighted 1/NTP_FREQ_GAIN against the estimate
+static const int32_t NTP_FREQ_GAIN = 16;
+// Way beyond any crystal, so a bad measurement can't run away
+static const int32_t NTP_FREQ_MAX_PPB = 500000;
+// Syncs closer together than a second say little about the frequency. A
+// timer that runs slow counts a little under a second between two pulses,
+// so allow for as far off as it can be
+static const int64_t NTP_FREQ_MIN_INTERVAL_US = 1000000 - NTP_FREQ_MAX_PPB / 1000;
+
+#if ENABLE_WATCHDOG
+// Clock state kept across a watchdog reboot, the same way light.c keeps
+// the PWM level.
+struct ntp_saved_state {
+    // `ntp_get_utc_us()` at the time of saving
+    uint64_t utc_us;
+    // Watchdog countdown at the time of saving. If the dog bites, it does
+    // so this much later (unless it was fed after saving)
+    uint32_t wdt_remaining_us;
+    // Age of the last sync at the time of saving
+    uint32_t sync_age_ms;
+    int32_t freq_ppb;
+    uint32_t ref;
+    uint8_t stratum;
+    // CRC-32 of everything above
+    uint32_t crc;
+};
+// Marker: static variable
+static volatile struct ntp_saved_state __uninitialized_ram(ntp_saved);
+// Marker: static variable
+static struct repeating_timer ntp_save_timer;
+#endif
 
 // Some getters
 uint8_t ntp_get_stratum(void) {
@@ -56,13 +107,52 @@ absolute_time_t ntp_get_last_sync(void) {
     return last_sync;
 }
 
+int32_t ntp_get_freq_ppb(void) {
+    return ntp_freq_ppb;
+}
+
+void ntp_hold_updates(bool hold) {
+    ntp_updates_held = hold;
+}
+
+/// Microseconds the timer has lost (gained if negative) since `last_sync`
+static int64_t ntp_freq_correction(uint64_t now_boot_us) {
+    int64_t elapsed = now_boot_us - to_us_since_boot(last_sync);
+    return elapsed * ntp_freq_ppb / 1000000000;
+}
+
+/// Nudge the frequency estimate given how far off we were at `now_boot_us`
+// residual: true time minus our time, in microseconds
+static void ntp_discipline_freq(int64_t residual, uint64_t now_boot_us) {
+    if (ntp_boot_us == 0)
+        // First sync, nothing to compare against
+        return;
+    int64_t interval = now_boot_us - to_us_since_boot(last_sync);
+    if (interval < NTP_FREQ_MIN_INTERVAL_US || residual > NTP_FREQ_MAX_RESIDUAL_US
+            || residual < -NTP_FREQ_MAX_RESIDUAL_US)
+        return;
+    int64_t measured = residual * 1000000000 / interval;
+    int32_t freq = ntp_freq_ppb + (int32_t) (measured / NTP_FREQ_GAIN);
+    if (freq > NTP_FREQ_MAX_PPB)
+        freq = NTP_FREQ_MAX_PPB;
+    else if (freq < -NTP_FREQ_MAX_PPB)
+        freq = -NTP_FREQ_MAX_PPB;
+    ntp_freq_ppb = freq;
+}
+
 // We should allow calling these from an ISR
 // now: number of microseconds since the UNIX epoch
 // stratum: stratum of `now` (i.e. 0 if `now` is from a GPS receiver)
 // ref: reference identifier of `now`
 void ntp_update_time(uint64_t now, uint8_t stratum, uint32_t ref) {
+    // A PPS edge (or a packet) held up by a flash write would move the
+    // clock by however long that took
+    if (ntp_updates_held)
+        return;
     const absolute_time_t now_abs = get_absolute_time();
-    ntp_boot_us = now - to_us_since_boot(now_abs);
+    const uint64_t now_boot_us = to_us_since_boot(now_abs);
+    ntp_discipline_freq(now - (ntp_boot_us + now_boot_us + ntp_freq_correction(now_boot_us)), now_boot_us);
+    ntp_boot_us = now - now_boot_us;
     ntp_stratum = stratum + 1;
     ntp_ref = ref;
     last_sync = now_abs;
@@ -73,16 +163,75 @@ void ntp_update_time(uint64_t now, uint8_t stratum, uint32_t ref) {
 // stratum: stratum of `now` (i.e. 0 if `now` is from a GPS receiver)
 // ref: reference identifier of `now`
 void ntp_update_time_by_offset(int64_t offset, uint8_t stratum, uint32_t ref) {
-    ntp_boot_us += offset;
+    if (ntp_updates_held)
+        return;
+    const absolute_time_t now_abs = get_absolute_time();
+    const uint64_t now_boot_us = to_us_since_boot(now_abs);
+    ntp_discipline_freq(offset, now_boot_us);
+    // Fold the frequency correction so far into the base
+    ntp_boot_us += offset + ntp_freq_correction(now_boot_us);
     ntp_stratum = stratum + 1;
     ntp_ref = ref;
-    last_sync = get_absolute_time();
+    last_sync = now_abs;
 }
 
 uint64_t ntp_get_utc_us(void) {
-    return ntp_boot_us + to_us_since_boot(get_absolute_time());
+    const uint64_t now_boot_us = to_us_since_boot(get_absolute_time());
+    return ntp_boot_us + now_boot_us + ntp_freq_correction(now_boot_us);
+}
+
+#if ENABLE_WATCHDOG
+static uint32_t ntp_saved_crc(const struct ntp_saved_state *state) {
+    return crc32_update(CRC32_INIT, state, offsetof(struct ntp_saved_state, crc));
 }
 
+static bool ntp_save_timer_cb(struct repeating_timer *t) {
+    struct ntp_saved_state state;
+    // Padding goes into the CRC too
+    memset(&state, 0, sizeof(state));
+    const uint64_t now_boot_us = to_us_since_boot(get_absolute_time());
+    state.utc_us = ntp_boot_us + now_boot_us + ntp_freq_correction(now_boot_us);
+    state.wdt_remaining_us = watchdog_get_count();
+    state.sync_age_ms = (now_boot_us - to_us_since_boot(last_sync)) / 1000;
+    state.freq_ppb = ntp_freq_ppb;
+    state.ref = ntp_ref;
+    state.stratum = ntp_boot_us ? ntp_stratum : 16;
+    state.crc = ntp_saved_crc(&state);
+    ntp_saved = state;
+    return true;
+}
+
+/// Pick up the clock from before a watchdog reboot, then keep saving it.
+/// Call this before anything else touches the clock.
+bool ntp_persist_init(void) {
+    bool restored = false;
+    struct ntp_saved_state state = ntp_saved;
+    // Other resets don't tell us how long we were gone
+    if (!watchdog_enable_caused_reboot())
+        goto start;
+    if (state.crc != ntp_saved_crc(&state) || state.stratum >= 16)
+        goto start;
+    if ((uint64_t) state.sync_age_ms * 1000 + state.wdt_remaining_us > NTP_RESTORE_MAX_AGE_US) {
+        LOG_WARN1("Saved clock is too old to restore");
+        goto start;
+    }
+    // The timer restarted from zero at the reset, which happened when the
+    // watchdog ran out
+    int64_t gone_us = state.wdt_remaining_us;
+    ntp_freq_ppb = state.freq_ppb;
+    ntp_boot_us = state.utc_us + gone_us + gone_us * state.freq_ppb / 1000000000;
+    ntp_ref = state.ref;
+    // We are no longer as good as what we were synchronized to
+    ntp_stratum = state.stratum < 15 ? state.stratum + 1 : 15;
+    // Keep `last_sync` at `nil_time` so that the NTP client checks us ASAP
+    restored = true;
+    LOG_INFO("Restored clock from before reboot, stratum %u\n", (unsigned) ntp_stratum);
+start:
+    add_repeating_timer_ms(NTP_SAVE_INTERVAL_MS, ntp_save_timer_cb, NULL, &ntp_save_timer);
+    return restored;
+}
+#endif
+
 /// Update the RTC with our version and store the current time in `dt`
 bool ntp_update_rtc(datetime_t *dt) {
     time_t t = ntp_get_utc_us() / 1000000;
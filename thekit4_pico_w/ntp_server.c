@@ -19,20 +19,39 @@
 #include "config.h"
 #include "log.h"
 #include "ntp.h"
+#include "trace.h"
 
 #ifdef PICO_CYW43_SUPPORTED
 #include "pico/cyw43_arch.h"
 #endif
 #include "pico/divider.h"
+#include "pico/time.h"
 
 #include "lwip/pbuf.h"
 #include "lwip/udp.h"
 
-static void ntp_server_recv_cb(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
-{
-#ifdef PICO_CYW43_SUPPORTED
-    cyw43_arch_lwip_check();
-#endif
+// Marker: static variable
+struct metric_counter ntp_server_requests;
+// Marker: static variable
+struct metric_counter ntp_server_bad_requests;
+
+/// Time of the last synchronization in NTP format, network byte order
+static void ntp_server_fill_ref(struct ntp_message *outgoing) {
+    absolute_time_t last_sync = ntp_get_last_sync();
+    if (!absolute_time_diff_us(nil_time, last_sync)) {
+        // Never synchronized
+        outgoing->ref_ts_sec = 0;
+        outgoing->ref_ts_frac = 0;
+        return;
+    }
+    uint64_t ref = ntp_get_utc_us() - absolute_time_diff_us(last_sync, get_absolute_time()), ref_uspart;
+    uint64_t ref_spart = divmod_u64u64_rem(ref, 1000000, &ref_uspart);
+    outgoing->ref_ts_sec = lwip_htonl((uint32_t) ref_spart + NTP_DELTA);
+    outgoing->ref_ts_frac = lwip_htonl((uint32_t) ((ref_uspart << 26) / 15625));
+}
+
+/// Answer the request in `p`, which is freed
+static void ntp_server_answer(struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
     uint64_t now = ntp_get_utc_us(), now_uspart;
     uint64_t now_spart = divmod_u64u64_rem(now, 1000000, &now_uspart);
     now_spart += NTP_DELTA;
@@ -42,22 +61,35 @@ static void ntp_server_recv_cb(void *arg, struct udp_pcb *upcb, struct pbuf *p,
     pbuf_free(p);
     if (!result) {
         LOG_ERR1("Failed to parse NTP message");
+        metric_inc(&ntp_server_bad_requests);
         return;
     }
     LOG_INFO("Received NTP request from [%s]:%u\n", ipaddr_ntoa(addr), port);
     ntp_dump_debug(&received);
+    // Clients get a server reply, peers (other kits) a symmetric passive one
+    uint8_t mode = received.flags & 0x7;
+    uint8_t reply_mode;
+    if (mode == NTP_MODE_CLIENT)
+        reply_mode = NTP_MODE_SERVER;
+    else if (mode == NTP_MODE_SYMMETRIC_ACTIVE)
+        reply_mode = NTP_MODE_SYMMETRIC_PASSIVE;
+    else {
+        LOG_ERR1("Unsupported NTP mode");
+        metric_inc(&ntp_server_bad_requests);
+        return;
+    }
     p = pbuf_alloc(PBUF_TRANSPORT, NTP_MSG_LEN, PBUF_RAM);
     assert(p != NULL);
     struct ntp_message *outgoing = (struct ntp_message *) p->payload;
-    outgoing->flags = (NTP_VERSION << 3) | 0x4;
+    outgoing->flags = (NTP_VERSION << 3) | reply_mode;
     outgoing->stratum = ntp_get_stratum();
     outgoing->poll = 0x03;
     outgoing->precision = 0xfa; // TODO: calculate this
     outgoing->root_delay = 0;
     outgoing->root_dispersion = 0;
     outgoing->ref_id = ntp_get_ref();
-    outgoing->ref_ts_sec = 0; // TODO: provide this
-    outgoing->ref_ts_frac = 0;
+    // Peers use this to tell whether we are worth syncing to
+    ntp_server_fill_ref(outgoing);
     outgoing->orig_ts_sec = received.tx_ts_sec;
     outgoing->orig_ts_frac = received.tx_ts_frac;
     outgoing->rx_ts_sec = lwip_htonl((uint32_t) now_spart);
@@ -70,25 +102,41 @@ static void ntp_server_recv_cb(void *arg, struct udp_pcb *upcb, struct pbuf *p,
     outgoing->tx_ts_frac = lwip_htonl((uint32_t) now_uspart);
     udp_sendto(upcb, p, addr, port);
     pbuf_free(p);
+    metric_inc(&ntp_server_requests);
+}
+
+static void ntp_server_recv_cb(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_check();
+#endif
+    TRACE_BLOCK("ntp_server_recv_cb", ntp_server_answer(upcb, p, addr, port));
 }
 
-static bool ntp_server_open_one(struct udp_pcb *ntp_server_udp_pcb, uint8_t lwip_type, const ip_addr_t *ipaddr) {
+static bool ntp_server_open_one(struct udp_pcb **ntp_server_udp_pcb, uint8_t lwip_type, const ip_addr_t *ipaddr) {
     LOG_INFO("Starting NTP server on [%s]:%u\n", ipaddr_ntoa(ipaddr), NTP_PORT);
 #ifdef PICO_CYW43_SUPPORTED
     cyw43_arch_lwip_begin();
 #endif
-    ntp_server_udp_pcb = udp_new_ip_type(lwip_type);
-    if (!ntp_server_udp_pcb) {
+    *ntp_server_udp_pcb = udp_new_ip_type(lwip_type);
+    if (!*ntp_server_udp_pcb) {
+#ifdef PICO_CYW43_SUPPORTED
+        cyw43_arch_lwip_end();
+#endif
         LOG_ERR1("Failed to create NTP server UDP PCB");
         return false;
     }
-    err_t err = udp_bind(ntp_server_udp_pcb, ipaddr, NTP_PORT);
+    err_t err = udp_bind(*ntp_server_udp_pcb, ipaddr, NTP_PORT);
     if (err != ERR_OK) {
+        udp_remove(*ntp_server_udp_pcb);
+        *ntp_server_udp_pcb = NULL;
+#ifdef PICO_CYW43_SUPPORTED
+        cyw43_arch_lwip_end();
+#endif
         LOG_ERR1("Failed to bind NTP server UDP PCB");
-        udp_remove(ntp_server_udp_pcb);
         return false;
     }
-    udp_recv(ntp_server_udp_pcb, ntp_server_recv_cb, NULL);
+    udp_recv(*ntp_server_udp_pcb, ntp_server_recv_cb, NULL);
 #ifdef PICO_CYW43_SUPPORTED
     cyw43_arch_lwip_end();
 #endif
@@ -107,10 +155,10 @@ static struct udp_pcb *ntp_server_udp_pcb6;
 bool ntp_server_open(void) {
     bool success = true;
 #if LWIP_IPV4
-    success &= ntp_server_open_one(ntp_server_udp_pcb4, IPADDR_TYPE_V4, IP4_ADDR_ANY);
+    success &= ntp_server_open_one(&ntp_server_udp_pcb4, IPADDR_TYPE_V4, IP4_ADDR_ANY);
 #endif
 #if LWIP_IPV6
-    success &= ntp_server_open_one(ntp_server_udp_pcb6, IPADDR_TYPE_V6, IP6_ADDR_ANY);
+    success &= ntp_server_open_one(&ntp_server_udp_pcb6, IPADDR_TYPE_V6, IP6_ADDR_ANY);
 #endif
     return success;
 }
@@ -0,0 +1,172 @@
+/*
+ *  profiler.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Every main loop stage is timed into a histogram (exported on /metrics)
+ * and a running maximum, and checked against its budget. The stage in
+ * progress and the last few timings are also kept in RAM that survives a
+ * watchdog reset, so that the next boot can tell what hung and for how long.
+ */
+
+#include "config.h"
+#include "thekit4_pico_w.h"
+#include "log.h"
+#include "trace.h"
+
+#include "pico/platform.h"
+#include "pico/time.h"
+
+#if ENABLE_WATCHDOG
+#include "hardware/watchdog.h"
+#endif
+
+// Timings kept across a reset
+#define PROFILER_HISTORY 16
+// `profiler_saved.stage` outside any stage
+#define PROFILER_IDLE LOOP_N_STAGES
+// Anything else in `profiler_saved` means it is left over from a power-on
+#define PROFILER_MAGIC 0x50524f46
+
+// In us. The last one is well past anything but a hang
+static const uint32_t profiler_bounds[] = {100, 1000, 10000, 100000, 1000000, 10000000};
+#define PROFILER_N_BOUNDS (sizeof(profiler_bounds) / sizeof(profiler_bounds[0]))
+
+// Marker: static variable
+static struct loop_stage_stats profiler_stats[LOOP_N_STAGES] = {
+    // Only slow when it has to reconnect, which is worth knowing about
+    [LOOP_WIFI] = {.name = "wifi", .budget_us = 10000},
+    [LOOP_NTP] = {.name = "ntp_client_check_run", .budget_us = 20000},
+    [LOOP_GPS] = {.name = "gps_parse_available", .budget_us = 20000},
+    // Writes flash once in a while
+    [LOOP_GPS_AIDING] = {.name = "gps_aiding_check_run", .budget_us = 100000},
+    [LOOP_PTP] = {.name = "ptp_server_check_run", .budget_us = 10000},
+    // I2C and ADC reads
+    [LOOP_SENSORS] = {.name = "sensors_check_run", .budget_us = 20000},
+    [LOOP_HTTP] = {.name = "http_server_check_run", .budget_us = 20000},
+    // Steps the HTTP clients, which do not wait on the network
+    [LOOP_TASKS] = {.name = "tasks_check_run", .budget_us = 50000},
+    [LOOP_LOG] = {.name = "log_sink_check_run", .budget_us = 50000},
+    [LOOP_CYW43_POLL] = {.name = "cyw43_arch_poll", .budget_us = 20000},
+};
+// Marker: static variable
+static uint32_t profiler_buckets[LOOP_N_STAGES][PROFILER_N_BOUNDS + 1];
+// Marker: static variable
+// When each stage was last warned about
+static absolute_time_t profiler_last_warning[LOOP_N_STAGES];
+// Marker: static variable
+// time_us_32() at the start of the current stage
+static uint32_t profiler_start;
+
+/// Where the main loop is, kept across a watchdog reset
+struct profiler_saved {
+    uint32_t magic;
+    // Stage in progress, or PROFILER_IDLE
+    uint8_t stage;
+    // Next slot of `history` to write
+    uint8_t history_next;
+    // Watchdog countdown when `stage` started. If the dog bit, it did so
+    // this long into the stage (unless the stage fed it itself)
+    uint32_t stage_wdt_us;
+    struct {
+        uint8_t stage;
+        uint32_t us;
+    } history[PROFILER_HISTORY];
+};
+// Marker: static variable
+static volatile struct profiler_saved __uninitialized_ram(profiler_saved);
+
+#if ENABLE_WATCHDOG
+/// Tell what was going on before a watchdog reset
+static void profiler_report(void) {
+    uint8_t stage = profiler_saved.stage;
+    if (stage < LOOP_N_STAGES)
+        LOG_ERR("Watchdog reset in %s, at least %lu ms into it\n",
+                profiler_stats[stage].name, (unsigned long) (profiler_saved.stage_wdt_us / 1000));
+    else
+        LOG_ERR1("Watchdog reset between main loop stages");
+    // Oldest first
+    for (uint8_t i = 0; i < PROFILER_HISTORY; ++i) {
+        uint8_t slot = (profiler_saved.history_next + i) % PROFILER_HISTORY;
+        uint8_t previous = profiler_saved.history[slot].stage;
+        if (previous < LOOP_N_STAGES)
+            LOG_INFO("Before the reset: %s took %lu us\n", profiler_stats[previous].name,
+                     (unsigned long) profiler_saved.history[slot].us);
+    }
+}
+#endif
+
+void profiler_init(void) {
+    for (uint8_t stage = 0; stage < LOOP_N_STAGES; ++stage) {
+        struct metric_histogram *duration = &profiler_stats[stage].duration;
+        duration->bounds = profiler_bounds;
+        duration->n_bounds = PROFILER_N_BOUNDS;
+        duration->buckets = profiler_buckets[stage];
+        duration->decimals = 6;
+        profiler_last_warning[stage] = nil_time;
+    }
+#if ENABLE_WATCHDOG
+    // Not a `watchdog_reboot` on purpose
+    if (watchdog_enable_caused_reboot() && profiler_saved.magic == PROFILER_MAGIC
+            && profiler_saved.history_next < PROFILER_HISTORY)
+        profiler_report();
+#endif
+    profiler_saved.magic = PROFILER_MAGIC;
+    profiler_saved.stage = PROFILER_IDLE;
+    profiler_saved.history_next = 0;
+    for (uint8_t i = 0; i < PROFILER_HISTORY; ++i)
+        profiler_saved.history[i].stage = PROFILER_IDLE;
+}
+
+void profiler_begin(enum loop_stage stage) {
+    TRACE_BEGIN(profiler_stats[stage].name);
+#if ENABLE_WATCHDOG
+    profiler_saved.stage_wdt_us = watchdog_get_count();
+#endif
+    profiler_saved.stage = stage;
+    profiler_start = time_us_32();
+}
+
+void profiler_end(enum loop_stage stage) {
+    uint32_t us = time_us_32() - profiler_start;
+    struct loop_stage_stats *stats = &profiler_stats[stage];
+    uint8_t slot = profiler_saved.history_next;
+    profiler_saved.stage = PROFILER_IDLE;
+    profiler_saved.history[slot].stage = stage;
+    profiler_saved.history[slot].us = us;
+    profiler_saved.history_next = (slot + 1) % PROFILER_HISTORY;
+
+    metric_observe(&stats->duration, us);
+    if (us > stats->max_us)
+        stats->max_us = us;
+    if (us > stats->budget_us) {
+        absolute_time_t now = get_absolute_time();
+        metric_inc(&stats->overruns);
+        if (is_nil_time(profiler_last_warning[stage])
+                || absolute_time_diff_us(profiler_last_warning[stage], now) >= LOOP_WARN_INTERVAL_MS * 1000) {
+            LOG_WARN("%s took %lu us, over its %lu us budget (p99 <= %lu us, max %lu us)\n",
+                     stats->name, (unsigned long) us, (unsigned long) stats->budget_us,
+                     (unsigned long) metric_histogram_quantile(&stats->duration, 990),
+                     (unsigned long) stats->max_us);
+            profiler_last_warning[stage] = now;
+        }
+    }
+    TRACE_END(stats->name);
+}
+
+const struct loop_stage_stats *profiler_get(enum loop_stage stage) {
+    return &profiler_stats[stage];
+}
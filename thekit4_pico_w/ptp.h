@@ -0,0 +1,85 @@
+/*
+ *  ptp.h
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* IEEE 1588-2008 (PTPv2) over UDP/IPv4 (Annex D), master side only.
+ * The timebase is the same one the NTP server hands out (`ntp_get_utc_us`).
+ */
+
+#ifndef _PTP_H
+#define _PTP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pico/time.h"
+
+// Sync and Delay_Req
+static const uint16_t PTP_EVENT_PORT = 319;
+// Announce, Follow_Up and Delay_Resp
+static const uint16_t PTP_GENERAL_PORT = 320;
+// 224.0.1.129 in host byte order
+static const uint32_t PTP_PRIMARY_MCAST = 0xe0000181;
+// PTP version this code speaks
+static const uint8_t PTP_VERSION = 2;
+// TAI - UTC in seconds. PTP runs on TAI; update this on the next leap second
+static const int16_t PTP_UTC_OFFSET = 37;
+
+// messageType, lower nibble of the first octet
+enum ptp_message_type {
+    PTP_MSG_SYNC = 0x0,
+    PTP_MSG_DELAY_REQ = 0x1,
+    PTP_MSG_FOLLOW_UP = 0x8,
+    PTP_MSG_DELAY_RESP = 0x9,
+    PTP_MSG_ANNOUNCE = 0xb,
+};
+
+// controlField, only kept for PTPv1 hardware
+enum ptp_control {
+    PTP_CTRL_SYNC = 0,
+    PTP_CTRL_DELAY_REQ = 1,
+    PTP_CTRL_FOLLOW_UP = 2,
+    PTP_CTRL_DELAY_RESP = 3,
+    PTP_CTRL_OTHER = 5,
+};
+
+// flagField, first octet in the upper byte
+#define PTP_FLAG_TWO_STEP           0x0200
+#define PTP_FLAG_UNICAST            0x0400
+#define PTP_FLAG_UTC_OFFSET_VALID   0x0004
+#define PTP_FLAG_PTP_TIMESCALE      0x0008
+#define PTP_FLAG_TIME_TRACEABLE     0x0010
+#define PTP_FLAG_FREQ_TRACEABLE     0x0020
+
+// Message lengths. All fields are big-endian and unaligned so messages are
+// (de)serialized byte by byte instead of with a struct
+#define PTP_HEADER_LEN 34
+// header + originTimestamp
+#define PTP_SYNC_LEN (PTP_HEADER_LEN + 10)
+#define PTP_DELAY_REQ_LEN (PTP_HEADER_LEN + 10)
+#define PTP_FOLLOW_UP_LEN (PTP_HEADER_LEN + 10)
+// header + receiveTimestamp + requestingPortIdentity
+#define PTP_DELAY_RESP_LEN (PTP_HEADER_LEN + 20)
+// header + originTimestamp + currentUtcOffset ... timeSource
+#define PTP_ANNOUNCE_LEN (PTP_HEADER_LEN + 30)
+
+// ptp_server.c
+bool ptp_server_open(void);
+void ptp_server_check_run(void);
+absolute_time_t ptp_server_next_run(void);
+
+#endif
@@ -0,0 +1,364 @@
+/*
+ *  ptp_server.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Two-step PTPv2 master with the end-to-end delay mechanism.
+ * We only ever act as the grandmaster: Announce and Sync/Follow_Up go out
+ * periodically to 224.0.1.129, and every Delay_Req is answered with a
+ * Delay_Resp. There is no BMCA, so don't put two of these on one domain.
+ *
+ * All timestamps are software timestamps taken from `ntp_get_utc_us`,
+ * which is why this has to be two-step: the Sync timestamp is only known
+ * after the frame has been handed to the driver.
+ *
+ * To test against linuxptp on a host bridged to the kit:
+ *   ptp4l -i <iface> -4 -E -S -s -m
+ * (`-S` software timestamping, `-s` slave only). `domainNumber` in
+ * ptp4l.conf must match `PTP_DOMAIN`.
+ */
+
+#include "config.h"
+#include "log.h"
+#include "ntp.h"
+#include "ptp.h"
+
+#include <string.h>
+
+#ifdef PICO_CYW43_SUPPORTED
+#include "pico/cyw43_arch.h"
+#endif
+#include "pico/divider.h"
+#include "pico/stdlib.h"
+
+#include "lwip/igmp.h"
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+#if ENABLE_PTP
+struct ptp_server {
+    // Bound to 319, receives Delay_Req and sends Sync
+    struct udp_pcb *event_pcb;
+    // Bound to 320, sends everything else
+    struct udp_pcb *general_pcb;
+    ip_addr_t mcast_addr;
+    // EUI-64 made from the MAC address, all zero until the netif is up
+    uint8_t clock_identity[8];
+    uint16_t sync_seq;
+    uint16_t announce_seq;
+    absolute_time_t next_sync;
+    absolute_time_t next_announce;
+};
+
+// Marker: static variable
+static struct ptp_server ptp_state;
+
+static inline void put_be16(uint8_t *dest, uint16_t value) {
+    dest[0] = value >> 8;
+    dest[1] = value;
+}
+
+static inline void put_be32(uint8_t *dest, uint32_t value) {
+    dest[0] = value >> 24;
+    dest[1] = value >> 16;
+    dest[2] = value >> 8;
+    dest[3] = value;
+}
+
+static inline uint16_t get_be16(const uint8_t *src) {
+    return ((uint16_t) src[0] << 8) | src[1];
+}
+
+/// Convert log2(seconds) into microseconds
+static uint64_t ptp_log_interval_us(int8_t log_interval) {
+    if (log_interval >= 0)
+        return 1000000ULL << log_interval;
+    return 1000000ULL >> -log_interval;
+}
+
+/// Write a PTP Timestamp (48-bit seconds + 32-bit nanoseconds) on the PTP
+/// timescale, given microseconds since the UNIX epoch
+static void ptp_fill_timestamp(uint8_t *dest, uint64_t utc_us) {
+    uint64_t uspart;
+    uint64_t spart = divmod_u64u64_rem(utc_us, 1000000, &uspart);
+    spart += PTP_UTC_OFFSET;
+    put_be16(dest, (uint16_t) (spart >> 32));
+    put_be32(dest + 2, (uint32_t) spart);
+    put_be32(dest + 6, (uint32_t) uspart * 1000);
+}
+
+/// Derive the clockIdentity from the MAC address as per 7.5.2.2.2
+static bool ptp_make_clock_identity(struct ptp_server *state) {
+    if (state->clock_identity[4] == 0xfe)
+        // Already done
+        return true;
+    const struct netif *nif = netif_default;
+    if (!nif)
+        return false;
+    const uint8_t *mac = nif->hwaddr;
+    state->clock_identity[0] = mac[0];
+    state->clock_identity[1] = mac[1];
+    state->clock_identity[2] = mac[2];
+    state->clock_identity[3] = 0xff;
+    state->clock_identity[4] = 0xfe;
+    state->clock_identity[5] = mac[3];
+    state->clock_identity[6] = mac[4];
+    state->clock_identity[7] = mac[5];
+    return true;
+}
+
+/// Fill in the common header. `correctionField` is zeroed.
+static void ptp_fill_header(const struct ptp_server *state, uint8_t *dest,
+                            enum ptp_message_type type, uint16_t length,
+                            uint16_t flags, uint16_t seq,
+                            enum ptp_control control, int8_t log_interval) {
+    memset(dest, 0, PTP_HEADER_LEN);
+    // transportSpecific = 0
+    dest[0] = type;
+    dest[1] = PTP_VERSION;
+    put_be16(dest + 2, length);
+    dest[4] = PTP_DOMAIN;
+    put_be16(dest + 6, flags);
+    // correctionField and reserved stay zero
+    // sourcePortIdentity: clockIdentity and port number 1
+    memcpy(dest + 20, state->clock_identity, 8);
+    put_be16(dest + 28, 1);
+    put_be16(dest + 30, seq);
+    dest[32] = control;
+    dest[33] = (uint8_t) log_interval;
+}
+
+/// Allocate a pbuf, copy `msg` in and send it
+static err_t ptp_send(struct udp_pcb *pcb, const uint8_t *msg, uint16_t len,
+                      const ip_addr_t *addr, uint16_t port) {
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    if (!p)
+        return ERR_MEM;
+    memcpy(p->payload, msg, len);
+    err_t err = udp_sendto(pcb, p, addr, port);
+    pbuf_free(p);
+    return err;
+}
+
+/// Describe our clock for Announce from the state of the NTP/GPS discipline
+static void ptp_clock_quality(uint8_t *clock_class, uint8_t *accuracy,
+                              uint8_t *time_source, uint16_t *flags) {
+    *flags = PTP_FLAG_UTC_OFFSET_VALID | PTP_FLAG_PTP_TIMESCALE;
+    // Stratum is higher while coasting on a clock restored after a reboot
+    if (ntp_get_stratum() == 1 && ntp_get_ref() == NTP_REF_GPS) {
+        // Locked to a primary reference
+        *clock_class = 6;
+        // Within 100 us, limited by software timestamping
+        *accuracy = 0x27;
+        *time_source = 0x20;
+        *flags |= PTP_FLAG_TIME_TRACEABLE | PTP_FLAG_FREQ_TRACEABLE;
+    } else {
+        // Synchronized over NTP, still traceable to the upstream server
+        *clock_class = 248;
+        // Within 10 ms
+        *accuracy = 0x2b;
+        *time_source = 0x50;
+        *flags |= PTP_FLAG_TIME_TRACEABLE;
+    }
+}
+
+static void ptp_send_announce(struct ptp_server *state) {
+    uint8_t msg[PTP_ANNOUNCE_LEN];
+    uint8_t clock_class, accuracy, time_source;
+    uint16_t flags;
+    ptp_clock_quality(&clock_class, &accuracy, &time_source, &flags);
+    ptp_fill_header(state, msg, PTP_MSG_ANNOUNCE, PTP_ANNOUNCE_LEN, flags,
+                    state->announce_seq++, PTP_CTRL_OTHER,
+                    PTP_LOG_ANNOUNCE_INTERVAL);
+    uint8_t *body = msg + PTP_HEADER_LEN;
+    ptp_fill_timestamp(body, ntp_get_utc_us());
+    put_be16(body + 10, PTP_UTC_OFFSET);
+    body[12] = 0;
+    // grandmasterPriority1
+    body[13] = 128;
+    // grandmasterClockQuality
+    body[14] = clock_class;
+    body[15] = accuracy;
+    // offsetScaledLogVariance: not computed
+    put_be16(body + 16, 0xffff);
+    // grandmasterPriority2
+    body[18] = 128;
+    memcpy(body + 19, state->clock_identity, 8);
+    // stepsRemoved
+    put_be16(body + 27, 0);
+    body[29] = time_source;
+    err_t err = ptp_send(state->general_pcb, msg, PTP_ANNOUNCE_LEN,
+                         &state->mcast_addr, PTP_GENERAL_PORT);
+    if (err != ERR_OK)
+        LOG_ERR("Failed to send PTP Announce: %d\n", err);
+}
+
+static void ptp_send_sync(struct ptp_server *state) {
+    uint16_t seq = state->sync_seq++;
+    // Prepare the pbuf beforehand so that nothing sits between the
+    // timestamp and the send
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, PTP_SYNC_LEN, PBUF_RAM);
+    if (!p) {
+        LOG_ERR1("Failed to allocate PTP Sync");
+        return;
+    }
+    uint8_t *msg = (uint8_t *) p->payload;
+    ptp_fill_header(state, msg, PTP_MSG_SYNC, PTP_SYNC_LEN, PTP_FLAG_TWO_STEP,
+                    seq, PTP_CTRL_SYNC, PTP_LOG_SYNC_INTERVAL);
+    // Two-step: originTimestamp is only an estimate
+    ptp_fill_timestamp(msg + PTP_HEADER_LEN, ntp_get_utc_us());
+    err_t err = udp_sendto(state->event_pcb, p, &state->mcast_addr, PTP_EVENT_PORT);
+    // Both drivers push the frame out synchronously, so right after
+    // `udp_sendto` returns is the closest we get to the wire
+    uint64_t sent = ntp_get_utc_us();
+    pbuf_free(p);
+    if (err != ERR_OK) {
+        LOG_ERR("Failed to send PTP Sync: %d\n", err);
+        return;
+    }
+
+    uint8_t follow_up[PTP_FOLLOW_UP_LEN];
+    ptp_fill_header(state, follow_up, PTP_MSG_FOLLOW_UP, PTP_FOLLOW_UP_LEN, 0,
+                    seq, PTP_CTRL_FOLLOW_UP, PTP_LOG_SYNC_INTERVAL);
+    ptp_fill_timestamp(follow_up + PTP_HEADER_LEN, sent);
+    err = ptp_send(state->general_pcb, follow_up, PTP_FOLLOW_UP_LEN,
+                   &state->mcast_addr, PTP_GENERAL_PORT);
+    if (err != ERR_OK)
+        LOG_ERR("Failed to send PTP Follow_Up: %d\n", err);
+}
+
+// Delay_Req received callback
+static void ptp_event_recv_cb(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+    // Take this before anything else
+    uint64_t now = ntp_get_utc_us();
+    struct ptp_server *state = (struct ptp_server *)arg;
+    uint8_t req[PTP_DELAY_REQ_LEN];
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_check();
+#endif
+    bool unicast = !ip_addr_ismulticast(ip_current_dest_addr());
+    bool result = p->tot_len >= PTP_DELAY_REQ_LEN
+        && pbuf_copy_partial(p, req, PTP_DELAY_REQ_LEN, 0) == PTP_DELAY_REQ_LEN;
+    pbuf_free(p);
+    if (!result)
+        return;
+    // Our own Sync comes back here too if multicast is looped
+    if ((req[0] & 0x0f) != PTP_MSG_DELAY_REQ || (req[1] & 0x0f) != PTP_VERSION
+            || req[4] != PTP_DOMAIN)
+        return;
+    if (ntp_get_stratum() == 16)
+        // Nothing to give out
+        return;
+    LOG_DEBUG("Received PTP Delay_Req from [%s]:%u\n", ipaddr_ntoa(addr), port);
+
+    uint8_t resp[PTP_DELAY_RESP_LEN];
+    ptp_fill_header(state, resp, PTP_MSG_DELAY_RESP, PTP_DELAY_RESP_LEN,
+                    unicast ? PTP_FLAG_UNICAST : 0, get_be16(req + 30),
+                    PTP_CTRL_DELAY_RESP, PTP_LOG_MIN_DELAY_REQ_INTERVAL);
+    // correctionField is carried over from the request
+    memcpy(resp + 8, req + 8, 8);
+    ptp_fill_timestamp(resp + PTP_HEADER_LEN, now);
+    // requestingPortIdentity is the request's sourcePortIdentity
+    memcpy(resp + PTP_HEADER_LEN + 10, req + 20, 10);
+    err_t err = ptp_send(state->general_pcb, resp, PTP_DELAY_RESP_LEN,
+                         unicast ? addr : &state->mcast_addr, PTP_GENERAL_PORT);
+    if (err != ERR_OK)
+        LOG_ERR("Failed to send PTP Delay_Resp: %d\n", err);
+}
+
+static struct udp_pcb *ptp_server_open_one(uint16_t port, udp_recv_fn recv) {
+    struct udp_pcb *pcb = udp_new_ip_type(IPADDR_TYPE_V4);
+    if (!pcb) {
+        LOG_ERR1("Failed to create PTP UDP PCB");
+        return NULL;
+    }
+    err_t err = udp_bind(pcb, IP4_ADDR_ANY, port);
+    if (err != ERR_OK) {
+        LOG_ERR1("Failed to bind PTP UDP PCB");
+        udp_remove(pcb);
+        return NULL;
+    }
+    if (recv)
+        udp_recv(pcb, recv, &ptp_state);
+    return pcb;
+}
+
+/// Open the PTP event and general ports (IPv4 only)
+bool ptp_server_open(void) {
+    LOG_INFO("Starting PTP master on ports %u and %u, domain %u\n",
+             PTP_EVENT_PORT, PTP_GENERAL_PORT, PTP_DOMAIN);
+    ip_addr_set_ip4_u32(&ptp_state.mcast_addr, lwip_htonl(PTP_PRIMARY_MCAST));
+    ptp_state.sync_seq = 0;
+    ptp_state.announce_seq = 0;
+    ptp_state.next_sync = get_absolute_time();
+    ptp_state.next_announce = get_absolute_time();
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_begin();
+#endif
+    ptp_state.event_pcb = ptp_server_open_one(PTP_EVENT_PORT, ptp_event_recv_cb);
+    ptp_state.general_pcb = ptp_server_open_one(PTP_GENERAL_PORT, NULL);
+#if LWIP_IGMP
+    // Delay_Req from slaves go to the same group
+    if (igmp_joingroup(IP4_ADDR_ANY4, ip_2_ip4(&ptp_state.mcast_addr)) != ERR_OK)
+        LOG_WARN1("Cannot join PTP multicast group, only unicast Delay_Req will work");
+#endif
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_end();
+#endif
+    return ptp_state.event_pcb && ptp_state.general_pcb;
+}
+
+/// Send Announce and Sync/Follow_Up when they are due
+void ptp_server_check_run(void) {
+    if (!ptp_state.event_pcb || !ptp_state.general_pcb)
+        return;
+    if (ntp_get_stratum() == 16)
+        // Don't advertise a clock that has never been set
+        return;
+    if (!ptp_make_clock_identity(&ptp_state))
+        return;
+    absolute_time_t now = get_absolute_time();
+    bool announce = absolute_time_diff_us(now, ptp_state.next_announce) < 0;
+    bool sync = absolute_time_diff_us(now, ptp_state.next_sync) < 0;
+    if (!announce && !sync)
+        return;
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_begin();
+#endif
+    if (announce) {
+        ptp_send_announce(&ptp_state);
+        ptp_state.next_announce = delayed_by_us(now, ptp_log_interval_us(PTP_LOG_ANNOUNCE_INTERVAL));
+    }
+    if (sync) {
+        ptp_send_sync(&ptp_state);
+        ptp_state.next_sync = delayed_by_us(now, ptp_log_interval_us(PTP_LOG_SYNC_INTERVAL));
+    }
+#ifdef PICO_CYW43_SUPPORTED
+    cyw43_arch_lwip_end();
+#endif
+}
+
+/// When `ptp_server_check_run` next has something to send
+absolute_time_t ptp_server_next_run(void) {
+    // Until then, only an interrupt (the clock being set) changes anything
+    if (!ptp_state.event_pcb || !ptp_state.general_pcb || ntp_get_stratum() == 16)
+        return at_the_end_of_time;
+    return absolute_time_min(ptp_state.next_announce, ptp_state.next_sync);
+}
+
+#endif
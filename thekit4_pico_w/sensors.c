@@ -0,0 +1,92 @@
+/*
+ *  sensors.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* All slow or bus-bound readings are taken here, from the main loop, and
+ * everyone else (HTTP, uploads) reads the last snapshot. lwIP callbacks run
+ * from an IRQ with the threadsafe_background arch, so they must neither
+ * block on I2C nor touch the ADC mux the main loop might be using.
+ */
+
+#include "config.h"
+#include "thekit4_pico_w.h"
+#include "log.h"
+
+#include "pico/time.h"
+
+// Marker: static variable
+// Double-buffered so that a reader interrupting an update sees the
+// previous complete snapshot
+static struct sensors_snapshot snapshots[2];
+// Marker: static variable
+static volatile uint8_t snapshot_current;
+// Marker: static variable
+static absolute_time_t next_sample_time;
+
+static void sensors_sample(void) {
+    struct sensors_snapshot *snap = &snapshots[!snapshot_current];
+#if ENABLE_TEMPERATURE_SENSOR
+    bmp280_measure(&snap->temperature, &snap->pressure);
+#else
+    // JSON doesn't support NaN
+    snap->temperature = -512;
+    snap->pressure = 0;
+#endif
+    snap->core_temperature = temperature_core();
+#if ENABLE_LIGHT
+    snap->light_voltage = light_smps_measure();
+#else
+    snap->light_voltage = 0;
+#endif
+#if ENABLE_GPS
+    snap->gps_valid = gps_get_location(&snap->lat, &snap->lon, &snap->alt, &snap->gps_age);
+#else
+    snap->gps_valid = false;
+#endif
+    if (!snap->gps_valid) {
+        snap->lat = -512;
+        snap->lon = -512;
+        snap->alt = -512;
+        snap->gps_age = 0;
+    }
+    snap->taken = get_absolute_time();
+    snap->valid = true;
+    // Publish
+    __compiler_memory_barrier();
+    snapshot_current = !snapshot_current;
+}
+
+void sensors_init(void) {
+    // So that there is always something to read
+    sensors_sample();
+    next_sample_time = make_timeout_time_ms(SENSORS_INTERVAL_MS);
+}
+
+void sensors_check_run(void) {
+    if (absolute_time_diff_us(get_absolute_time(), next_sample_time) >= 0)
+        return;
+    sensors_sample();
+    next_sample_time = make_timeout_time_ms(SENSORS_INTERVAL_MS);
+}
+
+absolute_time_t sensors_next_run(void) {
+    return next_sample_time;
+}
+
+const struct sensors_snapshot *sensors_get(void) {
+    return &snapshots[snapshot_current];
+}
@@ -0,0 +1,282 @@
+/*
+ *  spool.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Store and forward for telemetry, for outages longer than the spool in
+ * RAM lasts. Once a sink falls TELEMETRY_SPOOL_AFTER samples behind, its
+ * oldest records are packed (telemetry_pack) into a page-sized block, noting
+ * which sinks still need each, and taken off those sinks' backlogs. A full
+ * block is appended to a flash_ring, so flash is only written while there is
+ * an outage, a page at a time, and each sector is erased once per 16 blocks.
+ * The ring's per-record CRC is what commits a block: a torn write is just
+ * not there after a reboot.
+ * Once every sink is up with little waiting, the blocks are put back into
+ * the spool in RAM in order, one per sample so that live records are not
+ * held up for long. How far that got is itself kept in a small flash_ring,
+ * written only after the sinks have uploaded a block, so a reboot loses at
+ * worst the block that has yet to be filled.
+ */
+
+#include "config.h"
+#include "thekit4_pico_w.h"
+#include "flash_ring.h"
+#include "log.h"
+#include "ntp.h"
+#include "telemetry.h"
+
+#include <string.h>
+
+#include "hardware/flash.h"
+
+// A block fills a page with the flash_ring header: a record count, then
+// the packed records
+#define SPOOL_BLOCK_SIZE (FLASH_PAGE_SIZE - 8)
+
+// Marker: static variable
+static struct flash_ring spool_ring = FLASH_RING_INIT(
+    TELEMETRY_SPOOL_FLASH_OFFSET, TELEMETRY_SPOOL_SECTORS, SPOOL_BLOCK_SIZE);
+// Marker: static variable
+// The first block yet to be uploaded, as a `uint32_t`
+static struct flash_ring spool_cursor_ring = FLASH_RING_INIT(
+    TELEMETRY_SPOOL_CURSOR_FLASH_OFFSET, 2, sizeof(uint32_t));
+// Marker: static variable
+static bool spool_usable;
+// Marker: static variable
+// The block being filled
+static uint8_t spool_block[SPOOL_BLOCK_SIZE];
+// Marker: static variable
+static size_t spool_block_len;
+// Marker: static variable
+static struct telemetry_codec spool_packer;
+// Marker: static variable
+static const struct telemetry_field *spool_fields;
+// Marker: static variable
+static uint8_t spool_n_fields;
+// Marker: static variable
+// Next block to put back
+static uint32_t spool_replay_seq;
+// Marker: static variable
+// A block has been put back, and is committed once the sinks in
+// `spool_commit_readers` have uploaded past `spool_commit_index`
+static bool spool_committing;
+// Marker: static variable
+static uint32_t spool_commit_index;
+// Marker: static variable
+static uint8_t spool_commit_readers;
+// Marker: static variable
+static struct spool_stats spool_stats;
+
+static void spool_block_reset(void) {
+    spool_block[0] = 0;
+    spool_block_len = 1;
+    telemetry_codec_init(&spool_packer, spool_fields, spool_n_fields);
+}
+
+void spool_init(const struct telemetry_field *fields, uint8_t n_fields) {
+    spool_fields = fields;
+    spool_n_fields = n_fields;
+    spool_block_reset();
+    if (!flash_ring_init(&spool_ring) || !flash_ring_init(&spool_cursor_ring)) {
+        LOG_ERR1("Bad telemetry spool flash layout");
+        return;
+    }
+    spool_usable = true;
+    const uint32_t *cursor = flash_ring_latest(&spool_cursor_ring);
+    spool_replay_seq = cursor ? *cursor : 0;
+    if (spool_ring.next_seq > spool_replay_seq) {
+        spool_stats.blocks_waiting = spool_ring.next_seq - spool_replay_seq;
+        LOG_INFO("%lu telemetry blocks in flash to upload\n", (unsigned long) spool_stats.blocks_waiting);
+    }
+}
+
+/// `flash_ring_append`, which masks interrupts throughout, without taking a
+/// clock sync from a PPS edge or a packet that it holds up
+static bool spool_append(struct flash_ring *ring, const void *payload) {
+    ntp_hold_updates(true);
+    bool ok = flash_ring_append(ring, payload);
+    ntp_hold_updates(false);
+    return ok;
+}
+
+/// Write out the block being filled
+static void spool_block_flush(void) {
+    memset(spool_block + spool_block_len, 0xff, SPOOL_BLOCK_SIZE - spool_block_len);
+    if (spool_append(&spool_ring, spool_block)) {
+        ++spool_stats.blocks_written;
+        spool_stats.blocks_waiting = spool_ring.next_seq - spool_replay_seq;
+    }
+    else
+        LOG_ERR1("Failed to write telemetry block");
+    spool_block_reset();
+}
+
+static void spool_store(uint32_t time, const float *values, uint8_t readers) {
+    size_t len = telemetry_pack(&spool_packer, time, values, readers, spool_block + spool_block_len,
+                                SPOOL_BLOCK_SIZE - spool_block_len);
+    if (len == 0) {
+        spool_block_flush();
+        len = telemetry_pack(&spool_packer, time, values, readers, spool_block + spool_block_len,
+                             SPOOL_BLOCK_SIZE - spool_block_len);
+        if (len == 0)
+            return;
+    }
+    spool_block_len += len;
+    ++spool_block[0];
+    // Out now rather than when the next record does not fit, so that
+    // less is held in RAM
+    if (SPOOL_BLOCK_SIZE - spool_block_len < 8)
+        spool_block_flush();
+    ++spool_stats.spooled;
+}
+
+/// Move records off the backlog of the sinks furthest behind until none
+/// is more than TELEMETRY_SPOOL_AFTER behind
+static void spool_evict(void) {
+    // Without flash, they might as well stay until they are overwritten
+    if (!spool_usable)
+        return;
+    while (true) {
+        struct telemetry_reader *slowest = NULL;
+        struct telemetry_reader *reader;
+        struct uplink_stats stats;
+        uint32_t most = TELEMETRY_SPOOL_AFTER;
+        for (uint8_t i = 0; uplink_get_stats(i, &stats); ++i) {
+            if (stats.enabled && stats.pending > most) {
+                most = stats.pending;
+                slowest = uplink_get_reader(i);
+            }
+        }
+        if (slowest == NULL)
+            return;
+        uint32_t time;
+        float values[TELEMETRY_MAX_FIELDS];
+        uint8_t readers;
+        uint32_t n = telemetry_read(slowest, &time, values, spool_n_fields, &readers);
+        // Everyone that is just as far behind needs the same record
+        uint8_t behind = 0;
+        for (uint8_t i = 0; uplink_get_stats(i, &stats); ++i) {
+            reader = uplink_get_reader(i);
+            if (reader == NULL || reader->next != slowest->next)
+                continue;
+            // Its upload in flight might have this record
+            if (stats.busy)
+                return;
+            behind |= reader->bit;
+        }
+        readers &= behind;
+        // The server would stamp it with the time it is put back
+        if (time != 0 && readers != 0)
+            spool_store(time, values, readers);
+        uint32_t next = slowest->next;
+        for (uint8_t i = 0; uplink_get_stats(i, &stats); ++i) {
+            reader = uplink_get_reader(i);
+            if (reader != NULL && reader->next == next)
+                telemetry_ack(reader, n);
+        }
+    }
+}
+
+/// Whether every sink is up with little waiting
+static bool spool_sinks_ready(void) {
+    struct uplink_stats stats;
+    for (uint8_t i = 0; uplink_get_stats(i, &stats); ++i) {
+        if (!stats.enabled)
+            continue;
+        if (!stats.online || stats.pending > TELEMETRY_REPLAY_MAX_PENDING)
+            return false;
+    }
+    return true;
+}
+
+/// Whether the sinks `readers` names have all uploaded up to `index`
+static bool spool_sinks_past(uint8_t readers, uint32_t index) {
+    struct uplink_stats stats;
+    for (uint8_t i = 0; uplink_get_stats(i, &stats); ++i) {
+        struct telemetry_reader *reader = uplink_get_reader(i);
+        if (reader != NULL && (reader->bit & readers) && (int32_t) (reader->next - index) < 0)
+            return false;
+    }
+    return true;
+}
+
+/// Put the records of a block back into the spool in RAM. Returns whom
+/// they were for
+static uint8_t spool_unpack_block(const uint8_t *block) {
+    struct telemetry_codec unpacker;
+    uint8_t all = 0;
+    size_t pos = 1;
+    telemetry_codec_init(&unpacker, spool_fields, spool_n_fields);
+    for (uint8_t i = 0; i < block[0]; ++i) {
+        uint32_t time;
+        float values[TELEMETRY_MAX_FIELDS];
+        uint8_t readers;
+        size_t len = telemetry_unpack(&unpacker, block + pos, SPOOL_BLOCK_SIZE - pos, &time, values, &readers);
+        if (len == 0) {
+            LOG_ERR1("Corrupt telemetry block");
+            break;
+        }
+        pos += len;
+        telemetry_record_for(time, values, spool_n_fields, readers);
+        all |= readers;
+        ++spool_stats.replayed;
+    }
+    return all;
+}
+
+/// Put back the next block, once the last one has been uploaded
+static void spool_replay(void) {
+    if (spool_committing) {
+        if (!spool_sinks_past(spool_commit_readers, spool_commit_index))
+            return;
+        if (!spool_append(&spool_cursor_ring, &spool_replay_seq))
+            LOG_ERR1("Failed to save telemetry replay position");
+        spool_committing = false;
+    }
+    if (!spool_sinks_ready())
+        return;
+    uint32_t seq = spool_replay_seq;
+    const uint8_t *block = spool_usable ? flash_ring_next(&spool_ring, &seq) : NULL;
+    if (block != NULL) {
+        if (seq != spool_replay_seq) {
+            LOG_WARN("%lu telemetry blocks were overwritten\n", (unsigned long) (seq - spool_replay_seq));
+            spool_stats.blocks_lost += seq - spool_replay_seq;
+        }
+        spool_commit_readers = spool_unpack_block(block);
+        spool_commit_index = telemetry_recorded();
+        spool_committing = true;
+        spool_replay_seq = seq + 1;
+        spool_stats.blocks_waiting = spool_ring.next_seq - spool_replay_seq;
+    }
+    else if (spool_block[0] != 0) {
+        // Never made it to flash
+        spool_unpack_block(spool_block);
+        spool_block_reset();
+    }
+    else
+        return;
+    LOG_INFO1("Uploading spooled telemetry");
+    uplink_kick();
+}
+
+void spool_check_run(void) {
+    spool_evict();
+    spool_replay();
+}
+
+void spool_get_stats(struct spool_stats *stats) {
+    *stats = spool_stats;
+}
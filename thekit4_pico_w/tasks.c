@@ -19,175 +19,20 @@
 #include "config.h"
 #include "thekit4_pico_w.h"
 #include "log.h"
-#include "ntp.h"
+#include "sched.h"
 
-#include "hardware/rtc.h"
-#if ENABLE_WATCHDOG
-#include "hardware/watchdog.h"
-#endif
-
-#include "lwip/dns.h"
 #include "lwip/ip.h"
-#include "lwip/pbuf.h"
-#include "lwip/tcp.h"
 
 #define HTTP_DEFAULT_PORT 80
-static const char *REQUEST_FMT = "GET %s HTTP/1.0\r\n"
-    "Host: %s\r\n\r\n";
-
-struct http_request_data {
-    char *content;
-    uint16_t port;
-    bool free_path;
-    bool sent;
-    struct tcp_pcb *conn;
-};
-
-// Marker: static variable
-static absolute_time_t next_task_time;
-
-
-static err_t http_client_close(struct tcp_pcb *conn, struct tcp_pcb *tpcb) {
-    if (tpcb == NULL)
-        return ERR_OK;
-    err_t err = ERR_OK;
-    tcp_arg(tpcb, NULL);
-    tcp_recv(tpcb, NULL);
-    tcp_err(tpcb, NULL);
-    err = tcp_close(tpcb);
-    if (err != ERR_OK) {
-        LOG_ERR("Close failed (%d), calling abort\n", err);
-        tcp_abort(tpcb);
-        err = ERR_ABRT;
-    }
-    tcp_close(conn);
-    return err;
-}
-
-static err_t tcp_recv_cb(void *_arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
-    if (p == NULL) {
-        LOG_INFO1("Remote closed connection");
-        // In this case client is still closed by connect_cb
-        return ERR_OK;
-    }
-    if (err != ERR_OK) {
-      LOG_ERR("recv error: %d\n", err);
-      pbuf_free(p);
-      return err;
-    }
-    cyw43_arch_lwip_check();
-    tcp_recved(tpcb, p->tot_len);
-    pbuf_free(p);
-    return ERR_OK;
-}
 
-static err_t tcp_connect_cb(void *cb_arg, struct tcp_pcb *tpcb, err_t err) {
-    struct http_request_data *req_data = (struct http_request_data *)cb_arg;
-    size_t size = strlen(req_data->content);
-    if (err != ERR_OK) {
-      LOG_ERR("connect err: %d\n", err);
-      goto finally;
-    }
-    cyw43_arch_lwip_check();
-    tcp_recv(tpcb, tcp_recv_cb);
-    assert(size < tcp_sndbuf(tpcb));
-    err = tcp_write(tpcb, req_data->content, size, 0);
-    if (err != ERR_OK) {
-      LOG_ERR("write err: %d\n", err);
-      goto finally;
-    }
-    err = tcp_output(tpcb);
-    if (err != ERR_OK) {
-      LOG_ERR("output err: %d\n", err);
-      goto finally;
-    }
-finally:
-    http_client_close(req_data->conn, tpcb);
-    free(req_data->content);
-    free(req_data);
-    return err;
-}
-
-static void do_send_http(const char *name, const ip_addr_t *ipaddr, void *cb_arg) {
-    struct http_request_data *req_data = (struct http_request_data *)cb_arg;
-    err_t err;
-
-    // Caller should guarantee this
-    assert(req_data != NULL);
-    LOG_DEBUG("In do_send_http for %s; data=%s\n", name, req_data->content);
-    if (ipaddr == NULL) {
-        LOG_WARN1("DNS gave no result");
-        goto fail;
-    }
-
-    // `do_send_http` may be called by non-callback when DNS return cached results
-    cyw43_arch_lwip_begin();
-    struct tcp_pcb *conn = tcp_new_ip_type(IP_GET_TYPE(ipaddr));
-    cyw43_arch_lwip_end();
-    // To be closed by connect_cb
-    if (conn == NULL) {
-        LOG_ERR1("Cannot create TCP PCB");
-        goto fail;
-    }
-    req_data->conn = conn;
-
-    cyw43_arch_lwip_begin();
-    tcp_arg(conn, req_data);
-    err = tcp_connect(conn, ipaddr, req_data->port, tcp_connect_cb);
-    cyw43_arch_lwip_end();
-    if (err != ERR_OK) {
-        LOG_ERR("Cannot connect: %d\n", err);
-        goto fail;
-    }
-    // If succeeded, req_data and content should be free()d by connect_cb
-    return;
-fail:
-    free(req_data->content);
-    free(req_data);
-}
-
-/// Send a GET request. We don't really care about the response
-/// since there is no retrying anyways
-/// hostname: HTTP hostname
-/// path: HTTP path (e.g. /index)
-/// port: use 80
-/// free_path: whether `path` should be free()d
-static bool send_http_request_dns(const char *hostname, const char *path, uint16_t port, bool free_path) {
-    struct http_request_data *req_data = malloc(sizeof(struct http_request_data));
-    if (req_data == NULL) {
-        LOG_ERR1("Cannot allocate request data");
-        return false;
-    }
-    size_t size = snprintf(NULL, 0, REQUEST_FMT, path, hostname) + 1;
-    // free()d in connect_cb
-    char *content = malloc(size);
-    if (content == NULL) {
-        LOG_ERR1("Cannot allocate request");
-        free(req_data);
-        return false;
-    }
-    snprintf(content, size, REQUEST_FMT, path, hostname);
-    req_data->content = content;
-    req_data->port = port;
-    ip_addr_t cached_result;
-    cyw43_arch_lwip_begin();
-    err_t err = dns_gethostbyname(hostname, &cached_result, do_send_http, req_data);
-    cyw43_arch_lwip_end();
-    if (err == ERR_OK) {
-        // Has cached DNS result
-        do_send_http(hostname, &cached_result, req_data);
-    }
-    else if (err != ERR_INPROGRESS) {
-        LOG_ERR("Cannot do a DNS request: %d\n", err);
-        free(content);
-        free(req_data);
-    }
-    // If succeeded, content and req_data should be free()d in do_send_http
-    return true;
+#if ENABLE_DDNS
+static void ddns_done(void *arg, uint16_t status) {
+    struct sched_task *task = arg;
+    // http_client has logged any failure
+    sched_finish(task, to_us_since_boot(get_absolute_time()), status >= 200 && status < 300);
 }
 
-#if ENABLE_DDNS
-static bool send_ddns(void) {
+static bool send_ddns(struct sched_task *task) {
     char uri[DDNS_URI_BUFSIZE];
     char addr[IPADDR_STRLEN_MAX];
     // For some reason the return value is not always `&addr[0]`
@@ -202,74 +47,49 @@ static bool send_ddns(void) {
     assert(ipaddr);
     snprintf(uri, DDNS_URI_BUFSIZE, DDNS_URI, DDNS_HOSTNAME, DDNS_KEY, ipaddr);
     LOG_INFO("Sending DDNS, addr=%s\n", ipaddr);
-    bool result = send_http_request_dns(DDNS_HOST, uri, HTTP_DEFAULT_PORT, true);
-    return result;
+    // `done` may already have run when this returns
+    return http_client_get(DDNS_HOST, HTTP_DEFAULT_PORT, uri, ddns_done, task);
 }
-#endif
 
-#if ENABLE_TEMPERATURE_SENSOR
-static bool send_temperature(void) {
-    float temperature;
-    bmp280_measure(&temperature, NULL);
-    char uri[WOLFRAM_URI_BUFSIZE];
-    snprintf(uri, WOLFRAM_URI_BUFSIZE, WOLFRAM_URI, WOLFRAM_DATABIN_ID, temperature);
-    LOG_INFO1("Sending temperature");
-    bool result = send_http_request_dns(WOLFRAM_HOST, uri, HTTP_DEFAULT_PORT, true);
-    return result;
-}
+// Marker: static variable
+static struct sched_task ddns_task = {
+    .name = "ddns",
+    .run = send_ddns,
+    .period_ms = DDNS_INTERVAL_MS,
+    .jitter_ms = TASKS_JITTER_MS,
+    .retry_ms = TASKS_RETRY_MS,
+};
 #endif
 
-#if ENABLE_LIGHT
-// Sometimes for some reason the RTC alarm is not triggered
-// so we constantly renew the alarm
-static bool renew_light_alarm(void) {
-    datetime_t dt;
-    if (ntp_get_stratum() == 16) {
-        LOG_WARN1("No NTP sync yet, skipping light alarm");
-        return false;
-    }
-    if (!ntp_update_rtc(&dt)) {
-        LOG_WARN1("RTC not running, skipping light alarm");
+bool tasks_add(struct sched_task *task, uint32_t delay_ms) {
+    if (!sched_add(task, to_us_since_boot(get_absolute_time()), delay_ms)) {
+        LOG_ERR("Cannot schedule task %s\n", task->name);
         return false;
     }
-    LOG_INFO1("Renewing light alarm");
-    // Note that this function alters `dt`
-    light_register_next_alarm(&dt);
     return true;
 }
-#endif
 
 void tasks_init(void) {
-    dns_init();
-    next_task_time = get_absolute_time();
+    // Wi-Fi just came up (or did not), which takes a different time on
+    // every boot, so that kits sharing a server do not upload in step
+    sched_seed(time_us_32());
+#if ENABLE_DDNS
+    tasks_add(&ddns_task, 0);
+#endif
+    uplink_init();
+}
+
+absolute_time_t tasks_next_run(void) {
+    uint64_t due = sched_next_due();
+    absolute_time_t next = due == UINT64_MAX ? at_the_end_of_time : from_us_since_boot(due);
+    return absolute_time_min(next, http_clients_next_run());
 }
 
 bool tasks_check_run(void) {
-    if (absolute_time_diff_us(get_absolute_time(), next_task_time) < 0) {
-        bool result = true;
-#if ENABLE_DDNS
-        result = send_ddns();
-        if (!result)
-            LOG_ERR1("DDNS task failed");
-#endif
-#if ENABLE_WATCHDOG
-        watchdog_update();
-#endif
-#if ENABLE_TEMPERATURE_SENSOR
-        result = send_temperature();
-        if (!result)
-            LOG_ERR1("Temperature task failed");
-#endif
-#if ENABLE_WATCHDOG
-        watchdog_update();
-#endif
-#if ENABLE_LIGHT
-        result = renew_light_alarm();
-        if (!result)
-            LOG_ERR1("Light alarm task failed");
-#endif
-        next_task_time = make_timeout_time_ms(TASKS_INTERVAL_MS);
-        return result;
-    }
-    return true;
+    http_clients_check_run();
+    struct sched_task *task = sched_run_due(to_us_since_boot(get_absolute_time()));
+    if (task == NULL || task->backoff_ms == 0)
+        return true;
+    LOG_WARN("%s task failed, retrying in %lu s\n", task->name, (unsigned long) (task->backoff_ms / 1000));
+    return false;
 }
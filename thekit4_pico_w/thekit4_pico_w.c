@@ -21,6 +21,8 @@
 #include "thekit4_pico_w.h"
 #include "log.h"
 #include "ntp.h"
+#include "ptp.h"
+#include "trace.h"
 
 #include "pico/cyw43_arch.h"
 #include "pico/stdlib.h"
@@ -28,6 +30,7 @@
 
 #include "hardware/adc.h"
 #include "hardware/rtc.h"
+#include "hardware/structs/scb.h"
 #if ENABLE_WATCHDOG
 #include "hardware/watchdog.h"
 #endif
@@ -40,6 +43,7 @@ static struct ntp_client ntp_state;
 static void feed_dog() {
 #if ENABLE_WATCHDOG
     watchdog_update();
+    metric_inc(&metrics_watchdog_feeds);
 #endif
 }
 
@@ -54,7 +58,10 @@ static void init() {
 #if ENABLE_WATCHDOG
     if (watchdog_caused_reboot())
         LOG_WARN1("Rebooted by watchdog");
+    // Before anything else sets the clock
+    ntp_persist_init();
 #endif
+    profiler_init();
 
     rtc_init();
     // ADC (before light and temperature)
@@ -69,7 +76,13 @@ static void init() {
 #if ENABLE_GPS
     gps_init();
 #endif
+    // After all the sensors
+    sensors_init();
     irq_init();
+    // An interrupt that becomes pending also sets the event register, so
+    // one that is handled just before the main loop goes to sleep still
+    // wakes it
+    scb_hw->scr |= M0PLUS_SCR_SEVONPEND_BITS;
 
 #if ENABLE_WATCHDOG
     // Needs to be larger than `wifi_connect`'s timeout
@@ -80,7 +93,9 @@ static void init() {
         panic("ERROR: Cannot init CYW43");
     // Depends on cyw43
     cyw43_arch_enable_sta_mode();
+    log_sink_init();
     wifi_connect();
+    tasks_init();
 
 #if ENABLE_NTP
     if (!ntp_client_init(&ntp_state))
@@ -94,14 +109,38 @@ static void init() {
 
 #if ENABLE_NTP
     ntp_server_open();
+#endif
+#if ENABLE_PTP
+    if (!ptp_server_open())
+        LOG_WARN1("Cannot open PTP server");
 #endif
     LOG_INFO1("Successfully initialized everything");
 }
 
+/// The earliest time any stage has work, short of an interrupt
+static absolute_time_t loop_next_deadline(void) {
+    absolute_time_t next = make_timeout_time_ms(LOOP_MAX_SLEEP_MS);
+#if ENABLE_NTP
+    next = absolute_time_min(next, ntp_client_next_run(&ntp_state));
+#endif
+#if ENABLE_GPS
+    next = absolute_time_min(next, gps_next_run());
+#endif
+#if ENABLE_PTP
+    next = absolute_time_min(next, ptp_server_next_run());
+#endif
+    next = absolute_time_min(next, sensors_next_run());
+    next = absolute_time_min(next, http_server_next_run());
+    next = absolute_time_min(next, tasks_next_run());
+    next = absolute_time_min(next, log_sink_next_run());
+    return next;
+}
+
 int main() {
     init();
 
     while (1) {
+        profiler_begin(LOOP_WIFI);
         int wifi_state = cyw43_wifi_link_status(&cyw43_state, CYW43_ITF_STA);
         feed_dog();
         if (wifi_state != CYW43_LINK_JOIN) {
@@ -109,21 +148,36 @@ int main() {
             wifi_connect();
             feed_dog();
         }
+        profiler_end(LOOP_WIFI);
 #if ENABLE_NTP
-        ntp_client_check_run(&ntp_state);
+        LOOP_STAGE(LOOP_NTP, ntp_client_check_run(&ntp_state));
         feed_dog();
 #endif
 #if ENABLE_GPS
-        gps_parse_available();
+        LOOP_STAGE(LOOP_GPS, gps_parse_available());
+        LOOP_STAGE(LOOP_GPS_AIDING, gps_aiding_check_run());
         feed_dog();
 #endif
-        tasks_check_run();
+#if ENABLE_PTP
+        LOOP_STAGE(LOOP_PTP, ptp_server_check_run());
+#endif
+        LOOP_STAGE(LOOP_SENSORS, sensors_check_run());
+        LOOP_STAGE(LOOP_HTTP, http_server_check_run());
         feed_dog();
+        LOOP_STAGE(LOOP_TASKS, tasks_check_run());
+        feed_dog();
+        // Whatever the rest of the iteration logged
+        LOOP_STAGE(LOOP_LOG, log_sink_check_run());
+        absolute_time_t deadline = loop_next_deadline();
 #if PICO_CYW43_ARCH_POLL
-        cyw43_arch_poll();
-#endif
-#if !ENABLE_GPS && !PICO_CYW43_ARCH_POLL
-        sleep_ms(100);
+        LOOP_STAGE(LOOP_CYW43_POLL, cyw43_arch_poll());
+        // This also wakes up for lwIP's timers, which only run in
+        // `cyw43_arch_poll` in this mode
+        TRACE_BLOCK("sleep", cyw43_arch_wait_for_work_until(deadline));
+#else
+        // lwIP, the GPS UART and PPS all have interrupts, any of which ends
+        // the wait
+        TRACE_BLOCK("sleep", best_effort_wfe_or_timeout(deadline));
 #endif
     }
     http_server_close();
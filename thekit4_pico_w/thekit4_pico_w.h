@@ -21,9 +21,15 @@
 
 #include <stdint.h>
 
+#include "pico/time.h"
+
 #include "lwip/ip_addr.h"
 
 #include "gps_util.h"
+#include "metrics.h"
+#include "pool.h"
+#include "sched.h"
+#include "telemetry.h"
 
 #define WIFI_NETIF (cyw43_state.netif[CYW43_ITF_STA])
 
@@ -44,6 +50,31 @@ struct wifi_config_entry {
 
 void irq_init(void);
 
+/// Readings taken together by `sensors_check_run`
+struct sensors_snapshot {
+    // False until the first sample
+    bool valid;
+    absolute_time_t taken;
+    // -512 without a sensor
+    float temperature;
+    uint32_t pressure;
+    float core_temperature;
+    float light_voltage;
+    // -512 without a fix
+    float lat;
+    float lon;
+    float alt;
+    // Age of the fix when the snapshot was taken
+    timestamp_t gps_age;
+    bool gps_valid;
+};
+
+void sensors_init(void);
+void sensors_check_run(void);
+absolute_time_t sensors_next_run(void);
+/// The latest snapshot. Never blocks
+const struct sensors_snapshot *sensors_get(void);
+
 void bmp280_temperature_init(void);
 void bmp280_measure(float *temperature, uint32_t *pressure);
 float vsys_measure(void);
@@ -60,16 +91,138 @@ void light_register_next_alarm(datetime_t *current);
 
 bool wifi_connect(void);
 
+void log_sink_init(void);
+void log_sink_check_run(void);
+absolute_time_t log_sink_next_run(void);
+
 bool http_server_open(void);
+void http_server_check_run(void);
+absolute_time_t http_server_next_run(void);
 void http_server_close(void);
 
+extern struct metric_counter metrics_http_requests;
+extern struct metric_counter metrics_http_bad_requests;
+extern struct metric_counter metrics_http_rejected;
+extern struct metric_counter metrics_watchdog_feeds;
+extern struct metric_histogram metrics_http_duration;
+extern struct pool http_conn_pool;
+extern struct pool http_client_pool;
+/// Everything /metrics exports, in the Prometheus text format, as much as
+/// fits at a time. `*pos` starts at 0. Returns false once it is all out
+bool metrics_write_next(struct metrics_writer *writer, uint32_t *pos);
+
+/// Main loop stages, timed by profiler.c
+enum loop_stage {
+    LOOP_WIFI = 0,
+    LOOP_NTP,
+    LOOP_GPS,
+    LOOP_GPS_AIDING,
+    LOOP_PTP,
+    LOOP_SENSORS,
+    LOOP_HTTP,
+    LOOP_TASKS,
+    LOOP_LOG,
+    LOOP_CYW43_POLL,
+    LOOP_N_STAGES
+};
+
+/// What the profiler has seen of a stage
+struct loop_stage_stats {
+    const char *name;
+    // Slower runs are warned about
+    uint32_t budget_us;
+    struct metric_histogram duration;
+    uint32_t max_us;
+    struct metric_counter overruns;
+};
+
+/// Report on the stage a watchdog reset interrupted, if any. Call early
+void profiler_init(void);
+void profiler_begin(enum loop_stage stage);
+void profiler_end(enum loop_stage stage);
+const struct loop_stage_stats *profiler_get(enum loop_stage stage);
+
+/// Run `stmt` as main loop stage `stage`
+#define LOOP_STAGE(stage, stmt) do { \
+    profiler_begin(stage); \
+    stmt; \
+    profiler_end(stage); \
+} while (0)
+
+/// Called from `http_clients_check_run` when a request is over, with the
+/// response status or 0 if it failed
+typedef void (*http_client_done_fn)(void *arg, uint16_t status);
+/// Start an HTTP GET for `path`, run by `http_clients_check_run`. `done`
+/// may be NULL, and may be called before this returns.
+/// Returns false if all HTTP_MAX_CLIENTS are busy or the request does not fit
+bool http_client_get(const char *host, uint16_t port, const char *path, http_client_done_fn done, void *arg);
+/// Likewise for a POST of `body`, which must stay valid until `done`
+bool http_client_post(const char *host, uint16_t port, const char *path, const char *content_type,
+                      const char *body, uint16_t body_len, http_client_done_fn done, void *arg);
+void http_clients_check_run(void);
+absolute_time_t http_clients_next_run(void);
+
+/// Register the network tasks. Call once Wi-Fi is up
 void tasks_init(void);
+/// Schedule `task` to first run `delay_ms` from now. Can be called before
+/// `tasks_init`
+bool tasks_add(struct sched_task *task, uint32_t delay_ms);
 bool tasks_check_run(void);
+absolute_time_t tasks_next_run(void);
+
+/// What a telemetry sink has done
+struct uplink_stats {
+    const char *name;
+    // Configured, with a host
+    bool enabled;
+    // The last upload went through
+    bool online;
+    // An upload is in flight
+    bool busy;
+    uint32_t uploads;
+    // Samples waiting for this sink
+    uint32_t pending;
+    // Samples overwritten before this sink got them out
+    uint32_t lost;
+};
+
+/// Start spooling telemetry and register the configured sinks. Called by
+/// `tasks_init`
+void uplink_init(void);
+/// Sink `i`, configured or not. Returns false past the last one
+bool uplink_get_stats(uint8_t i, struct uplink_stats *stats);
+/// Where sink `i` is in the telemetry spool, NULL if it is not configured
+struct telemetry_reader *uplink_get_reader(uint8_t i);
+/// Have every idle sink upload now
+void uplink_kick(void);
+
+/// What the flash spool has done
+struct spool_stats {
+    // Records moved to flash, and put back for upload
+    uint32_t spooled;
+    uint32_t replayed;
+    // Blocks written, and overwritten before they were put back
+    uint32_t blocks_written;
+    uint32_t blocks_lost;
+    // Blocks in flash yet to be put back
+    uint32_t blocks_waiting;
+};
+
+/// Find what is left in flash from before. Called by `uplink_init`
+void spool_init(const struct telemetry_field *fields, uint8_t n_fields);
+/// Move the backlog of lagging sinks to flash, or put some back when all
+/// are up. Called after every sample
+void spool_check_run(void);
+void spool_get_stats(struct spool_stats *stats);
 
 void gps_init(void);
 bool gps_get_location(float *lat, float *lon, float *alt, timestamp_t *age);
 bool gps_get_time(time_t *time, timestamp_t *age);
 uint8_t gps_get_sat_num(void);
+/// NMEA sentences parsed and rejected since boot
+void gps_get_sentence_counts(uint32_t *good, uint32_t *bad);
 void gps_parse_available(void);
+void gps_aiding_check_run(void);
+absolute_time_t gps_next_run(void);
 
 #endif
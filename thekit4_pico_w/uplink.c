@@ -0,0 +1,345 @@
+/*
+ *  uplink.c
+ *  Copyright (C) 2024 Zhang Maiyun <me@maiyun.me>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Telemetry uploads. The sampling task spools a record of the sensor
+ * snapshot every TELEMETRY_SAMPLE_INTERVAL_MS (telemetry.h), and every
+ * configured sink is a scheduled task of its own that uploads whatever it
+ * has not yet sent as one batch. A batch is only acknowledged once the
+ * server took it, so samples taken during a Wi-Fi dropout simply wait in
+ * the spool and go out with the next upload that succeeds; the task's
+ * retry backoff keeps a dead server from being hammered. A sink that could
+ * not fit its whole backlog in a batch comes back after
+ * TELEMETRY_BACKLOG_DELAY_MS instead of a full period. An outage longer
+ * than the spool lasts is handed over to spool.c, which keeps the oldest
+ * records in flash and puts them back once the sinks are up again.
+ */
+
+#include "config.h"
+#include "thekit4_pico_w.h"
+#include "log.h"
+#include "ntp.h"
+#include "telemetry.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/cyw43_arch.h"
+
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+// Datagrams an Influx UDP sink sends per run
+#define UPLINK_UDP_MAX_BATCHES 4
+
+enum uplink_field {
+    UPLINK_TEMPERATURE = 0,
+    UPLINK_PRESSURE,
+    UPLINK_CORE_TEMPERATURE,
+    UPLINK_N_FIELDS
+};
+#define UPLINK_ALL_FIELDS ((1 << UPLINK_N_FIELDS) - 1)
+
+static const struct telemetry_field uplink_fields[UPLINK_N_FIELDS] = {
+    [UPLINK_TEMPERATURE] = {"temperature", 2},
+    [UPLINK_PRESSURE] = {"pressure", 0},
+    [UPLINK_CORE_TEMPERATURE] = {"core_temperature", 1},
+};
+
+enum uplink_transport {
+    // A GET with one record in the query string. `path` is WOLFRAM_URI
+    UPLINK_WOLFRAM,
+    UPLINK_POST,
+    // Best effort, acknowledged as soon as lwIP takes it
+    UPLINK_UDP,
+};
+
+typedef uint32_t (*uplink_format_fn)(struct telemetry_reader *reader, const struct telemetry_format *format,
+                                     char *buf, size_t size, size_t *len);
+
+struct uplink {
+    // First, so that the scheduler's task pointer is the uplink
+    struct sched_task task;
+    enum uplink_transport transport;
+    // "" to leave the sink out
+    const char *host;
+    uint16_t port;
+    const char *path;
+    const char *content_type;
+    uplink_format_fn format_batch;
+    struct telemetry_format format;
+    struct telemetry_reader reader;
+    // Registered with the scheduler
+    bool enabled;
+    // An HTTP request is in flight with this many samples
+    bool busy;
+    uint32_t in_flight;
+    // The last batch left some of the backlog behind
+    bool more;
+    uint32_t uploads;
+    char batch[TELEMETRY_BATCH_SIZE];
+};
+
+static bool uplink_run(struct sched_task *task);
+
+#define UPLINK_TASK(task_name, interval) { \
+    .name = (task_name), \
+    .run = uplink_run, \
+    .period_ms = (interval), \
+    .jitter_ms = TASKS_JITTER_MS, \
+    .retry_ms = TASKS_RETRY_MS, \
+}
+
+// Marker: static variable
+static struct uplink uplinks[] = {
+#if ENABLE_TEMPERATURE_SENSOR
+    {
+        .task = UPLINK_TASK("wolfram", WOLFRAM_INTERVAL_MS),
+        .transport = UPLINK_WOLFRAM,
+        .host = WOLFRAM_HOST,
+        .port = WOLFRAM_PORT,
+        .path = WOLFRAM_URI,
+        .format_batch = telemetry_format_query,
+        .format = {.fields = uplink_fields, .mask = 1 << UPLINK_TEMPERATURE},
+    },
+#endif
+    {
+        .task = UPLINK_TASK("influx_udp", TELEMETRY_UPLOAD_INTERVAL_MS),
+        .transport = UPLINK_UDP,
+        .host = INFLUX_UDP_SERVER,
+        .port = INFLUX_UDP_PORT,
+        .format_batch = telemetry_format_influx,
+        // The UDP listener's precision defaults to nanoseconds
+        .format = {
+            .fields = uplink_fields, .mask = UPLINK_ALL_FIELDS, .measurement = TELEMETRY_MEASUREMENT,
+            .nanoseconds = true
+        },
+    },
+    {
+        .task = UPLINK_TASK("influx_http", TELEMETRY_UPLOAD_INTERVAL_MS),
+        .transport = UPLINK_POST,
+        .host = INFLUX_HTTP_HOST,
+        .port = INFLUX_HTTP_PORT,
+        .path = INFLUX_HTTP_PATH,
+        .content_type = "text/plain; charset=utf-8",
+        .format_batch = telemetry_format_influx,
+        .format = {.fields = uplink_fields, .mask = UPLINK_ALL_FIELDS, .measurement = TELEMETRY_MEASUREMENT},
+    },
+    {
+        .task = UPLINK_TASK("telemetry_post", TELEMETRY_UPLOAD_INTERVAL_MS),
+        .transport = UPLINK_POST,
+        .host = TELEMETRY_POST_HOST,
+        .port = TELEMETRY_POST_PORT,
+        .path = TELEMETRY_POST_PATH,
+        .content_type = "application/json",
+        .format_batch = telemetry_format_json,
+        .format = {.fields = uplink_fields, .mask = UPLINK_ALL_FIELDS},
+    },
+};
+#define UPLINK_N (sizeof(uplinks) / sizeof(uplinks[0]))
+
+// Marker: static variable
+static struct udp_pcb *uplink_udp_pcb;
+// Marker: static variable
+static ip_addr_t uplink_udp_server;
+
+static bool uplink_sample(struct sched_task *task) {
+    const struct sensors_snapshot *snap = sensors_get();
+    if (!snap->valid)
+        return false;
+    float values[UPLINK_N_FIELDS];
+    values[UPLINK_TEMPERATURE] = snap->temperature == -512 ? NAN : snap->temperature;
+    values[UPLINK_PRESSURE] = snap->pressure == 0 ? NAN : (float) snap->pressure;
+    values[UPLINK_CORE_TEMPERATURE] = snap->core_temperature;
+    // Left for the server to stamp until NTP has synced
+    uint32_t time = ntp_get_stratum() == 16 ? 0 : ntp_get_utc_us() / 1000000;
+    telemetry_record(time, values, UPLINK_N_FIELDS);
+    spool_check_run();
+    return true;
+}
+
+// Marker: static variable
+static struct sched_task uplink_sample_task = {
+    .name = "telemetry",
+    .run = uplink_sample,
+    .period_ms = TELEMETRY_SAMPLE_INTERVAL_MS,
+};
+
+/// Format a batch from the start of `uplink`'s backlog into `batch`, like
+/// the telemetry formatters do
+static uint32_t uplink_format(struct uplink *uplink, size_t *len) {
+    if (uplink->transport != UPLINK_WOLFRAM)
+        return uplink->format_batch(&uplink->reader, &uplink->format, uplink->batch, sizeof(uplink->batch), len);
+    // The batch is the whole URI
+    char query[128];
+    size_t query_len;
+    uint32_t n = uplink->format_batch(&uplink->reader, &uplink->format, query, sizeof(query), &query_len);
+    *len = 0;
+    if (n == 0 || query_len == 0)
+        return n;
+    int uri_len = snprintf(uplink->batch, sizeof(uplink->batch), uplink->path,
+                           WOLFRAM_DATABIN_ID, (int) query_len, query);
+    if (uri_len < 0 || (size_t) uri_len >= sizeof(uplink->batch))
+        return 0;
+    *len = uri_len;
+    return n;
+}
+
+/// Put `uplink`'s next batch into `batch`. Returns the samples it covers,
+/// or 0 with nothing to send
+static uint32_t uplink_prepare(struct uplink *uplink, size_t *len) {
+    uint32_t pending;
+    while ((pending = telemetry_pending(&uplink->reader)) != 0) {
+        uint32_t n = uplink_format(uplink, len);
+        if (n == 0) {
+            // Would never go out, so it must not hold up the rest
+            LOG_ERR("%s: record does not fit, dropping\n", uplink->task.name);
+            telemetry_ack(&uplink->reader, 1);
+            continue;
+        }
+        uplink->more = n < pending;
+        if (*len != 0)
+            return n;
+        // Nothing this sink uploads
+        telemetry_ack(&uplink->reader, n);
+    }
+    return 0;
+}
+
+static void uplink_done(void *arg, uint16_t status) {
+    struct uplink *uplink = arg;
+    bool ok = status >= 200 && status < 300;
+    uint64_t now = to_us_since_boot(get_absolute_time());
+    uplink->busy = false;
+    if (ok) {
+        telemetry_ack(&uplink->reader, uplink->in_flight);
+        ++uplink->uploads;
+    }
+    sched_finish(&uplink->task, now, ok);
+    if (ok && uplink->more)
+        sched_set_due(&uplink->task, now + (uint64_t) TELEMETRY_BACKLOG_DELAY_MS * 1000);
+}
+
+static bool uplink_send_udp(struct uplink *uplink) {
+    for (uint8_t i = 0; i < UPLINK_UDP_MAX_BATCHES; ++i) {
+        size_t len;
+        uint32_t n = uplink_prepare(uplink, &len);
+        if (n == 0)
+            return true;
+        err_t err = ERR_MEM;
+        cyw43_arch_lwip_begin();
+        struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+        if (p) {
+            memcpy(p->payload, uplink->batch, len);
+            err = udp_sendto(uplink_udp_pcb, p, &uplink_udp_server, uplink->port);
+            pbuf_free(p);
+        }
+        cyw43_arch_lwip_end();
+        if (err != ERR_OK) {
+            LOG_WARN("%s: send failed (%d)\n", uplink->task.name, (int) err);
+            return false;
+        }
+        telemetry_ack(&uplink->reader, n);
+        ++uplink->uploads;
+        if (!uplink->more)
+            return true;
+    }
+    // Leave the rest to the next iterations of the main loop, as
+    // `uplink_done` does
+    uint64_t now = to_us_since_boot(get_absolute_time());
+    sched_finish(&uplink->task, now, true);
+    sched_set_due(&uplink->task, now + (uint64_t) TELEMETRY_BACKLOG_DELAY_MS * 1000);
+    return true;
+}
+
+static bool uplink_run(struct sched_task *task) {
+    struct uplink *uplink = (struct uplink *) task;
+    // Still waiting for the last one, which reschedules the task when done
+    if (uplink->busy)
+        return true;
+    if (uplink->transport == UPLINK_UDP)
+        return uplink_send_udp(uplink);
+    size_t len;
+    uint32_t n = uplink_prepare(uplink, &len);
+    if (n == 0)
+        return true;
+    LOG_INFO("%s: uploading %lu samples\n", task->name, (unsigned long) n);
+    uplink->busy = true;
+    uplink->in_flight = n;
+    // `done` may already have run when these return
+    bool started = uplink->transport == UPLINK_WOLFRAM
+        ? http_client_get(uplink->host, uplink->port, uplink->batch, uplink_done, uplink)
+        : http_client_post(uplink->host, uplink->port, uplink->path, uplink->content_type,
+                           uplink->batch, len, uplink_done, uplink);
+    if (!started)
+        uplink->busy = false;
+    return started;
+}
+
+void uplink_init(void) {
+    spool_init(uplink_fields, UPLINK_N_FIELDS);
+    tasks_add(&uplink_sample_task, 0);
+    for (size_t i = 0; i < UPLINK_N; ++i) {
+        struct uplink *uplink = &uplinks[i];
+        // Which records spooled in flash are for whom
+        uplink->reader.bit = 1 << i;
+        if (!uplink->host[0])
+            continue;
+        if (uplink->transport == UPLINK_UDP) {
+            if (!ipaddr_aton(uplink->host, &uplink_udp_server)) {
+                LOG_ERR("Bad address for %s\n", uplink->task.name);
+                continue;
+            }
+            cyw43_arch_lwip_begin();
+            uplink_udp_pcb = udp_new_ip_type(IP_GET_TYPE(&uplink_udp_server));
+            cyw43_arch_lwip_end();
+            if (!uplink_udp_pcb) {
+                LOG_ERR("Failed to create %s pcb\n", uplink->task.name);
+                continue;
+            }
+        }
+        // After a few samples
+        uplink->enabled = tasks_add(&uplink->task, TELEMETRY_SAMPLE_INTERVAL_MS);
+    }
+}
+
+struct telemetry_reader *uplink_get_reader(uint8_t i) {
+    return i < UPLINK_N && uplinks[i].enabled ? &uplinks[i].reader : NULL;
+}
+
+void uplink_kick(void) {
+    uint64_t now = to_us_since_boot(get_absolute_time());
+    for (size_t i = 0; i < UPLINK_N; ++i)
+        if (uplinks[i].enabled && !uplinks[i].busy)
+            sched_set_due(&uplinks[i].task, now);
+}
+
+bool uplink_get_stats(uint8_t i, struct uplink_stats *stats) {
+    if (i >= UPLINK_N)
+        return false;
+    struct uplink *uplink = &uplinks[i];
+    stats->name = uplink->task.name;
+    stats->enabled = uplink->enabled;
+    // Up since its last upload went through
+    stats->online = uplink->uploads != 0 && uplink->task.backoff_ms == 0;
+    stats->busy = uplink->busy;
+    stats->uploads = uplink->uploads;
+    stats->pending = telemetry_pending(&uplink->reader);
+    stats->lost = uplink->reader.lost;
+    return true;
+}